@@ -41,6 +41,7 @@
 #include <sys/param.h>
 
 void aofUpdateCurrentSize(void);
+static void aofSetFd(int fd);
 void aofClosePipes(void);
 
 /* ----------------------------------------------------------------------------
@@ -193,6 +194,348 @@ ssize_t aofRewriteBufferWrite(int fd) {
     return count;
 }
 
+/* ----------------------------------------------------------------------------
+ * Multi part AOF
+ *
+ * When aof-multi-part is enabled the AOF is made of a base file, written by
+ * the latest rewrite (an RDB or an AOF depending on aof-use-rdb-preamble),
+ * followed by increment files containing the commands executed after the
+ * base was created. The files are listed, in the order they must be loaded,
+ * in the manifest, a file named like appendfilename plus ".manifest":
+ *
+ *   file "appendonly.aof.3.base.rdb" seq 3 type b
+ *   file "appendonly.aof.7.incr.aof" seq 7 type i
+ *   file "appendonly.aof.8.incr.aof" seq 8 type i
+ *
+ * A rewrite opens a new increment file, that receives the writes from now
+ * on, and forks a child writing the new base. So the parent doesn't need to
+ * accumulate the writes performed during the rewrite and to send them to
+ * the child: when the child is done the new manifest lists the new base
+ * followed by the increment files opened since the fork, and the older files
+ * are deleted.
+ * ------------------------------------------------------------------------- */
+
+static aofFile *aofFileCreate(sds name, long long seq) {
+    aofFile *af = zmalloc(sizeof(*af));
+
+    af->name = name;
+    af->seq = seq;
+    return af;
+}
+
+static void aofFileFree(void *ptr) {
+    aofFile *af = ptr;
+
+    sdsfree(af->name);
+    zfree(af);
+}
+
+static aofManifest *aofManifestCreate(void) {
+    aofManifest *am = zmalloc(sizeof(*am));
+
+    am->base = NULL;
+    am->incrs = listCreate();
+    listSetFreeMethod(am->incrs,aofFileFree);
+    am->base_seq = 0;
+    am->incr_seq = 0;
+    return am;
+}
+
+static void aofManifestFree(aofManifest *am) {
+    if (am->base) aofFileFree(am->base);
+    listRelease(am->incrs);
+    zfree(am);
+}
+
+/* Return the name of the manifest file. The caller should free it. */
+static sds aofManifestFilename(void) {
+    return sdscatfmt(sdsempty(),"%s.manifest",server.aof_filename);
+}
+
+/* Load the manifest of the multi part AOF. When there is no manifest but
+ * there is a single file AOF, the latter is used as base, so that the
+ * dataset is preserved when aof-multi-part is enabled. On error NULL is
+ * returned and the error is logged. */
+static aofManifest *aofLoadManifest(void) {
+    aofManifest *am = aofManifestCreate();
+    sds filename = aofManifestFilename();
+    FILE *fp = fopen(filename,"r");
+    char buf[1024];
+    int linenum = 0;
+
+    if (fp == NULL) {
+        if (errno != ENOENT) {
+            serverLog(LL_WARNING,"Can't open the AOF manifest %s: %s",
+                filename, strerror(errno));
+            goto err;
+        }
+        if (access(server.aof_filename,F_OK) == 0) {
+            serverLog(LL_NOTICE,"No AOF manifest found, using %s as base",
+                server.aof_filename);
+            am->base = aofFileCreate(sdsnew(server.aof_filename),0);
+        }
+        sdsfree(filename);
+        return am;
+    }
+
+    while(fgets(buf,sizeof(buf),fp) != NULL) {
+        sds *argv;
+        int argc;
+        long long seq;
+
+        linenum++;
+        if (buf[0] == '#') continue;
+        argv = sdssplitargs(buf,&argc);
+        if (argv == NULL) goto fmterr;
+        if (argc == 0) {
+            sdsfreesplitres(argv,argc);
+            continue;
+        }
+        if (argc != 6 || strcmp(argv[0],"file") || strcmp(argv[2],"seq") ||
+            strcmp(argv[4],"type") ||
+            !string2ll(argv[3],sdslen(argv[3]),&seq) || seq < 0)
+        {
+            sdsfreesplitres(argv,argc);
+            goto fmterr;
+        }
+        if (!strcmp(argv[5],"b") && am->base == NULL) {
+            am->base = aofFileCreate(sdsdup(argv[1]),seq);
+            am->base_seq = seq;
+        } else if (!strcmp(argv[5],"i")) {
+            listAddNodeTail(am->incrs,aofFileCreate(sdsdup(argv[1]),seq));
+            if (seq > am->incr_seq) am->incr_seq = seq;
+        } else {
+            sdsfreesplitres(argv,argc);
+            goto fmterr;
+        }
+        sdsfreesplitres(argv,argc);
+    }
+    if (ferror(fp)) {
+        serverLog(LL_WARNING,"Error reading the AOF manifest %s: %s",
+            filename, strerror(errno));
+        goto err;
+    }
+    fclose(fp);
+    sdsfree(filename);
+    return am;
+
+fmterr:
+    serverLog(LL_WARNING,"Bad format of the AOF manifest %s at line %d",
+        filename, linenum);
+err:
+    if (fp) fclose(fp);
+    sdsfree(filename);
+    aofManifestFree(am);
+    return NULL;
+}
+
+/* Write the manifest on disk, atomically replacing the old one. Returns
+ * C_ERR on error. */
+static int aofPersistManifest(aofManifest *am) {
+    sds filename = aofManifestFilename();
+    sds tmpfile = sdscatfmt(sdsempty(),"temp-%S",filename);
+    sds buf = sdsempty();
+    listIter li;
+    listNode *ln;
+    int fd;
+
+    if (am->base) {
+        buf = sdscat(buf,"file ");
+        buf = sdscatrepr(buf,am->base->name,sdslen(am->base->name));
+        buf = sdscatfmt(buf," seq %I type b\n",am->base->seq);
+    }
+    listRewind(am->incrs,&li);
+    while((ln = listNext(&li)) != NULL) {
+        aofFile *af = listNodeValue(ln);
+
+        buf = sdscat(buf,"file ");
+        buf = sdscatrepr(buf,af->name,sdslen(af->name));
+        buf = sdscatfmt(buf," seq %I type i\n",af->seq);
+    }
+
+    if ((fd = open(tmpfile,O_WRONLY|O_CREAT|O_TRUNC,0644)) == -1 ||
+        write(fd,buf,sdslen(buf)) != (ssize_t)sdslen(buf) ||
+        redis_fsync(fd) == -1 || close(fd) == -1)
+    {
+        serverLog(LL_WARNING,"Error writing the AOF manifest %s: %s",
+            tmpfile, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+            unlink(tmpfile);
+        }
+        goto err;
+    }
+    if (rename(tmpfile,filename) == -1) {
+        serverLog(LL_WARNING,"Error renaming the AOF manifest %s into %s: %s",
+            tmpfile, filename, strerror(errno));
+        unlink(tmpfile);
+        goto err;
+    }
+    sdsfree(buf);
+    sdsfree(tmpfile);
+    sdsfree(filename);
+    return C_OK;
+
+err:
+    sdsfree(buf);
+    sdsfree(tmpfile);
+    sdsfree(filename);
+    return C_ERR;
+}
+
+/* Create a new increment file and add it to the manifest in memory.
+ * Returns the file descriptor of the file, or -1 on error. */
+static int aofCreateIncrFile(void) {
+    aofManifest *am = server.aof_manifest;
+    long long seq = am->incr_seq+1;
+    sds filename = sdscatfmt(sdsempty(),"%s.%I.incr.aof",
+                             server.aof_filename,seq);
+    int fd = open(filename,O_WRONLY|O_APPEND|O_CREAT|O_TRUNC,0644);
+
+    if (fd == -1) {
+        serverLog(LL_WARNING,"Can't create the AOF increment file %s: %s",
+            filename, strerror(errno));
+        sdsfree(filename);
+        return -1;
+    }
+    am->incr_seq = seq;
+    listAddNodeTail(am->incrs,aofFileCreate(filename,seq));
+    return fd;
+}
+
+/* Called before forking the child writing a new base: from now on the
+ * writes are appended to a new increment file, that will follow the new
+ * base in the manifest. Returns C_ERR on error. */
+static int aofRotateIncrFile(void) {
+    aofManifest *am = server.aof_manifest;
+    int newfd, oldfd = server.aof_fd;
+
+    /* What was already buffered is part of the dataset the child is going
+     * to write, so it must end in the old file. */
+    if (oldfd != -1) {
+        flushAppendOnlyFile(1);
+        if (sdslen(server.aof_buf) || server.aof_last_write_status == C_ERR)
+            return C_ERR;
+    }
+
+    if ((newfd = aofCreateIncrFile()) == -1) return C_ERR;
+    if (server.aof_state == AOF_ON && aofPersistManifest(am) == C_ERR) {
+        aofFile *af = listNodeValue(listLast(am->incrs));
+
+        close(newfd);
+        bg_unlink(af->name);
+        listDelNode(am->incrs,listLast(am->incrs));
+        return C_ERR;
+    }
+
+    aofSetFd(newfd);
+    server.aof_selected_db = -1; /* Make sure SELECT is re-issued */
+    if (oldfd != -1) {
+        /* The old file is fsynced and closed in background. */
+        bioCreateBackgroundJob(BIO_CLOSE_FILE,(void*)(long)oldfd,(void*)1,NULL);
+        server.aof_fsync_offset = server.aof_current_size;
+    }
+    return C_OK;
+}
+
+/* Called at startup when aof-multi-part is enabled: load the manifest and,
+ * if the AOF is enabled, open the increment file where the writes are
+ * appended, creating it if there is none. */
+void aofMultiPartInit(void) {
+    aofManifest *am = aofLoadManifest();
+
+    if (am == NULL) {
+        if (server.aof_state == AOF_ON) exit(1);
+        am = aofManifestCreate();
+    }
+    server.aof_manifest = am;
+    if (server.aof_state != AOF_ON) return;
+
+    if (listLength(am->incrs)) {
+        aofFile *af = listNodeValue(listLast(am->incrs));
+
+        server.aof_fd = open(af->name,O_WRONLY|O_APPEND|O_CREAT,0644);
+        if (server.aof_fd == -1) {
+            serverLog(LL_WARNING,"Can't open the AOF increment file %s: %s",
+                af->name, strerror(errno));
+            exit(1);
+        }
+    } else {
+        server.aof_fd = aofCreateIncrFile();
+        if (server.aof_fd == -1 || aofPersistManifest(am) == C_ERR) exit(1);
+    }
+}
+
+/* Return the size of all the files of the multi part AOF. */
+static off_t aofManifestSize(aofManifest *am) {
+    struct redis_stat sb;
+    listIter li;
+    listNode *ln;
+    off_t size = 0;
+
+    if (am->base && redis_stat(am->base->name,&sb) == 0) size += sb.st_size;
+    listRewind(am->incrs,&li);
+    while((ln = listNext(&li)) != NULL) {
+        aofFile *af = listNodeValue(ln);
+        if (redis_stat(af->name,&sb) == 0) size += sb.st_size;
+    }
+    return size;
+}
+
+/* The child rewriting the multi part AOF terminated with success: the file
+ * it produced becomes the new base, replacing the old base and the increment
+ * files that were closed before the fork. Returns C_ERR on error. */
+static int aofInstallRewrittenBase(void) {
+    aofManifest *am = server.aof_manifest, *newam;
+    char tmpfile[256];
+    unsigned long j = 0;
+    listIter li;
+    listNode *ln;
+    sds base;
+
+    snprintf(tmpfile,256,"temp-rewriteaof-bg-%d.aof",
+        (int)server.aof_child_pid);
+    base = sdscatfmt(sdsempty(),"%s.%I.base.%s",server.aof_filename,
+        am->base_seq+1,server.aof_use_rdb_preamble ? "rdb" : "aof");
+    if (rename(tmpfile,base) == -1) {
+        serverLog(LL_WARNING,
+            "Error trying to rename the temporary AOF file %s into %s: %s",
+            tmpfile, base, strerror(errno));
+        sdsfree(base);
+        return C_ERR;
+    }
+
+    newam = aofManifestCreate();
+    newam->base = aofFileCreate(base,am->base_seq+1);
+    newam->base_seq = am->base_seq+1;
+    newam->incr_seq = am->incr_seq;
+    listRewind(am->incrs,&li);
+    while((ln = listNext(&li)) != NULL) {
+        aofFile *af = listNodeValue(ln);
+        if (j++ < server.aof_rewrite_incrs) continue;
+        listAddNodeTail(newam->incrs,aofFileCreate(sdsdup(af->name),af->seq));
+    }
+    if (aofPersistManifest(newam) == C_ERR) {
+        bg_unlink(base);
+        aofManifestFree(newam);
+        return C_ERR;
+    }
+
+    /* The old files are not referenced by the manifest anymore. */
+    if (am->base) bg_unlink(am->base->name);
+    j = 0;
+    listRewind(am->incrs,&li);
+    while((ln = listNext(&li)) != NULL && j++ < server.aof_rewrite_incrs) {
+        aofFile *af = listNodeValue(ln);
+        bg_unlink(af->name);
+    }
+    aofManifestFree(am);
+    server.aof_manifest = newam;
+    aofUpdateCurrentSize();
+    server.aof_rewrite_base_size = server.aof_current_size;
+    return C_OK;
+}
+
 /* ----------------------------------------------------------------------------
  * AOF file implementation
  * ------------------------------------------------------------------------- */
@@ -226,7 +569,7 @@ void killAppendOnlyChild(void) {
     server.aof_child_pid = -1;
     server.aof_rewrite_time_start = -1;
     /* Close pipes used for IPC between the two processes. */
-    aofClosePipes();
+    if (!server.aof_multi_part) aofClosePipes();
     closeChildInfoPipe();
     updateDictResizePolicy();
 }
@@ -234,12 +577,14 @@ void killAppendOnlyChild(void) {
 /* Called when the user switches from "appendonly yes" to "appendonly no"
  * at runtime using the CONFIG command. */
 void stopAppendOnly(void) {
+    int oldfd = server.aof_fd;
+
     serverAssert(server.aof_state != AOF_OFF);
     flushAppendOnlyFile(1);
-    redis_fsync(server.aof_fd);
-    close(server.aof_fd);
+    aofSetFd(-1);
+    redis_fsync(oldfd);
+    close(oldfd);
 
-    server.aof_fd = -1;
     server.aof_selected_db = -1;
     server.aof_state = AOF_OFF;
     server.aof_rewrite_scheduled = 0;
@@ -250,20 +595,26 @@ void stopAppendOnly(void) {
  * at runtime using the CONFIG command. */
 int startAppendOnly(void) {
     char cwd[MAXPATHLEN]; /* Current working dir path for error messages. */
-    int newfd;
+    int newfd = -1;
 
-    newfd = open(server.aof_filename,O_WRONLY|O_APPEND|O_CREAT,0644);
     serverAssert(server.aof_state == AOF_OFF);
-    if (newfd == -1) {
-        char *cwdp = getcwd(cwd,MAXPATHLEN);
+    if (server.aof_multi_part) {
+        /* The increment file receiving the writes is created by the
+         * rewrite, so the state must be already set when it starts. */
+        server.aof_state = AOF_WAIT_REWRITE;
+    } else {
+        newfd = open(server.aof_filename,O_WRONLY|O_APPEND|O_CREAT,0644);
+        if (newfd == -1) {
+            char *cwdp = getcwd(cwd,MAXPATHLEN);
 
-        serverLog(LL_WARNING,
-            "Redis needs to enable the AOF but can't open the "
-            "append only file %s (in server root dir %s): %s",
-            server.aof_filename,
-            cwdp ? cwdp : "unknown",
-            strerror(errno));
-        return C_ERR;
+            serverLog(LL_WARNING,
+                "Redis needs to enable the AOF but can't open the "
+                "append only file %s (in server root dir %s): %s",
+                server.aof_filename,
+                cwdp ? cwdp : "unknown",
+                strerror(errno));
+            return C_ERR;
+        }
     }
     if (hasActiveChildProcess() && server.aof_child_pid == -1) {
         server.aof_rewrite_scheduled = 1;
@@ -277,7 +628,14 @@ int startAppendOnly(void) {
             killAppendOnlyChild();
         }
         if (rewriteAppendOnlyFileBackground() == C_ERR) {
-            close(newfd);
+            if (newfd != -1) close(newfd);
+            if (server.aof_multi_part) {
+                int oldfd = server.aof_fd;
+
+                server.aof_state = AOF_OFF;
+                aofSetFd(-1);
+                if (oldfd != -1) close(oldfd);
+            }
             serverLog(LL_WARNING,"Redis needs to enable the AOF but can't trigger a background AOF rewrite operation. Check the above logs for more info about the error.");
             return C_ERR;
         }
@@ -286,7 +644,7 @@ int startAppendOnly(void) {
      * in order to append data on disk. */
     server.aof_state = AOF_WAIT_REWRITE;
     server.aof_last_fsync = server.unixtime;
-    server.aof_fd = newfd;
+    if (!server.aof_multi_part) aofSetFd(newfd);
     return C_OK;
 }
 
@@ -316,6 +674,343 @@ ssize_t aofWrite(int fd, const char *buf, size_t len) {
     return totwritten;
 }
 
+/* ----------------------------------------------------------------------------
+ * AOF writer thread
+ *
+ * When aof-writer-thread is enabled the main thread doesn't write the AOF
+ * buffer: flushAppendOnlyFile() hands it off to a dedicated thread, just
+ * swapping server.aof_buf with the empty buffer the thread is going to write
+ * next, so that the event loop never waits for the disk. While the thread is
+ * busy writing or fsyncing, the following hand-offs are appended to its next
+ * buffer, so that a single write and fsync commit all of them (group
+ * commit).
+ *
+ * The thread fsyncs the AOF as requested by appendfsync: at most once per
+ * second with "everysec", or after every write with "always". The replies
+ * of the clients that performed writes are held until their writes reached
+ * the file (and were fsynced with "always"), while the event loop keeps
+ * serving the other clients in the meantime. Unlike with the classic
+ * implementation the writes are visible to the other clients, and are
+ * propagated to the replicas, before they reach the file. The thread
+ * notifies the main thread when new data is written using a pipe.
+ *
+ * The file descriptor is only replaced while the thread is idle, see
+ * aofWriterSetFd(), so that the old file can be closed right after.
+ * ------------------------------------------------------------------------- */
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;   /* New data was handed off. */
+    pthread_cond_t idle_cond;   /* The thread is not busy anymore. */
+    sds next;                   /* Data handed off, to write next. */
+    int fsync_policy;           /* server.aof_fsync at the last hand-off. */
+    int no_fsync;               /* Don't fsync: a child is saving. */
+    int flush_sleep;            /* server.aof_flush_sleep. */
+    long long handed;           /* Bytes handed off so far. */
+    int busy;                   /* The thread is writing or fsyncing. */
+    /* While 'busy' is set only the writer thread accesses the following
+     * fields, otherwise the main thread can access them holding the mutex:
+     * see aofWriterSetFd(). */
+    int fd;                     /* AOF file, or -1 if the AOF is off. */
+    sds buf;                    /* Data being written. */
+    long long written;          /* Bytes written (or discarded) so far. */
+    off_t truncate_to;          /* Length of the file without the partial
+                                   write left by an error, or -1. */
+    long long synced;           /* Bytes written (and fsynced if needed). */
+    int write_errno;            /* errno of the last failed write, or 0. */
+    int notify_pipe[2];         /* Wakes up the main thread. */
+} aofWriter = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .work_cond = PTHREAD_COND_INITIALIZER,
+    .idle_cond = PTHREAD_COND_INITIALIZER,
+    .fd = -1,
+    .truncate_to = -1
+};
+
+/* Copy of aofWriter.synced only accessed by the main thread. */
+static long long aofWriterSynced = 0;
+
+static void aofWriterFlush(int force);
+
+static void *aofWriterMain(void *arg) {
+    long long fsynced = 0;
+    time_t last_fsync = time(NULL);
+    UNUSED(arg);
+
+    redis_set_thread_title("aof_writer");
+    pthread_mutex_lock(&aofWriter.mutex);
+    while(1) {
+        int fd, policy, no_fsync, flush_sleep, err = 0;
+        ssize_t nwritten;
+        size_t len;
+
+        /* Wait for new data, or for the next fsync with "everysec", unless
+         * the fsync is skipped, or the thread would spin. */
+        while(sdslen(aofWriter.next) == 0 && sdslen(aofWriter.buf) == 0 &&
+              !(aofWriter.fsync_policy == AOF_FSYNC_EVERYSEC &&
+                aofWriter.fd != -1 && !aofWriter.no_fsync &&
+                aofWriter.written > fsynced && time(NULL) > last_fsync))
+        {
+            struct timespec ts;
+
+            aofWriter.busy = 0;
+            pthread_cond_broadcast(&aofWriter.idle_cond);
+            clock_gettime(CLOCK_REALTIME,&ts);
+            ts.tv_sec++;
+            pthread_cond_timedwait(&aofWriter.work_cond,&aofWriter.mutex,&ts);
+        }
+        aofWriter.busy = 1;
+        if (sdslen(aofWriter.buf) == 0) {
+            sds tmp = aofWriter.buf;
+            aofWriter.buf = aofWriter.next;
+            aofWriter.next = tmp;
+        } else {
+            /* Data left by a failed write goes first. */
+            aofWriter.buf = sdscatsds(aofWriter.buf,aofWriter.next);
+            sdsclear(aofWriter.next);
+        }
+        fd = aofWriter.fd;
+        policy = aofWriter.fsync_policy;
+        no_fsync = aofWriter.no_fsync;
+        flush_sleep = aofWriter.flush_sleep;
+        pthread_mutex_unlock(&aofWriter.mutex);
+
+        len = sdslen(aofWriter.buf);
+        if (len) {
+            if (flush_sleep) usleep(flush_sleep);
+            /* If the AOF was turned off there is nothing to write to. */
+            nwritten = fd == -1 ? (ssize_t)len : aofWrite(fd,aofWriter.buf,len);
+            if (nwritten != (ssize_t)len) {
+                err = nwritten == -1 ? errno : ENOSPC;
+                if (policy == AOF_FSYNC_ALWAYS) {
+                    serverLog(LL_WARNING,"Can't recover from AOF write error when the AOF fsync policy is 'always'. Exiting...");
+                    exit(1);
+                }
+                if (nwritten > 0) {
+                    /* Remove the partial write like flushAppendOnlyFile()
+                     * does, or remember where it starts so that it can be
+                     * removed if the file is replaced before the rest of
+                     * the data is written. */
+                    off_t size = lseek(fd,0,SEEK_END);
+
+                    if (size != -1 && ftruncate(fd,size-nwritten) != -1)
+                        nwritten = 0;
+                    else if (size != -1 && aofWriter.truncate_to == -1)
+                        aofWriter.truncate_to = size-nwritten;
+                }
+            }
+            if (nwritten > 0) {
+                aofWriter.written += nwritten;
+                sdsrange(aofWriter.buf,nwritten,-1);
+            }
+            if (sdslen(aofWriter.buf) == 0) aofWriter.truncate_to = -1;
+        }
+        /* Re-use the buffer when it is small enough, like server.aof_buf. */
+        if (sdslen(aofWriter.buf) == 0 && sdsalloc(aofWriter.buf) >= 4000) {
+            sdsfree(aofWriter.buf);
+            aofWriter.buf = sdsempty();
+        }
+
+        if (fd != -1 && aofWriter.written > fsynced &&
+            (policy == AOF_FSYNC_ALWAYS ||
+             (policy == AOF_FSYNC_EVERYSEC && time(NULL) > last_fsync)) &&
+            !no_fsync)
+        {
+            redis_fsync(fd);
+            fsynced = aofWriter.written;
+            last_fsync = time(NULL);
+        }
+
+        pthread_mutex_lock(&aofWriter.mutex);
+        aofWriter.write_errno = err;
+        if (aofWriter.synced != aofWriter.written || err) {
+            aofWriter.synced = aofWriter.written;
+            if (write(aofWriter.notify_pipe[1],"x",1) == -1) {
+                /* The pipe is full: the main thread will wake up anyway. */
+            }
+        }
+        if (err) {
+            /* Retry at the next hand-off, or in a second. */
+            struct timespec ts;
+
+            aofWriter.busy = 0;
+            pthread_cond_broadcast(&aofWriter.idle_cond);
+            clock_gettime(CLOCK_REALTIME,&ts);
+            ts.tv_sec++;
+            pthread_cond_timedwait(&aofWriter.work_cond,&aofWriter.mutex,&ts);
+        }
+    }
+    return NULL;
+}
+
+/* Make the writer thread write to 'fd' from now on. Returns once the thread
+ * is done with the old file, so that the caller can close it. The data that
+ * could not be written to the old file yet is discarded, like the classic
+ * implementation does with server.aof_buf when the file is replaced, and
+ * the partial write it may have left in the old file is removed. */
+static void aofWriterSetFd(int fd) {
+    pthread_mutex_lock(&aofWriter.mutex);
+    while(aofWriter.busy)
+        pthread_cond_wait(&aofWriter.idle_cond,&aofWriter.mutex);
+    if (aofWriter.truncate_to != -1 && aofWriter.fd != -1 &&
+        ftruncate(aofWriter.fd,aofWriter.truncate_to) == -1)
+    {
+        serverLog(LL_WARNING, "Could not remove short write "
+                 "from the append-only file.  Redis may refuse "
+                 "to load the AOF the next time it starts.  "
+                 "ftruncate: %s", strerror(errno));
+    }
+    aofWriter.truncate_to = -1;
+    aofWriter.written += sdslen(aofWriter.buf) + sdslen(aofWriter.next);
+    sdsclear(aofWriter.buf);
+    sdsclear(aofWriter.next);
+    aofWriter.synced = aofWriterSynced = aofWriter.written;
+    aofWriter.fd = fd;
+    pthread_mutex_unlock(&aofWriter.mutex);
+}
+
+/* Set the file descriptor the AOF is written to. */
+static void aofSetFd(int fd) {
+    if (server.aof_writer_thread) aofWriterSetFd(fd);
+    server.aof_fd = fd;
+}
+
+/* Release the replies of the clients whose writes were written. */
+static void aofReleaseClientReplies(void) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.clients_waiting_aof,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+
+        if (aofClientMustWait(c)) continue;
+        listDelNode(server.clients_waiting_aof,ln);
+        c->flags &= ~CLIENT_AOF_WAIT;
+        if (clientHasPendingReplies(c)) clientInstallWriteHandler(c);
+    }
+}
+
+static void aofWriterNotifyReadable(aeEventLoop *el, int fd, void *privdata, int mask) {
+    char buf[128];
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    while(read(fd,buf,sizeof(buf)) > 0);
+    aofWriterFlush(0);
+}
+
+void aofWriterInit(void) {
+    aofWriter.next = sdsempty();
+    aofWriter.buf = sdsempty();
+    aofWriter.fd = server.aof_fd;
+    aofWriter.fsync_policy = server.aof_fsync;
+    if (pipe(aofWriter.notify_pipe) == -1 ||
+        anetNonBlock(NULL,aofWriter.notify_pipe[0]) != ANET_OK ||
+        anetNonBlock(NULL,aofWriter.notify_pipe[1]) != ANET_OK ||
+        aeCreateFileEvent(server.el,aofWriter.notify_pipe[0],AE_READABLE,
+                          aofWriterNotifyReadable,NULL) == AE_ERR ||
+        pthread_create(&aofWriter.thread,NULL,aofWriterMain,NULL) != 0)
+    {
+        serverLog(LL_WARNING,"Fatal: Can't initialize the AOF writer thread.");
+        exit(1);
+    }
+}
+
+/* Hand off the AOF buffer to the writer thread. If 'force' is true wait
+ * for the thread to write all the data handed off so far. */
+static void aofWriterFlush(int force) {
+    size_t len = sdslen(server.aof_buf);
+    int err;
+
+    pthread_mutex_lock(&aofWriter.mutex);
+    aofWriter.fsync_policy = server.aof_fsync;
+    aofWriter.no_fsync = server.aof_no_fsync_on_rewrite &&
+                         hasActiveChildProcess();
+    aofWriter.flush_sleep = server.aof_flush_sleep;
+    if (len) {
+        if (sdslen(aofWriter.next) == 0) {
+            sds tmp = aofWriter.next;
+            aofWriter.next = server.aof_buf;
+            server.aof_buf = tmp;
+        } else {
+            aofWriter.next = sdscatsds(aofWriter.next,server.aof_buf);
+            sdsclear(server.aof_buf);
+        }
+        aofWriter.handed += len;
+        server.aof_current_size += len;
+        pthread_cond_signal(&aofWriter.work_cond);
+    }
+    if (force) {
+        while((sdslen(aofWriter.next) || aofWriter.busy) &&
+              !aofWriter.write_errno)
+            pthread_cond_wait(&aofWriter.idle_cond,&aofWriter.mutex);
+    }
+    aofWriterSynced = aofWriter.synced;
+    err = aofWriter.write_errno;
+    pthread_mutex_unlock(&aofWriter.mutex);
+
+    if (err) {
+        if (server.aof_last_write_status == C_OK)
+            serverLog(LL_WARNING,"Error writing to the AOF file: %s",
+                strerror(err));
+        server.aof_last_write_status = C_ERR;
+        server.aof_last_write_errno = err;
+    } else if (server.aof_last_write_status == C_ERR) {
+        serverLog(LL_WARNING,
+            "AOF write error looks solved, Redis can write again.");
+        server.aof_last_write_status = C_OK;
+    }
+    if (listLength(server.clients_waiting_aof)) aofReleaseClientReplies();
+}
+
+/* Return true if the replies of the client can't be sent yet, because its
+ * writes were not written (or fsynced) yet. While the AOF can't be written
+ * the replies are not held, like with the classic implementation: the
+ * clients are refused further writes instead. */
+int aofClientMustWait(client *c) {
+    return c->aof_woff > aofWriterSynced &&
+           server.aof_last_write_status == C_OK;
+}
+
+/* Hold the replies of the client until its writes are written. */
+void aofHoldClientReplies(client *c) {
+    if (c->flags & CLIENT_AOF_WAIT) return;
+    if (c->flags & CLIENT_PENDING_WRITE) {
+        listNode *ln = listSearchKey(server.clients_pending_write,c);
+        serverAssert(ln != NULL);
+        listDelNode(server.clients_pending_write,ln);
+        c->flags &= ~CLIENT_PENDING_WRITE;
+    }
+    c->flags |= CLIENT_AOF_WAIT;
+    listAddNodeTail(server.clients_waiting_aof,c);
+}
+
+/* Called before writing the replies of the clients with pending writes:
+ * hold the ones of the clients whose writes are not written yet. */
+void aofHoldPendingReplies(void) {
+    listIter li;
+    listNode *ln;
+
+    /* Fast path: everything handed off is already written. */
+    if (aofWriterSynced == aofWriter.handed) return;
+
+    listRewind(server.clients_pending_write,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+
+        if (!aofClientMustWait(c)) continue;
+        listDelNode(server.clients_pending_write,ln);
+        c->flags &= ~CLIENT_PENDING_WRITE;
+        if (!(c->flags & CLIENT_AOF_WAIT)) {
+            c->flags |= CLIENT_AOF_WAIT;
+            listAddNodeTail(server.clients_waiting_aof,c);
+        }
+    }
+}
+
 /* Write the append only file buffer on disk.
  *
  * Since we are required to write the AOF before replying to the client,
@@ -340,6 +1035,11 @@ void flushAppendOnlyFile(int force) {
     int sync_in_progress = 0;
     mstime_t latency;
 
+    if (server.aof_writer_thread) {
+        aofWriterFlush(force);
+        return;
+    }
+
     if (sdslen(server.aof_buf) == 0) {
         /* Check if we need to do fsync even the aof buffer is empty,
          * because previously in AOF_FSYNC_EVERYSEC mode, fsync is
@@ -519,11 +1219,183 @@ try_fsync:
     }
 }
 
+/* ----------------------------------------------------------------------------
+ * AOF binary format
+ *
+ * With aof-format set to "binary" the commands are appended to the AOF as
+ * binary blocks instead of RESP text. Every call to feedAppendOnlyFile()
+ * produces a block, so that a block is never split across writes:
+ *
+ *   AOF_BINARY_BLOCK <payload len> <payload> <crc64 of the payload>
+ *
+ * The length is stored with the RDB length encoding and the checksum as 8
+ * bytes in little endian. The payload is a sequence of records:
+ *
+ *   AOF_BINARY_SELECT <dbid>
+ *   AOF_BINARY_COMMAND <argc> <arg> ... <arg>
+ *
+ * where the numbers use the RDB length encoding and the arguments are RDB
+ * strings, so that small integers take one to five bytes. Unlike RDB files
+ * no compression is attempted, not to slow down the hot path of every write.
+ *
+ * Loading a block doesn't require to parse any text, and the checksum
+ * detects corrupted blocks. Since a block can't start with '*', binary
+ * blocks and RESP commands can be mixed in the same file, so that the
+ * format can be switched at runtime. The rewrite still emits RESP commands
+ * after the RDB preamble, if any.
+ * ------------------------------------------------------------------------- */
+
+/* Append an argument to the payload of a binary block. */
+static void aofBinaryWriteArg(rio *r, robj *o) {
+    unsigned char enc[5];
+    size_t len;
+    int enclen;
+
+    if (o->encoding == OBJ_ENCODING_INT) {
+        rdbSaveLongLongAsStringObject(r,(long)o->ptr);
+        return;
+    }
+    len = sdslen(o->ptr);
+    if (len <= 11 && (enclen = rdbTryIntegerEncoding(o->ptr,len,enc)) > 0) {
+        rioWrite(r,enc,enclen);
+    } else {
+        rdbSaveLen(r,len);
+        rioWrite(r,o->ptr,len);
+    }
+}
+
+/* Append a command record to the payload of a binary block. */
+static sds catAppendOnlyBinaryCommand(sds dst, int argc, robj **argv) {
+    unsigned char type = AOF_BINARY_COMMAND;
+    rio r;
+    int j;
+
+    rioInitWithBuffer(&r,dst);
+    rioWrite(&r,&type,1);
+    rdbSaveLen(&r,argc);
+    for (j = 0; j < argc; j++) aofBinaryWriteArg(&r,argv[j]);
+    return r.io.buffer.ptr;
+}
+
+/* Append a DB selection record to the payload of a binary block. */
+static sds catAppendOnlyBinarySelect(sds dst, int dictid) {
+    unsigned char type = AOF_BINARY_SELECT;
+    rio r;
+
+    rioInitWithBuffer(&r,dst);
+    rioWrite(&r,&type,1);
+    rdbSaveLen(&r,dictid);
+    return r.io.buffer.ptr;
+}
+
+/* Turn the records in 'payload' into a block. The payload is freed and the
+ * block is returned. */
+static sds aofBinaryBlock(sds payload) {
+    unsigned char magic = AOF_BINARY_BLOCK;
+    size_t len = sdslen(payload);
+    uint64_t crc = crc64(0,(unsigned char*)payload,len);
+    rio r;
+
+    rioInitWithBuffer(&r,sdsMakeRoomFor(sdsempty(),len+18));
+    rioWrite(&r,&magic,1);
+    rdbSaveLen(&r,len);
+    rioWrite(&r,payload,len);
+    memrev64ifbe(&crc);
+    rioWrite(&r,&crc,sizeof(crc));
+    sdsfree(payload);
+    return r.io.buffer.ptr;
+}
+
+/* Read the rest of a binary block whose first byte was already consumed,
+ * verifying its checksum. 'size' is the size of the file, used to reject
+ * lengths that can't be right before allocating them. On success 1 is
+ * returned and the payload is stored at '*payload'. On short read 0 is
+ * returned: the caller can check feof() to tell a truncated file from an
+ * I/O error. If the block is corrupted -1 is returned. */
+int aofReadBinaryBlock(FILE *fp, off_t size, sds *payload) {
+    uint64_t len, crc;
+    off_t pos;
+    sds buf;
+    rio r;
+    int c;
+
+    /* Reject the RDB special encodings, that are not lengths. */
+    if ((c = getc(fp)) == EOF) return 0;
+    if ((c & 0xC0) == 0xC0 || ((c & 0xC0) == 0x80 &&
+        c != RDB_32BITLEN && c != RDB_64BITLEN)) return -1;
+    ungetc(c,fp);
+    rioInitWithFile(&r,fp);
+    if (rdbLoadLenByRef(&r,NULL,&len) == -1) return 0;
+    if ((pos = ftello(fp)) == -1) return 0;
+    if (len > (uint64_t)(size-pos)) {
+        /* The block can't fit in the file: try to read up to the end
+         * anyway, to tell a short read from an error. */
+        while(getc(fp) != EOF);
+        return 0;
+    }
+    buf = sdsnewlen(SDS_NOINIT,len);
+    if ((len && fread(buf,len,1,fp) == 0) || fread(&crc,sizeof(crc),1,fp) == 0) {
+        sdsfree(buf);
+        return 0;
+    }
+    memrev64ifbe(&crc);
+    if (crc != crc64(0,(unsigned char*)buf,len)) {
+        sdsfree(buf);
+        return -1;
+    }
+    *payload = buf;
+    return 1;
+}
+
+/* Parse the next record of the payload of a binary block into a command
+ * vector. A DB selection is returned as a SELECT command, so that it is
+ * queued like any other command inside MULTI. Returns C_ERR if the record
+ * is malformed. */
+int aofParseBinaryRecord(rio *payload, int *argcp, robj ***argvp) {
+    size_t left = sdslen(payload->io.buffer.ptr)-payload->io.buffer.pos;
+    unsigned char type;
+    uint64_t argc, dbid, j;
+    robj **argv;
+
+    if (rioRead(payload,&type,1) == 0) return C_ERR;
+    if (type == AOF_BINARY_SELECT) {
+        if ((dbid = rdbLoadLen(payload,NULL)) == RDB_LENERR ||
+            dbid > INT_MAX) return C_ERR;
+        argv = zmalloc(sizeof(robj*)*2);
+        argv[0] = createStringObject("SELECT",6);
+        argv[1] = createObject(OBJ_STRING,sdsfromlonglong(dbid));
+        *argcp = 2;
+        *argvp = argv;
+        return C_OK;
+    } else if (type != AOF_BINARY_COMMAND) {
+        return C_ERR;
+    }
+
+    /* Every argument takes at least a byte. */
+    argc = rdbLoadLen(payload,NULL);
+    if (argc == RDB_LENERR || argc == 0 || argc > left) return C_ERR;
+    argv = zmalloc(sizeof(robj*)*argc);
+    for (j = 0; j < argc; j++) {
+        argv[j] = rdbGenericLoadStringObject(payload,RDB_LOAD_NONE,NULL);
+        if (argv[j] == NULL) {
+            while(j--) decrRefCount(argv[j]);
+            zfree(argv);
+            return C_ERR;
+        }
+    }
+    *argcp = argc;
+    *argvp = argv;
+    return C_OK;
+}
+
 sds catAppendOnlyGenericCommand(sds dst, int argc, robj **argv) {
     char buf[32];
     int len, j;
     robj *o;
 
+    if (server.aof_format == AOF_FORMAT_BINARY)
+        return catAppendOnlyBinaryCommand(dst,argc,argv);
+
     buf[0] = '*';
     len = 1+ll2string(buf+1,sizeof(buf)-1,argc);
     buf[len++] = '\r';
@@ -590,9 +1462,13 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
     if (dictid != server.aof_selected_db) {
         char seldb[64];
 
-        snprintf(seldb,sizeof(seldb),"%d",dictid);
-        buf = sdscatprintf(buf,"*2\r\n$6\r\nSELECT\r\n$%lu\r\n%s\r\n",
-            (unsigned long)strlen(seldb),seldb);
+        if (server.aof_format == AOF_FORMAT_BINARY) {
+            buf = catAppendOnlyBinarySelect(buf,dictid);
+        } else {
+            snprintf(seldb,sizeof(seldb),"%d",dictid);
+            buf = sdscatprintf(buf,"*2\r\n$6\r\nSELECT\r\n$%lu\r\n%s\r\n",
+                (unsigned long)strlen(seldb),seldb);
+        }
         server.aof_selected_db = dictid;
     }
 
@@ -635,18 +1511,31 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
          * for the replication itself. */
         buf = catAppendOnlyGenericCommand(buf,argc,argv);
     }
+    if (server.aof_format == AOF_FORMAT_BINARY) buf = aofBinaryBlock(buf);
 
     /* Append to the AOF buffer. This will be flushed on disk just before
      * of re-entering the event loop, so before the client will get a
-     * positive reply about the operation performed. */
-    if (server.aof_state == AOF_ON)
+     * positive reply about the operation performed. With the multi part AOF
+     * the writes performed while waiting for the first rewrite are appended
+     * to the increment file opened by the rewrite as well. */
+    if (server.aof_state == AOF_ON ||
+        (server.aof_multi_part && server.aof_fd != -1))
+    {
         server.aof_buf = sdscatlen(server.aof_buf,buf,sdslen(buf));
 
+        /* With the writer thread the replies of the client are held until
+         * this offset is written. */
+        if (server.aof_writer_thread && server.current_client) {
+            server.current_client->aof_woff =
+                aofWriter.handed + sdslen(server.aof_buf);
+        }
+    }
+
     /* If a background append only file rewriting is in progress we want to
      * accumulate the differences between the child DB and the current one
      * in a buffer, so that when the child process will do its work we
      * can append the differences to the new append only file. */
-    if (server.aof_child_pid != -1)
+    if (server.aof_child_pid != -1 && !server.aof_multi_part)
         aofRewriteBufferAppend((unsigned char*)buf,sdslen(buf));
 
     sdsfree(buf);
@@ -706,10 +1595,50 @@ void freeFakeClient(struct client *c) {
     zfree(c);
 }
 
-/* Replay the append log file. On success C_OK is returned. On non fatal
+/* Run the command loaded in the argv of the AOF fake client, that is freed
+ * afterwards. The command is returned. */
+static struct redisCommand *execAOFCommand(client *fakeClient) {
+    struct redisCommand *cmd;
+
+    /* Command lookup */
+    cmd = lookupCommand(fakeClient->argv[0]->ptr);
+    if (!cmd) {
+        serverLog(LL_WARNING,
+            "Unknown command '%s' reading the append only file",
+            (char*)fakeClient->argv[0]->ptr);
+        exit(1);
+    }
+
+    /* Run the command in the context of a fake client */
+    fakeClient->cmd = fakeClient->lastcmd = cmd;
+    if (fakeClient->flags & CLIENT_MULTI &&
+        fakeClient->cmd->proc != execCommand)
+    {
+        queueMultiCommand(fakeClient);
+    } else {
+        cmd->proc(fakeClient);
+    }
+
+    /* The fake client should not have a reply */
+    serverAssert(fakeClient->bufpos == 0 &&
+                 listLength(fakeClient->reply) == 0);
+
+    /* The fake client should never get blocked */
+    serverAssert((fakeClient->flags & CLIENT_BLOCKED) == 0);
+
+    /* Clean up. Command code may have changed argv/argc so we use the
+     * argv/argc of the client instead of the local variables. */
+    freeFakeClientArgv(fakeClient);
+    fakeClient->cmd = NULL;
+    return cmd;
+}
+
+/* Replay an append log file. On success C_OK is returned. On non fatal
  * error (the append only file is zero-length) C_ERR is returned. On
- * fatal error an error message is logged and the program exists. */
-int loadAppendOnlyFile(char *filename) {
+ * fatal error an error message is logged and the program exists. If 'last'
+ * is false the file is followed by other files of a multi part AOF, so it
+ * can't be truncated even if aof-load-truncated is enabled. */
+static int loadAppendOnlyFilePart(char *filename, int last) {
     struct client *fakeClient;
     FILE *fp = fopen(filename,"r");
     struct redis_stat sb;
@@ -728,8 +1657,6 @@ int loadAppendOnlyFile(char *filename) {
      * a zero length file at startup, that will remain like that if no write
      * operation is received. */
     if (fp && redis_fstat(fileno(fp),&sb) != -1 && sb.st_size == 0) {
-        server.aof_current_size = 0;
-        server.aof_fsync_offset = server.aof_current_size;
         fclose(fp);
         return C_ERR;
     }
@@ -762,9 +1689,10 @@ int loadAppendOnlyFile(char *filename) {
         }
     }
 
-    /* Read the actual AOF file, in REPL format, command by command. */
+    /* Read the actual AOF file, in REPL format, command by command, or
+     * in binary format, block by block. */
     while(1) {
-        int argc, j;
+        int argc, j, c;
         unsigned long len;
         robj **argv;
         char buf[128];
@@ -778,14 +1706,39 @@ int loadAppendOnlyFile(char *filename) {
             processModuleLoadingProgressEvent(1);
         }
 
-        if (fgets(buf,sizeof(buf),fp) == NULL) {
+        if ((c = getc(fp)) == EOF) {
             if (feof(fp))
                 break;
             else
                 goto readerr;
         }
-        if (buf[0] != '*') goto fmterr;
-        if (buf[1] == '\0') goto readerr;
+
+        if (c == AOF_BINARY_BLOCK) {
+            sds payload;
+            rio r;
+            int ret = aofReadBinaryBlock(fp,sb.st_size,&payload);
+
+            if (ret == 0) goto readerr;
+            if (ret == -1) goto fmterr;
+            rioInitWithBuffer(&r,payload);
+            while((size_t)r.io.buffer.pos < sdslen(payload)) {
+                if (aofParseBinaryRecord(&r,&fakeClient->argc,
+                                         &fakeClient->argv) == C_ERR)
+                {
+                    sdsfree(payload);
+                    goto fmterr;
+                }
+                cmd = execAOFCommand(fakeClient);
+                if (cmd == server.multiCommand)
+                    valid_before_multi = valid_up_to;
+            }
+            sdsfree(payload);
+            goto next;
+        }
+
+        if (c != '*') goto fmterr;
+        buf[0] = c;
+        if (fgets(buf+1,sizeof(buf)-1,fp) == NULL) goto readerr;
         argc = atoi(buf+1);
         if (argc < 1) goto fmterr;
 
@@ -826,38 +1779,10 @@ int loadAppendOnlyFile(char *filename) {
             }
         }
 
-        /* Command lookup */
-        cmd = lookupCommand(argv[0]->ptr);
-        if (!cmd) {
-            serverLog(LL_WARNING,
-                "Unknown command '%s' reading the append only file",
-                (char*)argv[0]->ptr);
-            exit(1);
-        }
-
+        cmd = execAOFCommand(fakeClient);
         if (cmd == server.multiCommand) valid_before_multi = valid_up_to;
 
-        /* Run the command in the context of a fake client */
-        fakeClient->cmd = fakeClient->lastcmd = cmd;
-        if (fakeClient->flags & CLIENT_MULTI &&
-            fakeClient->cmd->proc != execCommand)
-        {
-            queueMultiCommand(fakeClient);
-        } else {
-            cmd->proc(fakeClient);
-        }
-
-        /* The fake client should not have a reply */
-        serverAssert(fakeClient->bufpos == 0 &&
-                     listLength(fakeClient->reply) == 0);
-
-        /* The fake client should never get blocked */
-        serverAssert((fakeClient->flags & CLIENT_BLOCKED) == 0);
-
-        /* Clean up. Command code may have changed argv/argc so we use the
-         * argv/argc of the client instead of the local variables. */
-        freeFakeClientArgv(fakeClient);
-        fakeClient->cmd = NULL;
+next:
         if (server.aof_load_truncated) valid_up_to = ftello(fp);
         if (server.key_load_delay)
             usleep(server.key_load_delay);
@@ -879,9 +1804,6 @@ loaded_ok: /* DB loaded, cleanup and return C_OK to the caller. */
     freeFakeClient(fakeClient);
     server.aof_state = old_aof_state;
     stopLoading(1);
-    aofUpdateCurrentSize();
-    server.aof_rewrite_base_size = server.aof_current_size;
-    server.aof_fsync_offset = server.aof_current_size;
     return C_OK;
 
 readerr: /* Read error. If feof(fp) is true, fall through to unexpected EOF. */
@@ -893,7 +1815,10 @@ readerr: /* Read error. If feof(fp) is true, fall through to unexpected EOF. */
     }
 
 uxeof: /* Unexpected AOF end of file. */
-    if (server.aof_load_truncated) {
+    if (server.aof_load_truncated && !last) {
+        serverLog(LL_WARNING,"The AOF file %s is truncated, but it is not "
+            "the last file of the AOF, so it can't be truncated.", filename);
+    } else if (server.aof_load_truncated) {
         serverLog(LL_WARNING,"!!! Warning: short read while loading the AOF file !!!");
         serverLog(LL_WARNING,"!!! Truncating the AOF at offset %llu !!!",
             (unsigned long long) valid_up_to);
@@ -929,6 +1854,43 @@ fmterr: /* Format error. */
     exit(1);
 }
 
+/* Replay the AOF: with aof-multi-part enabled the files listed in the
+ * manifest are loaded in order and 'filename' is ignored. Only the last non
+ * empty file can be truncated: it is usually the latest increment, but it
+ * may be the base if the increments that follow it are still empty. Returns
+ * C_OK if at least a non empty file was loaded, otherwise the same as
+ * loadAppendOnlyFilePart(). */
+int loadAppendOnlyFile(char *filename) {
+    int retval = C_ERR;
+
+    if (server.aof_multi_part) {
+        aofManifest *am = server.aof_manifest;
+        unsigned long numfiles = 0, last = 0, j;
+        aofFile **files = zmalloc(sizeof(aofFile*)*(listLength(am->incrs)+1));
+        struct redis_stat sb;
+        listIter li;
+        listNode *ln;
+
+        if (am->base) files[numfiles++] = am->base;
+        listRewind(am->incrs,&li);
+        while((ln = listNext(&li)) != NULL) files[numfiles++] = listNodeValue(ln);
+        for (j = 0; j < numfiles; j++) {
+            if (redis_stat(files[j]->name,&sb) == 0 && sb.st_size) last = j;
+        }
+        for (j = 0; j < numfiles; j++) {
+            if (loadAppendOnlyFilePart(files[j]->name,j >= last) == C_OK)
+                retval = C_OK;
+        }
+        zfree(files);
+    } else {
+        retval = loadAppendOnlyFilePart(filename,1);
+    }
+    aofUpdateCurrentSize();
+    server.aof_rewrite_base_size = server.aof_current_size;
+    server.aof_fsync_offset = server.aof_current_size;
+    return retval;
+}
+
 /* ----------------------------------------------------------------------------
  * AOF rewrite
  * ------------------------------------------------------------------------- */
@@ -1003,6 +1965,26 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
             if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
             items--;
         }
+    } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *p = lpFirst(o->ptr);
+        unsigned char buf[LP_INTBUF_SIZE], *str;
+        int64_t len;
+
+        while(p) {
+            str = lpGet(p,&len,buf);
+            if (count == 0) {
+                int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
+                    AOF_REWRITE_ITEMS_PER_CMD : items;
+
+                if (rioWriteBulkCount(r,'*',2+cmd_items) == 0) return 0;
+                if (rioWriteBulkString(r,"SADD",4) == 0) return 0;
+                if (rioWriteBulkObject(r,key) == 0) return 0;
+            }
+            if (rioWriteBulkString(r,(char*)str,len) == 0) return 0;
+            if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+            items--;
+            p = lpNext(o->ptr,p);
+        }
     } else if (o->encoding == OBJ_ENCODING_HT) {
         dictIterator *di = dictGetIterator(o->ptr);
         dictEntry *de;
@@ -1033,7 +2015,7 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
 int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
     long long count = 0, items = zsetLength(o);
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = o->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -1041,13 +2023,13 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
         long long vll;
         double score;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         while (eptr != NULL) {
-            serverAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+            vstr = lpGetValue(eptr,&vlen,&vll);
             score = zzlGetScore(sptr);
 
             if (count == 0) {
@@ -1091,6 +2073,26 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
             items--;
         }
         dictReleaseIterator(di);
+    } else if (o->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = o->ptr;
+        zbtCursor cur;
+
+        if (zbtFirst(zs->zbt,&cur)) do {
+            zbtEntry *e = zbtCursorEntry(&cur);
+
+            if (count == 0) {
+                int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
+                    AOF_REWRITE_ITEMS_PER_CMD : items;
+
+                if (rioWriteBulkCount(r,'*',2+cmd_items*2) == 0) return 0;
+                if (rioWriteBulkString(r,"ZADD",4) == 0) return 0;
+                if (rioWriteBulkObject(r,key) == 0) return 0;
+            }
+            if (rioWriteBulkDouble(r,e->score) == 0) return 0;
+            if (rioWriteBulkString(r,e->ele,sdslen(e->ele)) == 0) return 0;
+            if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+            items--;
+        } while(zbtNext(&cur));
     } else {
         serverPanic("Unknown sorted zset encoding");
     }
@@ -1104,12 +2106,12 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
  *
  * The function returns 0 on error, non-zero on success. */
 static int rioWriteHashIteratorCursor(rio *r, hashTypeIterator *hi, int what) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
         if (vstr)
             return rioWriteBulkString(r, (char*)vstr, vlen);
         else
@@ -1123,6 +2125,51 @@ static int rioWriteHashIteratorCursor(rio *r, hashTypeIterator *hi, int what) {
     return 0;
 }
 
+/* Emit the HPEXPIREAT commands needed to restore the expires of the fields
+ * of a hash. The fields are visited in expire time order in the index of
+ * the hash (see t_hash.c), so the fields sharing the same expire time, as
+ * the ones set by a single HEXPIRE, are emitted with a single command. */
+static int rewriteHashFieldsExpires(rio *r, robj *key, robj *o) {
+    sds fields[AOF_REWRITE_ITEMS_PER_CMD];
+    int numfields = 0, retval = 1;
+    long long when = 0;
+    raxIterator ri;
+
+    raxStart(&ri,((dict*)o->ptr)->privdata);
+    raxSeek(&ri,"^",NULL,0);
+    while (retval) {
+        int more = raxNext(&ri);
+        long long t = more ? expiresIndexKeyTime(ri.key) : 0;
+
+        /* Flush the fields collected so far if the expire time changes,
+         * the batch is full, or there are no more fields. */
+        if (numfields && (!more || t != when ||
+                          numfields == AOF_REWRITE_ITEMS_PER_CMD))
+        {
+            if (rioWriteBulkCount(r,'*',5+numfields) == 0 ||
+                rioWriteBulkString(r,"HPEXPIREAT",10) == 0 ||
+                rioWriteBulkObject(r,key) == 0 ||
+                rioWriteBulkLongLong(r,when) == 0 ||
+                rioWriteBulkString(r,"FIELDS",6) == 0 ||
+                rioWriteBulkLongLong(r,numfields) == 0) retval = 0;
+            for (int j = 0; j < numfields; j++) {
+                if (retval &&
+                    rioWriteBulkString(r,fields[j],sdslen(fields[j])) == 0)
+                    retval = 0;
+                sdsfree(fields[j]);
+            }
+            numfields = 0;
+        }
+        if (!more) break;
+        when = t;
+        fields[numfields++] = sdsnewlen(ri.key+EXPIRES_INDEX_PREFIX_LEN,
+                                        ri.key_len-EXPIRES_INDEX_PREFIX_LEN);
+    }
+    raxStop(&ri);
+    while (numfields) sdsfree(fields[--numfields]);
+    return retval;
+}
+
 /* Emit the commands needed to rebuild a hash object.
  * The function returns 0 on error, 1 on success. */
 int rewriteHashObject(rio *r, robj *key, robj *o) {
@@ -1148,6 +2195,7 @@ int rewriteHashObject(rio *r, robj *key, robj *o) {
 
     hashTypeReleaseIterator(hi);
 
+    if (hashTypeHasVolatileFields(o)) return rewriteHashFieldsExpires(r,key,o);
     return 1;
 }
 
@@ -1334,6 +2382,8 @@ ssize_t aofReadDiffFromParent(void) {
     char buf[65536]; /* Default pipe buffer size on most Linux systems. */
     ssize_t nread, total = 0;
 
+    /* The multi part AOF doesn't use the diff pipes. */
+    if (server.aof_multi_part) return 0;
     while ((nread =
             read(server.aof_pipe_read_data_from_parent,buf,sizeof(buf))) > 0) {
         server.aof_child_diff = sdscatlen(server.aof_child_diff,buf,nread);
@@ -1462,45 +2512,50 @@ int rewriteAppendOnlyFile(char *filename) {
     if (fflush(fp) == EOF) goto werr;
     if (fsync(fileno(fp)) == -1) goto werr;
 
-    /* Read again a few times to get more data from the parent.
-     * We can't read forever (the server may receive data from clients
-     * faster than it is able to send data to the child), so we try to read
-     * some more data in a loop as soon as there is a good chance more data
-     * will come. If it looks like we are wasting time, we abort (this
-     * happens after 20 ms without new data). */
-    int nodata = 0;
-    mstime_t start = mstime();
-    while(mstime()-start < 1000 && nodata < 20) {
-        if (aeWait(server.aof_pipe_read_data_from_parent, AE_READABLE, 1) <= 0)
-        {
-            nodata++;
-            continue;
+    /* With the multi part AOF the writes performed during the rewrite are
+     * appended to a new increment file by the parent, so there is no diff
+     * to read. */
+    if (!server.aof_multi_part) {
+        /* Read again a few times to get more data from the parent.
+         * We can't read forever (the server may receive data from clients
+         * faster than it is able to send data to the child), so we try to read
+         * some more data in a loop as soon as there is a good chance more data
+         * will come. If it looks like we are wasting time, we abort (this
+         * happens after 20 ms without new data). */
+        int nodata = 0;
+        mstime_t start = mstime();
+        while(mstime()-start < 1000 && nodata < 20) {
+            if (aeWait(server.aof_pipe_read_data_from_parent, AE_READABLE, 1) <= 0)
+            {
+                nodata++;
+                continue;
+            }
+            nodata = 0; /* Start counting from zero, we stop on N *contiguous*
+                           timeouts. */
+            aofReadDiffFromParent();
         }
-        nodata = 0; /* Start counting from zero, we stop on N *contiguous*
-                       timeouts. */
-        aofReadDiffFromParent();
-    }
-
-    /* Ask the master to stop sending diffs. */
-    if (write(server.aof_pipe_write_ack_to_parent,"!",1) != 1) goto werr;
-    if (anetNonBlock(NULL,server.aof_pipe_read_ack_from_parent) != ANET_OK)
-        goto werr;
-    /* We read the ACK from the server using a 10 seconds timeout. Normally
-     * it should reply ASAP, but just in case we lose its reply, we are sure
-     * the child will eventually get terminated. */
-    if (syncRead(server.aof_pipe_read_ack_from_parent,&byte,1,5000) != 1 ||
-        byte != '!') goto werr;
-    serverLog(LL_NOTICE,"Parent agreed to stop sending diffs. Finalizing AOF...");
 
-    /* Read the final diff if any. */
-    aofReadDiffFromParent();
+        /* Ask the master to stop sending diffs. */
+        if (write(server.aof_pipe_write_ack_to_parent,"!",1) != 1) goto werr;
+        if (anetNonBlock(NULL,server.aof_pipe_read_ack_from_parent) != ANET_OK)
+            goto werr;
+        /* We read the ACK from the server using a 10 seconds timeout. Normally
+         * it should reply ASAP, but just in case we lose its reply, we are sure
+         * the child will eventually get terminated. */
+        if (syncRead(server.aof_pipe_read_ack_from_parent,&byte,1,5000) != 1 ||
+            byte != '!') goto werr;
+        serverLog(LL_NOTICE,"Parent agreed to stop sending diffs. Finalizing AOF...");
+
+        /* Read the final diff if any. */
+        aofReadDiffFromParent();
 
-    /* Write the received diff to the file. */
-    serverLog(LL_NOTICE,
-        "Concatenating %.2f MB of AOF diff received from parent.",
-        (double) sdslen(server.aof_child_diff) / (1024*1024));
-    if (rioWrite(&aof,server.aof_child_diff,sdslen(server.aof_child_diff)) == 0)
-        goto werr;
+        /* Write the received diff to the file. */
+        serverLog(LL_NOTICE,
+            "Concatenating %.2f MB of AOF diff received from parent.",
+            (double) sdslen(server.aof_child_diff) / (1024*1024));
+        if (rioWrite(&aof,server.aof_child_diff,sdslen(server.aof_child_diff)) == 0)
+            goto werr;
+    }
 
     /* Make sure data will not remain on the OS's output buffers */
     if (fflush(fp)) goto werr;
@@ -1617,12 +2672,25 @@ void aofClosePipes(void) {
  *    data accumulated into server.aof_rewrite_buf into the temp file, and
  *    finally will rename(2) the temp file in the actual file name.
  *    The the new file is reopened as the new append only file. Profit!
+ *
+ * With aof-multi-part enabled there is no differences buffer: the parent
+ * appends the writes to a new increment file, and the temp file written by
+ * the child becomes the new base. See the "Multi part AOF" section above.
  */
 int rewriteAppendOnlyFileBackground(void) {
     pid_t childpid;
 
     if (hasActiveChildProcess()) return C_ERR;
-    if (aofCreatePipes() != C_OK) return C_ERR;
+    if (server.aof_multi_part) {
+        /* The new base replaces all the increment files but the one opened
+         * now, where the writes performed from now on are appended. */
+        if (server.aof_state != AOF_OFF && aofRotateIncrFile() == C_ERR)
+            return C_ERR;
+        server.aof_rewrite_incrs = listLength(server.aof_manifest->incrs);
+        if (server.aof_state != AOF_OFF) server.aof_rewrite_incrs--;
+    } else if (aofCreatePipes() != C_OK) {
+        return C_ERR;
+    }
     openChildInfoPipe();
     if ((childpid = redisFork(CHILD_TYPE_AOF)) == 0) {
         char tmpfile[256];
@@ -1644,7 +2712,7 @@ int rewriteAppendOnlyFileBackground(void) {
             serverLog(LL_WARNING,
                 "Can't rewrite append only file in background: fork: %s",
                 strerror(errno));
-            aofClosePipes();
+            if (!server.aof_multi_part) aofClosePipes();
             return C_ERR;
         }
         serverLog(LL_NOTICE,
@@ -1689,15 +2757,18 @@ void aofRemoveTempFile(pid_t childpid) {
 }
 
 /* Update the server.aof_current_size field explicitly using stat(2)
- * to check the size of the file. This is useful after a rewrite or after
- * a restart, normally the size is updated just adding the write length
- * to the current length, that is much faster. */
+ * to check the size of the file, or of all the files of a multi part AOF.
+ * This is useful after a rewrite or after a restart, normally the size is
+ * updated just adding the write length to the current length, that is much
+ * faster. */
 void aofUpdateCurrentSize(void) {
     struct redis_stat sb;
     mstime_t latency;
 
     latencyStartMonitor(latency);
-    if (redis_fstat(server.aof_fd,&sb) == -1) {
+    if (server.aof_multi_part) {
+        server.aof_current_size = aofManifestSize(server.aof_manifest);
+    } else if (redis_fstat(server.aof_fd,&sb) == -1) {
         serverLog(LL_WARNING,"Unable to obtain the AOF file length. stat: %s",
             strerror(errno));
     } else {
@@ -1710,7 +2781,19 @@ void aofUpdateCurrentSize(void) {
 /* A background append only file rewriting (BGREWRITEAOF) terminated its work.
  * Handle this. */
 void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
-    if (!bysignal && exitcode == 0) {
+    if (!bysignal && exitcode == 0 && server.aof_multi_part) {
+        serverLog(LL_NOTICE,
+            "Background AOF rewrite terminated with success");
+        if (aofInstallRewrittenBase() == C_OK) {
+            server.aof_lastbgrewrite_status = C_OK;
+            serverLog(LL_NOTICE,
+                "Background AOF rewrite finished successfully");
+            if (server.aof_state == AOF_WAIT_REWRITE)
+                server.aof_state = AOF_ON;
+        } else {
+            server.aof_lastbgrewrite_status = C_ERR;
+        }
+    } else if (!bysignal && exitcode == 0) {
         int newfd, oldfd;
         char tmpfile[256];
         long long now = ustime();
@@ -1805,7 +2888,7 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
         } else {
             /* AOF enabled, replace the old fd with the new one. */
             oldfd = server.aof_fd;
-            server.aof_fd = newfd;
+            aofSetFd(newfd);
             if (server.aof_fsync == AOF_FSYNC_ALWAYS)
                 redis_fsync(newfd);
             else if (server.aof_fsync == AOF_FSYNC_EVERYSEC)
@@ -1849,7 +2932,7 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
     }
 
 cleanup:
-    aofClosePipes();
+    if (!server.aof_multi_part) aofClosePipes();
     aofRewriteBufferReset();
     aofRemoveTempFile(server.aof_child_pid);
     server.aof_child_pid = -1;
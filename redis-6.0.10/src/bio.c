@@ -24,6 +24,11 @@
  * recently inserted to the most recently inserted (older jobs processed
  * first).
  *
+ * The only exception is BIO_LAZY_FREE, that can be served by a pool of
+ * threads (see the lazyfree-threads option) sharing the same job queue: in
+ * that case older jobs are still started first, but may complete after more
+ * recent ones. This is fine as freeing memory has no ordering requirement.
+ *
  * Currently there is no way for the creator of the job to be notified about
  * the completion of the operation, this will only be added when/if needed.
  *
@@ -61,7 +66,8 @@
 #include "server.h"
 #include "bio.h"
 
-static pthread_t bio_threads[BIO_NUM_OPS];
+static pthread_t bio_threads[BIO_NUM_OPS][BIO_MAX_THREADS_PER_OP];
+static int bio_threads_num[BIO_NUM_OPS];
 static pthread_mutex_t bio_mutex[BIO_NUM_OPS];
 static pthread_cond_t bio_newjob_cond[BIO_NUM_OPS];
 static pthread_cond_t bio_step_cond[BIO_NUM_OPS];
@@ -84,9 +90,8 @@ struct bio_job {
 };
 
 void *bioProcessBackgroundJobs(void *arg);
-void lazyfreeFreeObjectFromBioThread(robj *o);
-void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2);
-void lazyfreeFreeSlotsMapFromBioThread(zskiplist *sl);
+void lazyfreeFreeBatchFromBioThread(void *batch);
+void lazyfreeFreeRangeFromBioThread(void *range);
 
 /* Make sure we have enough stack to perform all the things we do in the
  * main thread. */
@@ -97,7 +102,7 @@ void bioInit(void) {
     pthread_attr_t attr;
     pthread_t thread;
     size_t stacksize;
-    int j;
+    int j, i;
 
     /* Initialization of state vars and objects */
     for (j = 0; j < BIO_NUM_OPS; j++) {
@@ -106,7 +111,11 @@ void bioInit(void) {
         pthread_cond_init(&bio_step_cond[j],NULL);
         bio_jobs[j] = listCreate();
         bio_pending[j] = 0;
+        bio_threads_num[j] = 1;
     }
+    bio_threads_num[BIO_LAZY_FREE] = server.lazyfree_threads;
+    if (bio_threads_num[BIO_LAZY_FREE] > BIO_MAX_THREADS_PER_OP)
+        bio_threads_num[BIO_LAZY_FREE] = BIO_MAX_THREADS_PER_OP;
 
     /* Set the stack size as by default it may be small in some system */
     pthread_attr_init(&attr);
@@ -120,11 +129,13 @@ void bioInit(void) {
      * responsible of. */
     for (j = 0; j < BIO_NUM_OPS; j++) {
         void *arg = (void*)(unsigned long) j;
-        if (pthread_create(&thread,&attr,bioProcessBackgroundJobs,arg) != 0) {
-            serverLog(LL_WARNING,"Fatal: Can't initialize Background Jobs.");
-            exit(1);
+        for (i = 0; i < bio_threads_num[j]; i++) {
+            if (pthread_create(&thread,&attr,bioProcessBackgroundJobs,arg) != 0) {
+                serverLog(LL_WARNING,"Fatal: Can't initialize Background Jobs.");
+                exit(1);
+            }
+            bio_threads[j][i] = thread;
         }
-        bio_threads[j] = thread;
     }
 }
 
@@ -163,6 +174,11 @@ void *bioProcessBackgroundJobs(void *arg) {
         break;
     case BIO_LAZY_FREE:
         redis_set_thread_title("bio_lazy_free");
+        /* With more than one lazyfree thread, every thread allocates from
+         * an arena of its own, so that they don't contend with each other
+         * and with the main thread. The default single thread is left as
+         * it always was. */
+        if (server.lazyfree_threads > 1) set_jemalloc_thread_arena();
         break;
     }
 
@@ -187,29 +203,37 @@ void *bioProcessBackgroundJobs(void *arg) {
             pthread_cond_wait(&bio_newjob_cond[type],&bio_mutex[type]);
             continue;
         }
-        /* Pop the job from the queue. */
+        /* Pop the job from the queue. It is removed from the queue before
+         * processing it, since other threads may serve the same queue. */
         ln = listFirst(bio_jobs[type]);
         job = ln->value;
+        listDelNode(bio_jobs[type],ln);
         /* It is now possible to unlock the background system as we know have
          * a stand alone job structure to process.*/
         pthread_mutex_unlock(&bio_mutex[type]);
 
         /* Process the job accordingly to its type. */
         if (type == BIO_CLOSE_FILE) {
+            /* A non NULL arg2 asks to fsync the file before closing it. */
+            if (job->arg2) redis_fsync((long)job->arg1);
             close((long)job->arg1);
         } else if (type == BIO_AOF_FSYNC) {
             redis_fsync((long)job->arg1);
         } else if (type == BIO_LAZY_FREE) {
             /* What we free changes depending on what arguments are set:
-             * arg1 -> free the object at pointer.
-             * arg2 & arg3 -> free two dictionaries (a Redis DB).
-             * only arg3 -> free the radix tree. */
+             * arg1 -> a batch of objects, databases and radix trees.
+             * arg2 -> a range of a large object or database, that is
+             *         released in parallel by the lazyfree threads.
+             * See lazyfree.c for more info. */
             if (job->arg1)
-                lazyfreeFreeObjectFromBioThread(job->arg1);
-            else if (job->arg2 && job->arg3)
-                lazyfreeFreeDatabaseFromBioThread(job->arg2,job->arg3);
-            else if (job->arg3)
-                lazyfreeFreeSlotsMapFromBioThread(job->arg3);
+                lazyfreeFreeBatchFromBioThread(job->arg1);
+            else
+                lazyfreeFreeRangeFromBioThread(job->arg2);
+            /* Return the memory cached by this thread to the arenas, so
+             * that it can be reused by the main thread ASAP. This is only
+             * worth it when the frees are spread among many threads, each
+             * one keeping its own cache. */
+            if (server.lazyfree_threads > 1) flush_jemalloc_thread_tcache();
         } else {
             serverPanic("Wrong job type in bioProcessBackgroundJobs().");
         }
@@ -218,7 +242,6 @@ void *bioProcessBackgroundJobs(void *arg) {
         /* Lock again before reiterating the loop, if there are no longer
          * jobs to process we'll block again in pthread_cond_wait(). */
         pthread_mutex_lock(&bio_mutex[type]);
-        listDelNode(bio_jobs[type],ln);
         bio_pending[type]--;
 
         /* Unblock threads blocked on bioWaitStepOfType() if any. */
@@ -262,12 +285,15 @@ unsigned long long bioWaitStepOfType(int type) {
  * Currently Redis does this only on crash (for instance on SIGSEGV) in order
  * to perform a fast memory check without other threads messing with memory. */
 void bioKillThreads(void) {
-    int err, j;
+    int err, j, i;
 
     for (j = 0; j < BIO_NUM_OPS; j++) {
-        if (bio_threads[j] == pthread_self()) continue;
-        if (bio_threads[j] && pthread_cancel(bio_threads[j]) == 0) {
-            if ((err = pthread_join(bio_threads[j],NULL)) != 0) {
+        for (i = 0; i < bio_threads_num[j]; i++) {
+            pthread_t thread = bio_threads[j][i];
+
+            if (thread == pthread_self()) continue;
+            if (!thread || pthread_cancel(thread) != 0) continue;
+            if ((err = pthread_join(thread,NULL)) != 0) {
                 serverLog(LL_WARNING,
                     "Bio thread for job type #%d can not be joined: %s",
                         j, strerror(err));
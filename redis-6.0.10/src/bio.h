@@ -44,4 +44,7 @@ void bioKillThreads(void);
 #define BIO_LAZY_FREE     2 /* Deferred objects freeing. */
 #define BIO_NUM_OPS       3
 
+/* Max number of threads serving the same job type. */
+#define BIO_MAX_THREADS_PER_OP 16
+
 #endif
@@ -38,7 +38,11 @@ void openChildInfoPipe(void) {
         /* On error our two file descriptors should be still set to -1,
          * but we call anyway cloesChildInfoPipe() since can't hurt. */
         closeChildInfoPipe();
-    } else if (anetNonBlock(NULL,server.child_info_pipe[0]) != ANET_OK) {
+    } else if (anetNonBlock(NULL,server.child_info_pipe[0]) != ANET_OK ||
+               anetNonBlock(NULL,server.child_info_pipe[1]) != ANET_OK)
+    {
+        /* The write side is non blocking as well, so that a child sending
+         * progress info never blocks if the parent is slow reading it. */
         closeChildInfoPipe();
     } else {
         memset(&server.child_info_data,0,sizeof(server.child_info_data));
@@ -63,20 +67,34 @@ void sendChildInfo(int ptype) {
     if (server.child_info_pipe[1] == -1) return;
     server.child_info_data.magic = CHILD_INFO_MAGIC;
     server.child_info_data.process_type = ptype;
+    if (ptype == CHILD_TYPE_RDB)
+        server.child_info_data.rdb_stats = server.stat_rdb_save;
     ssize_t wlen = sizeof(server.child_info_data);
     if (write(server.child_info_pipe[1],&server.child_info_data,wlen) != wlen) {
         /* Nothing to do on error, this will be detected by the other side. */
     }
 }
 
-/* Receive COW data from parent. */
+/* Send the stats of the work in progress to the parent, without the COW
+ * size that is only sent when done. */
+void sendChildProgressInfo(int ptype) {
+    server.child_info_data.progress = 1;
+    sendChildInfo(ptype);
+    server.child_info_data.progress = 0;
+}
+
+/* Receive COW data from parent. Called both when the child exits and while
+ * it is working, to get the progress info: all the pending messages are
+ * consumed, so that the last one wins. */
 void receiveChildInfo(void) {
     if (server.child_info_pipe[0] == -1) return;
     ssize_t wlen = sizeof(server.child_info_data);
-    if (read(server.child_info_pipe[0],&server.child_info_data,wlen) == wlen &&
-        server.child_info_data.magic == CHILD_INFO_MAGIC)
+    while (read(server.child_info_pipe[0],&server.child_info_data,wlen) == wlen &&
+           server.child_info_data.magic == CHILD_INFO_MAGIC)
     {
         if (server.child_info_data.process_type == CHILD_TYPE_RDB) {
+            server.stat_rdb_save = server.child_info_data.rdb_stats;
+            if (server.child_info_data.progress) continue;
             server.stat_rdb_cow_bytes = server.child_info_data.cow_size;
         } else if (server.child_info_data.process_type == CHILD_TYPE_AOF) {
             server.stat_aof_cow_bytes = server.child_info_data.cow_size;
@@ -117,6 +117,15 @@
 #define rdb_fsync_range(fd,off,size) fsync(fd)
 #endif
 
+/* Software prefetching of data structures we are going to access soon.
+ * It is just a hint, so it is fine to turn it into a no-op where the
+ * compiler does not provide it. */
+#if defined(__GNUC__) || defined(__clang__)
+#define redis_prefetch(addr) __builtin_prefetch(addr)
+#else
+#define redis_prefetch(addr) ((void)(addr))
+#endif
+
 /* Check if we can use setproctitle().
  * BSD systems have support for it, we provide an implementation for
  * Linux and osx. */
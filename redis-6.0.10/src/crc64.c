@@ -122,6 +122,60 @@ uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l) {
     return crcspeed64native(crc64_table, crc, (void *) s, l);
 }
 
+/* Multiply the 64x64 GF(2) matrix 'mat' by the vector 'vec'. */
+static uint64_t gf2_matrix_times(const uint64_t *mat, uint64_t vec) {
+    uint64_t sum = 0;
+
+    while (vec) {
+        if (vec & 1) sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+/* Store in 'square' the square of the 64x64 GF(2) matrix 'mat'. */
+static void gf2_matrix_square(uint64_t *square, const uint64_t *mat) {
+    for (int n = 0; n < 64; n++)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/* Return the crc64 of the concatenation of two buffers A and B, given the
+ * crc64 of A, the crc64 of B, and the length of B. This is the same
+ * approach used by crc32_combine() of zlib: appending len2 zero bytes to A
+ * is a linear operator on the crc, that is computed by repeated squaring
+ * of the operator appending a single zero bit. It allows to compute the
+ * crc of different parts of a stream in parallel. */
+uint64_t crc64_combine(uint64_t crc1, uint64_t crc2, uint64_t len2) {
+    uint64_t even[64], odd[64], row = 1;
+
+    if (len2 == 0) return crc1;
+
+    /* Operator for one zero bit: the reflected polynomial. */
+    odd[0] = crc_reflect(POLY, 64);
+    for (int n = 1; n < 64; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd); /* Two zero bits. */
+    gf2_matrix_square(odd, even); /* Four zero bits. */
+
+    /* Apply len2 zero bytes to crc1, the first square of the loop being
+     * the operator for one zero byte. */
+    do {
+        gf2_matrix_square(even, odd);
+        if (len2 & 1) crc1 = gf2_matrix_times(even, crc1);
+        len2 >>= 1;
+        if (len2 == 0) break;
+
+        gf2_matrix_square(odd, even);
+        if (len2 & 1) crc1 = gf2_matrix_times(odd, crc1);
+        len2 >>= 1;
+    } while (len2);
+
+    return crc1 ^ crc2;
+}
+
 /* Test main */
 #ifdef REDIS_TEST
 #include <stdio.h>
@@ -147,6 +201,10 @@ int crc64Test(int argc, char *argv[]) {
            (uint64_t)_crc64(0, li, sizeof(li)));
     printf("[64speed]: c7794709e69683b3 == %016" PRIx64 "\n",
            (uint64_t)crc64(0, li, sizeof(li)));
+    printf("[combine]: c7794709e69683b3 == %016" PRIx64 "\n",
+           crc64_combine(crc64(0, (unsigned char*)li, 100),
+                         crc64(0, (unsigned char*)li+100, sizeof(li)-100),
+                         sizeof(li)-100));
     return 0;
 }
 
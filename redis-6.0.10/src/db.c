@@ -45,7 +45,14 @@ struct dbBackup {
  * C-level DB API
  *----------------------------------------------------------------------------*/
 
-int keyIsExpired(redisDb *db, robj *key);
+/* With compact keyspace entries (see the keyspace-compact-entries option)
+ * the main dict entry of every key embeds the key itself, and a copy of the
+ * expire time of the key (-1 if the key has no expire) in the metadata of
+ * the entry. This way the common lookups can check if the key is expired
+ * without an additional lookup in db->expires, which is still maintained
+ * since active expiry and the volatile eviction policies sample it. */
+#define dbHasEntryExpire(db) ((db)->dict->type->entryMetadataBytes != 0)
+#define dbEntryExpire(db,de) (*(long long*)dictEntryMetadata((db)->dict,(de)))
 
 /* Update LFU when an object is accessed.
  * Firstly, decrement the counter if the decrement time is reached.
@@ -56,11 +63,20 @@ void updateLFU(robj *val) {
     val->lru = (LFUGetTimeInMinutes()<<8) | counter;
 }
 
+static robj *lookupKeyEntry(dictEntry *de, int flags);
+static int expireIfNeededAndFind(redisDb *db, robj *key, dictEntry **dep);
+static int expireKeyIfMaster(redisDb *db, robj *key);
+
 /* Low level key lookup API, not actually called directly from commands
  * implementations that should instead rely on lookupKeyRead(),
  * lookupKeyWrite() and lookupKeyReadWithFlags(). */
 robj *lookupKey(redisDb *db, robj *key, int flags) {
-    dictEntry *de = dictFind(db->dict,key->ptr);
+    return lookupKeyEntry(dictFind(db->dict,key->ptr),flags);
+}
+
+/* Like lookupKey(), but for the main dict entry of the key, that was
+ * already found by the caller, or NULL if the key does not exist. */
+static robj *lookupKeyEntry(dictEntry *de, int flags) {
     if (de) {
         robj *val = dictGetVal(de);
 
@@ -103,9 +119,10 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
  * correctly report a key is expired on slaves even if the master is lagging
  * expiring our key via DELs in the replication link. */
 robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
+    dictEntry *de;
     robj *val;
 
-    if (expireIfNeeded(db,key) == 1) {
+    if (expireIfNeededAndFind(db,key,&de) == 1) {
         /* Key expired. If we are in the context of a master, expireIfNeeded()
          * returns 0 only when the key does not exist at all, so it's safe
          * to return NULL ASAP. */
@@ -132,9 +149,13 @@ robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
             goto keymiss;
         }
     }
-    val = lookupKey(db,key,flags);
+    val = lookupKeyEntry(de,flags);
     if (val == NULL)
         goto keymiss;
+    /* Like the key itself, the expired fields of a hash are deleted when
+     * the hash is accessed, and so may be the whole key. */
+    if (hashTypeHasVolatileFields(val) && hashTypeExpireIfNeeded(db,key,val))
+        goto keymiss;
     server.stat_keyspace_hits++;
     return val;
 
@@ -158,8 +179,15 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
  * Returns the linked value object if the key exists or NULL if the key
  * does not exist in the specified DB. */
 robj *lookupKeyWriteWithFlags(redisDb *db, robj *key, int flags) {
-    expireIfNeeded(db,key);
-    return lookupKey(db,key,flags);
+    dictEntry *de;
+    robj *val;
+
+    if (server.snapshot_in_progress) snapshotBeforeWrite(db,key->ptr);
+    expireIfNeededAndFind(db,key,&de);
+    val = lookupKeyEntry(de,flags);
+    if (val && hashTypeHasVolatileFields(val) &&
+        hashTypeExpireIfNeeded(db,key,val)) return NULL;
+    return val;
 }
 
 robj *lookupKeyWrite(redisDb *db, robj *key) {
@@ -178,15 +206,48 @@ robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply) {
     return o;
 }
 
+/* Lookup at once the specified keys in the DB, prefetching into the CPU
+ * caches their main dictionary entries and value objects, and the expires
+ * dictionary as well if it is not empty, since lookupKeyRead() and
+ * lookupKeyWrite() will also check the TTL. The keys are taken from
+ * keys[0], keys[step], keys[step*2], ... so that commands taking key/value
+ * pairs like MSET can pass their argument vector directly.
+ *
+ * At most DB_PREFETCH_BATCH keys are resolved: commands looking up many
+ * keys call this function every DB_PREFETCH_BATCH keys in their loop, so
+ * that the cache misses of the keys of a batch overlap (see dictFindMany())
+ * instead of being paid serially. This is only a hint: the entries found
+ * are not kept, and the command then looks up its keys as usual. */
+void dbPrefetchKeys(redisDb *db, robj **keys, int numkeys, int step) {
+    void *names[DB_PREFETCH_BATCH];
+    dictEntry *entries[DB_PREFETCH_BATCH];
+    int j;
+
+    if (numkeys > DB_PREFETCH_BATCH) numkeys = DB_PREFETCH_BATCH;
+    for (j = 0; j < numkeys; j++) names[j] = keys[j*step]->ptr;
+    if (dictFindMany(db->dict,names,entries,numkeys)) {
+        for (j = 0; j < numkeys; j++)
+            if (entries[j]) redis_prefetch(dictGetVal(entries[j]));
+    }
+    if (dictSize(db->expires))
+        dictPrefetchKeys(db->expires,names,numkeys);
+}
+
 /* Add the key to the DB. It's up to the caller to increment the reference
  * counter of the value if needed.
  *
  * The program is aborted if the key already exists. */
 void dbAdd(redisDb *db, robj *key, robj *val) {
-    sds copy = sdsdup(key->ptr);
-    int retval = dictAdd(db->dict, copy, val);
+    if (server.snapshot_in_progress) snapshotBeforeWrite(db,key->ptr);
+
+    /* Embedded keys are copied by the dictionary itself. */
+    sds copy = dbKeysAreEmbedded(db) ? key->ptr : sdsdup(key->ptr);
+    dictEntry *de = dictAddRaw(db->dict, copy, NULL);
 
-    serverAssertWithInfo(NULL,key,retval == DICT_OK);
+    serverAssertWithInfo(NULL,key,de != NULL);
+    dictSetVal(db->dict, de, val);
+    if (dbHasEntryExpire(db)) dbEntryExpire(db,de) = -1;
+    if (hashTypeHasVolatileFields(val)) dbTrackVolatileHash(db,key->ptr);
     if (val->type == OBJ_LIST ||
         val->type == OBJ_ZSET ||
         val->type == OBJ_STREAM)
@@ -206,8 +267,11 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
  * ownership of the SDS string, otherwise 0 is returned, and is up to the
  * caller to free the SDS string. */
 int dbAddRDBLoad(redisDb *db, sds key, robj *val) {
-    int retval = dictAdd(db->dict, key, val);
-    if (retval != DICT_OK) return 0;
+    dictEntry *de = dictAddRaw(db->dict, key, NULL);
+    if (de == NULL) return 0;
+    dictSetVal(db->dict, de, val);
+    if (dbHasEntryExpire(db)) dbEntryExpire(db,de) = -1;
+    if (hashTypeHasVolatileFields(val)) dbTrackVolatileHash(db,key);
     if (server.cluster_enabled) slotToKeyAdd(key);
     return 1;
 }
@@ -218,6 +282,7 @@ int dbAddRDBLoad(redisDb *db, sds key, robj *val) {
  *
  * The program is aborted if the key was not already present. */
 void dbOverwrite(redisDb *db, robj *key, robj *val) {
+    if (server.snapshot_in_progress) snapshotBeforeWrite(db,key->ptr);
     dictEntry *de = dictFind(db->dict,key->ptr);
 
     serverAssertWithInfo(NULL,key,de != NULL);
@@ -227,6 +292,7 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
         val->lru = old->lru;
     }
     dictSetVal(db->dict, de, val);
+    if (hashTypeHasVolatileFields(val)) dbTrackVolatileHash(db,key->ptr);
 
     if (server.lazyfree_lazy_server_del) {
         freeObjAsync(old);
@@ -310,9 +376,11 @@ robj *dbRandomKey(redisDb *db) {
 
 /* Delete a key, value, and associated expiration entry if any, from the DB */
 int dbSyncDelete(redisDb *db, robj *key) {
+    if (server.snapshot_in_progress) snapshotBeforeWrite(db,key->ptr);
+
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
+    dbDeleteExpire(db,key->ptr);
     if (dictDelete(db->dict,key->ptr) == DICT_OK) {
         if (server.cluster_enabled) slotToKeyDel(key->ptr);
         return 1;
@@ -392,11 +460,17 @@ long long emptyDbStructure(redisDb *dbarray, int dbnum, int async,
         } else {
             dictEmpty(dbarray[j].dict,callback);
             dictEmpty(dbarray[j].expires,callback);
+            if (dbarray[j].expires_index) {
+                raxFree(dbarray[j].expires_index);
+                dbarray[j].expires_index = raxNew();
+            }
         }
+        dictEmpty(dbarray[j].volatile_hashes,NULL);
         /* Because all keys of database are removed, reset average ttl. */
         dbarray[j].avg_ttl = 0;
         dbarray[j].expires_cursor = 0;
     }
+    if (async) lazyfreeFlushBatch();
 
     return removed;
 }
@@ -425,6 +499,9 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
         return -1;
     }
 
+    /* A fork-less snapshot can't keep track of the keys of a flushed DB. */
+    snapshotAbort();
+
     /* Fire the flushdb modules event. */
     moduleFireServerEvent(REDISMODULE_EVENT_FLUSHDB,
                           REDISMODULE_SUBEVENT_FLUSHDB_START,
@@ -459,12 +536,16 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
 dbBackup *backupDb(void) {
     dbBackup *backup = zmalloc(sizeof(dbBackup));
 
+    snapshotAbort();
+
     /* Backup main DBs. */
     backup->dbarray = zmalloc(sizeof(redisDb)*server.dbnum);
     for (int i=0; i<server.dbnum; i++) {
         backup->dbarray[i] = server.db[i];
         server.db[i].dict = dictCreate(&dbDictType,NULL);
         server.db[i].expires = dictCreate(&keyptrDictType,NULL);
+        if (server.active_expire_index) server.db[i].expires_index = raxNew();
+        server.db[i].volatile_hashes = dictCreate(&setDictType,NULL);
     }
 
     /* Backup cluster slots to keys map if enable cluster. */
@@ -490,6 +571,9 @@ void discardDbBackup(dbBackup *buckup, int flags, void(callback)(void*)) {
     for (int i=0; i<server.dbnum; i++) {
         dictRelease(buckup->dbarray[i].dict);
         dictRelease(buckup->dbarray[i].expires);
+        if (buckup->dbarray[i].expires_index)
+            raxFree(buckup->dbarray[i].expires_index);
+        dictRelease(buckup->dbarray[i].volatile_hashes);
     }
 
     /* Release slots to keys map backup if enable cluster. */
@@ -511,6 +595,8 @@ void restoreDbBackup(dbBackup *buckup) {
         serverAssert(dictSize(server.db[i].expires) == 0);
         dictRelease(server.db[i].dict);
         dictRelease(server.db[i].expires);
+        if (server.db[i].expires_index) raxFree(server.db[i].expires_index);
+        dictRelease(server.db[i].volatile_hashes);
         server.db[i] = buckup->dbarray[i];
     }
 
@@ -528,6 +614,18 @@ void restoreDbBackup(dbBackup *buckup) {
     zfree(buckup);
 }
 
+/* Swap the databases with the ones in the backup, without releasing
+ * anything: calling it again swaps them back. This is used to serve the old
+ * dataset while the new one is loaded, see loadingProcessEvents(). The
+ * cluster slots to keys map is not swapped. */
+void swapDbBackup(dbBackup *backup) {
+    for (int i=0; i<server.dbnum; i++) {
+        redisDb tmp = server.db[i];
+        server.db[i] = backup->dbarray[i];
+        backup->dbarray[i] = tmp;
+    }
+}
+
 int selectDb(client *c, int id) {
     if (id < 0 || id >= server.dbnum)
         return C_ERR;
@@ -658,6 +756,8 @@ void delGenericCommand(client *c, int lazy) {
     int numdel = 0, j;
 
     for (j = 1; j < c->argc; j++) {
+        if ((j-1) % DB_PREFETCH_BATCH == 0)
+            dbPrefetchKeys(c->db,c->argv+j,c->argc-j,1);
         expireIfNeeded(c->db,c->argv[j]);
         int deleted  = lazy ? dbAsyncDelete(c->db,c->argv[j]) :
                               dbSyncDelete(c->db,c->argv[j]);
@@ -669,6 +769,7 @@ void delGenericCommand(client *c, int lazy) {
             numdel++;
         }
     }
+    if (lazy) lazyfreeFlushBatch();
     addReplyLongLong(c,numdel);
 }
 
@@ -687,6 +788,8 @@ void existsCommand(client *c) {
     int j;
 
     for (j = 1; j < c->argc; j++) {
+        if ((j-1) % DB_PREFETCH_BATCH == 0)
+            dbPrefetchKeys(c->db,c->argv+j,c->argc-j,1);
         if (lookupKeyReadWithFlags(c->db,c->argv[j],LOOKUP_NOTOUCH)) count++;
     }
     addReplyLongLong(c,count);
@@ -766,12 +869,14 @@ void scanCallback(void *privdata, const dictEntry *de) {
     } else if (o->type == OBJ_HASH) {
         sds sdskey = dictGetKey(de);
         sds sdsval = dictGetVal(de);
+        /* Expired fields not yet deleted by the master of a replica. */
+        if (hashTypeFieldIsHidden(o->ptr,(dictEntry*)de)) return;
         key = createStringObject(sdskey,sdslen(sdskey));
         val = createStringObject(sdsval,sdslen(sdsval));
     } else if (o->type == OBJ_ZSET) {
         sds sdskey = dictGetKey(de);
         key = createStringObject(sdskey,sdslen(sdskey));
-        val = createStringObjectFromLongDouble(*(double*)dictGetVal(de),0);
+        val = createStringObjectFromLongDouble(zsetDictGetScore(o,de),0);
     } else {
         serverPanic("Type not handled in SCAN callback.");
     }
@@ -865,7 +970,7 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
 
     /* Step 2: Iterate the collection.
      *
-     * Note that if the object is encoded with a ziplist, intset, or any other
+     * Note that if the object is encoded with a listpack, intset, or any other
      * representation that is not a hash table, we are sure that it is also
      * composed of a small number of elements. So to avoid taking state we
      * just return everything inside the object in a single call, setting the
@@ -880,7 +985,8 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
     } else if (o->type == OBJ_HASH && o->encoding == OBJ_ENCODING_HT) {
         ht = o->ptr;
         count *= 2; /* We return key / value for this type. */
-    } else if (o->type == OBJ_ZSET && o->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (o->type == OBJ_ZSET && (o->encoding == OBJ_ENCODING_SKIPLIST ||
+                                       o->encoding == OBJ_ENCODING_BTREE)) {
         zset *zs = o->ptr;
         ht = zs->dict;
         count *= 2; /* We return key / value for this type. */
@@ -904,6 +1010,17 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         } while (cursor &&
               maxiterations-- &&
               listLength(keys) < (unsigned long)count);
+    } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *p = lpFirst(o->ptr);
+        unsigned char buf[LP_INTBUF_SIZE], *str;
+        int64_t len;
+
+        while(p) {
+            str = lpGet(p,&len,buf);
+            listAddNodeTail(keys,createStringObject((char*)str,len));
+            p = lpNext(o->ptr,p);
+        }
+        cursor = 0;
     } else if (o->type == OBJ_SET) {
         int pos = 0;
         int64_t ll;
@@ -912,17 +1029,17 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
             listAddNodeTail(keys,createStringObjectFromLongLong(ll));
         cursor = 0;
     } else if (o->type == OBJ_HASH || o->type == OBJ_ZSET) {
-        unsigned char *p = ziplistIndex(o->ptr,0);
+        unsigned char *p = lpSeek(o->ptr,0);
         unsigned char *vstr;
         unsigned int vlen;
         long long vll;
 
         while(p) {
-            ziplistGet(p,&vstr,&vlen,&vll);
+            vstr = lpGetValue(p,&vlen,&vll);
             listAddNodeTail(keys,
                 (vstr != NULL) ? createStringObject((char*)vstr,vlen) :
                                  createStringObjectFromLongLong(vll));
-            p = ziplistNext(o->ptr,p);
+            p = lpNext(o->ptr,p);
         }
         cursor = 0;
     } else {
@@ -1204,6 +1321,7 @@ int dbSwapDatabases(long id1, long id2) {
     if (id1 < 0 || id1 >= server.dbnum ||
         id2 < 0 || id2 >= server.dbnum) return C_ERR;
     if (id1 == id2) return C_OK;
+    snapshotAbort();
     redisDb aux = server.db[id1];
     redisDb *db1 = &server.db[id1], *db2 = &server.db[id2];
 
@@ -1214,11 +1332,15 @@ int dbSwapDatabases(long id1, long id2) {
     db1->expires = db2->expires;
     db1->avg_ttl = db2->avg_ttl;
     db1->expires_cursor = db2->expires_cursor;
+    db1->expires_index = db2->expires_index;
+    db1->volatile_hashes = db2->volatile_hashes;
 
     db2->dict = aux.dict;
     db2->expires = aux.expires;
     db2->avg_ttl = aux.avg_ttl;
     db2->expires_cursor = aux.expires_cursor;
+    db2->expires_index = aux.expires_index;
+    db2->volatile_hashes = aux.volatile_hashes;
 
     /* Now we need to handle clients blocked on lists: as an effect
      * of swapping the two DBs, a client that was waiting for list
@@ -1274,11 +1396,78 @@ void swapdbCommand(client *c) {
  * Expires API
  *----------------------------------------------------------------------------*/
 
+/* The expires index (see the active-expire-index option) is a radix tree
+ * for every DB, that contains all the keys with an expire, prefixed by
+ * their expire time, so that the active expire cycle can visit them in
+ * expire time order. The time is stored as a big endian integer, with the
+ * sign bit flipped so that negative times sort before positive ones.
+ *
+ * The same layout is used by the expires index of the hash fields, see
+ * t_hash.c, so this function takes the radix tree to update. */
+void expiresIndexUpdate(rax *index, unsigned char *key, size_t keylen,
+                        long long when, int add)
+{
+    uint64_t t = (uint64_t)when ^ (1ULL<<63);
+    unsigned char buf[64];
+    unsigned char *indexed = buf;
+
+    if (keylen+EXPIRES_INDEX_PREFIX_LEN > sizeof(buf))
+        indexed = zmalloc(keylen+EXPIRES_INDEX_PREFIX_LEN);
+    for (int j = 0; j < EXPIRES_INDEX_PREFIX_LEN; j++)
+        indexed[j] = (t >> (56-j*8)) & 0xff;
+    memcpy(indexed+EXPIRES_INDEX_PREFIX_LEN,key,keylen);
+    if (add) {
+        raxInsert(index,indexed,keylen+EXPIRES_INDEX_PREFIX_LEN,NULL,NULL);
+    } else {
+        raxRemove(index,indexed,keylen+EXPIRES_INDEX_PREFIX_LEN,NULL);
+    }
+    if (indexed != buf) zfree(indexed);
+}
+
+static void expiresIndexUpdateKey(redisDb *db, sds key, long long when,
+                                  int add)
+{
+    expiresIndexUpdate(db->expires_index,(unsigned char*)key,sdslen(key),
+                       when,add);
+}
+
+/* Remember that the hash stored at 'key' has fields with a TTL, so that the
+ * active expire cycle reclaims them, see activeExpireVolatileHashes(). The
+ * set is cleaned up lazily: the keys that no longer exist, or no longer
+ * have volatile fields, are removed from it when sampled. */
+void dbTrackVolatileHash(redisDb *db, sds key) {
+    if (dictFind(db->volatile_hashes,key) == NULL)
+        dictAdd(db->volatile_hashes,sdsdup(key),NULL);
+}
+
+/* Return the expire time of a key of the expires index. */
+long long expiresIndexKeyTime(unsigned char *indexed) {
+    uint64_t t = 0;
+    for (int j = 0; j < EXPIRES_INDEX_PREFIX_LEN; j++)
+        t = (t << 8) | indexed[j];
+    return (long long)(t ^ (1ULL<<63));
+}
+
+/* Remove the expire of the key from the expires dict and, if enabled, from
+ * the expires index. Returns 1 if the key had an expire, otherwise 0. */
+int dbDeleteExpire(redisDb *db, sds key) {
+    if (dictSize(db->expires) == 0) return 0;
+    if (db->expires_index) {
+        dictEntry *de = dictFind(db->expires,key);
+        if (de == NULL) return 0;
+        expiresIndexUpdateKey(db,key,dictGetSignedIntegerVal(de),0);
+    }
+    return dictDelete(db->expires,key) == DICT_OK;
+}
+
 int removeExpire(redisDb *db, robj *key) {
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
-    serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictDelete(db->expires,key->ptr) == DICT_OK;
+    if (server.snapshot_in_progress) snapshotBeforeWrite(db,key->ptr);
+    dictEntry *kde = dictFind(db->dict,key->ptr);
+    serverAssertWithInfo(NULL,key,kde != NULL);
+    if (dbHasEntryExpire(db)) dbEntryExpire(db,kde) = -1;
+    return dbDeleteExpire(db,key->ptr);
 }
 
 /* Set an expire to the specified key. If the expire is set in the context
@@ -1288,11 +1477,21 @@ int removeExpire(redisDb *db, robj *key) {
 void setExpire(client *c, redisDb *db, robj *key, long long when) {
     dictEntry *kde, *de;
 
+    if (server.snapshot_in_progress) snapshotBeforeWrite(db,key->ptr);
+
     /* Reuse the sds from the main dict in the expire dict */
     kde = dictFind(db->dict,key->ptr);
     serverAssertWithInfo(NULL,key,kde != NULL);
+    if (db->expires_index) {
+        /* Replace the old position of the key in the index, if any. */
+        if ((de = dictFind(db->expires,dictGetKey(kde))) != NULL)
+            expiresIndexUpdateKey(db,dictGetKey(kde),
+                                  dictGetSignedIntegerVal(de),0);
+        expiresIndexUpdateKey(db,dictGetKey(kde),when,1);
+    }
     de = dictAddOrFind(db->expires,dictGetKey(kde));
     dictSetSignedIntegerVal(de,when);
+    if (dbHasEntryExpire(db)) dbEntryExpire(db,kde) = when;
 
     int writable_slave = server.masterhost && server.repl_slave_ro == 0;
     if (c && writable_slave && !(c->flags & CLIENT_MASTER))
@@ -1305,8 +1504,15 @@ long long getExpire(redisDb *db, robj *key) {
     dictEntry *de;
 
     /* No expire? return ASAP */
-    if (dictSize(db->expires) == 0 ||
-       (de = dictFind(db->expires,key->ptr)) == NULL) return -1;
+    if (dictSize(db->expires) == 0) return -1;
+
+    /* With compact entries the expire is cached in the main dict entry. */
+    if (dbHasEntryExpire(db)) {
+        de = dictFind(db->dict,key->ptr);
+        return de ? dbEntryExpire(db,de) : -1;
+    }
+
+    if ((de = dictFind(db->expires,key->ptr)) == NULL) return -1;
 
     /* The entry was found in the expire dict, this means it should also
      * be present in the main dict (safety check). */
@@ -1338,15 +1544,42 @@ void propagateExpire(redisDb *db, robj *key, int lazy) {
     decrRefCount(argv[1]);
 }
 
+/* Like propagateExpire(), but for a batch of keys expired together by the
+ * active expire cycle, that are propagated with a single DEL or UNLINK. */
+void propagateExpires(redisDb *db, robj **keys, int numkeys, int lazy) {
+    robj **argv = zmalloc(sizeof(robj*)*(numkeys+1));
+    int j;
+
+    argv[0] = lazy ? shared.unlink : shared.del;
+    for (j = 0; j < numkeys; j++) argv[j+1] = keys[j];
+    for (j = 0; j <= numkeys; j++) incrRefCount(argv[j]);
+
+    if (server.aof_state != AOF_OFF)
+        feedAppendOnlyFile(server.delCommand,db->id,argv,numkeys+1);
+    replicationFeedSlaves(server.slaves,db->id,argv,numkeys+1);
+
+    for (j = 0; j <= numkeys; j++) decrRefCount(argv[j]);
+    zfree(argv);
+}
+
 /* Check if the key is expired. */
 int keyIsExpired(redisDb *db, robj *key) {
-    mstime_t when = getExpire(db,key);
+    return expireTimeIsReached(getExpire(db,key));
+}
+
+/* Check if a key with the specified expire time ('when' is -1 if the key
+ * has no expire) should be considered expired at this time. */
+int expireTimeIsReached(mstime_t when) {
     mstime_t now;
 
     if (when < 0) return 0; /* No expire for this key */
 
-    /* Don't expire anything while loading. It will be done later. */
-    if (server.loading) return 0;
+    /* Don't expire anything while loading. It will be done later. However
+     * when the old dataset is served while the new one is loaded (see
+     * loadingProcessEvents()), the keys it contains may be logically
+     * expired like at any other time, otherwise they would be served as
+     * live. The replica never deletes them anyway. */
+    if (server.loading && !server.loading_serving_stale) return 0;
 
     /* If we are in the context of a Lua script, we pretend that time is
      * blocked to when the Lua script started. This way a key can expire
@@ -1397,7 +1630,31 @@ int keyIsExpired(redisDb *db, robj *key) {
  * otherwise the function returns 1 if the key is expired. */
 int expireIfNeeded(redisDb *db, robj *key) {
     if (!keyIsExpired(db,key)) return 0;
+    return expireKeyIfMaster(db,key);
+}
+
+/* Like expireIfNeeded(), but also returns by reference the main dict
+ * entry of the key, or NULL if the key does not exist or was deleted
+ * because expired. With compact keyspace entries this needs a single
+ * lookup in the main dict, since the entry caches the expire time. */
+static int expireIfNeededAndFind(redisDb *db, robj *key, dictEntry **dep) {
+    if (!dbHasEntryExpire(db)) {
+        int expired = expireIfNeeded(db,key);
+        *dep = dictFind(db->dict,key->ptr);
+        return expired;
+    }
+
+    dictEntry *de = dictFind(db->dict,key->ptr);
+    *dep = de;
+    if (de == NULL || !expireTimeIsReached(dbEntryExpire(db,de))) return 0;
+    /* Slaves don't delete expired keys, so the entry is still valid. */
+    if (server.masterhost == NULL) *dep = NULL;
+    return expireKeyIfMaster(db,key);
+}
 
+/* Helper of the expireIfNeeded*() functions, called once the key is known
+ * to be logically expired. */
+static int expireKeyIfMaster(redisDb *db, robj *key) {
     /* If we are running in the context of a slave, instead of
      * evicting the expired key from the database, we return ASAP:
      * the slave key expiration is controlled by the master that will
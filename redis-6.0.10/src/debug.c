@@ -147,7 +147,7 @@ void xorObjectDigest(redisDb *db, robj *keyobj, unsigned char *digest, robj *o)
     } else if (o->type == OBJ_ZSET) {
         unsigned char eledigest[20];
 
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
             unsigned char *zl = o->ptr;
             unsigned char *eptr, *sptr;
             unsigned char *vstr;
@@ -155,13 +155,13 @@ void xorObjectDigest(redisDb *db, robj *keyobj, unsigned char *digest, robj *o)
             long long vll;
             double score;
 
-            eptr = ziplistIndex(zl,0);
+            eptr = lpSeek(zl,0);
             serverAssert(eptr != NULL);
-            sptr = ziplistNext(zl,eptr);
+            sptr = lpNext(zl,eptr);
             serverAssert(sptr != NULL);
 
             while (eptr != NULL) {
-                serverAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+                vstr = lpGetValue(eptr,&vlen,&vll);
                 score = zzlGetScore(sptr);
 
                 memset(eledigest,0,20);
@@ -177,16 +177,18 @@ void xorObjectDigest(redisDb *db, robj *keyobj, unsigned char *digest, robj *o)
                 xorDigest(digest,eledigest,20);
                 zzlNext(zl,&eptr,&sptr);
             }
-        } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+                   o->encoding == OBJ_ENCODING_BTREE)
+        {
             zset *zs = o->ptr;
             dictIterator *di = dictGetIterator(zs->dict);
             dictEntry *de;
 
             while((de = dictNext(di)) != NULL) {
                 sds sdsele = dictGetKey(de);
-                double *score = dictGetVal(de);
+                double score = zsetDictGetScore(o,de);
 
-                snprintf(buf,sizeof(buf),"%.17g",*score);
+                snprintf(buf,sizeof(buf),"%.17g",score);
                 memset(eledigest,0,20);
                 mixDigest(eledigest,sdsele,sdslen(sdsele));
                 mixDigest(eledigest,buf,strlen(buf));
@@ -209,6 +211,9 @@ void xorObjectDigest(redisDb *db, robj *keyobj, unsigned char *digest, robj *o)
             sdsele = hashTypeCurrentObjectNewSds(hi,OBJ_HASH_VALUE);
             mixDigest(eledigest,sdsele,sdslen(sdsele));
             sdsfree(sdsele);
+            if (hashTypeHasVolatileFields(o) &&
+                hashEntryExpire((dict*)o->ptr,hi->de))
+                mixDigest(eledigest,"!!expire!!",10);
             xorDigest(digest,eledigest,20);
         }
         hashTypeReleaseIterator(hi);
@@ -390,12 +395,14 @@ void debugCommand(client *c) {
 "RELOAD [MERGE] [NOFLUSH] [NOSAVE] -- Save the RDB on disk and reload it back in memory. By default it will save the RDB file and load it back. With the NOFLUSH option the current database is not removed before loading the new one, but conflicts in keys will kill the server with an exception. When MERGE is used, conflicting keys will be loaded (the key in the loaded RDB file will win). When NOSAVE is used, the server will not save the current dataset in the RDB file before loading. Use DEBUG RELOAD NOSAVE when you want just to load the RDB file you placed in the Redis working directory in order to replace the current dataset in memory. Use DEBUG RELOAD NOSAVE NOFLUSH MERGE when you want to add what is in the current RDB file placed in the Redis current directory, with the current memory content. Use DEBUG RELOAD when you want to verify Redis is able to persist the current dataset in the RDB file, flush the memory content, and load it back.",
 "RESTART -- Graceful restart: save config, db, restart.",
 "SDSLEN <key> -- Show low level SDS string info representing key and value.",
+"SAVESTATS -- Return statistics of the current or last RDB save: progress, time spent serializing every type of key, compression and I/O.",
 "SEGFAULT -- Crash the server with sigsegv.",
 "SET-ACTIVE-EXPIRE <0|1> -- Setting it to 0 disables expiring keys in background when they are not accessed (otherwise the Redis behavior). Setting it to 1 reenables back the default.",
 "AOF-FLUSH-SLEEP <microsec> -- Server will sleep before flushing the AOF, this is used for testing",
 "SLEEP <seconds> -- Stop the server for <seconds>. Decimals allowed.",
 "STRUCTSIZE -- Return the size of different Redis core C structures.",
 "ZIPLIST <key> -- Show low level info about the ziplist encoding.",
+"LISTPACK <key> -- Show low level info about the listpack encoding.",
 "STRINGMATCH-TEST -- Run a fuzz tester against the stringmatchlen() function.",
 "CONFIG-REWRITE-FORCE-ALL -- Like CONFIG REWRITE but writes all configuration options, including keywords not listed in original configuration file or default values.",
 #ifdef USE_JEMALLOC
@@ -542,10 +549,11 @@ NULL
         addReplyStatusFormat(c,
             "Value at:%p refcount:%d "
             "encoding:%s serializedlength:%zu "
-            "lru:%d lru_seconds_idle:%llu%s",
+            "lru:%d lru_seconds_idle:%llu%s%s",
             (void*)val, val->refcount,
             strenc, rdbSavedObjectLen(val, c->argv[2]),
-            val->lru, estimateObjectIdleTime(val)/1000, extra);
+            val->lru, estimateObjectIdleTime(val)/1000, extra,
+            dbKeysAreEmbedded(c->db) ? " keyspace_entry:compact" : "");
     } else if (!strcasecmp(c->argv[1]->ptr,"sdslen") && c->argc == 3) {
         dictEntry *de;
         robj *val;
@@ -566,7 +574,9 @@ NULL
                 "val_sds_len:%lld, val_sds_avail:%lld, val_zmalloc: %lld",
                 (long long) sdslen(key),
                 (long long) sdsavail(key),
-                (long long) sdsZmallocSize(key),
+                /* Embedded keys share the allocation of the dict entry. */
+                (long long) (dbKeysAreEmbedded(c->db) ? zmalloc_size(de) :
+                                                        sdsZmallocSize(key)),
                 (long long) sdslen(val->ptr),
                 (long long) sdsavail(val->ptr),
                 (long long) getStringObjectSdsUsedMemory(val));
@@ -583,6 +593,18 @@ NULL
             ziplistRepr(o->ptr);
             addReplyStatus(c,"Ziplist structure printed on stdout");
         }
+    } else if (!strcasecmp(c->argv[1]->ptr,"listpack") && c->argc == 3) {
+        robj *o;
+
+        if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.nokeyerr))
+                == NULL) return;
+
+        if (o->encoding != OBJ_ENCODING_LISTPACK) {
+            addReplyError(c,"Not a listpack encoded object.");
+        } else {
+            lpRepr(o->ptr);
+            addReplyStatus(c,"Listpack structure printed on stdout");
+        }
     } else if (!strcasecmp(c->argv[1]->ptr,"populate") &&
                c->argc >= 3 && c->argc <= 5) {
         long keys, j;
@@ -760,6 +782,56 @@ NULL
         dictGetStats(buf,sizeof(buf),server.db[dbid].expires);
         stats = sdscat(stats,buf);
 
+        addReplyVerbatim(c,stats,sdslen(stats),"txt");
+        sdsfree(stats);
+    } else if (!strcasecmp(c->argv[1]->ptr,"savestats") && c->argc == 2) {
+        static char *types[OBJ_TYPE_MAX] = {
+            "string","list","set","zset","hash","module","stream"
+        };
+        rdbSaveStats *rs = &server.stat_rdb_save;
+        unsigned long long saved = 0, usecs = 0;
+        sds stats = sdsempty();
+        int j;
+
+        for (j = 0; j < OBJ_TYPE_MAX; j++) {
+            saved += rs->keys[j];
+            usecs += rs->usecs[j];
+        }
+        stats = sdscatprintf(stats,"[RDB save]\n"
+            " in progress: %s\n"
+            " keys: %llu of %llu (%.2f%%)\n"
+            " bytes: %llu in %.3f seconds (%.2f MB/s)\n",
+            (server.rdb_child_pid != -1) ? "yes" : "no",
+            saved, rs->keys_total,
+            rs->keys_total ? (double)saved/rs->keys_total*100 : 0,
+            rs->bytes, (double)rs->elapsed_usecs/1000000,
+            rs->elapsed_usecs ?
+                (double)rs->bytes/rs->elapsed_usecs*1000000/(1024*1024) : 0);
+
+        stats = sdscatprintf(stats,"[Serialization]\n");
+        for (j = 0; j < OBJ_TYPE_MAX; j++) {
+            if (rs->keys[j] == 0) continue;
+            stats = sdscatprintf(stats,
+                " %s: %llu keys in %llu usec (%.2f usec per key, %.2f%%)\n",
+                types[j], rs->keys[j], rs->usecs[j],
+                (double)rs->usecs[j]/rs->keys[j],
+                usecs ? (double)rs->usecs[j]/usecs*100 : 0);
+        }
+
+        stats = sdscatprintf(stats,"[Compression]\n"
+            " strings: %llu\n"
+            " bytes: %llu in, %llu out (ratio %.2f)\n"
+            " time: %llu usec\n",
+            rs->compress_strings,
+            rs->compress_in, rs->compress_out,
+            rs->compress_out ? (double)rs->compress_in/rs->compress_out : 0,
+            rs->compress_usecs);
+
+        stats = sdscatprintf(stats,"[I/O]\n"
+            " write: %llu usec\n"
+            " fsync: %llu usec\n",
+            rs->write_usecs, rs->fsync_usecs);
+
         addReplyVerbatim(c,stats,sdslen(stats),"txt");
         sdsfree(stats);
     } else if (!strcasecmp(c->argv[1]->ptr,"htstats-key") && c->argc == 3) {
@@ -772,6 +844,7 @@ NULL
         /* Get the hash table reference from the object, if possible. */
         switch (o->encoding) {
         case OBJ_ENCODING_SKIPLIST:
+        case OBJ_ENCODING_BTREE:
             {
                 zset *zs = o->ptr;
                 ht = zs->dict;
@@ -880,6 +953,8 @@ void serverLogObjectDebugInfo(const robj *o) {
         serverLog(LL_WARNING,"Sorted set size: %d", (int) zsetLength(o));
         if (o->encoding == OBJ_ENCODING_SKIPLIST)
             serverLog(LL_WARNING,"Skiplist level: %d", (int) ((const zset*)o->ptr)->zsl->level);
+        else if (o->encoding == OBJ_ENCODING_BTREE)
+            serverLog(LL_WARNING,"B+tree height: %d", ((const zset*)o->ptr)->zbt->height);
     } else if (o->type == OBJ_STREAM) {
         serverLog(LL_WARNING,"Stream size: %d", (int) streamLength(o));
     }
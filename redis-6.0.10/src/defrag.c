@@ -255,6 +255,51 @@ long activeDefragZsetEntry(zset *zs, dictEntry *de) {
     return defragged;
 }
 
+/* Defrag helper for btree encoded sorted sets. Defrag the element of a dict
+ * entry, that is shared with the entry of the B+tree. */
+long activeDefragZsetBtreeEntry(zset *zs, dictEntry *de) {
+    sds sdsele = dictGetKey(de), newsds;
+    zbtCursor cur;
+
+    /* Find the entry of the B+tree before the element is moved. */
+    int found = zbtFind(zs->zbt,dictGetDoubleVal(de),sdsele,&cur);
+    serverAssert(found);
+    if ((newsds = activeDefragSds(sdsele))) {
+        de->key = newsds;
+        zbtCursorEntry(&cur)->ele = newsds;
+        return 1;
+    }
+    return 0;
+}
+
+/* Defrag the nodes of a B+tree, and the lower bounds stored in the inner
+ * nodes. 'ref' is where the node is referenced from, the parent node or the
+ * root of the tree. */
+long activeDefragZbtNode(zbtree *t, zbtNode **ref) {
+    zbtNode *n = *ref, *newn;
+    long defragged = 0;
+    int j;
+
+    if ((newn = activeDefragAlloc(n))) {
+        defragged++, *ref = n = newn;
+        if (n->leaf) {
+            zbtLeaf *l = (zbtLeaf*)n;
+            if (l->prev) l->prev->next = l; else t->head = l;
+            if (l->next) l->next->prev = l; else t->tail = l;
+        }
+    }
+    if (!n->leaf) {
+        zbtInner *in = (zbtInner*)n;
+        sds newsds;
+        for (j = 0; j < n->count; j++) {
+            if (j && (newsds = activeDefragSds(in->keys[j].ele)))
+                defragged++, in->keys[j].ele = newsds;
+            defragged += activeDefragZbtNode(t,&in->children[j]);
+        }
+    }
+    return defragged;
+}
+
 #define DEFRAG_SDS_DICT_NO_VAL 0
 #define DEFRAG_SDS_DICT_VAL_IS_SDS 1
 #define DEFRAG_SDS_DICT_VAL_IS_STROB 2
@@ -492,12 +537,16 @@ typedef struct {
 void scanLaterZsetCallback(void *privdata, const dictEntry *_de) {
     dictEntry *de = (dictEntry*)_de;
     scanLaterZsetData *data = privdata;
-    data->defragged += activeDefragZsetEntry(data->zs, de);
+    if (data->zs->zbt)
+        data->defragged += activeDefragZsetBtreeEntry(data->zs, de);
+    else
+        data->defragged += activeDefragZsetEntry(data->zs, de);
     server.stat_active_defrag_scanned++;
 }
 
 long scanLaterZset(robj *ob, unsigned long *cursor) {
-    if (ob->type != OBJ_ZSET || ob->encoding != OBJ_ENCODING_SKIPLIST)
+    if (ob->type != OBJ_ZSET || (ob->encoding != OBJ_ENCODING_SKIPLIST &&
+                                 ob->encoding != OBJ_ENCODING_BTREE))
         return 0;
     zset *zs = (zset*)ob->ptr;
     dict *d = zs->dict;
@@ -592,6 +641,41 @@ long defragZsetSkiplist(redisDb *db, dictEntry *kde) {
     return defragged;
 }
 
+long defragZsetBtree(redisDb *db, dictEntry *kde) {
+    robj *ob = dictGetVal(kde);
+    long defragged = 0;
+    zset *zs = (zset*)ob->ptr;
+    zset *newzs;
+    zbtree *newzbt;
+    dict *newdict;
+    dictEntry *de;
+    serverAssert(ob->type == OBJ_ZSET && ob->encoding == OBJ_ENCODING_BTREE);
+    if ((newzs = activeDefragAlloc(zs)))
+        defragged++, ob->ptr = zs = newzs;
+    if ((newzbt = activeDefragAlloc(zs->zbt)))
+        defragged++, zs->zbt = newzbt;
+    /* The nodes are visited walking the tree, that can't be resumed later,
+     * so the nodes of the large trees are not defragged. They are about
+     * ZBT_LEAF_MAX/2 times less than the elements, and much larger. */
+    if (zs->zbt->leaves+zs->zbt->inners <= server.active_defrag_max_scan_fields)
+        defragged += activeDefragZbtNode(zs->zbt,&zs->zbt->root);
+    if (dictSize(zs->dict) > server.active_defrag_max_scan_fields)
+        defragLater(db, kde);
+    else {
+        dictIterator *di = dictGetIterator(zs->dict);
+        while((de = dictNext(di)) != NULL) {
+            defragged += activeDefragZsetBtreeEntry(zs, de);
+        }
+        dictReleaseIterator(di);
+    }
+    /* handle the dict struct */
+    if ((newdict = activeDefragAlloc(zs->dict)))
+        defragged++, zs->dict = newdict;
+    /* defrag the dict tables */
+    defragged += dictDefragTables(zs->dict);
+    return defragged;
+}
+
 long defragHash(redisDb *db, dictEntry *kde) {
     long defragged = 0;
     robj *ob = dictGetVal(kde);
@@ -805,8 +889,9 @@ long defragKey(redisDb *db, dictEntry *de) {
     long defragged = 0;
     sds newsds;
 
-    /* Try to defrag the key name. */
-    newsds = activeDefragSds(keysds);
+    /* Try to defrag the key name. Keys embedded in the dict entry are moved
+     * together with the entry, see defragEmbeddedKeysBucketCallback(). */
+    newsds = dbKeysAreEmbedded(db) ? NULL : activeDefragSds(keysds);
     if (newsds)
         defragged++, de->key = newsds;
     if (dictSize(db->expires)) {
@@ -842,20 +927,25 @@ long defragKey(redisDb *db, dictEntry *de) {
             intset *newis, *is = ob->ptr;
             if ((newis = activeDefragAlloc(is)))
                 defragged++, ob->ptr = newis;
+        } else if (ob->encoding == OBJ_ENCODING_LISTPACK) {
+            if ((newzl = activeDefragAlloc(ob->ptr)))
+                defragged++, ob->ptr = newzl;
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (ob->type == OBJ_ZSET) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_SKIPLIST) {
             defragged += defragZsetSkiplist(db, de);
+        } else if (ob->encoding == OBJ_ENCODING_BTREE) {
+            defragged += defragZsetBtree(db, de);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (ob->type == OBJ_HASH) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_HT) {
@@ -898,6 +988,33 @@ void defragDictBucketCallback(void *privdata, dictEntry **bucketref) {
     }
 }
 
+/* Defrag scan callback for each bucket of the main dict of a DB that has
+ * the keys embedded in the entries (keyspace-compact-entries). Moving such
+ * an entry moves its key as well, so we also have to fix the key pointer
+ * of the entry, and the one of the expires dict that shares it. */
+void defragEmbeddedKeysBucketCallback(void *privdata, dictEntry **bucketref) {
+    redisDb *db = privdata;
+    long defragged = 0;
+
+    while(*bucketref) {
+        dictEntry *de = *bucketref, *newde;
+        sds oldkey = dictGetKey(de);
+        if ((newde = activeDefragAlloc(de))) {
+            sds newkey = (char*)newde + ((char*)oldkey - (char*)de);
+            newde->key = newkey;
+            *bucketref = newde;
+            defragged++;
+            if (dictSize(db->expires)) {
+                uint64_t hash = dictGetHash(db->dict, newkey);
+                replaceSatelliteDictKeyPtrAndOrDefragDictEntry(db->expires,
+                    oldkey, newkey, hash, &defragged);
+            }
+        }
+        bucketref = &(*bucketref)->next;
+    }
+    server.stat_active_defrag_hits += defragged;
+}
+
 /* Utility function to get the fragmentation ratio from jemalloc.
  * It is critical to do that by comparing only heap maps that belong to
  * jemalloc, and skip ones the jemalloc keeps as spare. Since we use this
@@ -1154,7 +1271,9 @@ void activeDefragCycle(void) {
                 break; /* this will exit the function and we'll continue on the next cycle */
             }
 
-            cursor = dictScan(db->dict, cursor, defragScanCallback, defragDictBucketCallback, db);
+            cursor = dictScan(db->dict, cursor, defragScanCallback,
+                dbKeysAreEmbedded(db) ? defragEmbeddedKeysBucketCallback :
+                                        defragDictBucketCallback, db);
 
             /* Once in 16 scan iterations, 512 pointer reallocations. or 64 keys
              * (if we have a lot of pointers in one hash bucket or rehasing),
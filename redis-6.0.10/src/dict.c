@@ -45,6 +45,7 @@
 
 #include "dict.h"
 #include "zmalloc.h"
+#include "config.h"
 #ifndef DICT_BENCHMARK_MAIN
 #include "redisassert.h"
 #else
@@ -243,7 +244,8 @@ int dictRehash(dict *d, int n) {
             nextde = de->next;
             /* Get the index in the new hash table */
             //获取key的哈希值并计算其在新哈希表中桶的索引值
-            h = dictHashKey(d, de->key) & d->ht[1].sizemask;
+            h = d->type->storeHash ? dictEntryHash(de) : dictHashKey(d, de->key);
+            h &= d->ht[1].sizemask;
             de->next = d->ht[1].table[h];  //在bukect对应链表的头节点前插入de
             d->ht[1].table[h] = de;
             d->ht[0].used--;
@@ -344,6 +346,7 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
     long index;
     dictEntry *entry;
     dictht *ht;
+    uint64_t hash;
 
     //rehash 期间的插入操作也会触发一次槽位 rehash。
     if (dictIsRehashing(d)) _dictRehashStep(d);
@@ -353,7 +356,8 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
      * dictAddRaw 函数通过 _dictKeyIndex 返回的索引值来确认键是否在哈希表中，
      * 不存在的话插入一个新的键值对在哈希表的槽位上。
      * */
-    if ((index = _dictKeyIndex(d, key, dictHashKey(d,key), existing)) == -1)
+    hash = dictHashKey(d,key);
+    if ((index = _dictKeyIndex(d, key, hash, existing)) == -1)
         return NULL;
 
     /* Allocate the memory and store the new entry.
@@ -361,13 +365,21 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
      * system it is more likely that recently added entries are accessed
      * more frequently. */
     ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
-    entry = zmalloc(sizeof(*entry));
+    size_t entrysize = dictEntryMemSize(d);
+    size_t keysize = d->type->keyEmbed ? d->type->keyEmbedLen(key) : 0;
+    entry = zmalloc(entrysize+keysize);
+    if (d->type->storeHash) dictEntryHash(entry) = hash;
+    if (d->type->entryMetadataBytes)
+        memset(dictEntryMetadata(d,entry),0,d->type->entryMetadataBytes);
     entry->next = ht->table[index];
     ht->table[index] = entry;
     ht->used++;
 
     /* Set the hash entry fields. */
-    dictSetKey(d, entry, key);
+    if (d->type->keyEmbed)
+        entry->key = d->type->keyEmbed((char*)entry+entrysize,key);
+    else
+        dictSetKey(d, entry, key);
     return entry;
 }
 
@@ -440,7 +452,9 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
         he = d->ht[table].table[idx];
         prevHe = NULL;
         while(he) {
-            if (key==he->key || dictCompareKeys(d, key, he->key)) {
+            if (key==he->key ||
+                (dictEntryHashMatches(d, he, h) && dictCompareKeys(d, key, he->key)))
+            {
                 /* Unlink the element from the list */
                 if (prevHe)
                     prevHe->next = he->next;
@@ -550,6 +564,41 @@ void dictRelease(dict *d)
     zfree(d);
 }
 
+/* Free the entries stored in the buckets from 'start' to 'end' (excluded)
+ * of the specified table, leaving such buckets empty. The number of entries
+ * of the table is not updated, so that different threads can free disjoint
+ * ranges of the same dict at the same time: once all the buckets were freed
+ * the dict must be marked as empty with dictSetEmptied(), and then it can be
+ * released. Returns the number of entries freed. */
+unsigned long dictFreeBucketRange(dict *d, int table, unsigned long start,
+                                  unsigned long end)
+{
+    dictht *ht = &d->ht[table];
+    unsigned long i, freed = 0;
+
+    if (end > ht->size) end = ht->size;
+    for (i = start; i < end; i++) {
+        dictEntry *he = ht->table[i], *nextHe;
+
+        while(he) {
+            nextHe = he->next;
+            dictFreeKey(d, he);
+            dictFreeVal(d, he);
+            zfree(he);
+            freed++;
+            he = nextHe;
+        }
+        ht->table[i] = NULL;
+    }
+    return freed;
+}
+
+/* Mark as empty a dict whose buckets were all freed by dictFreeBucketRange(). */
+void dictSetEmptied(dict *d) {
+    d->ht[0].used = 0;
+    d->ht[1].used = 0;
+}
+
 /*
 查找。先计算key的hash值，找到对应的槽，依次比较。但是由于存在rehash状态，所以需要查找两个dictht
 */
@@ -565,7 +614,8 @@ dictEntry *dictFind(dict *d, const void *key)
         idx = h & d->ht[table].sizemask;
         he = d->ht[table].table[idx];
         while(he) {
-            if (key==he->key || dictCompareKeys(d, key, he->key))
+            if (key==he->key ||
+                (dictEntryHashMatches(d, he, h) && dictCompareKeys(d, key, he->key)))
                 return he;
             he = he->next;
         }
@@ -584,6 +634,123 @@ void *dictFetchValue(dict *d, const void *key) {
     return he ? dictGetVal(he) : NULL;
 }
 
+/* Prefetch into the CPU caches the memory that dictFind() is going to touch
+ * in order to lookup the 'count' keys in the 'keys' array: the bucket slots,
+ * the first entry of every bucket and the key of such entry.
+ *
+ * Looking up a key in a big dictionary is dominated by two dependent cache
+ * misses (the bucket slot and then the entry). When many keys are going to
+ * be looked up at once, it is much faster to issue the loads for all the
+ * keys stage by stage, so that the misses of the different keys overlap,
+ * instead of paying them serially one key after the other.
+ *
+ * This function is just a hint: it does not change the dictionary and it
+ * is always safe to call, no matter what the keys are. */
+#define DICT_PREFETCH_BATCH 16
+void dictPrefetchKeys(dict *d, void **keys, unsigned long count) {
+    dictEntry **buckets[DICT_PREFETCH_BATCH*2];
+
+    if (dictSize(d) == 0) return;
+    for (unsigned long start = 0; start < count; start += DICT_PREFETCH_BATCH) {
+        unsigned long j, n = count-start;
+        int b, nb = 0;
+
+        if (n > DICT_PREFETCH_BATCH) n = DICT_PREFETCH_BATCH;
+
+        /* Stage 1: hash the keys and fetch the bucket slots, from both the
+         * tables if we are rehashing. */
+        for (j = 0; j < n; j++) {
+            uint64_t h = dictHashKey(d, keys[start+j]);
+            for (int table = 0; table <= 1; table++) {
+                buckets[nb] = &d->ht[table].table[h & d->ht[table].sizemask];
+                redis_prefetch(buckets[nb]);
+                nb++;
+                if (!dictIsRehashing(d)) break;
+            }
+        }
+
+        /* Stage 2: fetch the first entry of every bucket. */
+        for (b = 0; b < nb; b++)
+            if (*buckets[b]) redis_prefetch(*buckets[b]);
+
+        /* Stage 3: fetch the keys that dictFind() compares first. */
+        for (b = 0; b < nb; b++)
+            if (*buckets[b]) redis_prefetch((*buckets[b])->key);
+    }
+}
+
+/* Lookup 'count' keys at once: on return entries[j] is the entry of keys[j],
+ * or NULL if such key is not in the dictionary, exactly like if dictFind()
+ * was called for every key. The number of keys found is returned.
+ *
+ * The lookups are pipelined in batches of DICT_PREFETCH_BATCH keys: first
+ * all the keys of the batch are hashed and their buckets prefetched, then
+ * the first entry of every bucket is prefetched, and only then the chains
+ * are walked. This way the dependent cache misses of the different keys
+ * overlap, which for big dictionaries is much faster than a dictFind() loop.
+ *
+ * Note that the returned entries are only valid as long as the dictionary
+ * is not modified. */
+unsigned long dictFindMany(dict *d, void **keys, dictEntry **entries, unsigned long count) {
+    dictEntry **buckets[DICT_PREFETCH_BATCH*2];
+    uint64_t hashes[DICT_PREFETCH_BATCH];
+    unsigned long found = 0;
+
+    if (dictSize(d) == 0) {
+        memset(entries,0,sizeof(dictEntry*)*count);
+        return 0;
+    }
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+
+    /* The tables to check for every key: one, or two if rehashing. */
+    int tables = dictIsRehashing(d) ? 2 : 1;
+    for (unsigned long start = 0; start < count; start += DICT_PREFETCH_BATCH) {
+        unsigned long j, n = count-start;
+        int b, nb = 0;
+
+        if (n > DICT_PREFETCH_BATCH) n = DICT_PREFETCH_BATCH;
+
+        /* Stage 1: hash the keys and fetch the bucket slots. */
+        for (j = 0; j < n; j++) {
+            uint64_t h = hashes[j] = dictHashKey(d, keys[start+j]);
+            for (int table = 0; table < tables; table++) {
+                buckets[nb] = &d->ht[table].table[h & d->ht[table].sizemask];
+                redis_prefetch(buckets[nb]);
+                nb++;
+            }
+        }
+
+        /* Stage 2: fetch the first entry of every bucket, and then the
+         * keys we are going to compare. */
+        for (b = 0; b < nb; b++)
+            if (*buckets[b]) redis_prefetch(*buckets[b]);
+        for (b = 0; b < nb; b++) {
+            dictEntry *he = *buckets[b];
+            if (he && dictEntryHashMatches(d, he, hashes[b/tables]))
+                redis_prefetch(he->key);
+        }
+
+        /* Stage 3: walk the chains, that should be in cache by now. */
+        for (j = 0, b = 0; j < n; j++, b += tables) {
+            const void *key = keys[start+j];
+            dictEntry *he = NULL;
+
+            for (int table = 0; table < tables && he == NULL; table++) {
+                he = *buckets[b+table];
+                while(he) {
+                    if (key==he->key ||
+                        (dictEntryHashMatches(d, he, hashes[j]) &&
+                         dictCompareKeys(d, key, he->key))) break;
+                    he = he->next;
+                }
+            }
+            entries[start+j] = he;
+            if (he) found++;
+        }
+    }
+    return found;
+}
+
 /* A fingerprint is a 64 bit number that represents the state of the dictionary
  * at a given time, it's just a few dict properties xored together.
  * When an unsafe iterator is initialized, we get the dict fingerprint, and check
@@ -1079,6 +1246,14 @@ unsigned long dictScan(dict *d,
     return v;
 }
 
+/* Return true if a full dictScan() iteration that returned the cursor 'v'
+ * already visited the bucket of 'key'. This only holds as long as the table
+ * is never shrunk during the iteration, since shrinking the table may move
+ * keys already visited to buckets not yet visited. */
+int dictScanCursorPassed(dict *d, unsigned long v, const void *key) {
+    return rev(dictHashKey(d,key)) < rev(v);
+}
+
 /* ------------------------- private functions ------------------------------ */
 
 /* Expand the hash table if needed */
@@ -1154,7 +1329,9 @@ static long _dictKeyIndex(dict *d, const void *key, uint64_t hash, dictEntry **e
         he = d->ht[table].table[idx];
         while(he) {
             //如果key 存在，则返回-1
-            if (key==he->key || dictCompareKeys(d, key, he->key)) {
+            if (key==he->key ||
+                (dictEntryHashMatches(d, he, hash) && dictCompareKeys(d, key, he->key)))
+            {
                 if (existing) *existing = he;
                 return -1;
             }
@@ -1390,6 +1567,22 @@ int main(int argc, char **argv) {
     }
     end_benchmark("Random access of existing elements");
 
+    start_benchmark();
+    for (j = 0; j < count; j += 16) {
+        void *keys[16];
+        dictEntry *des[16];
+        long k, n = count-j < 16 ? count-j : 16;
+
+        for (k = 0; k < n; k++) keys[k] = sdsfromlonglong(rand() % count);
+        long found = dictFindMany(dict,keys,des,n);
+        assert(found == n);
+        for (k = 0; k < n; k++) {
+            assert(des[k] != NULL && sdscmp(keys[k],dictGetKey(des[k])) == 0);
+            sdsfree(keys[k]);
+        }
+    }
+    end_benchmark("Random access of existing elements (dictFindMany)");
+
     start_benchmark();
     for (j = 0; j < count; j++) {
         sds key = sdsfromlonglong(rand() % count);
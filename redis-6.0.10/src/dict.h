@@ -75,8 +75,40 @@ typedef struct dictType {
     void (*keyDestructor)(void *privdata, void *key);
     //销毁值
     void (*valDestructor)(void *privdata, void *obj);
+    //是否在节点中缓存key的hash值
+    int storeHash; /* Cache the key hash in every entry, see dictEntryWithHash. */
+    //每个节点中预留的元数据字节数
+    size_t entryMetadataBytes; /* See dictEntryMetadata(). */
+    //把key复制到节点的内存中
+    size_t (*keyEmbedLen)(const void *key);
+    void *(*keyEmbed)(void *buf, const void *key);
 } dictType;
 
+/* Every entry can reserve 'entryMetadataBytes' bytes of memory, zeroed on
+ * creation, for the caller to use, see dictEntryMetadata().
+ *
+ * If 'keyEmbed' is set, dictAddRaw() does not retain the key it is passed:
+ * it allocates 'keyEmbedLen(key)' additional bytes in the entry, and uses
+ * 'keyEmbed' to store a copy of the key there, so that every entry is a
+ * single allocation, and the key is near the entry in memory. Such keys are
+ * released together with the entry, so 'keyDup' and 'keyDestructor' should
+ * be NULL.
+ *
+ * The layout of an entry is the dictEntry itself, the cached hash if
+ * 'storeHash' is set, the metadata, and finally the embedded key. */
+
+/* Entries of dictionaries having the 'storeHash' type flag set are allocated
+ * with the hash of the key right after the dictEntry fields. Rehashing then
+ * just needs to relink the entries, without computing the hash function
+ * again and without touching the keys, and lookups can skip the comparison
+ * of the keys having a different hash (that is, the access to the key
+ * memory). With jemalloc a dictEntry is served from the 32 bytes size class
+ * anyway, so caching the hash does not use more memory. */
+typedef struct dictEntryWithHash {
+    dictEntry de;
+    uint64_t hash;
+} dictEntryWithHash;
+
 /* This is our hash table structure. Every dictionary has two of this as we
  * implement incremental rehashing, for the old to the new table. */
 //hash表节点，Key-Value节点
@@ -193,6 +225,19 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 
 //获取指定key的哈希值
 #define dictHashKey(d, key) (d)->type->hashFunction(key)
+//获取节点中缓存的key的哈希值，只对storeHash类型的字典有效
+#define dictEntryHash(he) (((dictEntryWithHash*)(he))->hash)
+//节点是否可能保存哈希值为h的key
+#define dictEntryHashMatches(d, he, h) \
+    (!(d)->type->storeHash || dictEntryHash(he) == (h))
+//节点中元数据的起始地址
+#define dictEntryMetadata(d, he) \
+    ((void*)((char*)(he) + \
+    ((d)->type->storeHash ? sizeof(dictEntryWithHash) : sizeof(dictEntry))))
+//每个节点占用的内存，不包括内嵌的key
+#define dictEntryMemSize(d) \
+    (((d)->type->storeHash ? sizeof(dictEntryWithHash) : sizeof(dictEntry)) + \
+     (d)->type->entryMetadataBytes)
 //获取指定节点的key
 #define dictGetKey(he) ((he)->key)
 //获取指定节点的value
@@ -225,8 +270,12 @@ int dictDelete(dict *d, const void *key);
 dictEntry *dictUnlink(dict *ht, const void *key);
 void dictFreeUnlinkedEntry(dict *d, dictEntry *he);
 void dictRelease(dict *d);
+unsigned long dictFreeBucketRange(dict *d, int table, unsigned long start, unsigned long end);
+void dictSetEmptied(dict *d);
 dictEntry * dictFind(dict *d, const void *key);
 void *dictFetchValue(dict *d, const void *key);
+void dictPrefetchKeys(dict *d, void **keys, unsigned long count);
+unsigned long dictFindMany(dict *d, void **keys, dictEntry **entries, unsigned long count);
 int dictResize(dict *d);
 dictIterator *dictGetIterator(dict *d);
 dictIterator *dictGetSafeIterator(dict *d);
@@ -246,6 +295,7 @@ int dictRehashMilliseconds(dict *d, int ms);
 void dictSetHashFunctionSeed(uint8_t *seed);
 uint8_t *dictGetHashFunctionSeed(void);
 unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, dictScanBucketFunction *bucketfn, void *privdata);
+int dictScanCursorPassed(dict *d, unsigned long v, const void *key);
 uint64_t dictGetHash(dict *d, const void *key);
 dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t hash);
 
@@ -60,6 +60,29 @@ struct evictionPoolEntry {
 
 static struct evictionPoolEntry *EvictionPoolLRU;
 
+/* The pool is not populated again for every key we evict: keys are evicted
+ * from the pool in batches of server.eviction_batch keys, best to worst,
+ * before sampling new keys. The pool is also kept populated by serverCron()
+ * when we are close to the memory limit, so that a burst of writes over the
+ * limit can start evicting without sampling at all.
+ *
+ * Evicting more keys from the same pool, and evicting keys sampled some time
+ * ago, lowers the quality of the eviction. So we estimate the precision of
+ * the eviction: every time we sample keys, we check how many of them are
+ * worse candidates than the last key evicted. If the evicted keys are among
+ * the best candidates of the dataset, almost all the sampled keys are worse
+ * candidates, and the precision is near to 1. When the precision is below
+ * EVICTION_TARGET_PRECISION we sample more keys and evict smaller batches,
+ * otherwise we go back to maxmemory-samples keys and larger batches. */
+#define EVICTION_TARGET_PRECISION 0.95
+#define EVICTION_SAMPLES_MAX 64
+#define EVICTION_BATCH_MAX (EVPOOL_SIZE/2)
+#define EVICTION_POOL_REFRESH_LEVEL 0.9 /* Memory level to refresh the pool. */
+
+static int EvictionPoolBatchLeft = 0; /* Keys to evict before sampling. */
+static unsigned long long EvictionLastScore = 0; /* Last evicted key score. */
+static int EvictionLastScoreValid = 0;
+
 /* ----------------------------------------------------------------------------
  * Implementation of eviction, aging and LRU
  * --------------------------------------------------------------------------*/
@@ -150,6 +173,102 @@ void evictionPoolAlloc(void) {
     EvictionPoolLRU = ep;
 }
 
+/* Return the eviction score of the key stored at the entry 'de' of the
+ * dictionary 'sampledict', that is either the main dictionary 'keydict' of
+ * the DB or its expires dictionary. */
+static unsigned long long evictionScore(dict *sampledict, dict *keydict,
+                                        dictEntry *de)
+{
+    unsigned long long idle;
+    robj *o = NULL;
+
+    /* If the dictionary we are sampling from is not the main
+     * dictionary (but the expires one) we need to lookup the key
+     * again in the key dictionary to obtain the value object. */
+    if (server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL) {
+        if (sampledict != keydict) de = dictFind(keydict, dictGetKey(de));
+        o = dictGetVal(de);
+    }
+
+    /* Calculate the idle time according to the policy. This is called
+     * idle just because the code initially handled LRU, but is in fact
+     * just a score where an higher score means better candidate. */
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_LRU) {
+        idle = estimateObjectIdleTime(o);
+    } else if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
+        /* When we use an LRU policy, we sort the keys by idle time
+         * so that we expire keys starting from greater idle time.
+         * However when the policy is an LFU one, we have a frequency
+         * estimation, and we want to evict keys with lower frequency
+         * first. So inside the pool we put objects using the inverted
+         * frequency subtracting the actual frequency to the maximum
+         * frequency of 255. */
+        idle = 255-LFUDecrAndReturn(o);
+    } else if (server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL) {
+        /* In this case the sooner the expire the better. */
+        idle = ULLONG_MAX - (long)dictGetVal(de);
+    } else {
+        serverPanic("Unknown eviction policy in evictionScore()");
+    }
+    return idle;
+}
+
+/* Return the number of keys to sample from every DB when populating the
+ * pool, that is maxmemory-samples, or more if the precision is low. */
+static int evictionSamples(void) {
+    return server.eviction_samples;
+}
+
+/* Clamp the adaptive number of samples between maxmemory-samples and
+ * EVICTION_SAMPLES_MAX (or maxmemory-samples itself if it is greater). */
+static void evictionClampSamples(void) {
+    int max = server.maxmemory_samples > EVICTION_SAMPLES_MAX ?
+              server.maxmemory_samples : EVICTION_SAMPLES_MAX;
+    if (server.eviction_samples < server.maxmemory_samples)
+        server.eviction_samples = server.maxmemory_samples;
+    if (server.eviction_samples > max) server.eviction_samples = max;
+}
+
+/* Update the precision estimate with the result of a round of sampling,
+ * and adapt the samples and the batch size accordingly. */
+static void evictionUpdatePrecision(unsigned long sampled,
+                                    unsigned long worse)
+{
+    if (sampled == 0) return;
+    double precision = (double)worse/sampled;
+    server.stat_eviction_precision = server.stat_eviction_precision*0.9+
+                                     precision*0.1;
+    if (server.stat_eviction_precision < EVICTION_TARGET_PRECISION) {
+        server.eviction_samples *= 2;
+        server.eviction_batch = 1;
+    } else {
+        server.eviction_samples--;
+        if (server.eviction_batch < EVICTION_BATCH_MAX)
+            server.eviction_batch++;
+    }
+    evictionClampSamples();
+}
+
+/* Empty the pool and restart the adaptive sampling from maxmemory-samples.
+ * Called at startup and when maxmemory-policy or maxmemory-samples change,
+ * since the scores of the keys in the pool, and the precision estimated so
+ * far, only make sense for the policy and the samples they were computed
+ * with. */
+void evictionResetState(void) {
+    for (int k = 0; k < EVPOOL_SIZE; k++) {
+        if (EvictionPoolLRU[k].key != EvictionPoolLRU[k].cached)
+            sdsfree(EvictionPoolLRU[k].key);
+        EvictionPoolLRU[k].key = NULL;
+        EvictionPoolLRU[k].idle = 0;
+    }
+    EvictionPoolBatchLeft = 0;
+    EvictionLastScore = 0;
+    EvictionLastScoreValid = 0;
+    server.eviction_samples = server.maxmemory_samples;
+    server.eviction_batch = 1;
+    server.stat_eviction_precision = 1;
+}
+
 /* This is an helper function for freeMemoryIfNeeded(), it is used in order
  * to populate the evictionPool with a few entries every time we want to
  * expire a key. Keys with idle time smaller than one of the current
@@ -157,49 +276,29 @@ void evictionPoolAlloc(void) {
  *
  * We insert keys on place in ascending order, so keys with the smaller
  * idle time are on the left, and keys with the higher idle time on the
- * right. */
+ * right.
+ *
+ * The number of sampled keys, and of the sampled keys that are worse
+ * candidates than the last evicted key, are accumulated in '*sampled' and
+ * '*worse', in order to estimate the precision of the eviction. */
 
-void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evictionPoolEntry *pool) {
+void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evictionPoolEntry *pool, unsigned long *sampled, unsigned long *worse) {
     int j, k, count;
-    dictEntry *samples[server.maxmemory_samples];
+    int numsamples = evictionSamples();
+    dictEntry *samples[numsamples];
 
-    count = dictGetSomeKeys(sampledict,samples,server.maxmemory_samples);
+    count = dictGetSomeKeys(sampledict,samples,numsamples);
     for (j = 0; j < count; j++) {
         unsigned long long idle;
         sds key;
-        robj *o;
         dictEntry *de;
 
         de = samples[j];
         key = dictGetKey(de);
-
-        /* If the dictionary we are sampling from is not the main
-         * dictionary (but the expires one) we need to lookup the key
-         * again in the key dictionary to obtain the value object. */
-        if (server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL) {
-            if (sampledict != keydict) de = dictFind(keydict, key);
-            o = dictGetVal(de);
-        }
-
-        /* Calculate the idle time according to the policy. This is called
-         * idle just because the code initially handled LRU, but is in fact
-         * just a score where an higher score means better candidate. */
-        if (server.maxmemory_policy & MAXMEMORY_FLAG_LRU) {
-            idle = estimateObjectIdleTime(o);
-        } else if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
-            /* When we use an LRU policy, we sort the keys by idle time
-             * so that we expire keys starting from greater idle time.
-             * However when the policy is an LFU one, we have a frequency
-             * estimation, and we want to evict keys with lower frequency
-             * first. So inside the pool we put objects using the inverted
-             * frequency subtracting the actual frequency to the maximum
-             * frequency of 255. */
-            idle = 255-LFUDecrAndReturn(o);
-        } else if (server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL) {
-            /* In this case the sooner the expire the better. */
-            idle = ULLONG_MAX - (long)dictGetVal(de);
-        } else {
-            serverPanic("Unknown eviction policy in evictionPoolPopulate()");
+        idle = evictionScore(sampledict,keydict,de);
+        if (EvictionLastScoreValid) {
+            (*sampled)++;
+            if (idle <= EvictionLastScore) (*worse)++;
         }
 
         /* Insert the element inside the pool.
@@ -256,6 +355,42 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evic
     }
 }
 
+/* Populate the pool sampling keys from every DB, and start a new batch of
+ * evictions. Returns the number of keys that can be evicted, so zero if
+ * there is nothing to evict. */
+static unsigned long evictionPoolPopulateAll(void) {
+    unsigned long total_keys = 0, keys, sampled = 0, worse = 0;
+
+    for (int i = 0; i < server.dbnum; i++) {
+        redisDb *db = server.db+i;
+        dict *d = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
+                  db->dict : db->expires;
+        if ((keys = dictSize(d)) != 0) {
+            evictionPoolPopulate(i, d, db->dict, EvictionPoolLRU,
+                                 &sampled, &worse);
+            total_keys += keys;
+        }
+    }
+    evictionUpdatePrecision(sampled,worse);
+    EvictionPoolBatchLeft = total_keys ? server.eviction_batch : 0;
+    return total_keys;
+}
+
+/* Called by serverCron(): when we are near the memory limit keep the pool
+ * populated, so that the next evictions don't need to sample keys. */
+void evictionPoolRefresh(void) {
+    float level;
+
+    if (!server.maxmemory ||
+        !(server.maxmemory_policy & (MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_LFU) ||
+          server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL)) return;
+    if (server.masterhost && server.repl_slave_ignore_maxmemory) return;
+    if (clientsArePaused()) return;
+    getMaxmemoryState(NULL,NULL,NULL,&level);
+    if (level < EVICTION_POOL_REFRESH_LEVEL) return;
+    evictionPoolPopulateAll();
+}
+
 /* ----------------------------------------------------------------------------
  * LFU (Least Frequently Used) implementation.
 
@@ -483,33 +618,33 @@ int freeMemoryIfNeeded(void) {
             struct evictionPoolEntry *pool = EvictionPoolLRU;
 
             while(bestkey == NULL) {
-                unsigned long total_keys = 0, keys;
-
                 /* We don't want to make local-db choices when expiring keys,
                  * so to start populate the eviction pool sampling keys from
-                 * every DB. */
-                for (i = 0; i < server.dbnum; i++) {
-                    db = server.db+i;
-                    dict = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
-                            db->dict : db->expires;
-                    if ((keys = dictSize(dict)) != 0) {
-                        evictionPoolPopulate(i, dict, db->dict, pool);
-                        total_keys += keys;
-                    }
+                 * every DB. This is done once every batch of evictions. */
+                if (EvictionPoolBatchLeft == 0) {
+                    if (!evictionPoolPopulateAll()) break; /* No keys. */
                 }
-                if (!total_keys) break; /* No keys to evict. */
+                EvictionPoolBatchLeft--;
 
                 /* Go backward from best to worst element to evict. */
                 for (k = EVPOOL_SIZE-1; k >= 0; k--) {
                     if (pool[k].key == NULL) continue;
                     bestdbid = pool[k].dbid;
-
-                    if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) {
-                        de = dictFind(server.db[pool[k].dbid].dict,
-                            pool[k].key);
-                    } else {
-                        de = dictFind(server.db[pool[k].dbid].expires,
-                            pool[k].key);
+                    db = server.db+bestdbid;
+                    dict = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
+                            db->dict : db->expires;
+                    de = dictFind(dict,pool[k].key);
+
+                    /* The key may have been accessed, or its TTL changed,
+                     * since it was sampled, if so it is no longer a good
+                     * candidate: handle it like a ghost. */
+                    if (de && evictionScore(dict,db->dict,de) < pool[k].idle) {
+                        server.stat_eviction_stale_candidates++;
+                        de = NULL;
+                    }
+                    if (de) {
+                        EvictionLastScore = pool[k].idle;
+                        EvictionLastScoreValid = 1;
                     }
 
                     /* Remove the entry from the pool. */
@@ -527,6 +662,9 @@ int freeMemoryIfNeeded(void) {
                         /* Ghost... Iterate again. */
                     }
                 }
+
+                /* Sample again if the pool was drained. */
+                if (bestkey == NULL) EvictionPoolBatchLeft = 0;
             }
         }
 
@@ -595,8 +733,10 @@ int freeMemoryIfNeeded(void) {
              * check, from time to time, if we already reached our target
              * memory, since the "mem_freed" amount is computed only
              * across the dbAsyncDelete() call, while the thread can
-             * release the memory all the time. */
+             * release the memory all the time. The objects deleted so far
+             * are handed to the thread with a single job. */
             if (server.lazyfree_lazy_eviction && !(keys_freed % 16)) {
+                lazyfreeFlushBatch();
                 if (getMaxmemoryState(NULL,NULL,NULL,NULL) == C_OK) {
                     /* Let's satisfy our stop condition. */
                     mem_freed = mem_tofree;
@@ -609,6 +749,8 @@ int freeMemoryIfNeeded(void) {
     result = C_OK;
 
 cant_free:
+    if (server.lazyfree_lazy_eviction) lazyfreeFlushBatch();
+
     /* We are here if we are not able to reclaim memory. There is only one
      * last thing we can try: check if the lazyfree thread has jobs in queue
      * and wait... */
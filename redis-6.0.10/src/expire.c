@@ -73,6 +73,348 @@ int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
     }
 }
 
+/*-----------------------------------------------------------------------------
+ * Background discovery of the expired keys.
+ *
+ * With active-expire-scan-thread enabled the active expire cycle does not
+ * sample db->expires: a thread scans the buckets of the expires dicts of all
+ * the DBs, collecting a copy of the names of the keys found expired, and the
+ * cycle just verifies them and reclaims them.
+ *
+ * The thread only reads the keyspace while the main thread is sleeping in
+ * the event loop, that is, from the end of beforeSleep() to afterSleep(),
+ * where the main thread stops it again, waiting at most for the bucket scan
+ * in progress to complete. When modules are loaded the thread also holds
+ * the modules GIL while scanning, since module threads may modify the
+ * keyspace while the main thread sleeps.
+ *
+ * The dicts may be resized and rehashed between two scan steps, so a few
+ * buckets may be visited twice or not at all in a pass: this is fine, since
+ * every candidate is verified again by the main thread, and the keys missed
+ * are found in the next pass (or expired on access).
+ *----------------------------------------------------------------------------*/
+
+#define ACTIVE_EXPIRE_SCAN_BUCKETS 64 /* Buckets scanned in every step. */
+#define ACTIVE_EXPIRE_SCAN_MAX_KEYS 16384 /* Expired keys not yet reclaimed. */
+#define ACTIVE_EXPIRE_SCAN_BATCH 128 /* Keys propagated with a single DEL. */
+
+typedef struct expireScanDb {
+    sds *keys;                  /* Names of the expired keys found. */
+    unsigned long numkeys, size;
+    unsigned long scanned;      /* Keys scanned since the last reclaim. */
+    long long ttl_sum;          /* Sum of the TTLs of keys not yet expired. */
+    long long ttl_samples;
+} expireScanDb;
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t resume_cond; /* Signaled when the scan can go on. */
+    pthread_cond_t pause_cond;  /* Signaled when a scan step completes. */
+    int allowed;                /* The main thread is sleeping. */
+    int running;                /* The thread is reading the keyspace. */
+    /* The state below is only accessed by the thread while running, and by
+     * the main thread while the thread is not running. */
+    expireScanDb *dbs;          /* Expired keys found, for every DB. */
+    unsigned long numkeys;      /* Expired keys found in all the DBs. */
+    int dbid;                   /* DB being scanned. */
+    unsigned long cursor;       /* Next bucket to scan. */
+    long long next_pass;        /* Unix time (ms) to start the next pass. */
+    unsigned long pass_scanned, pass_expired; /* Stats of the current pass. */
+} expire_scan = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .resume_cond = PTHREAD_COND_INITIALIZER,
+    .pause_cond = PTHREAD_COND_INITIALIZER
+};
+
+/* Scan the next buckets of the expires dicts. Returns ASAP if the scan pass
+ * was completed, or if there is no room for more expired keys. */
+static void activeExpireScanStep(void) {
+    long long now = mstime();
+
+    for (int j = 0; j < ACTIVE_EXPIRE_SCAN_BUCKETS; j++) {
+        redisDb *db = server.db+expire_scan.dbid;
+        expireScanDb *sdb = expire_scan.dbs+expire_scan.dbid;
+        dict *d = db->expires;
+        unsigned long idx = expire_scan.cursor;
+
+        if (idx >= d->ht[0].size &&
+            (!dictIsRehashing(d) || idx >= d->ht[1].size))
+        {
+            /* Done with this DB, continue with the next one. */
+            expire_scan.cursor = 0;
+            if (++expire_scan.dbid < server.dbnum) continue;
+
+            /* The pass over all the DBs is completed. */
+            expire_scan.dbid = 0;
+            server.stat_expire_scan_stale_perc = expire_scan.pass_scanned ?
+                (double)expire_scan.pass_expired/expire_scan.pass_scanned : 0;
+            expire_scan.pass_scanned = 0;
+            expire_scan.pass_expired = 0;
+            expire_scan.next_pass = now+1000/server.hz;
+            return;
+        }
+        if (expire_scan.numkeys == ACTIVE_EXPIRE_SCAN_MAX_KEYS) return;
+
+        for (int table = 0; table < 2; table++) {
+            if (table == 1 && !dictIsRehashing(d)) break;
+            if (idx >= d->ht[table].size) continue;
+
+            dictEntry *de = d->ht[table].table[idx];
+            while(de) {
+                long long ttl = dictGetSignedIntegerVal(de)-now;
+
+                if (ttl < 0) {
+                    /* Keys not fitting are found again in the next pass. */
+                    if (expire_scan.numkeys < ACTIVE_EXPIRE_SCAN_MAX_KEYS) {
+                        if (sdb->numkeys == sdb->size) {
+                            sdb->size = sdb->size ? sdb->size*2 : 64;
+                            sdb->keys = zrealloc(sdb->keys,
+                                                 sizeof(sds)*sdb->size);
+                        }
+                        sdb->keys[sdb->numkeys++] = sdsdup(dictGetKey(de));
+                        expire_scan.numkeys++;
+                    }
+                    expire_scan.pass_expired++;
+                } else if (ttl > 0) {
+                    sdb->ttl_sum += ttl;
+                    sdb->ttl_samples++;
+                }
+                sdb->scanned++;
+                expire_scan.pass_scanned++;
+                de = de->next;
+            }
+        }
+        expire_scan.cursor++;
+    }
+}
+
+static void *activeExpireScanThreadMain(void *arg) {
+    UNUSED(arg);
+    redis_set_thread_title("expire_scan");
+    redisSetCpuAffinity(server.server_cpulist);
+
+    pthread_mutex_lock(&expire_scan.mutex);
+    while(1) {
+        /* Wait for the main thread to sleep. If a pass was just completed
+         * or there is no room for more keys, wait for the next sleep. */
+        pthread_cond_wait(&expire_scan.resume_cond,&expire_scan.mutex);
+        while (expire_scan.allowed &&
+               expire_scan.numkeys < ACTIVE_EXPIRE_SCAN_MAX_KEYS &&
+               mstime() >= expire_scan.next_pass)
+        {
+            expire_scan.running = 1;
+            pthread_mutex_unlock(&expire_scan.mutex);
+
+            int gil = moduleCount() != 0;
+            if (gil) moduleAcquireGIL();
+            activeExpireScanStep();
+            if (gil) moduleReleaseGIL();
+
+            pthread_mutex_lock(&expire_scan.mutex);
+            expire_scan.running = 0;
+            pthread_cond_signal(&expire_scan.pause_cond);
+        }
+    }
+    return NULL;
+}
+
+/* Start the expire scan thread, if configured. */
+void initActiveExpireScanThread(void) {
+    if (!server.active_expire_scan_thread) return;
+    if (server.active_expire_index) {
+        serverLog(LL_WARNING,"The expire scan thread is not started since "
+                             "active-expire-index is enabled.");
+        server.active_expire_scan_thread = 0;
+        return;
+    }
+    expire_scan.dbs = zcalloc(sizeof(expireScanDb)*server.dbnum);
+    if (pthread_create(&expire_scan.thread,NULL,
+                       activeExpireScanThreadMain,NULL) != 0)
+    {
+        serverLog(LL_WARNING,"Fatal: Can't initialize the expire scan thread.");
+        exit(1);
+    }
+}
+
+/* Called by beforeSleep(): let the thread scan the keyspace while the main
+ * thread sleeps. Nothing is scanned when keys are not actively expired. */
+void activeExpireScanResume(void) {
+    if (!server.active_expire_scan_thread) return;
+    if (!server.active_expire_enabled || server.masterhost != NULL ||
+        server.loading || clientsArePaused()) return;
+
+    pthread_mutex_lock(&expire_scan.mutex);
+    expire_scan.allowed = 1;
+    pthread_cond_signal(&expire_scan.resume_cond);
+    pthread_mutex_unlock(&expire_scan.mutex);
+}
+
+/* Called by afterSleep(): stop the thread, waiting for the current scan
+ * step to complete, before the main thread modifies the keyspace again. */
+void activeExpireScanPause(void) {
+    if (!server.active_expire_scan_thread) return;
+
+    pthread_mutex_lock(&expire_scan.mutex);
+    expire_scan.allowed = 0;
+    while (expire_scan.running)
+        pthread_cond_wait(&expire_scan.pause_cond,&expire_scan.mutex);
+    pthread_mutex_unlock(&expire_scan.mutex);
+}
+
+/* Reclaim the expired keys of the DB found by the scan thread, propagating
+ * them in batches with a single DEL (or UNLINK). Every key is verified
+ * again, since it may have been deleted or got a new TTL after it was
+ * scanned. Stops when the unix time in microseconds 'deadline' is reached,
+ * leaving the rest of the keys to the next call. Returns the number of
+ * expired keys, and by reference the number of keys scanned in the DB since
+ * the last call. */
+static unsigned long activeExpireReclaimScanned(redisDb *db,
+    long long deadline, unsigned long *sampled)
+{
+    expireScanDb *sdb = expire_scan.dbs+db->id;
+    robj *keys[ACTIVE_EXPIRE_SCAN_BATCH];
+    unsigned long expired = 0;
+    long long now = mstime();
+
+    *sampled = sdb->scanned;
+    sdb->scanned = 0;
+
+    /* Update the average TTL stats for this database, see
+     * activeExpireCycle(). */
+    if (dictSize(db->expires) == 0) {
+        db->avg_ttl = 0;
+    } else if (sdb->ttl_samples) {
+        long long avg_ttl = sdb->ttl_sum/sdb->ttl_samples;
+
+        if (db->avg_ttl == 0) db->avg_ttl = avg_ttl;
+        db->avg_ttl = (db->avg_ttl/50)*49 + (avg_ttl/50);
+    }
+    sdb->ttl_sum = 0;
+    sdb->ttl_samples = 0;
+
+    while (sdb->numkeys && ustime() < deadline) {
+        int numkeys = 0;
+
+        while (sdb->numkeys && numkeys < ACTIVE_EXPIRE_SCAN_BATCH) {
+            sds key = sdb->keys[--sdb->numkeys];
+            dictEntry *de = dictFind(db->expires,key);
+
+            expire_scan.numkeys--;
+            if (de && now > dictGetSignedIntegerVal(de))
+                keys[numkeys++] = createObject(OBJ_STRING,key);
+            else
+                sdsfree(key);
+        }
+        if (numkeys == 0) continue;
+
+        propagateExpires(db,keys,numkeys,server.lazyfree_lazy_expire);
+        for (int j = 0; j < numkeys; j++) {
+            robj *keyobj = keys[j];
+            int deleted = server.lazyfree_lazy_expire ?
+                          dbAsyncDelete(db,keyobj) : dbSyncDelete(db,keyobj);
+
+            if (deleted) {
+                notifyKeyspaceEvent(NOTIFY_EXPIRED,
+                    "expired",keyobj,db->id);
+                signalModifiedKey(NULL,db,keyobj);
+                server.stat_expiredkeys++;
+                expired++;
+            }
+            decrRefCount(keyobj);
+        }
+    }
+    return expired;
+}
+
+/* With active-expire-index the active expire cycle does not sample the
+ * expires dictionary: it visits the expires index of the DB, where keys are
+ * ordered by expire time, and expires up to 'max' keys that are due.
+ * Returns the number of expired keys, and by reference the number of keys
+ * checked, that is, the due ones plus the first key not yet expired
+ * if any. */
+static unsigned long activeExpireFromIndex(redisDb *db, long long now,
+    unsigned long max, unsigned long *sampled)
+{
+    robj **keys = zmalloc(sizeof(robj*)*max);
+    long long *times = zmalloc(sizeof(long long)*max);
+    unsigned long numkeys = 0, expired = 0;
+    raxIterator ri;
+
+    /* Collect the due keys first, since the index can't be modified while
+     * we iterate it. */
+    *sampled = 0;
+    raxStart(&ri,db->expires_index);
+    raxSeek(&ri,"^",NULL,0);
+    while (numkeys < max && raxNext(&ri)) {
+        (*sampled)++;
+        times[numkeys] = expiresIndexKeyTime(ri.key);
+        if (!(now > times[numkeys])) break;
+        keys[numkeys] = createStringObject(
+            (char*)ri.key+EXPIRES_INDEX_PREFIX_LEN,
+            ri.key_len-EXPIRES_INDEX_PREFIX_LEN);
+
+        /* The index must always agree with the expires dict. */
+        dictEntry *de = dictFind(db->expires,keys[numkeys]->ptr);
+        serverAssertWithInfo(NULL,keys[numkeys],
+            de != NULL && dictGetSignedIntegerVal(de) == times[numkeys]);
+        numkeys++;
+    }
+    raxStop(&ri);
+
+    for (unsigned long j = 0; j < numkeys; j++) {
+        dictEntry *de = dictFind(db->expires,keys[j]->ptr);
+
+        /* Expiring the previous keys of the batch may have deleted this one,
+         * or changed its expire, for instance from a module subscribed to
+         * the expired keyspace events. The index was updated as well in
+         * that case, so just skip it. */
+        if (de && dictGetSignedIntegerVal(de) == times[j] &&
+            activeExpireCycleTryExpire(db,de,now)) expired++;
+        decrRefCount(keys[j]);
+    }
+    zfree(keys);
+    zfree(times);
+    return expired;
+}
+
+/* Reclaim the expired fields of the hashes of the DB, see t_hash.c: up to
+ * 'maxkeys' hashes are sampled among the ones in db->volatile_hashes, and
+ * up to 'maxfields' due fields are deleted from each one, in expire time
+ * order thanks to the expires index of the hash. Returns the number of
+ * expired fields. */
+static long activeExpireVolatileHashes(redisDb *db, unsigned long maxkeys,
+                                       long maxfields)
+{
+    long expired = 0;
+
+    for (unsigned long j = 0; j < maxkeys && dictSize(db->volatile_hashes);
+         j++)
+    {
+        dictEntry *de = dictGetRandomKey(db->volatile_hashes);
+        sds key = dictGetKey(de);
+        dictEntry *kde = dictFind(db->dict,key);
+        robj *o = kde ? dictGetVal(kde) : NULL;
+        int keyremoved;
+
+        /* The set is cleaned up lazily, see dbTrackVolatileHash(). */
+        if (o == NULL || !hashTypeHasVolatileFields(o)) {
+            dictDelete(db->volatile_hashes,key);
+            continue;
+        }
+
+        /* If the whole key is expired leave it to the keys expire cycle. */
+        robj *keyobj = createStringObject(key,sdslen(key));
+        if (!keyIsExpired(db,keyobj)) {
+            expired += hashTypeExpireFields(db,keyobj,o,maxfields,
+                                            &keyremoved);
+            if (keyremoved) dictDelete(db->volatile_hashes,keyobj->ptr);
+        }
+        decrRefCount(keyobj);
+    }
+    return expired;
+}
+
 /* Try to expire a few timed out keys. The algorithm used is adaptive and
  * will use few CPU cycles if there are few expiring keys, otherwise
  * it will get more aggressive to avoid that too much memory is used by
@@ -115,6 +457,7 @@ int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
  */
 
 #define ACTIVE_EXPIRE_CYCLE_KEYS_PER_LOOP 20 /* Keys for each DB loop. */
+#define ACTIVE_EXPIRE_CYCLE_FIELDS_PER_KEY 100 /* Hash fields for each key. */
 #define ACTIVE_EXPIRE_CYCLE_FAST_DURATION 1000 /* Microseconds. */
 #define ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC 25 /* Max % of CPU to use. */
 #define ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_STALE 10 /* % of stale keys after which
@@ -203,6 +546,36 @@ void activeExpireCycle(int type) {
          * distribute the time evenly across DBs. */
         current_db++;
 
+        /* Reclaim the expired hash fields first, sampling hashes as long as
+         * the sampled ones had due fields, within the time limit. */
+        if (dictSize(db->volatile_hashes)) {
+            long expired_fields;
+
+            do {
+                expired_fields = activeExpireVolatileHashes(db,
+                    config_keys_per_loop,ACTIVE_EXPIRE_CYCLE_FIELDS_PER_KEY);
+                if (ustime()-start > timelimit) {
+                    timelimit_exit = 1;
+                    server.stat_expired_time_cap_reached_count++;
+                    break;
+                }
+            } while (expired_fields);
+            if (timelimit_exit) break;
+        }
+
+        /* With the scan thread the expired keys were already found in
+         * background: just reclaim them within the time limit. */
+        if (server.active_expire_scan_thread) {
+            expired = activeExpireReclaimScanned(db,start+timelimit,&sampled);
+            total_expired += expired;
+            total_sampled += sampled;
+            if (ustime()-start > timelimit) {
+                timelimit_exit = 1;
+                server.stat_expired_time_cap_reached_count++;
+            }
+            continue;
+        }
+
         /* Continue to expire if at the end of the cycle there are still
          * a big percentage of keys to expire, compared to the number of keys
          * we scanned. The percentage, stored in config_cycle_acceptable_stale
@@ -224,7 +597,7 @@ void activeExpireCycle(int type) {
             /* When there are less than 1% filled slots, sampling the key
              * space is expensive, so stop here waiting for better times...
              * The dictionary will be resized asap. */
-            if (num && slots > DICT_HT_INITIAL_SIZE &&
+            if (!db->expires_index && num && slots > DICT_HT_INITIAL_SIZE &&
                 (num*100/slots < 1)) break;
 
             /* The main collection cycle. Sample random keys among keys
@@ -234,51 +607,66 @@ void activeExpireCycle(int type) {
             ttl_sum = 0;
             ttl_samples = 0;
 
-            if (num > config_keys_per_loop)
-                num = config_keys_per_loop;
-
-            /* Here we access the low level representation of the hash table
-             * for speed concerns: this makes this code coupled with dict.c,
-             * but it hardly changed in ten years.
-             *
-             * Note that certain places of the hash table may be empty,
-             * so we want also a stop condition about the number of
-             * buckets that we scanned. However scanning for free buckets
-             * is very fast: we are in the cache line scanning a sequential
-             * array of NULL pointers, so we can scan a lot more buckets
-             * than keys in the same time. */
-            long max_buckets = num*20;
-            long checked_buckets = 0;
-
-            while (sampled < num && checked_buckets < max_buckets) {
-                for (int table = 0; table < 2; table++) {
-                    if (table == 1 && !dictIsRehashing(db->expires)) break;
-
-                    unsigned long idx = db->expires_cursor;
-                    idx &= db->expires->ht[table].sizemask;
-                    dictEntry *de = db->expires->ht[table].table[idx];
-                    long long ttl;
-
-                    /* Scan the current bucket of the current table. */
-                    checked_buckets++;
-                    while(de) {
-                        /* Get the next entry now since this entry may get
-                         * deleted. */
-                        dictEntry *e = de;
-                        de = de->next;
-
-                        ttl = dictGetSignedIntegerVal(e)-now;
-                        if (activeExpireCycleTryExpire(db,e,now)) expired++;
-                        if (ttl > 0) {
-                            /* We want the average TTL of keys yet
-                             * not expired. */
-                            ttl_sum += ttl;
-                            ttl_samples++;
+            if (db->expires_index) {
+                expired = activeExpireFromIndex(db,now,config_keys_per_loop,
+                                                &sampled);
+
+                /* The index tells nothing about the TTLs of the keys not
+                 * yet expired, so sample one at random for the stats. */
+                dictEntry *de = dictSize(db->expires) ?
+                                dictGetRandomKey(db->expires) : NULL;
+                long long ttl = de ? dictGetSignedIntegerVal(de)-now : 0;
+                if (ttl > 0) {
+                    ttl_sum = ttl;
+                    ttl_samples = 1;
+                }
+            } else {
+                if (num > config_keys_per_loop)
+                    num = config_keys_per_loop;
+
+                /* Here we access the low level representation of the hash table
+                 * for speed concerns: this makes this code coupled with dict.c,
+                 * but it hardly changed in ten years.
+                 *
+                 * Note that certain places of the hash table may be empty,
+                 * so we want also a stop condition about the number of
+                 * buckets that we scanned. However scanning for free buckets
+                 * is very fast: we are in the cache line scanning a sequential
+                 * array of NULL pointers, so we can scan a lot more buckets
+                 * than keys in the same time. */
+                long max_buckets = num*20;
+                long checked_buckets = 0;
+
+                while (sampled < num && checked_buckets < max_buckets) {
+                    for (int table = 0; table < 2; table++) {
+                        if (table == 1 && !dictIsRehashing(db->expires)) break;
+
+                        unsigned long idx = db->expires_cursor;
+                        idx &= db->expires->ht[table].sizemask;
+                        dictEntry *de = db->expires->ht[table].table[idx];
+                        long long ttl;
+
+                        /* Scan the current bucket of the current table. */
+                        checked_buckets++;
+                        while(de) {
+                            /* Get the next entry now since this entry may get
+                             * deleted. */
+                            dictEntry *e = de;
+                            de = de->next;
+
+                            ttl = dictGetSignedIntegerVal(e)-now;
+                            if (activeExpireCycleTryExpire(db,e,now)) expired++;
+                            if (ttl > 0) {
+                                /* We want the average TTL of keys yet
+                                 * not expired. */
+                                ttl_sum += ttl;
+                                ttl_samples++;
+                            }
+                            sampled++;
                         }
-                        sampled++;
                     }
+                    db->expires_cursor++;
                 }
-                db->expires_cursor++;
             }
             total_expired += expired;
             total_sampled += sampled;
@@ -312,8 +700,11 @@ void activeExpireCycle(int type) {
                  (expired*100/sampled) > config_cycle_acceptable_stale);
     }
 
+    if (server.lazyfree_lazy_expire) lazyfreeFlushBatch();
     elapsed = ustime()-start;
     server.stat_expire_cycle_time_used += elapsed;
+    server.stat_expire_cycle_scanned_keys += total_sampled;
+    server.stat_expire_cycle_expired_keys += total_expired;
     latencyAddSampleIfNeeded("expire-cycle",elapsed/1000);
 
     /* Update our estimate of keys existing but yet to be expired.
@@ -229,7 +229,7 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
     size_t origincount = ga->used;
     sds member;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr = NULL;
@@ -242,7 +242,7 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
             return 0;
         }
 
-        sptr = ziplistNext(zl, eptr);
+        sptr = lpNext(zl, eptr);
         while (eptr) {
             score = zzlGetScore(sptr);
 
@@ -250,8 +250,7 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
             if (!zslValueLteMax(score, &range))
                 break;
 
-            /* We know the element exists. ziplistGet should always succeed */
-            ziplistGet(eptr, &vstr, &vlen, &vlong);
+            vstr = lpGetValue(eptr, &vlen, &vlong);
             member = (vstr == NULL) ? sdsfromlonglong(vlong) :
                                       sdsnewlen(vstr,vlen);
             if (geoAppendIfWithinRadius(ga,lon,lat,radius,score,member)
@@ -279,6 +278,27 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
                 == C_ERR) sdsfree(ele);
             ln = ln->level[0].forward;
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtCursor cur;
+        int valid;
+
+        if (!(valid = zbtFirstInRange(zs->zbt, &range, &cur, NULL))) {
+            /* Nothing exists starting at our min.  No results. */
+            return 0;
+        }
+
+        while (valid) {
+            zbtEntry *e = zbtCursorEntry(&cur);
+            /* Abort when the entry is no longer in range. */
+            if (!zslValueLteMax(e->score, &range))
+                break;
+
+            sds ele = sdsdup(e->ele);
+            if (geoAppendIfWithinRadius(ga,lon,lat,radius,e->score,ele)
+                == C_ERR) sdsfree(ele);
+            valid = zbtNext(&cur);
+        }
     }
     return ga->used - origincount;
 }
@@ -638,7 +658,8 @@ void georadiusGeneric(client *c, int flags) {
         size_t maxelelen = 0;
 
         if (returned_items) {
-            zobj = createZsetObject();
+            zobj = ((size_t)returned_items > server.zset_max_skiplist_entries) ?
+                   createZsetBtreeObject() : createZsetObject();
             zs = zobj->ptr;
         }
 
@@ -650,13 +671,17 @@ void georadiusGeneric(client *c, int flags) {
             size_t elelen = sdslen(gp->member);
 
             if (maxelelen < elelen) maxelelen = elelen;
-            znode = zslInsert(zs->zsl,score,gp->member);
-            serverAssert(dictAdd(zs->dict,gp->member,&znode->score) == DICT_OK);
+            if (zobj->encoding == OBJ_ENCODING_BTREE) {
+                zsetBtreeInsert(zs,score,gp->member);
+            } else {
+                znode = zslInsert(zs->zsl,score,gp->member);
+                serverAssert(dictAdd(zs->dict,gp->member,&znode->score) == DICT_OK);
+            }
             gp->member = NULL;
         }
 
         if (returned_items) {
-            zsetConvertToZiplistIfNeeded(zobj,maxelelen);
+            zsetConvertToListpackIfNeeded(zobj,maxelelen);
             setKey(c,c->db,storekey,zobj);
             decrRefCount(zobj);
             notifyKeyspaceEvent(NOTIFY_ZSET,"georadiusstore",storekey,
@@ -41,6 +41,18 @@
 #define INTSET_ENC_INT32 (sizeof(int32_t))
 #define INTSET_ENC_INT64 (sizeof(int64_t))
 
+/* Elements scanned linearly at the end of a binary search. */
+#define INTSET_SEARCH_WINDOW 32
+
+/* The intset contents are little endian, so on x86-64 they can be loaded
+ * directly in SIMD registers. SSE2 is always available there, SSE4.2 and
+ * AVX2 kernels are compiled with a target attribute and selected at run
+ * time. */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define INTSET_X86_KERNELS
+#include <immintrin.h>
+#endif
+
 /* Return the required encoding for the provided value. */
 static uint8_t _intsetValueEncoding(int64_t v) {
     if (v < INT32_MIN || v > INT32_MAX)
@@ -108,23 +120,62 @@ static intset *intsetResize(intset *is, uint32_t len) {
     return is;
 }
 
+/* Count the elements at positions [from,to) that are lower than "value".
+ * Since the intset is sorted, from+count is the position of the first
+ * element not lower than "value". With SSE2 eight (or four) elements are
+ * compared with a single instruction, that is faster than going on with
+ * the binary search once the range fits a couple of cache lines. */
+static uint32_t intsetCountLower(intset *is, uint32_t from, uint32_t to,
+                                 int64_t value)
+{
+    uint32_t encoding = intrev32ifbe(is->encoding);
+    uint32_t count = 0, i = from;
+
+#ifdef INTSET_X86_KERNELS
+    if (encoding == INTSET_ENC_INT16) {
+        const int16_t *p = (int16_t*)is->contents;
+        __m128i v = _mm_set1_epi16((int16_t)value);
+        for (; i+8 <= to; i += 8) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(p+i));
+            count += __builtin_popcount(
+                _mm_movemask_epi8(_mm_cmplt_epi16(x,v)))/2;
+        }
+    } else if (encoding == INTSET_ENC_INT32) {
+        const int32_t *p = (int32_t*)is->contents;
+        __m128i v = _mm_set1_epi32((int32_t)value);
+        for (; i+4 <= to; i += 4) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(p+i));
+            count += __builtin_popcount(
+                _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(x,v))));
+        }
+    }
+#endif
+    for (; i < to; i++) {
+        if (_intsetGetEncoded(is,i,encoding) < value) count++;
+    }
+    return count;
+}
+
 /* Search for the position of "value". Return 1 when the value was found and
  * sets "pos" to the position of the value within the intset. Return 0 when
  * the value is not present in the intset and sets "pos" to the position
- * where "value" can be inserted. */
+ * where "value" can be inserted.
+ *
+ * The range is bisected until it is at most INTSET_SEARCH_WINDOW elements
+ * long, then the position is found by intsetCountLower(). */
 static uint8_t intsetSearch(intset *is, int64_t value, uint32_t *pos) {
-    int min = 0, max = intrev32ifbe(is->length)-1, mid = -1;
-    int64_t cur = -1;
+    uint32_t len = intrev32ifbe(is->length);
+    uint32_t min = 0, max, mid;
 
     /* The value can never be found when the set is empty */
-    if (intrev32ifbe(is->length) == 0) {
+    if (len == 0) {
         if (pos) *pos = 0;
         return 0;
     } else {
         /* Check for the case where we know we cannot find the value,
          * but do know the insert position. */
-        if (value > _intsetGet(is,max)) {
-            if (pos) *pos = intrev32ifbe(is->length);
+        if (value > _intsetGet(is,len-1)) {
+            if (pos) *pos = len;
             return 0;
         } else if (value < _intsetGet(is,0)) {
             if (pos) *pos = 0;
@@ -132,25 +183,18 @@ static uint8_t intsetSearch(intset *is, int64_t value, uint32_t *pos) {
         }
     }
 
-    while(max >= min) {
-        mid = ((unsigned int)min + (unsigned int)max) >> 1;
-        cur = _intsetGet(is,mid);
-        if (value > cur) {
+    /* The first element not lower than "value" is at [min,max]. */
+    max = len-1;
+    while (max-min > INTSET_SEARCH_WINDOW) {
+        mid = min+(max-min)/2;
+        if (_intsetGet(is,mid) < value)
             min = mid+1;
-        } else if (value < cur) {
-            max = mid-1;
-        } else {
-            break;
-        }
-    }
-
-    if (value == cur) {
-        if (pos) *pos = mid;
-        return 1;
-    } else {
-        if (pos) *pos = min;
-        return 0;
+        else
+            max = mid;
     }
+    mid = min+intsetCountLower(is,min,max,value);
+    if (pos) *pos = mid;
+    return _intsetGet(is,mid) == value;
 }
 
 /* Upgrades the intset to a larger encoding and inserts the given integer. */
@@ -281,6 +325,282 @@ size_t intsetBlobLen(intset *is) {
     return sizeof(intset)+intrev32ifbe(is->length)*intrev32ifbe(is->encoding);
 }
 
+/* -------------------------- Operations between intsets -------------------- */
+
+/* Intersection of sets with sizes ratio above this are computed looking up
+ * the elements of the smaller set in the bigger one. */
+#define INTSET_GALLOP_RATIO 32
+
+/* Create an intset with room for "len" elements of the given encoding. The
+ * caller writes the elements, then sets the final length with intsetTrim(). */
+static intset *intsetCreateEncoded(uint32_t encoding, uint32_t len) {
+    intset *is = zmalloc(sizeof(intset)+(size_t)len*encoding);
+    is->encoding = intrev32ifbe(encoding);
+    is->length = 0;
+    return is;
+}
+
+/* Set the length of an intset created by intsetCreateEncoded(), releasing
+ * the space not used. */
+static intset *intsetTrim(intset *is, uint32_t len) {
+    is->length = intrev32ifbe(len);
+    return intsetResize(is,len);
+}
+
+/* Return the position of the first element not lower than "value", starting
+ * the search from the position "from". The step is doubled until such an
+ * element is found, then the last step is bisected, so the cost is
+ * logarithmic in the distance from "from" instead of in the intset size. */
+static uint32_t intsetGallop(intset *is, uint32_t from, int64_t value) {
+    uint32_t len = intrev32ifbe(is->length);
+    uint32_t encoding = intrev32ifbe(is->encoding);
+    uint32_t lo = from, hi, mid, step = 1;
+
+    if (lo >= len || _intsetGetEncoded(is,lo,encoding) >= value) return lo;
+    while (lo+step < len && _intsetGetEncoded(is,lo+step,encoding) < value) {
+        lo += step;
+        step <<= 1;
+    }
+
+    /* The element is now at (lo,hi], or it is not found if hi == len. */
+    hi = lo+step < len ? lo+step : len;
+    lo++;
+    while (lo < hi) {
+        mid = lo+(hi-lo)/2;
+        if (_intsetGetEncoded(is,mid,encoding) < value)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+#ifdef INTSET_X86_KERNELS
+/* The intersection kernels below compare a block of elements of "a" with a
+ * block of elements of "b", all against all, rotating the block of "b" in
+ * its register. The elements of "a" that matched are stored in "out", then
+ * the block with the lower last element is replaced by the next one (or both
+ * if the last elements are the same). Only full blocks are processed: the
+ * positions reached are stored in *ai and *bi so that the caller can finish
+ * the job, and the number of elements stored is returned. */
+
+/* Store the elements of "a" selected by "mask" in "out". */
+#define INTSET_EMIT_MATCHES(out,k,a,mask) do { \
+    while (mask) { \
+        (out)[(k)++] = (a)[__builtin_ctz(mask)]; \
+        (mask) &= (mask)-1; \
+    } \
+} while(0)
+
+static uint32_t intsetIntersect32SSE2(const int32_t *a, uint32_t alen,
+    const int32_t *b, uint32_t blen, int32_t *out, uint32_t *ai, uint32_t *bi)
+{
+    uint32_t i = 0, j = 0, k = 0;
+
+    while (i+4 <= alen && j+4 <= blen) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a+i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b+j));
+        __m128i eq = _mm_or_si128(
+            _mm_or_si128(
+                _mm_cmpeq_epi32(va,vb),
+                _mm_cmpeq_epi32(va,_mm_shuffle_epi32(vb,_MM_SHUFFLE(0,3,2,1)))),
+            _mm_or_si128(
+                _mm_cmpeq_epi32(va,_mm_shuffle_epi32(vb,_MM_SHUFFLE(1,0,3,2))),
+                _mm_cmpeq_epi32(va,_mm_shuffle_epi32(vb,_MM_SHUFFLE(2,1,0,3)))));
+        unsigned int mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+        int32_t amax = a[i+3], bmax = b[j+3];
+
+        INTSET_EMIT_MATCHES(out,k,a+i,mask);
+        if (amax <= bmax) i += 4;
+        if (bmax <= amax) j += 4;
+    }
+    *ai = i;
+    *bi = j;
+    return k;
+}
+
+__attribute__((target("avx2")))
+static uint32_t intsetIntersect32AVX2(const int32_t *a, uint32_t alen,
+    const int32_t *b, uint32_t blen, int32_t *out, uint32_t *ai, uint32_t *bi)
+{
+    const __m256i rotate = _mm256_set_epi32(0,7,6,5,4,3,2,1);
+    uint32_t i = 0, j = 0, k = 0;
+
+    while (i+8 <= alen && j+8 <= blen) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a+i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(b+j));
+        __m256i eq = _mm256_cmpeq_epi32(va,vb);
+        for (int r = 1; r < 8; r++) {
+            vb = _mm256_permutevar8x32_epi32(vb,rotate);
+            eq = _mm256_or_si256(eq,_mm256_cmpeq_epi32(va,vb));
+        }
+        unsigned int mask = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+        int32_t amax = a[i+7], bmax = b[j+7];
+
+        INTSET_EMIT_MATCHES(out,k,a+i,mask);
+        if (amax <= bmax) i += 8;
+        if (bmax <= amax) j += 8;
+    }
+    *ai = i;
+    *bi = j;
+    return k;
+}
+
+/* With 16 bit elements PCMPESTRM compares 8 elements against 8 elements with
+ * a single instruction. */
+__attribute__((target("sse4.2")))
+static uint32_t intsetIntersect16SSE42(const int16_t *a, uint32_t alen,
+    const int16_t *b, uint32_t blen, int16_t *out, uint32_t *ai, uint32_t *bi)
+{
+    uint32_t i = 0, j = 0, k = 0;
+
+    while (i+8 <= alen && j+8 <= blen) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a+i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b+j));
+        __m128i eq = _mm_cmpestrm(vb,8,va,8,
+            _SIDD_SWORD_OPS|_SIDD_CMP_EQUAL_ANY|_SIDD_BIT_MASK);
+        unsigned int mask = _mm_cvtsi128_si32(eq);
+        int16_t amax = a[i+7], bmax = b[j+7];
+
+        INTSET_EMIT_MATCHES(out,k,a+i,mask);
+        if (amax <= bmax) i += 8;
+        if (bmax <= amax) j += 8;
+    }
+    *ai = i;
+    *bi = j;
+    return k;
+}
+
+/* Intersect the full blocks of "a" and "b", that have the same encoding,
+ * storing the result in "r". Return the number of elements stored, and the
+ * positions reached in *ai and *bi. */
+static uint32_t intsetIntersectBlocks(intset *a, intset *b, intset *r,
+                                      uint32_t *ai, uint32_t *bi)
+{
+    uint32_t encoding = intrev32ifbe(a->encoding);
+    uint32_t alen = intrev32ifbe(a->length), blen = intrev32ifbe(b->length);
+
+    if (encoding == INTSET_ENC_INT32) {
+        if (__builtin_cpu_supports("avx2"))
+            return intsetIntersect32AVX2((int32_t*)a->contents,alen,
+                (int32_t*)b->contents,blen,(int32_t*)r->contents,ai,bi);
+        return intsetIntersect32SSE2((int32_t*)a->contents,alen,
+            (int32_t*)b->contents,blen,(int32_t*)r->contents,ai,bi);
+    } else if (encoding == INTSET_ENC_INT16 &&
+               __builtin_cpu_supports("sse4.2"))
+    {
+        return intsetIntersect16SSE42((int16_t*)a->contents,alen,
+            (int16_t*)b->contents,blen,(int16_t*)r->contents,ai,bi);
+    }
+    return 0;
+}
+#endif
+
+/* Return a new intset with the elements both in "a" and "b". */
+intset *intsetIntersect(intset *a, intset *b) {
+    uint32_t i = 0, j = 0, k = 0, alen, blen, aenc, benc;
+    intset *r;
+
+    /* Make "a" the smaller set. */
+    if (intrev32ifbe(a->length) > intrev32ifbe(b->length)) {
+        intset *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    alen = intrev32ifbe(a->length);
+    blen = intrev32ifbe(b->length);
+    aenc = intrev32ifbe(a->encoding);
+    benc = intrev32ifbe(b->encoding);
+
+    /* The elements in common fit the smaller encoding. */
+    r = intsetCreateEncoded(aenc < benc ? aenc : benc,alen);
+    if (alen == 0) return intsetTrim(r,0);
+
+    if (blen/alen >= INTSET_GALLOP_RATIO) {
+        for (i = 0; i < alen && j < blen; i++) {
+            int64_t value = _intsetGetEncoded(a,i,aenc);
+            j = intsetGallop(b,j,value);
+            if (j < blen && _intsetGetEncoded(b,j,benc) == value)
+                _intsetSet(r,k++,value);
+        }
+        return intsetTrim(r,k);
+    }
+
+#ifdef INTSET_X86_KERNELS
+    if (aenc == benc) k = intsetIntersectBlocks(a,b,r,&i,&j);
+#endif
+    while (i < alen && j < blen) {
+        int64_t va = _intsetGetEncoded(a,i,aenc);
+        int64_t vb = _intsetGetEncoded(b,j,benc);
+        if (va < vb) {
+            i++;
+        } else if (va > vb) {
+            j++;
+        } else {
+            _intsetSet(r,k++,va);
+            i++;
+            j++;
+        }
+    }
+    return intsetTrim(r,k);
+}
+
+/* Return a new intset with the elements in "a", "b" or both. */
+intset *intsetUnion(intset *a, intset *b) {
+    uint32_t i = 0, j = 0, k = 0;
+    uint32_t alen = intrev32ifbe(a->length), blen = intrev32ifbe(b->length);
+    uint32_t aenc = intrev32ifbe(a->encoding), benc = intrev32ifbe(b->encoding);
+    intset *r = intsetCreateEncoded(aenc > benc ? aenc : benc,alen+blen);
+
+    while (i < alen && j < blen) {
+        int64_t va = _intsetGetEncoded(a,i,aenc);
+        int64_t vb = _intsetGetEncoded(b,j,benc);
+        if (va < vb) {
+            _intsetSet(r,k++,va);
+            i++;
+        } else if (va > vb) {
+            _intsetSet(r,k++,vb);
+            j++;
+        } else {
+            _intsetSet(r,k++,va);
+            i++;
+            j++;
+        }
+    }
+    while (i < alen) _intsetSet(r,k++,_intsetGetEncoded(a,i++,aenc));
+    while (j < blen) _intsetSet(r,k++,_intsetGetEncoded(b,j++,benc));
+    return intsetTrim(r,k);
+}
+
+/* Return a new intset with the elements in "a" that are not in "b". */
+intset *intsetDifference(intset *a, intset *b) {
+    uint32_t i = 0, j = 0, k = 0;
+    uint32_t alen = intrev32ifbe(a->length), blen = intrev32ifbe(b->length);
+    uint32_t aenc = intrev32ifbe(a->encoding), benc = intrev32ifbe(b->encoding);
+    intset *r = intsetCreateEncoded(aenc,alen);
+    int gallop = alen && blen/alen >= INTSET_GALLOP_RATIO;
+
+    while (i < alen && j < blen) {
+        int64_t va = _intsetGetEncoded(a,i,aenc);
+        int64_t vb;
+
+        if (gallop) j = intsetGallop(b,j,va);
+        if (j == blen) break;
+        vb = _intsetGetEncoded(b,j,benc);
+        if (va < vb) {
+            _intsetSet(r,k++,va);
+            i++;
+        } else if (va > vb) {
+            j++;
+        } else {
+            i++;
+            j++;
+        }
+    }
+    while (i < alen) _intsetSet(r,k++,_intsetGetEncoded(a,i++,aenc));
+    return intsetTrim(r,k);
+}
+
 #ifdef REDIS_TEST
 #include <sys/time.h>
 #include <time.h>
@@ -487,6 +807,67 @@ int intsetTest(int argc, char **argv) {
         ok();
     }
 
+    printf("Intersection, union and difference: "); {
+        int bits[] = {8, 15, 20, 30, 0};
+        int sizes[] = {0, 1, 7, 100, 5000};
+
+        for (int x = 0; x < 25; x++) {
+            for (int y = 0; y < 25; y++) {
+                intset *a = createSet(bits[x%5] ? bits[x%5] : 20,sizes[x/5]);
+                intset *b = createSet(bits[y%5] ? bits[y%5] : 20,sizes[y/5]);
+                int64_t v;
+
+                /* Upgrade to 64 bit encoding. */
+                if (!bits[x%5]) a = intsetAdd(a,(int64_t)1<<40,NULL);
+                if (!bits[y%5]) b = intsetAdd(b,-((int64_t)1<<40),NULL);
+                intset *inter = intsetIntersect(a,b);
+                intset *uni = intsetUnion(a,b);
+                intset *diff = intsetDifference(a,b);
+                uint32_t expected_inter = 0, expected_diff = 0;
+
+                for (uint32_t j = 0; intsetGet(a,j,&v); j++) {
+                    if (intsetFind(b,v)) {
+                        expected_inter++;
+                        assert(intsetFind(inter,v) && !intsetFind(diff,v));
+                    } else {
+                        expected_diff++;
+                        assert(!intsetFind(inter,v) && intsetFind(diff,v));
+                    }
+                    assert(intsetFind(uni,v));
+                }
+                for (uint32_t j = 0; intsetGet(b,j,&v); j++)
+                    assert(intsetFind(uni,v));
+                assert(intsetLen(inter) == expected_inter);
+                assert(intsetLen(diff) == expected_diff);
+                assert(intsetLen(uni) ==
+                       intsetLen(a)+intsetLen(b)-expected_inter);
+                if (intsetLen(inter) > 1) checkConsistency(inter);
+                if (intsetLen(uni) > 1) checkConsistency(uni);
+                if (intsetLen(diff) > 1) checkConsistency(diff);
+                zfree(a);
+                zfree(b);
+                zfree(inter);
+                zfree(uni);
+                zfree(diff);
+            }
+        }
+        ok();
+    }
+
+    printf("Stress intersections: "); {
+        int num = 1000, size = 10000;
+        long long start;
+        intset *a = createSet(16,size), *b = createSet(16,size);
+        intset *c = createSet(24,size), *d = createSet(24,size);
+
+        start = usec();
+        for (int i = 0; i < num; i++) zfree(intsetIntersect(a,b));
+        printf("%d int16 intersections, %lldusec, ",num,usec()-start);
+        start = usec();
+        for (int i = 0; i < num; i++) zfree(intsetIntersect(c,d));
+        printf("%d int32 intersections, %lldusec\n",num,usec()-start);
+    }
+
     return 0;
 }
 #endif
@@ -6,13 +6,68 @@
 static size_t lazyfree_objects = 0;
 pthread_mutex_t lazyfree_objects_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* What we release in the background is not handed to the lazyfree thread
+ * one item at a time: items are queued by the main thread in a batch, that
+ * is submitted as a single BIO_LAZY_FREE job when it is full, or when the
+ * caller is done deleting (see lazyfreeFlushBatch()), and anyway before
+ * returning to the event loop. This way deleting many keys, for instance
+ * in an eviction storm, does not take the bio lock for every key. */
+#define LAZYFREE_BATCH_SIZE 1024
+
+#define LAZYFREE_ITEM_OBJECT 0      /* ptr1 is an object. */
+#define LAZYFREE_ITEM_DATABASE 1    /* ptr1 and ptr2 are the DB dicts. */
+#define LAZYFREE_ITEM_RAX 2         /* ptr1 is a radix tree. */
+
+typedef struct lazyfreeItem {
+    int type;
+    void *ptr1, *ptr2;
+    size_t objects;     /* Objects accounted for the item. */
+} lazyfreeItem;
+
+typedef struct lazyfreeBatch {
+    size_t count;       /* Number of items in the batch. */
+    size_t objects;     /* Objects released by the batch, for the stats. */
+    lazyfreeItem items[LAZYFREE_BATCH_SIZE];
+} lazyfreeBatch;
+
+static lazyfreeBatch *lazyfree_batch = NULL; /* Batch being filled. */
+
 /* Return the number of currently pending objects to free. */
 size_t lazyfreeGetPendingObjectsCount(void) {
     size_t aux;
     atomicGet(lazyfree_objects,aux);
+    if (lazyfree_batch) aux += lazyfree_batch->objects;
     return aux;
 }
 
+/* Submit the current batch to the lazyfree thread, if not empty. */
+void lazyfreeFlushBatch(void) {
+    lazyfreeBatch *b = lazyfree_batch;
+
+    if (b == NULL) return;
+    lazyfree_batch = NULL;
+    atomicIncr(lazyfree_objects,b->objects);
+    bioCreateBackgroundJob(BIO_LAZY_FREE,b,NULL,NULL);
+}
+
+/* Queue an item to release in the background. 'objects' is the number of
+ * objects the item accounts for in lazyfreeGetPendingObjectsCount(). */
+static void lazyfreeBatchAdd(int type, void *ptr1, void *ptr2, size_t objects) {
+    if (lazyfree_batch == NULL) {
+        lazyfree_batch = zmalloc(sizeof(lazyfreeBatch));
+        lazyfree_batch->count = 0;
+        lazyfree_batch->objects = 0;
+    }
+
+    lazyfreeItem *item = lazyfree_batch->items+lazyfree_batch->count++;
+    item->type = type;
+    item->ptr1 = ptr1;
+    item->ptr2 = ptr2;
+    item->objects = objects;
+    lazyfree_batch->objects += objects;
+    if (lazyfree_batch->count == LAZYFREE_BATCH_SIZE) lazyfreeFlushBatch();
+}
+
 /* Return the amount of work needed in order to free an object.
  * The return value is not always the actual number of allocations the
  * object is composed of, but a number proportional to it.
@@ -38,6 +93,9 @@ size_t lazyfreeGetFreeEffort(robj *obj) {
     } else if (obj->type == OBJ_ZSET && obj->encoding == OBJ_ENCODING_SKIPLIST){
         zset *zs = obj->ptr;
         return zs->zsl->length;
+    } else if (obj->type == OBJ_ZSET && obj->encoding == OBJ_ENCODING_BTREE){
+        zset *zs = obj->ptr;
+        return zs->zbt->length;
     } else if (obj->type == OBJ_HASH && obj->encoding == OBJ_ENCODING_HT) {
         dict *ht = obj->ptr;
         return dictSize(ht);
@@ -76,9 +134,11 @@ size_t lazyfreeGetFreeEffort(robj *obj) {
  * will be reclaimed in a different bio.c thread. */
 #define LAZYFREE_THRESHOLD 64
 int dbAsyncDelete(redisDb *db, robj *key) {
+    if (server.snapshot_in_progress) snapshotBeforeWrite(db,key->ptr);
+
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
+    dbDeleteExpire(db,key->ptr);
 
     /* If the value is composed of a few allocations, to free in a lazy way
      * is actually just slower... So under a certain limit we just free
@@ -97,8 +157,7 @@ int dbAsyncDelete(redisDb *db, robj *key) {
          * through and reach the dictFreeUnlinkedEntry() call, that will be
          * equivalent to just calling decrRefCount(). */
         if (free_effort > LAZYFREE_THRESHOLD && val->refcount == 1) {
-            atomicIncr(lazyfree_objects,1);
-            bioCreateBackgroundJob(BIO_LAZY_FREE,val,NULL,NULL);
+            lazyfreeBatchAdd(LAZYFREE_ITEM_OBJECT,val,NULL,1);
             dictSetVal(db->dict,de,NULL);
         }
     }
@@ -118,8 +177,7 @@ int dbAsyncDelete(redisDb *db, robj *key) {
 void freeObjAsync(robj *o) {
     size_t free_effort = lazyfreeGetFreeEffort(o);
     if (free_effort > LAZYFREE_THRESHOLD && o->refcount == 1) {
-        atomicIncr(lazyfree_objects,1);
-        bioCreateBackgroundJob(BIO_LAZY_FREE,o,NULL,NULL);
+        lazyfreeBatchAdd(LAZYFREE_ITEM_OBJECT,o,NULL,1);
     } else {
         decrRefCount(o);
     }
@@ -132,37 +190,220 @@ void emptyDbAsync(redisDb *db) {
     dict *oldht1 = db->dict, *oldht2 = db->expires;
     db->dict = dictCreate(&dbDictType,NULL);
     db->expires = dictCreate(&keyptrDictType,NULL);
-    atomicIncr(lazyfree_objects,dictSize(oldht1));
-    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,oldht1,oldht2);
+    lazyfreeBatchAdd(LAZYFREE_ITEM_DATABASE,oldht1,oldht2,dictSize(oldht1));
+    if (db->expires_index) {
+        lazyfreeBatchAdd(LAZYFREE_ITEM_RAX,db->expires_index,NULL,0);
+        db->expires_index = raxNew();
+    }
 }
 
 /* Release the radix tree mapping Redis Cluster keys to slots asynchronously. */
 void freeSlotsToKeysMapAsync(rax *rt) {
-    atomicIncr(lazyfree_objects,rt->numele);
-    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,NULL,rt);
+    lazyfreeBatchAdd(LAZYFREE_ITEM_RAX,rt,NULL,rt->numele);
 }
 
-/* Release objects from the lazyfree thread. It's just decrRefCount()
- * updating the count of objects to release. */
-void lazyfreeFreeObjectFromBioThread(robj *o) {
-    decrRefCount(o);
-    atomicDecr(lazyfree_objects,1);
+/* When there are multiple lazyfree threads (see the lazyfree-threads option)
+ * the hash tables and skiplists of large objects and databases are not
+ * released by the thread that finds them in a batch: they are split into
+ * ranges of buckets, or of skiplist nodes, that are submitted as jobs of
+ * their own, so that all the threads release them in parallel. The thread
+ * releasing the last range releases what remains of the object or database,
+ * that is, the empty tables and the object itself. */
+#define LAZYFREE_SPLIT_MIN_ITEMS 65536
+
+typedef struct lazyfreeSplit {
+    lazyfreeItem item;  /* The object or database to release. */
+    int ranges;         /* Number of ranges not yet released. */
+} lazyfreeSplit;
+
+typedef struct lazyfreeRange {
+    lazyfreeSplit *split;
+    /* Either the buckets from 'start' to 'end' (excluded) of a table of the
+     * dict 'd', or the skiplist nodes from 'from' to 'to' (excluded). */
+    dict *d;
+    int table;
+    unsigned long start, end;
+    zskiplistNode *from, *to;
+} lazyfreeRange;
+
+static pthread_mutex_t lazyfree_split_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank);
+
+/* Split the tables of the dict 'd' into about 'parts' ranges of buckets,
+ * appending them to the 'ranges' array. Returns the number of ranges. */
+static int lazyfreeSplitDict(lazyfreeSplit *split, dict *d, int parts,
+                             lazyfreeRange **ranges)
+{
+    int count = 0;
+
+    for (int table = 0; table <= 1; table++) {
+        unsigned long size = d->ht[table].size, step;
+
+        if (size == 0) continue;
+        step = (size+parts-1)/parts;
+        for (unsigned long start = 0; start < size; start += step) {
+            lazyfreeRange *r = zcalloc(sizeof(*r));
+            r->split = split;
+            r->d = d;
+            r->table = table;
+            r->start = start;
+            r->end = start+step;
+            ranges[count++] = r;
+        }
+    }
+    return count;
 }
 
-/* Release a database from the lazyfree thread. The 'db' pointer is the
- * database which was substituted with a fresh one in the main thread
- * when the database was logically deleted. */
-void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2) {
-    size_t numkeys = dictSize(ht1);
-    dictRelease(ht1);
-    dictRelease(ht2);
-    atomicDecr(lazyfree_objects,numkeys);
+/* Split the nodes of the skiplist 'zsl' into 'parts' ranges, appending them
+ * to the 'ranges' array. Returns the number of ranges. */
+static int lazyfreeSplitSkiplist(lazyfreeSplit *split, zskiplist *zsl,
+                                 int parts, lazyfreeRange **ranges)
+{
+    unsigned long len = zsl->length;
+    int count = 0;
+
+    for (int j = 0; j < parts; j++) {
+        lazyfreeRange *r = zcalloc(sizeof(*r));
+        r->split = split;
+        r->from = zslGetElementByRank(zsl,1+len*j/parts);
+        if (count) ranges[count-1]->to = r->from;
+        ranges[count++] = r;
+    }
+    return count;
 }
 
-/* Release the radix tree mapping Redis Cluster keys to slots in the
- * lazyfree thread. */
-void lazyfreeFreeSlotsMapFromBioThread(rax *rt) {
-    size_t len = rt->numele;
-    raxFree(rt);
-    atomicDecr(lazyfree_objects,len);
+/* If the item is large enough, split it into ranges and submit them to the
+ * lazyfree threads, returning 1. Otherwise 0 is returned, and the item must
+ * be released by the caller. */
+static int lazyfreeSplitItem(lazyfreeItem *item) {
+    int parts = server.lazyfree_threads, count = 0;
+    dict *d1 = NULL, *d2 = NULL;
+    zskiplist *zsl = NULL;
+
+    if (parts <= 1) return 0;
+    if (item->type == LAZYFREE_ITEM_OBJECT) {
+        robj *o = item->ptr1;
+
+        if (lazyfreeGetFreeEffort(o) < LAZYFREE_SPLIT_MIN_ITEMS) return 0;
+        if ((o->type == OBJ_SET || o->type == OBJ_HASH) &&
+            o->encoding == OBJ_ENCODING_HT)
+        {
+            d1 = o->ptr;
+        } else if (o->type == OBJ_ZSET &&
+                   o->encoding == OBJ_ENCODING_SKIPLIST)
+        {
+            zset *zs = o->ptr;
+            d1 = zs->dict;
+            zsl = zs->zsl;
+        } else {
+            return 0;
+        }
+    } else if (item->type == LAZYFREE_ITEM_DATABASE) {
+        if (dictSize((dict*)item->ptr1) < LAZYFREE_SPLIT_MIN_ITEMS) return 0;
+        d1 = item->ptr1;
+        d2 = item->ptr2;
+    } else {
+        return 0;
+    }
+
+    /* Create all the ranges before submitting them, since the split may be
+     * finished by another thread as soon as its ranges are submitted. */
+    lazyfreeSplit *split = zmalloc(sizeof(*split));
+    lazyfreeRange *ranges[BIO_MAX_THREADS_PER_OP*5];
+    split->item = *item;
+    count += lazyfreeSplitDict(split,d1,parts,ranges+count);
+    if (d2) count += lazyfreeSplitDict(split,d2,parts,ranges+count);
+    if (zsl) count += lazyfreeSplitSkiplist(split,zsl,parts,ranges+count);
+    split->ranges = count;
+    for (int j = 0; j < count; j++)
+        bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,ranges[j],NULL);
+    return 1;
+}
+
+/* Release what remains of a split object or database once all its ranges
+ * were released. */
+static void lazyfreeFinishSplit(lazyfreeSplit *split) {
+    lazyfreeItem *item = &split->item;
+
+    if (item->type == LAZYFREE_ITEM_OBJECT) {
+        robj *o = item->ptr1;
+
+        if (o->type == OBJ_ZSET) {
+            zset *zs = o->ptr;
+            dictSetEmptied(zs->dict);
+            zs->zsl->header->level[0].forward = NULL;
+        } else {
+            dictSetEmptied(o->ptr);
+        }
+        decrRefCount(o);
+        atomicDecr(lazyfree_objects,item->objects);
+    } else {
+        /* The objects of a database are accounted as the keys are
+         * released by lazyfreeFreeRangeFromBioThread(). */
+        dictSetEmptied(item->ptr1);
+        dictSetEmptied(item->ptr2);
+        dictRelease(item->ptr1);
+        dictRelease(item->ptr2);
+    }
+    zfree(split);
+}
+
+/* Release a range of a split object or database from a lazyfree thread. */
+void lazyfreeFreeRangeFromBioThread(void *range) {
+    lazyfreeRange *r = range;
+    lazyfreeSplit *split = r->split;
+    int last;
+
+    if (r->d) {
+        unsigned long freed = dictFreeBucketRange(r->d,r->table,r->start,r->end);
+        if (split->item.type == LAZYFREE_ITEM_DATABASE &&
+            r->d == split->item.ptr1)
+        {
+            atomicDecr(lazyfree_objects,freed);
+        }
+    } else {
+        zskiplistNode *node = r->from, *next;
+        while (node != r->to) {
+            next = node->level[0].forward;
+            zslFreeNode(node);
+            node = next;
+        }
+    }
+    zfree(r);
+
+    pthread_mutex_lock(&lazyfree_split_mutex);
+    last = --split->ranges == 0;
+    pthread_mutex_unlock(&lazyfree_split_mutex);
+    if (last) lazyfreeFinishSplit(split);
+}
+
+/* Release a batch of items from the lazyfree thread, updating the count of
+ * objects to release once the whole batch is released.
+ *
+ * Objects are just released with decrRefCount(). Databases are the dicts
+ * which were substituted with fresh ones in the main thread when the
+ * database was logically deleted. Radix trees are the ones mapping Redis
+ * Cluster keys to slots, or the expires indexes. Large objects and
+ * databases may be split and released in parallel instead, in that case
+ * they are accounted as they are released. */
+void lazyfreeFreeBatchFromBioThread(void *batch) {
+    lazyfreeBatch *b = batch;
+    size_t objects = b->objects;
+
+    for (size_t j = 0; j < b->count; j++) {
+        lazyfreeItem *item = b->items+j;
+        if (lazyfreeSplitItem(item)) {
+            objects -= item->objects;
+        } else if (item->type == LAZYFREE_ITEM_OBJECT) {
+            decrRefCount(item->ptr1);
+        } else if (item->type == LAZYFREE_ITEM_DATABASE) {
+            dictRelease(item->ptr1);
+            dictRelease(item->ptr2);
+        } else if (item->type == LAZYFREE_ITEM_RAX) {
+            raxFree(item->ptr1);
+        }
+    }
+    atomicDecr(lazyfree_objects,objects);
+    zfree(b);
 }
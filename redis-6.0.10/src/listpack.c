@@ -747,6 +747,101 @@ unsigned char *lpDelete(unsigned char *lp, unsigned char *p, unsigned char **new
     return lpInsert(lp,NULL,0,p,LP_REPLACE,newp);
 }
 
+/* Remove 'num' elements starting from the element pointed by 'p', and
+ * return the resulting listpack. The elements are removed with a single
+ * memmove(), instead of moving the tail of the listpack once for every
+ * element. */
+unsigned char *lpDeleteRangeWithEntry(unsigned char *lp, unsigned char *p, unsigned long num) {
+    unsigned char *tail = p;
+    unsigned long deleted = 0;
+    uint64_t bytes = lpGetTotalBytes(lp);
+
+    while (tail[0] != LP_EOF && deleted < num) {
+        tail = lpSkip(tail);
+        deleted++;
+    }
+    if (deleted == 0) return lp;
+
+    /* Move the rest of the listpack, EOF byte included, over the deleted
+     * elements. */
+    memmove(p,tail,(lp+bytes)-tail);
+    bytes -= tail-p;
+    lpSetTotalBytes(lp,bytes);
+    uint32_t numele = lpGetNumElements(lp);
+    if (numele != LP_HDR_NUMELE_UNKNOWN)
+        lpSetNumElements(lp,numele-deleted);
+    return lp_realloc(lp,bytes);
+}
+
+/* Like lpDeleteRangeWithEntry(), but the first element to remove is
+ * specified by its index, with the same semantics of lpSeek(). */
+unsigned char *lpDeleteRange(unsigned char *lp, long index, unsigned long num) {
+    unsigned char *p = lpSeek(lp,index);
+
+    if (p == NULL) return lp;
+    return lpDeleteRangeWithEntry(lp,p,num);
+}
+
+/* Return the element pointed by 'p' like ziplistGet() does: if it is a
+ * string, a pointer to the string is returned and its length is set by
+ * reference in 'slen'. Otherwise NULL is returned and the integer value is
+ * set by reference in 'lval'. */
+unsigned char *lpGetValue(unsigned char *p, unsigned int *slen, long long *lval) {
+    unsigned char *vstr;
+    int64_t count;
+
+    vstr = lpGet(p,&count,NULL);
+    if (vstr)
+        *slen = count;
+    else
+        *lval = count;
+    return vstr;
+}
+
+/* Return 1 if the element pointed by 'p' is equal to the string 's' of
+ * length 'slen', 0 otherwise. */
+int lpCompare(unsigned char *p, unsigned char *s, uint32_t slen) {
+    unsigned char buf[LP_INTBUF_SIZE], *value;
+    int64_t count;
+
+    value = lpGet(p,&count,buf);
+    return count == slen && memcmp(value,s,slen) == 0;
+}
+
+/* Find the element equal to the string 's' of length 'slen', starting from
+ * the element pointed by 'p', and return its pointer, or NULL if there is
+ * no such element. 'skip' elements are skipped between every compared
+ * element, so that only the keys of a listpack of key/value pairs can be
+ * searched passing 1. Strings that can be represented as integers are
+ * always stored as integers (see lpEncodeGetType()), so integer elements
+ * are compared as integers, and the other elements with memcmp(), without
+ * converting them. */
+unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s,
+                      uint32_t slen, unsigned int skip)
+{
+    int64_t sval, count;
+    int sint = lpStringToInt64((const char*)s,slen,&sval);
+    unsigned int skipcnt = 0;
+    unsigned char *ele;
+
+    while (p) {
+        if (skipcnt == 0) {
+            ele = lpGet(p,&count,NULL);
+            if (ele == NULL) {
+                if (sint && count == sval) return p;
+            } else {
+                if (!sint && count == slen && memcmp(ele,s,slen) == 0)
+                    return p;
+            }
+            skipcnt = skip;
+        } else {
+            skipcnt--;
+        }
+        p = lpNext(lp,p);
+    }
+    return NULL;
+}
+
 /* Return the total number of bytes the listpack is composed of. */
 uint32_t lpBytes(unsigned char *lp) {
     return lpGetTotalBytes(lp);
@@ -801,3 +896,50 @@ unsigned char *lpSeek(unsigned char *lp, long index) {
     }
 }
 
+/* Print info about the listpack and its elements on standard output. */
+void lpRepr(unsigned char *lp) {
+    unsigned char *p, *vstr;
+    int64_t vlen;
+    int index = 0;
+
+    printf("{total bytes %u} {num entries %u}\n",lpBytes(lp),lpLength(lp));
+    p = lpFirst(lp);
+    while(p) {
+        uint32_t encsize = lpCurrentEncodedSize(p);
+        unsigned long backlen = lpEncodeBacklen(NULL,encsize);
+
+        printf(
+            "{\n"
+                "\taddr 0x%08lx,\n"
+                "\tindex %2d,\n"
+                "\toffset %5lu,\n"
+                "\tencoded len: %5u,\n"
+                "\tbacklen len: %2lu,\n",
+            (long unsigned)p,
+            index,
+            (unsigned long) (p-lp),
+            encsize,
+            backlen);
+        printf("\tbytes: ");
+        for (unsigned long i = 0; i < encsize+backlen; i++) {
+            printf("%02x|",p[i]);
+        }
+        printf("\n");
+        vstr = lpGet(p,&vlen,NULL);
+        if (vstr) {
+            printf("\t[str]");
+            if (vlen > 40) {
+                if (fwrite(vstr,40,1,stdout) == 0) perror("fwrite");
+                printf("...");
+            } else {
+                if (vlen && fwrite(vstr,vlen,1,stdout) == 0) perror("fwrite");
+            }
+        } else {
+            printf("\t[int]%lld",(long long)vlen);
+        }
+        printf("\n}\n");
+        p = lpNext(lp,p);
+        index++;
+    }
+    printf("{end}\n\n");
+}
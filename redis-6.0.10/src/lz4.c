@@ -0,0 +1,360 @@
+/* LZ4 block format compression.
+ *
+ * This is a compact implementation of the LZ4 block format, the one used
+ * by the LZ4 library for the content of the frames, so that the output can
+ * be decoded with LZ4_decompress_safe() as well. It is used to compress
+ * the strings saved in RDB files as an alternative to LZF: it is much
+ * faster at decompressing, and compresses better at the higher levels.
+ *
+ * A block is a sequence of sequences, every sequence being:
+ *
+ * <token> [literals len] <literals> <offset> [match len]
+ *
+ * The high four bits of the token are the number of literals, and the low
+ * four bits the length of the match minus 4. When the four bits are all
+ * set, the length continues in the next bytes, every byte being added to
+ * the length, until a byte different than 255 is found. The offset is a
+ * 16 bits little endian distance back in the output where the match can be
+ * copied from. The last sequence has just the literals, and at least the
+ * last 5 bytes of the input are literals.
+ *
+ * At level 1 the compressor only looks for the last occurrence of every 4
+ * bytes sequence in a hash table, skipping the input faster when no match
+ * is found. The higher levels keep chains of the previous occurrences, and
+ * look at up to 2^(level-1) of them in order to find the longest match.
+ *
+ * Copyright (c) 2026, Redis Labs, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "lz4.h"
+
+#define LZ4_MINMATCH 4          /* Shortest match encoded. */
+#define LZ4_LASTLITERALS 5      /* The last bytes are always literals. */
+#define LZ4_MFLIMIT 12          /* Matches can't start in the last bytes. */
+#define LZ4_MAX_DISTANCE 65535  /* Max offset of a match. */
+#define LZ4_HASH_LOG 14         /* Max size of the hash table. */
+#define LZ4_CHAIN_SIZE 65536    /* Max size of the chains table. */
+#define LZ4_SKIP_TRIGGER 6      /* Skip faster after 2^6 failed attempts. */
+
+static inline uint32_t lz4Read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v,p,sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz4Hash(uint32_t v, int hashlog) {
+    return (v*2654435761U) >> (32-hashlog);
+}
+
+/* Return the number of bytes 'a' and 'b' have in common, without reading
+ * past 'limit'. */
+static inline size_t lz4MatchLength(const unsigned char *a,
+                                    const unsigned char *b,
+                                    const unsigned char *limit)
+{
+    const unsigned char *start = a;
+
+    while (a+sizeof(uint64_t) <= limit) {
+        uint64_t x, y;
+        memcpy(&x,a,sizeof(x));
+        memcpy(&y,b,sizeof(y));
+        if (x != y) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return (a-start)+(__builtin_ctzll(x^y)>>3);
+#else
+            break;
+#endif
+        }
+        a += sizeof(uint64_t);
+        b += sizeof(uint64_t);
+    }
+    while (a < limit && *a == *b) {
+        a++;
+        b++;
+    }
+    return a-start;
+}
+
+/* Write a length continuing after the four bits of the token. */
+static inline unsigned char *lz4WriteLength(unsigned char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/* Write a sequence of 'litlen' literals starting at 'anchor', followed by
+ * a match of 'matchlen' bytes at the specified offset, unless 'matchlen' is
+ * zero (last sequence). Returns NULL if the output buffer is too small. */
+static unsigned char *lz4WriteSequence(unsigned char *op, unsigned char *oend,
+                                       const unsigned char *anchor,
+                                       size_t litlen, size_t offset,
+                                       size_t matchlen)
+{
+    unsigned char *token = op;
+
+    /* Worst case size of the sequence. */
+    if ((size_t)(oend-op) < 1+litlen+litlen/255+1+2+matchlen/255+1)
+        return NULL;
+
+    op++;
+    if (litlen >= 15) {
+        *token = 15<<4;
+        op = lz4WriteLength(op,litlen-15);
+    } else {
+        *token = litlen<<4;
+    }
+    memcpy(op,anchor,litlen);
+    op += litlen;
+    if (matchlen == 0) return op;
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    matchlen -= LZ4_MINMATCH;
+    if (matchlen >= 15) {
+        *token |= 15;
+        op = lz4WriteLength(op,matchlen-15);
+    } else {
+        *token |= matchlen;
+    }
+    return op;
+}
+
+/* Compress 'in_len' bytes at 'in_data' into 'out_data' at the specified
+ * level, from LZ4_MIN_LEVEL (fastest) to LZ4_MAX_LEVEL (smallest). Returns
+ * the size of the compressed data, or 0 if it does not fit in 'out_len'
+ * bytes, exactly like lzf_compress(). */
+size_t lz4_compress(const void *in_data, size_t in_len,
+                    void *out_data, size_t out_len, int level)
+{
+    const unsigned char *in = in_data, *ip = in, *anchor = in;
+    const unsigned char *iend = in+in_len;
+    const unsigned char *mflimit = iend-LZ4_MFLIMIT;
+    const unsigned char *matchlimit = iend-LZ4_LASTLITERALS;
+    unsigned char *op = out_data, *oend = op+out_len;
+    uint32_t htab[1<<LZ4_HASH_LOG];
+    uint16_t chain[LZ4_CHAIN_SIZE];
+    size_t chainmask, inserted = 0;
+    int hashlog = 8, attempts, failures = 0;
+
+    if (level < LZ4_MIN_LEVEL) level = LZ4_MIN_LEVEL;
+    if (level > LZ4_MAX_LEVEL) level = LZ4_MAX_LEVEL;
+    attempts = 1<<(level-1);
+
+    /* Inputs too small to contain a match are just literals. */
+    if (in_len < LZ4_MFLIMIT+1) goto last_literals;
+
+    /* Size the tables after the input, so that compressing small strings
+     * does not require clearing large tables. The chains table does not
+     * need to be cleared at all, since only the entries of the positions
+     * already inserted are accessed. */
+    while (hashlog < LZ4_HASH_LOG && ((size_t)1<<hashlog) < in_len) hashlog++;
+    memset(htab,0,sizeof(uint32_t)<<hashlog);
+    chainmask = LZ4_CHAIN_SIZE-1;
+    while (chainmask > 255 && chainmask/2 >= in_len) chainmask /= 2;
+
+    while (ip <= mflimit) {
+        size_t pos = ip-in, matchlen = 0, offset = 0;
+        uint32_t h, cand;
+
+        if (attempts == 1) {
+            h = lz4Hash(lz4Read32(ip),hashlog);
+            cand = htab[h];
+            htab[h] = pos;
+            if (cand < pos && pos-cand <= LZ4_MAX_DISTANCE &&
+                lz4Read32(in+cand) == lz4Read32(ip))
+            {
+                matchlen = LZ4_MINMATCH+
+                    lz4MatchLength(ip+LZ4_MINMATCH,in+cand+LZ4_MINMATCH,
+                                   matchlimit);
+                offset = pos-cand;
+            }
+        } else {
+            /* Insert all the positions up to the current one, and look
+             * at the chain of the previous occurrences. */
+            while (inserted <= pos) {
+                size_t delta;
+
+                h = lz4Hash(lz4Read32(in+inserted),hashlog);
+                delta = inserted-htab[h];
+                chain[inserted&chainmask] =
+                    (htab[h] == 0 && inserted != 0) ||
+                    delta > LZ4_MAX_DISTANCE ? 0 : delta;
+                htab[h] = inserted++;
+            }
+            cand = pos;
+            for (int j = 0; j < attempts; j++) {
+                size_t delta = chain[cand&chainmask], len;
+
+                if (delta == 0 || cand < delta) break;
+                cand -= delta;
+                if (pos-cand > LZ4_MAX_DISTANCE) break;
+                if (lz4Read32(in+cand) != lz4Read32(ip)) continue;
+                len = LZ4_MINMATCH+lz4MatchLength(ip+LZ4_MINMATCH,
+                                                  in+cand+LZ4_MINMATCH,
+                                                  matchlimit);
+                if (len > matchlen) {
+                    matchlen = len;
+                    offset = pos-cand;
+                    if (ip+len == matchlimit) break;
+                }
+            }
+        }
+
+        if (matchlen == 0) {
+            /* Skip faster and faster in incompressible data at level 1. */
+            ip += (attempts == 1) ? 1+(failures++ >> LZ4_SKIP_TRIGGER) : 1;
+            continue;
+        }
+
+        op = lz4WriteSequence(op,oend,anchor,ip-anchor,offset,matchlen);
+        if (op == NULL) return 0;
+        ip += matchlen;
+        anchor = ip;
+        failures = 0;
+    }
+
+last_literals:
+    op = lz4WriteSequence(op,oend,anchor,iend-anchor,0,0);
+    if (op == NULL) return 0;
+    return op-(unsigned char*)out_data;
+}
+
+/* Decompress 'in_len' bytes of LZ4 block at 'in_data' into 'out_data'.
+ * Returns the size of the decompressed data, or 0 if the input is not
+ * valid or the output does not fit in 'out_len' bytes. The input is fully
+ * validated, so it is safe to use with untrusted data. */
+size_t lz4_decompress(const void *in_data, size_t in_len,
+                      void *out_data, size_t out_len)
+{
+    const unsigned char *ip = in_data, *iend = ip+in_len;
+    unsigned char *out = out_data, *op = out, *oend = out+out_len;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t len = token>>4, offset;
+        unsigned char b;
+
+        /* Literals. */
+        if (len == 15) {
+            do {
+                if (ip == iend) return 0;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        if (len > (size_t)(iend-ip) || len > (size_t)(oend-op)) return 0;
+        memcpy(op,ip,len);
+        ip += len;
+        op += len;
+        if (ip == iend) break; /* Last sequence. */
+
+        /* Match. */
+        if (iend-ip < 2) return 0;
+        offset = ip[0] | (ip[1]<<8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op-out)) return 0;
+        len = token&15;
+        if (len == 15) {
+            do {
+                if (ip == iend) return 0;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        len += LZ4_MINMATCH;
+        if (len > (size_t)(oend-op)) return 0;
+        if (offset >= len) {
+            memcpy(op,op-offset,len);
+            op += len;
+        } else {
+            /* Overlapping copy, that repeats the last 'offset' bytes. */
+            const unsigned char *match = op-offset;
+            while (len--) *op++ = *match++;
+        }
+    }
+    return op-out;
+}
+
+#ifdef REDIS_TEST
+#include <stdio.h>
+#include <stdlib.h>
+
+#define UNUSED(x) (void)(x)
+int lz4Test(int argc, char *argv[]) {
+    UNUSED(argc);
+    UNUSED(argv);
+    size_t sizes[] = {0, 1, 12, 13, 100, 4096, 100000, 1000000};
+    int errors = 0;
+
+    srand(1234);
+    for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+        size_t len = sizes[s], clen, dlen;
+        unsigned char *in = malloc(len+1), *out = malloc(len+len/255+16);
+        unsigned char *dec = malloc(len+1);
+
+        /* Mix of compressible and random data. */
+        for (size_t j = 0; j < len; j++)
+            in[j] = (j/64)%3 ? "abcdefgh"[rand()%8] : rand();
+
+        for (int level = LZ4_MIN_LEVEL; level <= LZ4_MAX_LEVEL; level++) {
+            clen = lz4_compress(in,len,out,len+len/255+16,level);
+            dlen = lz4_decompress(out,clen,dec,len);
+            if (clen == 0 || dlen != len || memcmp(in,dec,len)) {
+                printf("lz4 round trip failed: len %zu level %d\n",
+                    len, level);
+                errors++;
+            } else {
+                printf("lz4 len %zu level %d: %zu bytes\n",len,level,clen);
+            }
+            /* A truncated input must be detected. */
+            if (clen > 1 && len > 0 &&
+                lz4_decompress(out,clen-1,dec,len) == len &&
+                !memcmp(in,dec,len))
+            {
+                printf("lz4 truncated input not detected: len %zu\n", len);
+                errors++;
+            }
+        }
+        free(in);
+        free(out);
+        free(dec);
+    }
+    return errors;
+}
+#endif
+
+#ifdef LZ4_TEST_MAIN
+int main(int argc, char *argv[]) {
+    return lz4Test(argc, argv);
+}
+#endif
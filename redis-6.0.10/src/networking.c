@@ -129,6 +129,9 @@ client *createClient(connection *conn) {
     c->argv = NULL;
     c->argv_len_sum = 0;
     c->cmd = c->lastcmd = NULL;
+    c->parsed_cmd = NULL;
+    c->next_cmds_pos = c->next_cmds_num = 0;
+    c->cmds_version = 0;
     c->user = DefaultUser;
     c->multibulklen = 0;
     c->bulklen = -1;
@@ -163,6 +166,7 @@ client *createClient(connection *conn) {
     c->bpop.numreplicas = 0;
     c->bpop.reploffset = 0;
     c->woff = 0;
+    c->aof_woff = 0;
     c->watched_keys = listCreate();
     c->pubsub_channels = dictCreate(&objectKeyPointerValueDictType,NULL);
     c->pubsub_patterns = listCreate();
@@ -1100,6 +1104,7 @@ static void freeClientArgv(client *c) {
         decrRefCount(c->argv[j]);
     c->argc = 0;
     c->cmd = NULL;
+    c->parsed_cmd = NULL;
     c->argv_len_sum = 0;
 }
 
@@ -1163,6 +1168,14 @@ void unlinkClient(client *c) {
         c->flags &= ~CLIENT_PENDING_WRITE;
     }
 
+    /* Remove from the list of clients waiting for the AOF fsync if needed. */
+    if (c->flags & CLIENT_AOF_WAIT) {
+        ln = listSearchKey(server.clients_waiting_aof,c);
+        serverAssert(ln != NULL);
+        listDelNode(server.clients_waiting_aof,ln);
+        c->flags &= ~CLIENT_AOF_WAIT;
+    }
+
     /* Remove from the list of pending reads if needed. */
     if (c->flags & CLIENT_PENDING_READ) {
         ln = listSearchKey(server.clients_pending_read,c);
@@ -1468,6 +1481,14 @@ int writeToClient(client *c, int handler_installed) {
 /* Write event handler. Just send data to the client. */
 void sendReplyToClient(connection *conn) {
     client *c = connGetPrivateData(conn);
+
+    /* The replies of the client may not be sent until its writes are
+     * fsynced, when the AOF writer thread is used. */
+    if (server.aof_writer_thread && aofClientMustWait(c)) {
+        connSetWriteHandler(conn,NULL);
+        aofHoldClientReplies(c);
+        return;
+    }
     writeToClient(c,1);
 }
 
@@ -1903,6 +1924,70 @@ int processCommandAndResetClient(client *c) {
     return deadclient ? C_ERR : C_OK;
 }
 
+/* With pipelining the query buffer often holds several requests. Before
+ * executing them one after the other, look ahead at the next multibulk
+ * requests already received in full, without consuming them: their commands
+ * are looked up and remembered in c->next_cmds, so that processCommand()
+ * does not look them up again, and the keys of the single key commands are
+ * prefetched as a batch (see dbPrefetchKeys()), so that the cache misses of
+ * their lookups overlap instead of being paid serially. Stops at the first
+ * request that is incomplete, inline or with big arguments: such requests
+ * are just parsed as usual. */
+static void lookaheadQueryBuffer(client *c) {
+    static sds name = NULL, keynames[DB_PREFETCH_BATCH];
+    robj keyobjs[DB_PREFETCH_BATCH], *keys[DB_PREFETCH_BATCH];
+    char *p = c->querybuf+c->qb_pos, *end = c->querybuf+sdslen(c->querybuf);
+    int numkeys = 0;
+
+    c->next_cmds_pos = c->next_cmds_num = 0;
+    c->cmds_version = server.commands_version;
+    if (name == NULL) name = sdsempty();
+
+    while (c->next_cmds_num < CLIENT_LOOKAHEAD_CMDS && p < end && *p == '*') {
+        char *newline, *arg[2] = {NULL,NULL};
+        long long argc, len[2] = {0,0}, ll, j;
+
+        newline = memchr(p,'\r',end-p);
+        if (newline == NULL || newline+1 >= end ||
+            !string2ll(p+1,newline-(p+1),&argc) ||
+            argc <= 0 || argc > 1024*1024) break;
+        p = newline+2;
+        for (j = 0; j < argc; j++) {
+            if (p >= end || *p != '$') break;
+            newline = memchr(p,'\r',end-p);
+            if (newline == NULL || newline+1 >= end ||
+                !string2ll(p+1,newline-(p+1),&ll) ||
+                ll < 0 || ll >= PROTO_MBULK_BIG_ARG ||
+                ll+2 > end-(newline+2)) break;
+            if (j < 2) {
+                arg[j] = newline+2;
+                len[j] = ll;
+            }
+            p = newline+2+ll+2;
+        }
+        if (j != argc) break;
+
+        name = sdscpylen(name,arg[0],len[0]);
+        struct redisCommand *cmd = lookupCommand(name);
+        c->next_cmds[c->next_cmds_num++] = cmd;
+        if (cmd && cmd->firstkey == 1 && cmd->lastkey == 1 && argc >= 2 &&
+            numkeys < DB_PREFETCH_BATCH)
+        {
+            if (keynames[numkeys] == NULL) keynames[numkeys] = sdsempty();
+            keynames[numkeys] = sdscpylen(keynames[numkeys],arg[1],len[1]);
+            initStaticStringObject(keyobjs[numkeys],keynames[numkeys]);
+            keys[numkeys] = &keyobjs[numkeys];
+            numkeys++;
+        }
+    }
+
+    /* A single key is looked up right away anyway. */
+    if (numkeys > 1) {
+        dbPrefetchKeys(c->db,keys,numkeys,1);
+        server.stat_pipelined_keys_prefetched += numkeys;
+    }
+}
+
 /* This function is called every time, in the client structure 'c', there is
  * more query buffer to process, because we read more data from the socket
  * or because a client was blocked and later reactivated, so there could be
@@ -1933,6 +2018,14 @@ void processInputBuffer(client *c) {
          * The same applies for clients we want to terminate ASAP. */
         if (c->flags & (CLIENT_CLOSE_AFTER_REPLY|CLIENT_CLOSE_ASAP)) break;
 
+        /* Look ahead at the next requests, unless we are in the context of
+         * an I/O thread, that can't access the keyspace. */
+        if (c->next_cmds_pos == c->next_cmds_num && c->multibulklen == 0 &&
+            !(c->flags & CLIENT_PENDING_READ))
+        {
+            lookaheadQueryBuffer(c);
+        }
+
         /* Determine request type when unknown. */
         if (!c->reqtype) {
             if (c->querybuf[c->qb_pos] == '*') {
@@ -1944,6 +2037,7 @@ void processInputBuffer(client *c) {
 
         if (c->reqtype == PROTO_REQ_INLINE) {
             if (processInlineBuffer(c) != C_OK) break;
+            c->next_cmds_pos = c->next_cmds_num = 0;
             /* If the Gopher mode and we got zero or one argument, process
              * the request in Gopher mode. To avoid data race, Redis won't
              * support Gopher if enable io threads to read queries. */
@@ -1958,6 +2052,8 @@ void processInputBuffer(client *c) {
             }
         } else if (c->reqtype == PROTO_REQ_MULTIBULK) {
             if (processMultibulkBuffer(c) != C_OK) break;
+            if (c->next_cmds_pos < c->next_cmds_num)
+                c->parsed_cmd = c->next_cmds[c->next_cmds_pos++];
         } else {
             serverPanic("Unknown request type");
         }
@@ -3023,19 +3119,84 @@ int tio_debug = 0;
 #define IO_THREADS_OP_READ 0
 #define IO_THREADS_OP_WRITE 1
 
+/* Number of times an idle I/O thread polls its start condition before
+ * parking on its condition variable. Spinning for a short while keeps the
+ * latency low under sustained load, while parking avoids burning a whole
+ * core per thread when the traffic is low. */
+#define IO_THREADS_SPIN_COUNT 100000
+
 pthread_t io_threads[IO_THREADS_MAX_NUM];
 pthread_mutex_t io_threads_mutex[IO_THREADS_MAX_NUM];
 _Atomic unsigned long io_threads_pending[IO_THREADS_MAX_NUM];
 int io_threads_op;      /* IO_THREADS_OP_WRITE or IO_THREADS_OP_READ. */
 
-/* This is the list of clients each thread will serve when threaded I/O is
- * used. We spawn io_threads_num-1 threads, since one is the main thread
- * itself. */
-list *io_threads_list[IO_THREADS_MAX_NUM];
+/* Parking state of the I/O threads. A thread that found no work after
+ * spinning sets io_threads_parked[id] and sleeps on io_threads_cond[id]:
+ * the main thread only pays for a wakeup when the thread is parked. Note
+ * that io_threads_park_mutex is not the same mutex used to stop the threads,
+ * so that a thread waiting on the condition can always be canceled. */
+pthread_mutex_t io_threads_park_mutex[IO_THREADS_MAX_NUM];
+pthread_cond_t io_threads_cond[IO_THREADS_MAX_NUM];
+_Atomic int io_threads_parked[IO_THREADS_MAX_NUM];
+
+/* This is the vector of clients served by the threads (main thread included)
+ * during a given round of threaded I/O. Instead of assigning a fixed slice
+ * of clients to every thread, each thread claims the next client to serve
+ * incrementing io_threads_next_job, so that a thread that is slow with a
+ * client (big reply, slow socket, ...) does not delay the whole round:
+ * the other threads, and the main thread itself, just take the remaining
+ * clients. */
+client **io_threads_jobs = NULL;
+unsigned long io_threads_jobs_count = 0;
+unsigned long io_threads_jobs_size = 0;
+_Atomic unsigned long io_threads_next_job;
+
+/* Serve the clients of the current round until no client is left to claim.
+ * This is called both by the I/O threads and by the main thread. Returns
+ * the number of clients served by the caller. */
+static unsigned long IOThreadsServeJobs(void) {
+    unsigned long served = 0;
+    while(1) {
+        unsigned long j = io_threads_next_job++;
+        if (j >= io_threads_jobs_count) break;
+        client *c = io_threads_jobs[j];
+        if (io_threads_op == IO_THREADS_OP_WRITE) {
+            writeToClient(c,0);
+        } else if (io_threads_op == IO_THREADS_OP_READ) {
+            readQueryFromClient(c->conn);
+        } else {
+            serverPanic("io_threads_op value is unknown");
+        }
+        served++;
+    }
+    return served;
+}
+
+/* Wait for the main thread to give us something to do. The thread is
+ * parked on its condition variable, see wakeIOThread(). */
+static void IOThreadPark(long id) {
+    pthread_mutex_lock(&io_threads_park_mutex[id]);
+    io_threads_parked[id] = 1;
+    while (io_threads_pending[id] == 0)
+        pthread_cond_wait(&io_threads_cond[id],&io_threads_park_mutex[id]);
+    io_threads_parked[id] = 0;
+    pthread_mutex_unlock(&io_threads_park_mutex[id]);
+}
+
+/* Called by the main thread after setting io_threads_pending[id]. Both the
+ * pending counter and the parked flag are sequentially consistent atomic
+ * vars, so either the thread sees the new pending value before sleeping,
+ * or we see it parked and signal it under the park mutex. */
+static void wakeIOThread(int id) {
+    if (!io_threads_parked[id]) return;
+    pthread_mutex_lock(&io_threads_park_mutex[id]);
+    pthread_cond_signal(&io_threads_cond[id]);
+    pthread_mutex_unlock(&io_threads_park_mutex[id]);
+}
 
 void *IOThreadMain(void *myid) {
     /* The ID is the thread number (from 0 to server.iothreads_num-1), and is
-     * used by the thread to just manipulate a single sub-array of clients. */
+     * used by the thread to just manipulate its own start condition. */
     long id = (unsigned long)myid;
     char thdname[16];
 
@@ -3046,40 +3207,29 @@ void *IOThreadMain(void *myid) {
 
     while(1) {
         /* Wait for start */
-        for (int j = 0; j < 1000000; j++) {
+        for (int j = 0; j < IO_THREADS_SPIN_COUNT; j++) {
             if (io_threads_pending[id] != 0) break;
         }
 
-        /* Give the main thread a chance to stop this thread. */
         if (io_threads_pending[id] == 0) {
+            /* Give the main thread a chance to stop this thread. */
             pthread_mutex_lock(&io_threads_mutex[id]);
             pthread_mutex_unlock(&io_threads_mutex[id]);
+            /* Nothing to do after spinning: sleep until woken up. */
+            IOThreadPark(id);
             continue;
         }
 
         serverAssert(io_threads_pending[id] != 0);
 
-        if (tio_debug) printf("[%ld] %d to handle\n", id, (int)listLength(io_threads_list[id]));
+        if (tio_debug) printf("[%ld] starting round\n", id);
 
-        /* Process: note that the main thread will never touch our list
-         * before we drop the pending count to 0. */
-        listIter li;
-        listNode *ln;
-        listRewind(io_threads_list[id],&li);
-        while((ln = listNext(&li))) {
-            client *c = listNodeValue(ln);
-            if (io_threads_op == IO_THREADS_OP_WRITE) {
-                writeToClient(c,0);
-            } else if (io_threads_op == IO_THREADS_OP_READ) {
-                readQueryFromClient(c->conn);
-            } else {
-                serverPanic("io_threads_op value is unknown");
-            }
-        }
-        listEmpty(io_threads_list[id]);
+        /* Process: note that the main thread will never touch the jobs
+         * vector before we drop the pending count to 0. */
+        unsigned long served = IOThreadsServeJobs();
         io_threads_pending[id] = 0;
 
-        if (tio_debug) printf("[%ld] Done\n", id);
+        if (tio_debug) printf("[%ld] Done (%lu clients)\n", id, served);
     }
 }
 
@@ -3099,14 +3249,15 @@ void initThreadedIO(void) {
 
     /* Spawn and initialize the I/O threads. */
     for (int i = 0; i < server.io_threads_num; i++) {
-        /* Things we do for all the threads including the main thread. */
-        io_threads_list[i] = listCreate();
         if (i == 0) continue; /* Thread 0 is the main thread. */
 
         /* Things we do only for the additional threads. */
         pthread_t tid;
         pthread_mutex_init(&io_threads_mutex[i],NULL);
+        pthread_mutex_init(&io_threads_park_mutex[i],NULL);
+        pthread_cond_init(&io_threads_cond[i],NULL);
         io_threads_pending[i] = 0;
+        io_threads_parked[i] = 0;
         pthread_mutex_lock(&io_threads_mutex[i]); /* Thread will be stopped. */
         if (pthread_create(&tid,NULL,IOThreadMain,(void*)(long)i) != 0) {
             serverLog(LL_WARNING,"Fatal: Can't initialize IO thread.");
@@ -3179,6 +3330,49 @@ int stopThreadedIOIfNeeded(void) {
     }
 }
 
+/* Append a client to the jobs vector of the next threaded I/O round. */
+static void IOThreadsAddJob(client *c) {
+    if (io_threads_jobs_count == io_threads_jobs_size) {
+        io_threads_jobs_size = io_threads_jobs_size ? io_threads_jobs_size*2 : 64;
+        io_threads_jobs = zrealloc(io_threads_jobs,
+                                   sizeof(client*)*io_threads_jobs_size);
+    }
+    io_threads_jobs[io_threads_jobs_count++] = c;
+}
+
+/* Run a round of threaded I/O serving all the clients in the jobs vector
+ * with the operation 'op', and return only once all of them were served.
+ * The main thread takes part to the round as well: since the clients are
+ * claimed dynamically, when we return from IOThreadsServeJobs() the other
+ * threads are at most finishing the last client they claimed. */
+static void IOThreadsRunJobs(int op) {
+    /* Give the start condition to the waiting threads, by setting the
+     * start condition atomic var. There is no point in waking up more
+     * threads than the clients we have to serve. */
+    int threads = server.io_threads_num;
+    if ((unsigned long)threads > io_threads_jobs_count)
+        threads = io_threads_jobs_count;
+
+    io_threads_op = op;
+    io_threads_next_job = 0;
+    for (int j = 1; j < threads; j++) {
+        io_threads_pending[j] = 1;
+        wakeIOThread(j);
+    }
+
+    /* Also use the main thread to process clients. */
+    IOThreadsServeJobs();
+
+    /* Wait for all the other threads to end their work. */
+    while(1) {
+        unsigned long pending = 0;
+        for (int j = 1; j < threads; j++)
+            pending += io_threads_pending[j];
+        if (pending == 0) break;
+    }
+    io_threads_jobs_count = 0;
+}
+
 int handleClientsWithPendingWritesUsingThreads(void) {
     int processed = listLength(server.clients_pending_write);
     if (processed == 0) return 0; /* Return ASAP if there are no clients. */
@@ -3194,11 +3388,10 @@ int handleClientsWithPendingWritesUsingThreads(void) {
 
     if (tio_debug) printf("%d TOTAL WRITE pending clients\n", processed);
 
-    /* Distribute the clients across N different lists. */
+    /* Collect the clients to serve in the jobs vector. */
     listIter li;
     listNode *ln;
     listRewind(server.clients_pending_write,&li);
-    int item_id = 0;
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
         c->flags &= ~CLIENT_PENDING_WRITE;
@@ -3210,34 +3403,11 @@ int handleClientsWithPendingWritesUsingThreads(void) {
             continue;
         }
 
-        int target_id = item_id % server.io_threads_num;
-        listAddNodeTail(io_threads_list[target_id],c);
-        item_id++;
-    }
-
-    /* Give the start condition to the waiting threads, by setting the
-     * start condition atomic var. */
-    io_threads_op = IO_THREADS_OP_WRITE;
-    for (int j = 1; j < server.io_threads_num; j++) {
-        int count = listLength(io_threads_list[j]);
-        io_threads_pending[j] = count;
-    }
-
-    /* Also use the main thread to process a slice of clients. */
-    listRewind(io_threads_list[0],&li);
-    while((ln = listNext(&li))) {
-        client *c = listNodeValue(ln);
-        writeToClient(c,0);
+        IOThreadsAddJob(c);
     }
-    listEmpty(io_threads_list[0]);
 
-    /* Wait for all the other threads to end their work. */
-    while(1) {
-        unsigned long pending = 0;
-        for (int j = 1; j < server.io_threads_num; j++)
-            pending += io_threads_pending[j];
-        if (pending == 0) break;
-    }
+    /* Serve the clients using the I/O threads and the main thread. */
+    IOThreadsRunJobs(IO_THREADS_OP_WRITE);
     if (tio_debug) printf("I/O WRITE All threads finshed\n");
 
     /* Run the list of clients again to install the write handler where
@@ -3280,6 +3450,57 @@ int postponeClientRead(client *c) {
     }
 }
 
+/* Called once the I/O threads parsed the first command of every client in
+ * the pending read list, before the main thread executes them. With many
+ * clients pipelining simple commands, executing such commands is dominated
+ * by the cache misses of the keyspace lookups, that are paid serially one
+ * command after the other. Here we collect the key of every pending single
+ * key command (GET, SET, HGET, INCR, ...) and prefetch all of them as a
+ * batch, grouping consecutive clients that selected the same DB, so that
+ * the lookups performed by the commands will find the data in the cache.
+ *
+ * Note that the I/O threads only parse the first command of every client:
+ * the keys of the rest of a pipelined batch are prefetched later by the main
+ * thread in processInputBuffer(), see lookaheadQueryBuffer(). The command
+ * looked up here is remembered, so that processCommand() does not look it
+ * up again. */
+static void prefetchPendingCommandsKeys(void) {
+    robj *keys[DB_PREFETCH_BATCH];
+    redisDb *db = NULL;
+    int numkeys = 0;
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.clients_pending_read,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+
+        if (!(c->flags & CLIENT_PENDING_COMMAND) ||
+            (c->flags & CLIENT_MULTI) || c->argc < 2) continue;
+
+        /* The I/O thread may have taken the command from the ones looked
+         * up ahead, that are dropped if the command table changed. */
+        if (c->cmds_version != server.commands_version) {
+            c->parsed_cmd = NULL;
+            c->next_cmds_pos = c->next_cmds_num = 0;
+            c->cmds_version = server.commands_version;
+        }
+        if (c->parsed_cmd == NULL)
+            c->parsed_cmd = lookupCommand(c->argv[0]->ptr);
+        struct redisCommand *cmd = c->parsed_cmd;
+        if (!cmd || cmd->firstkey != 1 || cmd->lastkey != 1) continue;
+
+        if (numkeys && (db != c->db || numkeys == DB_PREFETCH_BATCH)) {
+            dbPrefetchKeys(db,keys,numkeys,1);
+            numkeys = 0;
+        }
+        db = c->db;
+        keys[numkeys++] = c->argv[1];
+        server.stat_io_keys_prefetched++;
+    }
+    if (numkeys) dbPrefetchKeys(db,keys,numkeys,1);
+}
+
 /* When threaded I/O is also enabled for the reading + parsing side, the
  * readable handler will just put normal clients into a queue of clients to
  * process (instead of serving them synchronously). This function runs
@@ -3293,43 +3514,24 @@ int handleClientsWithPendingReadsUsingThreads(void) {
 
     if (tio_debug) printf("%d TOTAL READ pending clients\n", processed);
 
-    /* Distribute the clients across N different lists. */
+    /* Collect the clients to serve in the jobs vector. */
     listIter li;
     listNode *ln;
     listRewind(server.clients_pending_read,&li);
-    int item_id = 0;
-    while((ln = listNext(&li))) {
-        client *c = listNodeValue(ln);
-        int target_id = item_id % server.io_threads_num;
-        listAddNodeTail(io_threads_list[target_id],c);
-        item_id++;
-    }
-
-    /* Give the start condition to the waiting threads, by setting the
-     * start condition atomic var. */
-    io_threads_op = IO_THREADS_OP_READ;
-    for (int j = 1; j < server.io_threads_num; j++) {
-        int count = listLength(io_threads_list[j]);
-        io_threads_pending[j] = count;
-    }
-
-    /* Also use the main thread to process a slice of clients. */
-    listRewind(io_threads_list[0],&li);
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
-        readQueryFromClient(c->conn);
+        IOThreadsAddJob(c);
     }
-    listEmpty(io_threads_list[0]);
 
-    /* Wait for all the other threads to end their work. */
-    while(1) {
-        unsigned long pending = 0;
-        for (int j = 1; j < server.io_threads_num; j++)
-            pending += io_threads_pending[j];
-        if (pending == 0) break;
-    }
+    /* Serve the clients using the I/O threads and the main thread. */
+    IOThreadsRunJobs(IO_THREADS_OP_READ);
     if (tio_debug) printf("I/O READ All threads finshed\n");
 
+    /* All the clients now have their first command parsed: prefetch the
+     * keys they are going to access before executing them one after the
+     * other. */
+    prefetchPendingCommandsKeys();
+
     /* Run the list of clients again to process the new buffers. */
     while(listLength(server.clients_pending_read)) {
         ln = listFirst(server.clients_pending_read);
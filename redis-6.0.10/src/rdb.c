@@ -29,6 +29,7 @@
 
 #include "server.h"
 #include "lzf.h"    /* LZF compression library */
+#include "lz4.h"    /* LZ4 compression */
 #include "zipmap.h"
 #include "endianconv.h"
 #include "stream.h"
@@ -52,6 +53,7 @@ char* rdbFileBeingLoaded = NULL; /* used for rdb checking on read error */
 extern int rdbCheckMode;
 void rdbCheckError(const char *fmt, ...);
 void rdbCheckSetError(const char *fmt, ...);
+void rdbCheckCompressedString(int enc);
 
 #ifdef __GNUC__
 void rdbReportError(int corruption_error, int linenum, char *reason, ...) __attribute__ ((format (printf, 3, 4)));
@@ -322,13 +324,15 @@ int rdbTryIntegerEncoding(char *s, size_t len, unsigned char *enc) {
     return rdbEncodeInteger(value,enc);
 }
 
-ssize_t rdbSaveLzfBlob(rio *rdb, void *data, size_t compress_len,
-                       size_t original_len) {
+/* Save a string compressed with the specified RDB_ENC_* encoding. */
+static ssize_t rdbSaveCompressedBlob(rio *rdb, int enc, void *data,
+                                     size_t compress_len, size_t original_len)
+{
     unsigned char byte;
     ssize_t n, nwritten = 0;
 
     /* Data compressed! Let's save it on disk */
-    byte = (RDB_ENCVAL<<6)|RDB_ENC_LZF;
+    byte = (RDB_ENCVAL<<6)|enc;
     if ((n = rdbWriteRaw(rdb,&byte,1)) == -1) goto writeerr;
     nwritten += n;
 
@@ -347,6 +351,12 @@ writeerr:
     return -1;
 }
 
+ssize_t rdbSaveLzfBlob(rio *rdb, void *data, size_t compress_len,
+                       size_t original_len) {
+    return rdbSaveCompressedBlob(rdb,RDB_ENC_LZF,data,compress_len,
+                                 original_len);
+}
+
 ssize_t rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
     size_t comprlen, outlen;
     void *out;
@@ -365,10 +375,30 @@ ssize_t rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
     return nwritten;
 }
 
-/* Load an LZF compressed string in RDB format. The returned value
- * changes according to 'flags'. For more info check the
- * rdbGenericLoadStringObject() function. */
-void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
+ssize_t rdbSaveLz4StringObject(rio *rdb, unsigned char *s, size_t len) {
+    size_t comprlen, outlen;
+    void *out;
+
+    /* Like for LZF, require at least four bytes compression. */
+    if (len <= 4) return 0;
+    outlen = len-4;
+    if ((out = zmalloc(outlen+1)) == NULL) return 0;
+    comprlen = lz4_compress(s, len, out, outlen, server.rdb_compression_level);
+    if (comprlen == 0) {
+        zfree(out);
+        return 0;
+    }
+    ssize_t nwritten = rdbSaveCompressedBlob(rdb, RDB_ENC_LZ4, out, comprlen,
+                                             len);
+    zfree(out);
+    return nwritten;
+}
+
+/* Load a string compressed with the RDB_ENC_LZF or RDB_ENC_LZ4 encoding in
+ * RDB format. The returned value changes according to 'flags'. For more
+ * info check the rdbGenericLoadStringObject() function. */
+void *rdbLoadCompressedStringObject(rio *rdb, int enc, int flags,
+                                    size_t *lenptr) {
     int plain = flags & RDB_LOAD_PLAIN;
     int sds = flags & RDB_LOAD_SDS;
     uint64_t len, clen;
@@ -389,9 +419,14 @@ void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
 
     /* Load the compressed representation and uncompress it to target. */
     if (rioRead(rdb,c,clen) == 0) goto err;
-    if (lzf_decompress(c,clen,val,len) == 0) {
-        rdbExitReportCorruptRDB("Invalid LZF compressed string");
+    if (enc == RDB_ENC_LZ4) {
+        if (lz4_decompress(c,clen,val,len) != len)
+            rdbExitReportCorruptRDB("Invalid LZ4 compressed string");
+    } else {
+        if (lzf_decompress(c,clen,val,len) == 0)
+            rdbExitReportCorruptRDB("Invalid LZF compressed string");
     }
+    if (rdbCheckMode) rdbCheckCompressedString(enc);
     zfree(c);
 
     if (plain || sds) {
@@ -408,6 +443,27 @@ err:
     return NULL;
 }
 
+/* Stats the compression of the strings is accounted in, while saving an RDB
+ * file (and not, for instance, serializing a key for DUMP). The strings may
+ * be compressed by the rdb-save-threads threads, hence the mutex. */
+static rdbSaveStats *rdbSaveCompressStats = NULL;
+static pthread_mutex_t rdbSaveCompressStatsMutex = PTHREAD_MUTEX_INITIALIZER;
+static long long rdbSaveStatsStartTime;
+static long long rdbSaveStatsLastSent;
+static unsigned long rdbSaveStatsCalls;
+static size_t rdbSaveStatsUpdated;
+
+static void rdbSaveAccountCompression(size_t len, size_t saved,
+                                      long long usecs)
+{
+    pthread_mutex_lock(&rdbSaveCompressStatsMutex);
+    rdbSaveCompressStats->compress_strings++;
+    rdbSaveCompressStats->compress_in += len;
+    rdbSaveCompressStats->compress_out += saved;
+    rdbSaveCompressStats->compress_usecs += usecs;
+    pthread_mutex_unlock(&rdbSaveCompressStatsMutex);
+}
+
 /* Save a string object as [len][data] on disk. If the object is a string
  * representation of an integer value we try to save it in a special form */
 ssize_t rdbSaveRawString(rio *rdb, unsigned char *s, size_t len) {
@@ -423,11 +479,17 @@ ssize_t rdbSaveRawString(rio *rdb, unsigned char *s, size_t len) {
         }
     }
 
-    /* Try LZF compression - under 20 bytes it's unable to compress even
+    /* Try compression - under 20 bytes it's unable to compress even
      * aaaaaaaaaaaaaaaaaa so skip it */
     if (server.rdb_compression && len > 20) {
-        n = rdbSaveLzfStringObject(rdb,s,len);
+        long long start = rdbSaveCompressStats ? ustime() : 0;
+        if (server.rdb_compression_codec == RDB_CODEC_LZ4)
+            n = rdbSaveLz4StringObject(rdb,s,len);
+        else
+            n = rdbSaveLzfStringObject(rdb,s,len);
         if (n == -1) return -1;
+        if (rdbSaveCompressStats)
+            rdbSaveAccountCompression(len,n ? (size_t)n : len,ustime()-start);
         if (n > 0) return n;
         /* Return value of 0 means data can't be compressed, save the old way */
     }
@@ -501,7 +563,8 @@ void *rdbGenericLoadStringObject(rio *rdb, int flags, size_t *lenptr) {
         case RDB_ENC_INT32:
             return rdbLoadIntegerObject(rdb,len,flags,lenptr);
         case RDB_ENC_LZF:
-            return rdbLoadLzfStringObject(rdb,flags,lenptr);
+        case RDB_ENC_LZ4:
+            return rdbLoadCompressedStringObject(rdb,len,flags,lenptr);
         default:
             rdbExitReportCorruptRDB("Unknown RDB string encoding type %llu",len);
             return NULL;
@@ -643,22 +706,26 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
     case OBJ_SET:
         if (o->encoding == OBJ_ENCODING_INTSET)
             return rdbSaveType(rdb,RDB_TYPE_SET_INTSET);
+        else if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_SET_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_HT)
             return rdbSaveType(rdb,RDB_TYPE_SET);
         else
             serverPanic("Unknown set encoding");
     case OBJ_ZSET:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_ZSET_ZIPLIST);
-        else if (o->encoding == OBJ_ENCODING_SKIPLIST)
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_ZSET_LISTPACK);
+        else if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+                 o->encoding == OBJ_ENCODING_BTREE)
             return rdbSaveType(rdb,RDB_TYPE_ZSET_2);
         else
             serverPanic("Unknown sorted set encoding");
     case OBJ_HASH:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_HASH_ZIPLIST);
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_HASH_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_HT)
-            return rdbSaveType(rdb,RDB_TYPE_HASH);
+            return rdbSaveType(rdb,hashTypeHasVolatileFields(o) ?
+                                   RDB_TYPE_HASH_TTL : RDB_TYPE_HASH);
         else
             serverPanic("Unknown hash encoding");
     case OBJ_STREAM:
@@ -833,6 +900,11 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
         } else if (o->encoding == OBJ_ENCODING_INTSET) {
             size_t l = intsetBlobLen((intset*)o->ptr);
 
+            if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
+            nwritten += n;
+        } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
+
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
         } else {
@@ -840,8 +912,8 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
         }
     } else if (o->type == OBJ_ZSET) {
         /* Save a sorted set value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
@@ -871,22 +943,58 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
                 nwritten += n;
                 zn = zn->backward;
             }
+        } else if (o->encoding == OBJ_ENCODING_BTREE) {
+            zset *zs = o->ptr;
+            zbtCursor cur;
+
+            if ((n = rdbSaveLen(rdb,zs->zbt->length)) == -1) return -1;
+            nwritten += n;
+
+            /* Same format and order of the skiplist. */
+            if (zbtLast(zs->zbt,&cur)) do {
+                zbtEntry *e = zbtCursorEntry(&cur);
+                if ((n = rdbSaveRawString(rdb,
+                    (unsigned char*)e->ele,sdslen(e->ele))) == -1)
+                {
+                    return -1;
+                }
+                nwritten += n;
+                if ((n = rdbSaveBinaryDoubleValue(rdb,e->score)) == -1)
+                    return -1;
+                nwritten += n;
+            } while(zbtPrev(&cur));
         } else {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (o->type == OBJ_HASH) {
         /* Save a hash value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
 
         } else if (o->encoding == OBJ_ENCODING_HT) {
-            dictIterator *di = dictGetIterator(o->ptr);
+            dict *d = o->ptr;
+            dictIterator *di = dictGetIterator(d);
             dictEntry *de;
+            int volatile_fields = hashTypeHasVolatileFields(o);
+            long long minexpire = 0;
+
+            /* With fields having a TTL, RDB_TYPE_HASH_TTL, the earliest
+             * expire time is saved first, and every field is preceded by
+             * its expire time relative to it, plus one, or zero if the
+             * field has no TTL. This way most expires take a few bytes. */
+            if (volatile_fields) {
+                minexpire = hashTypeMinFieldExpire(o);
+                if ((n = rdbSaveMillisecondTime(rdb,minexpire)) == -1) {
+                    dictReleaseIterator(di);
+                    return -1;
+                }
+                nwritten += n;
+            }
 
-            if ((n = rdbSaveLen(rdb,dictSize((dict*)o->ptr))) == -1) {
+            if ((n = rdbSaveLen(rdb,dictSize(d))) == -1) {
                 dictReleaseIterator(di);
                 return -1;
             }
@@ -896,6 +1004,17 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
                 sds field = dictGetKey(de);
                 sds value = dictGetVal(de);
 
+                if (volatile_fields) {
+                    long long when = hashEntryExpire(d,de);
+                    if ((n = rdbSaveLen(rdb,when ? when-minexpire+1 : 0))
+                        == -1)
+                    {
+                        dictReleaseIterator(di);
+                        return -1;
+                    }
+                    nwritten += n;
+                }
+
                 if ((n = rdbSaveRawString(rdb,(unsigned char*)field,
                         sdslen(field))) == -1)
                 {
@@ -1093,6 +1212,65 @@ int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime) {
     return 1;
 }
 
+/* Like rdbSaveKeyValuePair(), but accounts the key and the time it took to
+ * serialize it in the specified stats. To avoid calling ustime() twice for
+ * every key, only the first RDB_SAVE_STATS_SAMPLE keys of every type and
+ * then one every RDB_SAVE_STATS_SAMPLE are timed, and the time of a sampled
+ * key is accounted for all the keys it stands for. */
+#define RDB_SAVE_STATS_SAMPLE 16
+static int rdbSaveKeyValuePairWithStats(rio *rdb, robj *key, robj *val,
+                                        long long expiretime,
+                                        rdbSaveStats *stats)
+{
+    unsigned long long n = stats->keys[val->type]++;
+    long long start;
+    int retval;
+
+    if (n >= RDB_SAVE_STATS_SAMPLE && n % RDB_SAVE_STATS_SAMPLE)
+        return rdbSaveKeyValuePair(rdb,key,val,expiretime);
+
+    start = ustime();
+    retval = rdbSaveKeyValuePair(rdb,key,val,expiretime);
+    stats->usecs[val->type] += (ustime()-start) *
+        (n < RDB_SAVE_STATS_SAMPLE ? 1 : RDB_SAVE_STATS_SAMPLE);
+    return retval;
+}
+
+/* Start accounting the save of the dataset in server.stat_rdb_save. */
+static void rdbSaveStatsStart(void) {
+    memset(&server.stat_rdb_save,0,sizeof(server.stat_rdb_save));
+    for (int j = 0; j < server.dbnum; j++)
+        server.stat_rdb_save.keys_total += dictSize(server.db[j].dict);
+    rdbSaveStatsStartTime = rdbSaveStatsLastSent = ustime();
+    rdbSaveStatsCalls = 0;
+    rdbSaveStatsUpdated = 0;
+    rdbSaveCompressStats = &server.stat_rdb_save;
+}
+
+/* Update the I/O stats of the save with the ones of 'rdb'. Called for every
+ * key saved, the update is actually performed every 1024 keys or 1MB of
+ * output, unless 'force' is true. When saving in a child, the stats are
+ * also sent to the parent once per second. */
+static void rdbSaveStatsUpdate(rio *rdb, int force) {
+    long long now;
+
+    if (!force && ++rdbSaveStatsCalls % 1024 &&
+        rdb->processed_bytes-rdbSaveStatsUpdated < 1024*1024) return;
+    rdbSaveStatsUpdated = rdb->processed_bytes;
+    now = ustime();
+
+    server.stat_rdb_save.bytes = rdb->processed_bytes;
+    server.stat_rdb_save.write_usecs = rdb->write_usecs;
+    server.stat_rdb_save.fsync_usecs = rdb->fsync_usecs;
+    server.stat_rdb_save.elapsed_usecs = now-rdbSaveStatsStartTime;
+    if (server.in_fork_child == CHILD_TYPE_RDB &&
+        now-rdbSaveStatsLastSent >= 1000000)
+    {
+        sendChildProgressInfo(CHILD_TYPE_RDB);
+        rdbSaveStatsLastSent = now;
+    }
+}
+
 /* Save an AUX field. */
 ssize_t rdbSaveAuxField(rio *rdb, void *key, size_t keylen, void *val, size_t vallen) {
     ssize_t ret, len = 0;
@@ -1183,6 +1361,328 @@ ssize_t rdbSaveSingleModuleAux(rio *rdb, int when, moduleType *mt) {
     return io.bytes;
 }
 
+/* Write the part of the RDB preceding the keys: the magic string with the
+ * RDB version, the AUX fields and the module AUX data to save before the
+ * keys. Also enables the checksum of the rio stream if configured.
+ * Returns -1 on error. */
+int rdbSaveRioHeader(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
+    char magic[10];
+
+    if (server.rdb_checksum)
+        rdb->update_cksum = rioGenericUpdateChecksum;
+    snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
+    if (rdbWriteRaw(rdb,magic,9) == -1) return -1;
+    if (rdbSaveInfoAuxFields(rdb,rdbflags,rsi) == -1) return -1;
+    if (rdbSaveModulesAux(rdb, REDISMODULE_AUX_BEFORE_RDB) == -1) return -1;
+    return 1;
+}
+
+/* Write the part of the RDB following the keys: the Lua scripts if we are
+ * persisting the replication info, the module AUX data to save after the
+ * keys, the EOF opcode and the checksum. Returns -1 on error. */
+int rdbSaveRioTrailer(rio *rdb, rdbSaveInfo *rsi) {
+    dictIterator *di;
+    dictEntry *de;
+    uint64_t cksum;
+
+    /* If we are storing the replication information on disk, persist
+     * the script cache as well: on successful PSYNC after a restart, we need
+     * to be able to process any EVALSHA inside the replication backlog the
+     * master will send us. */
+    if (rsi && dictSize(server.lua_scripts)) {
+        di = dictGetIterator(server.lua_scripts);
+        while((de = dictNext(di)) != NULL) {
+            robj *body = dictGetVal(de);
+            if (rdbSaveAuxField(rdb,"lua",3,body->ptr,sdslen(body->ptr)) == -1)
+            {
+                dictReleaseIterator(di);
+                return -1;
+            }
+        }
+        dictReleaseIterator(di);
+    }
+
+    if (rdbSaveModulesAux(rdb, REDISMODULE_AUX_AFTER_RDB) == -1) return -1;
+
+    /* EOF opcode */
+    if (rdbSaveType(rdb,RDB_OPCODE_EOF) == -1) return -1;
+
+    /* CRC64 checksum. It will be zero if checksum computation is disabled, the
+     * loading code skips the check in this case. */
+    cksum = rdb->cksum;
+    memrev64ifbe(&cksum);
+    if (rioWrite(rdb,&cksum,8) == 0) return -1;
+    return 1;
+}
+
+/* -----------------------------------------------------------------------------
+ * Parallel saving
+ * -------------------------------------------------------------------------- */
+
+/* When rdb-save-threads is greater than 1, the child process saving the RDB
+ * serializes the keys of the large DBs with multiple threads, since the
+ * serialization, and the LZF compression especially, are CPU bound. The
+ * buckets of the hash tables of the DB are split in units of
+ * RDB_SAVE_UNIT_BUCKETS buckets, that the threads serialize into their own
+ * buffers, also computing the crc64 of every buffer. The main thread of the
+ * child writes the buffers in the order of the units, combining the checksum
+ * of the file with the checksum of every unit via crc64_combine(). So the
+ * output is exactly the one of a single thread iterating the DB.
+ *
+ * The dataset can be accessed by multiple threads without locking since it
+ * is not modified in the child, but the incremental rehashing is paused so
+ * that the lookups of the expires don't move the entries around. Values of
+ * module types are serialized by the main thread, since the modules don't
+ * expect their callbacks to be called concurrently. */
+
+#define RDB_SAVE_UNIT_BUCKETS 1024  /* Buckets serialized in a unit. */
+#define RDB_SAVE_RING_SIZE 64       /* Units serialized ahead of the writer. */
+#define RDB_SAVE_MIN_KEYS 16384     /* Smaller DBs are saved by one thread. */
+#define RDB_SAVE_MAX_THREADS 16
+
+typedef struct rdbSaveUnit {
+    sds buf;                /* Serialized keys of the unit. */
+    uint64_t crc;           /* crc64 of 'buf'. */
+    rdbSaveStats stats;     /* Keys serialized and their time. */
+    list *deferred;         /* Entries to be serialized by the main thread,
+                               see rdbSaveDeferred. */
+    int done;               /* The unit is ready to be written. */
+} rdbSaveUnit;
+
+/* An entry of a unit serialized by the main thread, and the offset in the
+ * buffer of the unit where it must be written, so that the keys are
+ * written in the same order of a single thread. */
+typedef struct rdbSaveDeferred {
+    dictEntry *de;
+    size_t offset;
+} rdbSaveDeferred;
+
+static struct {
+    pthread_t threads[RDB_SAVE_MAX_THREADS];
+    pthread_mutex_t mutex;
+    pthread_cond_t done_cond;   /* A unit was serialized. */
+    pthread_cond_t space_cond;  /* A unit was written, or stop was set. */
+    redisDb *db;
+    int checksum;               /* Compute the crc64 of the units. */
+    unsigned long units;        /* Units of the DB being saved. */
+    unsigned long next;         /* Next unit to serialize. */
+    unsigned long written;      /* Units written so far. */
+    int stop;                   /* Threads must exit ASAP. */
+    rdbSaveUnit ring[RDB_SAVE_RING_SIZE];
+} rdbSaver = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+    .space_cond = PTHREAD_COND_INITIALIZER
+};
+
+/* Serialize the keys in the buckets of the specified unit. */
+static void rdbSaveSerializeUnit(unsigned long id, rdbSaveUnit *unit) {
+    redisDb *db = rdbSaver.db;
+    dictht *ht = &db->dict->ht[0];
+    unsigned long start = id*RDB_SAVE_UNIT_BUCKETS, end;
+    unsigned long units0 = (ht->size+RDB_SAVE_UNIT_BUCKETS-1)/
+                           RDB_SAVE_UNIT_BUCKETS;
+    rio rdb;
+
+    /* Units past the ones of the first table refer to the second one, that
+     * is only used while rehashing. */
+    if (id >= units0) {
+        ht = &db->dict->ht[1];
+        start -= units0*RDB_SAVE_UNIT_BUCKETS;
+    }
+    end = start+RDB_SAVE_UNIT_BUCKETS;
+    if (end > ht->size) end = ht->size;
+
+    rioInitWithBuffer(&rdb,unit->buf);
+    for (unsigned long j = start; j < end; j++) {
+        dictEntry *de = ht->table[j];
+        while (de) {
+            sds keystr = dictGetKey(de);
+            robj key, *o = dictGetVal(de);
+
+            if (o->type == OBJ_MODULE) {
+                rdbSaveDeferred *d = zmalloc(sizeof(*d));
+                d->de = de;
+                d->offset = sdslen(rdb.io.buffer.ptr);
+                if (unit->deferred == NULL) {
+                    unit->deferred = listCreate();
+                    listSetFreeMethod(unit->deferred,zfree);
+                }
+                listAddNodeTail(unit->deferred,d);
+            } else {
+                initStaticStringObject(key,keystr);
+                rdbSaveKeyValuePairWithStats(&rdb,&key,o,getExpire(db,&key),
+                                             &unit->stats);
+            }
+            de = de->next;
+        }
+    }
+    unit->buf = rdb.io.buffer.ptr;
+    /* The units with deferred entries are written in pieces, and their
+     * checksum is computed while writing them. */
+    unit->crc = rdbSaver.checksum && unit->deferred == NULL ?
+        crc64(0,(unsigned char*)unit->buf,sdslen(unit->buf)) : 0;
+}
+
+static void *rdbSaveThreadMain(void *arg) {
+    UNUSED(arg);
+    unsigned long id;
+
+    redis_set_thread_title("rdb_save");
+    pthread_mutex_lock(&rdbSaver.mutex);
+    while (1) {
+        /* Don't get too far ahead of the writer. */
+        while (!rdbSaver.stop && rdbSaver.next < rdbSaver.units &&
+               rdbSaver.next-rdbSaver.written >= RDB_SAVE_RING_SIZE)
+            pthread_cond_wait(&rdbSaver.space_cond,&rdbSaver.mutex);
+        if (rdbSaver.stop || rdbSaver.next == rdbSaver.units) break;
+        id = rdbSaver.next++;
+        pthread_mutex_unlock(&rdbSaver.mutex);
+
+        rdbSaveUnit *unit = rdbSaver.ring+(id%RDB_SAVE_RING_SIZE);
+        rdbSaveSerializeUnit(id,unit);
+
+        pthread_mutex_lock(&rdbSaver.mutex);
+        unit->done = 1;
+        pthread_cond_signal(&rdbSaver.done_cond);
+    }
+    pthread_mutex_unlock(&rdbSaver.mutex);
+    return NULL;
+}
+
+/* Write a serialized unit to the RDB, and the entries it deferred in their
+ * place. Returns -1 on error. */
+static int rdbSaveWriteUnit(rio *rdb, rdbSaveUnit *unit) {
+    size_t len = sdslen(unit->buf);
+    int retval = 0;
+
+    if (unit->deferred == NULL) {
+        /* The checksum of the unit was already computed by the thread. */
+        void (*update_cksum)(struct _rio *, const void *, size_t);
+        update_cksum = rdb->update_cksum;
+        rdb->update_cksum = NULL;
+        if (len && rioWrite(rdb,unit->buf,len) == 0) retval = -1;
+        rdb->update_cksum = update_cksum;
+        if (update_cksum) rdb->cksum = crc64_combine(rdb->cksum,unit->crc,len);
+    } else {
+        size_t offset = 0;
+        listIter li;
+        listNode *ln;
+
+        listRewind(unit->deferred,&li);
+        while(retval == 0 && (ln = listNext(&li)) != NULL) {
+            rdbSaveDeferred *d = listNodeValue(ln);
+            robj key;
+
+            if (d->offset > offset &&
+                rioWrite(rdb,unit->buf+offset,d->offset-offset) == 0)
+            {
+                retval = -1;
+                break;
+            }
+            offset = d->offset;
+            initStaticStringObject(key,dictGetKey(d->de));
+            if (rdbSaveKeyValuePairWithStats(rdb,&key,dictGetVal(d->de),
+                    getExpire(rdbSaver.db,&key),&server.stat_rdb_save) == -1)
+                retval = -1;
+        }
+        if (retval == 0 && len > offset &&
+            rioWrite(rdb,unit->buf+offset,len-offset) == 0) retval = -1;
+        listRelease(unit->deferred);
+        unit->deferred = NULL;
+    }
+
+    /* Account the keys serialized by the thread. */
+    for (int j = 0; j < OBJ_TYPE_MAX; j++) {
+        server.stat_rdb_save.keys[j] += unit->stats.keys[j];
+        server.stat_rdb_save.usecs[j] += unit->stats.usecs[j];
+    }
+    memset(&unit->stats,0,sizeof(unit->stats));
+    rdbSaveStatsUpdate(rdb,0);
+    sdsclear(unit->buf);
+    unit->done = 0;
+    return retval;
+}
+
+/* Save the keys of the specified DB using rdb-save-threads threads. Returns
+ * -1 on error. */
+static int rdbSaveDbParallel(rio *rdb, redisDb *db, int rdbflags) {
+    dict *d = db->dict;
+    unsigned long units = 0;
+    size_t processed = 0;
+    int numthreads = server.rdb_save_threads, retval = 0, j;
+
+    for (j = 0; j < (dictIsRehashing(d) ? 2 : 1); j++)
+        units += (d->ht[j].size+RDB_SAVE_UNIT_BUCKETS-1)/RDB_SAVE_UNIT_BUCKETS;
+
+    /* Like a safe iterator, pause the rehashing while the threads perform
+     * lookups in the main dict and in the expires. */
+    d->iterators++;
+    db->expires->iterators++;
+
+    rdbSaver.db = db;
+    rdbSaver.checksum = rdb->update_cksum != NULL;
+    rdbSaver.units = units;
+    rdbSaver.next = rdbSaver.written = 0;
+    rdbSaver.stop = 0;
+    for (j = 0; j < RDB_SAVE_RING_SIZE; j++) {
+        rdbSaver.ring[j].buf = sdsempty();
+        memset(&rdbSaver.ring[j].stats,0,sizeof(rdbSaveStats));
+        rdbSaver.ring[j].deferred = NULL;
+        rdbSaver.ring[j].done = 0;
+    }
+    for (j = 0; j < numthreads; j++) {
+        if (pthread_create(&rdbSaver.threads[j],NULL,rdbSaveThreadMain,NULL)) {
+            serverLog(LL_WARNING,"Fatal: Can't initialize the RDB save threads.");
+            exit(1);
+        }
+    }
+
+    /* Write the units in order as soon as they are ready. */
+    while (rdbSaver.written < units) {
+        rdbSaveUnit *unit = rdbSaver.ring+(rdbSaver.written%RDB_SAVE_RING_SIZE);
+
+        pthread_mutex_lock(&rdbSaver.mutex);
+        while (!unit->done)
+            pthread_cond_wait(&rdbSaver.done_cond,&rdbSaver.mutex);
+        pthread_mutex_unlock(&rdbSaver.mutex);
+
+        if (rdbSaveWriteUnit(rdb,unit) == -1) {
+            retval = -1;
+            break;
+        }
+
+        pthread_mutex_lock(&rdbSaver.mutex);
+        rdbSaver.written++;
+        pthread_cond_broadcast(&rdbSaver.space_cond);
+        pthread_mutex_unlock(&rdbSaver.mutex);
+
+        /* When this RDB is produced as part of an AOF rewrite, move
+         * accumulated diff from parent to child while rewriting in
+         * order to have a smaller final write. */
+        if (rdbflags & RDBFLAGS_AOF_PREAMBLE &&
+            rdb->processed_bytes > processed+AOF_READ_DIFF_INTERVAL_BYTES)
+        {
+            processed = rdb->processed_bytes;
+            aofReadDiffFromParent();
+        }
+    }
+
+    pthread_mutex_lock(&rdbSaver.mutex);
+    rdbSaver.stop = 1;
+    pthread_cond_broadcast(&rdbSaver.space_cond);
+    pthread_mutex_unlock(&rdbSaver.mutex);
+    for (j = 0; j < numthreads; j++) pthread_join(rdbSaver.threads[j],NULL);
+    for (j = 0; j < RDB_SAVE_RING_SIZE; j++) {
+        sdsfree(rdbSaver.ring[j].buf);
+        if (rdbSaver.ring[j].deferred) listRelease(rdbSaver.ring[j].deferred);
+    }
+
+    d->iterators--;
+    db->expires->iterators--;
+    return retval;
+}
+
 /* Produces a dump of the database in RDB format sending it to the specified
  * Redis I/O channel. On success C_OK is returned, otherwise C_ERR
  * is returned and part of the output, or all the output, can be
@@ -1194,17 +1694,11 @@ ssize_t rdbSaveSingleModuleAux(rio *rdb, int when, moduleType *mt) {
 int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
     dictIterator *di = NULL;
     dictEntry *de;
-    char magic[10];
     int j;
-    uint64_t cksum;
     size_t processed = 0;
 
-    if (server.rdb_checksum)
-        rdb->update_cksum = rioGenericUpdateChecksum;
-    snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
-    if (rdbWriteRaw(rdb,magic,9) == -1) goto werr;
-    if (rdbSaveInfoAuxFields(rdb,rdbflags,rsi) == -1) goto werr;
-    if (rdbSaveModulesAux(rdb, REDISMODULE_AUX_BEFORE_RDB) == -1) goto werr;
+    rdbSaveStatsStart();
+    if (rdbSaveRioHeader(rdb,rdbflags,rsi) == -1) goto werr;
 
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
@@ -1224,6 +1718,16 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
         if (rdbSaveLen(rdb,db_size) == -1) goto werr;
         if (rdbSaveLen(rdb,expires_size) == -1) goto werr;
 
+        /* Large DBs are saved by multiple threads in the child process. */
+        if (server.rdb_save_threads > 1 && getpid() != server.pid &&
+            db_size >= RDB_SAVE_MIN_KEYS)
+        {
+            dictReleaseIterator(di);
+            di = NULL;
+            if (rdbSaveDbParallel(rdb,db,rdbflags) == -1) goto werr;
+            continue;
+        }
+
         /* Iterate this DB writing every entry */
         while((de = dictNext(di)) != NULL) {
             sds keystr = dictGetKey(de);
@@ -1232,7 +1736,10 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
 
             initStaticStringObject(key,keystr);
             expire = getExpire(db,&key);
-            if (rdbSaveKeyValuePair(rdb,&key,o,expire) == -1) goto werr;
+            if (rdbSaveKeyValuePairWithStats(rdb,&key,o,expire,
+                                             &server.stat_rdb_save) == -1)
+                goto werr;
+            rdbSaveStatsUpdate(rdb,0);
 
             /* When this RDB is produced as part of an AOF rewrite, move
              * accumulated diff from parent to child while rewriting in
@@ -1248,36 +1755,15 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
         di = NULL; /* So that we don't release it again on error. */
     }
 
-    /* If we are storing the replication information on disk, persist
-     * the script cache as well: on successful PSYNC after a restart, we need
-     * to be able to process any EVALSHA inside the replication backlog the
-     * master will send us. */
-    if (rsi && dictSize(server.lua_scripts)) {
-        di = dictGetIterator(server.lua_scripts);
-        while((de = dictNext(di)) != NULL) {
-            robj *body = dictGetVal(de);
-            if (rdbSaveAuxField(rdb,"lua",3,body->ptr,sdslen(body->ptr)) == -1)
-                goto werr;
-        }
-        dictReleaseIterator(di);
-        di = NULL; /* So that we don't release it again on error. */
-    }
-
-    if (rdbSaveModulesAux(rdb, REDISMODULE_AUX_AFTER_RDB) == -1) goto werr;
-
-    /* EOF opcode */
-    if (rdbSaveType(rdb,RDB_OPCODE_EOF) == -1) goto werr;
-
-    /* CRC64 checksum. It will be zero if checksum computation is disabled, the
-     * loading code skips the check in this case. */
-    cksum = rdb->cksum;
-    memrev64ifbe(&cksum);
-    if (rioWrite(rdb,&cksum,8) == 0) goto werr;
+    if (rdbSaveRioTrailer(rdb,rsi) == -1) goto werr;
+    rdbSaveStatsUpdate(rdb,1);
+    rdbSaveCompressStats = NULL;
     return C_OK;
 
 werr:
     if (error) *error = errno;
     if (di) dictReleaseIterator(di);
+    rdbSaveCompressStats = NULL;
     return C_ERR;
 }
 
@@ -1343,8 +1829,12 @@ int rdbSave(char *filename, rdbSaveInfo *rsi) {
     }
 
     /* Make sure data will not remain on the OS's output buffers */
+    long long start = ustime();
     if (fflush(fp)) goto werr;
+    server.stat_rdb_save.write_usecs += ustime()-start;
+    start = ustime();
     if (fsync(fileno(fp))) goto werr;
+    server.stat_rdb_save.fsync_usecs += ustime()-start;
     if (fclose(fp)) { fp = NULL; goto werr; }
     fp = NULL;
     
@@ -1384,6 +1874,10 @@ int rdbSaveBackground(char *filename, rdbSaveInfo *rsi) {
 
     if (hasActiveChildProcess()) return C_ERR;
 
+    /* The child saves a more recent point in time of the dataset to the
+     * same file a fork-less snapshot would write. */
+    snapshotAbort();
+
     server.dirty_before_bgsave = server.dirty;
     server.lastbgsave_try = time(NULL);
     openChildInfoPipe();
@@ -1410,6 +1904,7 @@ int rdbSaveBackground(char *filename, rdbSaveInfo *rsi) {
         }
         serverLog(LL_NOTICE,"Background saving started by pid %d",childpid);
         server.rdb_save_time_start = time(NULL);
+        memset(&server.stat_rdb_save,0,sizeof(server.stat_rdb_save));
         server.rdb_child_pid = childpid;
         server.rdb_child_type = RDB_CHILD_TYPE_DISK;
         updateDictResizePolicy();
@@ -1482,6 +1977,28 @@ robj *rdbLoadCheckModuleValue(rio *rdb, char *modulename) {
     return createStringObject("module-dummy-value",18);
 }
 
+/* Convert a ziplist encoded hash or sorted set, as saved by older versions,
+ * into a listpack with the same elements. The ziplist is freed. */
+static unsigned char *rdbZiplistToListpack(unsigned char *zl) {
+    unsigned char *lp = lpNew();
+    unsigned char *p = ziplistIndex(zl,0);
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vll;
+    char buf[LONG_STR_SIZE];
+
+    while (p != NULL && ziplistGet(p,&vstr,&vlen,&vll)) {
+        if (vstr == NULL) {
+            vlen = ll2string(buf,sizeof(buf),vll);
+            vstr = (unsigned char*)buf;
+        }
+        lp = lpAppend(lp,vstr,vlen);
+        p = ziplistNext(zl,p);
+    }
+    zfree(zl);
+    return lp;
+}
+
 /* Load a Redis object of the specified type from the specified file.
  * On success a newly allocated object is returned, otherwise NULL. */
 robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
@@ -1542,16 +2059,29 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
                 /* Fetch integer value from element. */
                 if (isSdsRepresentableAsLongLong(sdsele,&llval) == C_OK) {
                     o->ptr = intsetAdd(o->ptr,llval,NULL);
+                } else if (len <= server.set_max_listpack_entries &&
+                           sdslen(sdsele) <= server.set_max_listpack_value)
+                {
+                    setTypeConvert(o,OBJ_ENCODING_LISTPACK);
                 } else {
                     setTypeConvert(o,OBJ_ENCODING_HT);
                     dictExpand(o->ptr,len);
                 }
+            } else if (o->encoding == OBJ_ENCODING_LISTPACK &&
+                       sdslen(sdsele) > server.set_max_listpack_value)
+            {
+                setTypeConvert(o,OBJ_ENCODING_HT);
+                dictExpand(o->ptr,len);
             }
 
             /* This will also be called when the set was just converted
              * to a regular hash table encoded set. */
             if (o->encoding == OBJ_ENCODING_HT) {
                 dictAdd((dict*)o->ptr,sdsele,NULL);
+            } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
+                o->ptr = lpAppend(o->ptr,(unsigned char*)sdsele,
+                                  sdslen(sdsele));
+                sdsfree(sdsele);
             } else {
                 sdsfree(sdsele);
             }
@@ -1563,7 +2093,8 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
         zset *zs;
 
         if ((zsetlen = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
-        o = createZsetObject();
+        o = (zsetlen > server.zset_max_skiplist_entries) ?
+            createZsetBtreeObject() : createZsetObject();
         zs = o->ptr;
 
         if (zsetlen > DICT_HT_INITIAL_SIZE)
@@ -1597,14 +2128,18 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
             /* Don't care about integer-encoded strings. */
             if (sdslen(sdsele) > maxelelen) maxelelen = sdslen(sdsele);
 
-            znode = zslInsert(zs->zsl,score,sdsele);
-            dictAdd(zs->dict,sdsele,&znode->score);
+            if (o->encoding == OBJ_ENCODING_BTREE) {
+                zsetBtreeInsert(zs,score,sdsele);
+            } else {
+                znode = zslInsert(zs->zsl,score,sdsele);
+                dictAdd(zs->dict,sdsele,&znode->score);
+            }
         }
 
         /* Convert *after* loading, since sorted sets are not stored ordered. */
-        if (zsetLength(o) <= server.zset_max_ziplist_entries &&
-            maxelelen <= server.zset_max_ziplist_value)
-                zsetConvert(o,OBJ_ENCODING_ZIPLIST);
+        if (zsetLength(o) <= server.zset_max_listpack_entries &&
+            maxelelen <= server.zset_max_listpack_value)
+                zsetConvert(o,OBJ_ENCODING_LISTPACK);
     } else if (rdbtype == RDB_TYPE_HASH) {
         uint64_t len;
         int ret;
@@ -1616,11 +2151,11 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
         o = createHashObject();
 
         /* Too many entries? Use a hash table. */
-        if (len > server.hash_max_ziplist_entries)
+        if (len > server.hash_max_listpack_entries)
             hashTypeConvert(o, OBJ_ENCODING_HT);
 
-        /* Load every field and value into the ziplist */
-        while (o->encoding == OBJ_ENCODING_ZIPLIST && len > 0) {
+        /* Load every field and value into the listpack */
+        while (o->encoding == OBJ_ENCODING_LISTPACK && len > 0) {
             len--;
             /* Load raw strings */
             if ((field = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL) {
@@ -1633,15 +2168,13 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
                 return NULL;
             }
 
-            /* Add pair to ziplist */
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)field,
-                    sdslen(field), ZIPLIST_TAIL);
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)value,
-                    sdslen(value), ZIPLIST_TAIL);
+            /* Add pair to listpack */
+            o->ptr = lpAppend(o->ptr, (unsigned char*)field, sdslen(field));
+            o->ptr = lpAppend(o->ptr, (unsigned char*)value, sdslen(value));
 
             /* Convert to hash table if size threshold is exceeded */
-            if (sdslen(field) > server.hash_max_ziplist_value ||
-                sdslen(value) > server.hash_max_ziplist_value)
+            if (sdslen(field) > server.hash_max_listpack_value ||
+                sdslen(value) > server.hash_max_listpack_value)
             {
                 sdsfree(field);
                 sdsfree(value);
@@ -1678,6 +2211,40 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
 
         /* All pairs should be read by now */
         serverAssert(len == 0);
+    } else if (rdbtype == RDB_TYPE_HASH_TTL) {
+        uint64_t len, ttl;
+        long long minexpire;
+        sds field, value;
+
+        /* See rdbSaveObject() for the format. The hash is loaded as a hash
+         * table, the only encoding supporting fields with a TTL. */
+        minexpire = rdbLoadMillisecondTime(rdb,RDB_VERSION);
+        if (rioGetReadError(rdb)) return NULL;
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+        if (len == 0) rdbExitReportCorruptRDB("Empty hash with TTLs");
+
+        o = createHashObject();
+        hashTypeConvert(o,OBJ_ENCODING_HT);
+        if (len > DICT_HT_INITIAL_SIZE) dictExpand(o->ptr,len);
+
+        while (len--) {
+            if (rdbLoadLenByRef(rdb,NULL,&ttl) == -1) {
+                decrRefCount(o);
+                return NULL;
+            }
+            if ((field = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL) {
+                decrRefCount(o);
+                return NULL;
+            }
+            if ((value = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL) {
+                sdsfree(field);
+                decrRefCount(o);
+                return NULL;
+            }
+            if (dictAdd((dict*)o->ptr,field,value) == DICT_ERR)
+                rdbExitReportCorruptRDB("Duplicate keys detected");
+            if (ttl) hashTypeSetFieldExpire(o,field,minexpire+(long long)ttl-1);
+        }
     } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST) {
         if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
         o = createQuicklistObject();
@@ -1696,8 +2263,11 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
     } else if (rdbtype == RDB_TYPE_HASH_ZIPMAP  ||
                rdbtype == RDB_TYPE_LIST_ZIPLIST ||
                rdbtype == RDB_TYPE_SET_INTSET   ||
+               rdbtype == RDB_TYPE_SET_LISTPACK ||
                rdbtype == RDB_TYPE_ZSET_ZIPLIST ||
-               rdbtype == RDB_TYPE_HASH_ZIPLIST)
+               rdbtype == RDB_TYPE_HASH_ZIPLIST ||
+               rdbtype == RDB_TYPE_ZSET_LISTPACK ||
+               rdbtype == RDB_TYPE_HASH_LISTPACK)
     {
         unsigned char *encoded =
             rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
@@ -1712,10 +2282,10 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
          * converted. */
         switch(rdbtype) {
             case RDB_TYPE_HASH_ZIPMAP:
-                /* Convert to ziplist encoded hash. This must be deprecated
+                /* Convert to listpack encoded hash. This must be deprecated
                  * when loading dumps created by Redis 2.4 gets deprecated. */
                 {
-                    unsigned char *zl = ziplistNew();
+                    unsigned char *lp = lpNew();
                     unsigned char *zi = zipmapRewind(o->ptr);
                     unsigned char *fstr, *vstr;
                     unsigned int flen, vlen;
@@ -1724,17 +2294,17 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
                     while ((zi = zipmapNext(zi, &fstr, &flen, &vstr, &vlen)) != NULL) {
                         if (flen > maxlen) maxlen = flen;
                         if (vlen > maxlen) maxlen = vlen;
-                        zl = ziplistPush(zl, fstr, flen, ZIPLIST_TAIL);
-                        zl = ziplistPush(zl, vstr, vlen, ZIPLIST_TAIL);
+                        lp = lpAppend(lp, fstr, flen);
+                        lp = lpAppend(lp, vstr, vlen);
                     }
 
                     zfree(o->ptr);
-                    o->ptr = zl;
+                    o->ptr = lp;
                     o->type = OBJ_HASH;
-                    o->encoding = OBJ_ENCODING_ZIPLIST;
+                    o->encoding = OBJ_ENCODING_LISTPACK;
 
-                    if (hashTypeLength(o) > server.hash_max_ziplist_entries ||
-                        maxlen > server.hash_max_ziplist_value)
+                    if (hashTypeLength(o) > server.hash_max_listpack_entries ||
+                        maxlen > server.hash_max_listpack_value)
                     {
                         hashTypeConvert(o, OBJ_ENCODING_HT);
                     }
@@ -1751,16 +2321,28 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
                 if (intsetLen(o->ptr) > server.set_max_intset_entries)
                     setTypeConvert(o,OBJ_ENCODING_HT);
                 break;
+            case RDB_TYPE_SET_LISTPACK:
+                o->type = OBJ_SET;
+                o->encoding = OBJ_ENCODING_LISTPACK;
+                if (lpLength(o->ptr) > server.set_max_listpack_entries)
+                    setTypeConvert(o,OBJ_ENCODING_HT);
+                break;
             case RDB_TYPE_ZSET_ZIPLIST:
+            case RDB_TYPE_ZSET_LISTPACK:
+                if (rdbtype == RDB_TYPE_ZSET_ZIPLIST)
+                    o->ptr = rdbZiplistToListpack(o->ptr);
                 o->type = OBJ_ZSET;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
-                if (zsetLength(o) > server.zset_max_ziplist_entries)
+                o->encoding = OBJ_ENCODING_LISTPACK;
+                if (zsetLength(o) > server.zset_max_listpack_entries)
                     zsetConvert(o,OBJ_ENCODING_SKIPLIST);
                 break;
             case RDB_TYPE_HASH_ZIPLIST:
+            case RDB_TYPE_HASH_LISTPACK:
+                if (rdbtype == RDB_TYPE_HASH_ZIPLIST)
+                    o->ptr = rdbZiplistToListpack(o->ptr);
                 o->type = OBJ_HASH;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
-                if (hashTypeLength(o) > server.hash_max_ziplist_entries)
+                o->encoding = OBJ_ENCODING_LISTPACK;
+                if (hashTypeLength(o) > server.hash_max_listpack_entries)
                     hashTypeConvert(o, OBJ_ENCODING_HT);
                 break;
             default:
@@ -2087,23 +2669,465 @@ void stopSaving(int success) {
                           NULL);
 }
 
+/* -----------------------------------------------------------------------------
+ * Parallel loading
+ *
+ * When rdb-load-threads is greater than one, the values are not decoded by
+ * the main thread as they are read. The main thread just reads the key of
+ * every record, and frames its serialized value, parsing only the lengths
+ * and copying the bytes in a batch. Full batches are decoded by a pool of
+ * threads with rdbLoadObject(), and the main thread adds the decoded values
+ * to the dataset, in the same order they were read.
+ *
+ * Since the main thread still reads the whole stream, the checksum and
+ * rdbLoadProgressCallback() work as usual. Values that can't be framed
+ * without decoding them (streams and module types) are still loaded by the
+ * main thread, after the pending batches are added to the dataset, and so
+ * is the module AUX data, so that modules see the keys loaded so far.
+ * -------------------------------------------------------------------------- */
+
+#define RDB_LOAD_BATCH_KEYS 256
+#define RDB_LOAD_BATCH_BYTES (1024*256)
+#define RDB_LOAD_BATCHES_PER_THREAD 4
+#define RDB_LOAD_MAX_THREADS 16
+
+typedef struct rdbLoadRecord {
+    int type;                   /* RDB type of the value. */
+    redisDb *db;
+    sds key;
+    size_t offset;              /* Offset of the value in the batch buffer. */
+    long long expiretime, lru_idle, lfu_freq;
+    robj *val;                  /* Value decoded by the loading threads. */
+} rdbLoadRecord;
+
+typedef struct rdbLoadBatch {
+    sds buf;                    /* Serialized values of the records. */
+    int count;                  /* Number of records. */
+    int decoded;                /* True once decoded by a loading thread. */
+    rdbLoadRecord records[RDB_LOAD_BATCH_KEYS];
+} rdbLoadBatch;
+
+static struct rdbParallelLoader {
+    int threads;                /* Number of loading threads, 0 if disabled. */
+    pthread_t tids[RDB_LOAD_MAX_THREADS];
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;   /* Signaled when a batch is submitted. */
+    pthread_cond_t done_cond;   /* Signaled when a batch is decoded. */
+    int stop;                   /* Tell the loading threads to exit. */
+    rdbLoadBatch **batches;     /* Circular array of the submitted batches. */
+    int size;                   /* Size of the 'batches' array. */
+    unsigned long added;        /* Batches added to the dataset. */
+    unsigned long decoding;     /* Batches taken by the loading threads. */
+    unsigned long submitted;    /* Batches submitted. */
+    rdbLoadBatch *filling;      /* Batch being filled by the main thread. */
+    int capture;                /* Copy what is read in 'filling'. */
+    /* Options of the load, used to add the keys to the dataset. */
+    int rdbflags;
+    long long now, lru_clock;
+} rdbLoader = {0};
+
+static void rdbLoadAddKey(redisDb *db, sds key, robj *val,
+                          long long expiretime, long long lru_idle,
+                          long long lfu_freq, long long lru_clock,
+                          long long now, int rdbflags);
+
+/* Decode the values of the batches submitted by the main thread. */
+static void *rdbLoadThreadMain(void *arg) {
+    struct rdbParallelLoader *l = arg;
+    rio r;
+
+    redis_set_thread_title("rdb_load");
+    pthread_mutex_lock(&l->mutex);
+    while(1) {
+        if (l->stop) break;
+        if (l->decoding == l->submitted) {
+            pthread_cond_wait(&l->work_cond,&l->mutex);
+            continue;
+        }
+        rdbLoadBatch *b = l->batches[l->decoding++ % l->size];
+        pthread_mutex_unlock(&l->mutex);
+
+        rioInitWithBuffer(&r,b->buf);
+        for (int j = 0; j < b->count; j++) {
+            rdbLoadRecord *rec = b->records+j;
+            r.io.buffer.pos = rec->offset;
+            rec->val = rdbLoadObject(rec->type,&r,rec->key);
+            if (rec->val == NULL) break; /* Reported by the main thread. */
+        }
+
+        pthread_mutex_lock(&l->mutex);
+        b->decoded = 1;
+        pthread_cond_broadcast(&l->done_cond);
+    }
+    pthread_mutex_unlock(&l->mutex);
+    return NULL;
+}
+
+/* Start the loading threads if rdb-load-threads is greater than one. */
+static void rdbParallelLoadStart(int rdbflags, long long now,
+                                 long long lru_clock)
+{
+    struct rdbParallelLoader *l = &rdbLoader;
+    int threads = server.rdb_load_threads;
+
+    l->threads = 0;
+    if (threads <= 1) return;
+    if (threads > RDB_LOAD_MAX_THREADS) threads = RDB_LOAD_MAX_THREADS;
+
+    pthread_mutex_init(&l->mutex,NULL);
+    pthread_cond_init(&l->work_cond,NULL);
+    pthread_cond_init(&l->done_cond,NULL);
+    l->stop = 0;
+    l->size = threads*RDB_LOAD_BATCHES_PER_THREAD;
+    l->batches = zmalloc(sizeof(rdbLoadBatch*)*l->size);
+    l->added = l->decoding = l->submitted = 0;
+    l->filling = NULL;
+    l->capture = 0;
+    l->rdbflags = rdbflags;
+    l->now = now;
+    l->lru_clock = lru_clock;
+    for (int j = 0; j < threads; j++) {
+        if (pthread_create(&l->tids[j],NULL,rdbLoadThreadMain,l) != 0) break;
+        l->threads++;
+    }
+    if (l->threads == 0) {
+        serverLog(LL_WARNING,"Can't create the RDB loading threads, "
+                             "loading with the main thread.");
+        zfree(l->batches);
+    }
+}
+
+/* Release a batch that was not submitted. */
+static void rdbParallelLoadFreeBatch(rdbLoadBatch *b) {
+    for (int j = 0; j < b->count; j++) sdsfree(b->records[j].key);
+    sdsfree(b->buf);
+    zfree(b);
+}
+
+/* Add to the dataset the oldest submitted batch, waiting for the loading
+ * threads to decode it. If 'discard' is true the batch is just released.
+ * Returns C_ERR if a value could not be decoded. */
+static int rdbParallelLoadAddBatch(int discard) {
+    struct rdbParallelLoader *l = &rdbLoader;
+    rdbLoadBatch *b = l->batches[l->added % l->size];
+    int retval = C_OK;
+
+    pthread_mutex_lock(&l->mutex);
+    while (!b->decoded) pthread_cond_wait(&l->done_cond,&l->mutex);
+    pthread_mutex_unlock(&l->mutex);
+
+    for (int j = 0; j < b->count; j++) {
+        rdbLoadRecord *rec = b->records+j;
+        if (rec->val == NULL) retval = C_ERR;
+        if (retval == C_OK && !discard) {
+            rdbLoadAddKey(rec->db,rec->key,rec->val,rec->expiretime,
+                          rec->lru_idle,rec->lfu_freq,l->lru_clock,l->now,
+                          l->rdbflags);
+        } else {
+            if (rec->val) decrRefCount(rec->val);
+            sdsfree(rec->key);
+        }
+    }
+    sdsfree(b->buf);
+    zfree(b);
+    l->added++;
+    return retval;
+}
+
+/* Submit the batch being filled to the loading threads. */
+static int rdbParallelLoadSubmit(void) {
+    struct rdbParallelLoader *l = &rdbLoader;
+    rdbLoadBatch *b = l->filling;
+
+    if (b == NULL) return C_OK;
+    l->filling = NULL;
+    /* Make room for the batch adding the oldest one to the dataset. */
+    if (l->submitted - l->added == (unsigned long)l->size &&
+        rdbParallelLoadAddBatch(0) == C_ERR)
+    {
+        rdbParallelLoadFreeBatch(b);
+        return C_ERR;
+    }
+    pthread_mutex_lock(&l->mutex);
+    l->batches[l->submitted++ % l->size] = b;
+    pthread_cond_signal(&l->work_cond);
+    pthread_mutex_unlock(&l->mutex);
+    return C_OK;
+}
+
+/* Submit the batch being filled, and add to the dataset all the submitted
+ * batches. Returns C_ERR if a value could not be decoded. */
+static int rdbParallelLoadFlush(void) {
+    struct rdbParallelLoader *l = &rdbLoader;
+    int retval = rdbParallelLoadSubmit();
+
+    while (l->added != l->submitted) {
+        if (rdbParallelLoadAddBatch(retval == C_ERR) == C_ERR) retval = C_ERR;
+    }
+    return retval;
+}
+
+/* Stop the loading threads, releasing the batches not yet added to the
+ * dataset, if any (that is, if the loading failed). */
+static void rdbParallelLoadStop(void) {
+    struct rdbParallelLoader *l = &rdbLoader;
+
+    if (l->threads == 0) return;
+    l->capture = 0;
+    if (l->filling) {
+        rdbParallelLoadFreeBatch(l->filling);
+        l->filling = NULL;
+    }
+    while (l->added != l->submitted) rdbParallelLoadAddBatch(1);
+
+    pthread_mutex_lock(&l->mutex);
+    l->stop = 1;
+    pthread_cond_broadcast(&l->work_cond);
+    pthread_mutex_unlock(&l->mutex);
+    for (int j = 0; j < l->threads; j++) pthread_join(l->tids[j],NULL);
+    pthread_mutex_destroy(&l->mutex);
+    pthread_cond_destroy(&l->work_cond);
+    pthread_cond_destroy(&l->done_cond);
+    zfree(l->batches);
+    l->threads = 0;
+}
+
+/* Return true if values of the specified RDB type can be framed without
+ * decoding them, see rdbSkipObject(). */
+static int rdbParallelLoadType(int rdbtype) {
+    return rdbtype != RDB_TYPE_STREAM_LISTPACKS &&
+           rdbtype != RDB_TYPE_MODULE &&
+           rdbtype != RDB_TYPE_MODULE_2;
+}
+
+/* Skip 'len' bytes of the stream. */
+static int rdbSkipBytes(rio *rdb, uint64_t len) {
+    char buf[4096];
+
+    while (len) {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (rioRead(rdb,buf,n) == 0) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Skip a string saved with rdbSaveRawString(). */
+static int rdbSkipString(rio *rdb) {
+    int isencoded;
+    uint64_t len;
+
+    if (rdbLoadLenByRef(rdb,&isencoded,&len) == -1) return -1;
+    if (isencoded) {
+        switch(len) {
+        case RDB_ENC_INT8: len = 1; break;
+        case RDB_ENC_INT16: len = 2; break;
+        case RDB_ENC_INT32: len = 4; break;
+        case RDB_ENC_LZF:
+        case RDB_ENC_LZ4:
+            if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+            if (rdbLoadLen(rdb,NULL) == RDB_LENERR) return -1;
+            break;
+        default:
+            rdbExitReportCorruptRDB("Unknown RDB string encoding type %d",
+                (int)len);
+            return -1;
+        }
+    }
+    return rdbSkipBytes(rdb,len);
+}
+
+/* Skip a value of the specified RDB type, reading just the lengths needed
+ * in order to find where it ends. Returns 0 on success, -1 on read error. */
+static int rdbSkipObject(rio *rdb, int rdbtype) {
+    uint64_t len;
+    unsigned char dlen;
+
+    switch(rdbtype) {
+    case RDB_TYPE_STRING:
+    case RDB_TYPE_HASH_ZIPMAP:
+    case RDB_TYPE_LIST_ZIPLIST:
+    case RDB_TYPE_SET_INTSET:
+    case RDB_TYPE_SET_LISTPACK:
+    case RDB_TYPE_ZSET_ZIPLIST:
+    case RDB_TYPE_HASH_ZIPLIST:
+    case RDB_TYPE_ZSET_LISTPACK:
+    case RDB_TYPE_HASH_LISTPACK:
+        return rdbSkipString(rdb);
+    case RDB_TYPE_LIST:
+    case RDB_TYPE_SET:
+    case RDB_TYPE_LIST_QUICKLIST:
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+        while (len--) if (rdbSkipString(rdb) == -1) return -1;
+        return 0;
+    case RDB_TYPE_HASH:
+    case RDB_TYPE_HASH_TTL:
+        if (rdbtype == RDB_TYPE_HASH_TTL &&
+            rdbSkipBytes(rdb,sizeof(int64_t)) == -1) return -1;
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+        while (len--) {
+            if (rdbtype == RDB_TYPE_HASH_TTL &&
+                rdbLoadLen(rdb,NULL) == RDB_LENERR) return -1;
+            if (rdbSkipString(rdb) == -1) return -1;
+            if (rdbSkipString(rdb) == -1) return -1;
+        }
+        return 0;
+    case RDB_TYPE_ZSET_2:
+    case RDB_TYPE_ZSET:
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+        while (len--) {
+            if (rdbSkipString(rdb) == -1) return -1;
+            if (rdbtype == RDB_TYPE_ZSET_2) {
+                if (rdbSkipBytes(rdb,sizeof(double)) == -1) return -1;
+            } else {
+                /* See rdbLoadDoubleValue(). */
+                if (rioRead(rdb,&dlen,1) == 0) return -1;
+                if (dlen < 253 && rdbSkipBytes(rdb,dlen) == -1) return -1;
+            }
+        }
+        return 0;
+    default:
+        rdbExitReportCorruptRDB("Unknown RDB encoding type %d",rdbtype);
+        return -1;
+    }
+}
+
+/* Frame the value of the specified key, adding it to the batch being filled,
+ * that is submitted to the loading threads once full. Returns C_ERR on read
+ * errors, or if a value of a previous batch could not be decoded. */
+static int rdbParallelLoadKey(rio *rdb, int rdbtype, redisDb *db, sds key,
+                              long long expiretime, long long lru_idle,
+                              long long lfu_freq)
+{
+    struct rdbParallelLoader *l = &rdbLoader;
+    rdbLoadBatch *b = l->filling;
+
+    if (b == NULL) {
+        b = l->filling = zmalloc(sizeof(*b));
+        b->buf = sdsMakeRoomFor(sdsempty(),RDB_LOAD_BATCH_BYTES);
+        b->count = 0;
+        b->decoded = 0;
+    }
+
+    rdbLoadRecord *rec = b->records+b->count++;
+    rec->type = rdbtype;
+    rec->db = db;
+    rec->key = key;
+    rec->offset = sdslen(b->buf);
+    rec->expiretime = expiretime;
+    rec->lru_idle = lru_idle;
+    rec->lfu_freq = lfu_freq;
+    rec->val = NULL;
+
+    /* rdbLoadProgressCallback() copies in the batch what we read. */
+    l->capture = 1;
+    int retval = rdbSkipObject(rdb,rdbtype);
+    l->capture = 0;
+    if (retval == -1) return C_ERR;
+
+    if (b->count == RDB_LOAD_BATCH_KEYS ||
+        sdslen(b->buf) >= RDB_LOAD_BATCH_BYTES)
+    {
+        return rdbParallelLoadSubmit();
+    }
+    return C_OK;
+}
+
 /* Track loading progress in order to serve client's from time to time
    and if needed calculate rdb checksum  */
 void rdbLoadProgressCallback(rio *r, const void *buf, size_t len) {
     if (server.rdb_checksum)
         rioGenericUpdateChecksum(r, buf, len);
+    if (rdbLoader.capture)
+        rdbLoader.filling->buf = sdscatlen(rdbLoader.filling->buf,buf,len);
     if (server.loading_process_events_interval_bytes &&
         (r->processed_bytes + len)/server.loading_process_events_interval_bytes > r->processed_bytes/server.loading_process_events_interval_bytes)
     {
-        /* The DB can take some non trivial amount of time to load. Update
-         * our cached time since it is used to create and update the last
-         * interaction time with clients and for other important things. */
-        updateCachedTime(0);
-        if (server.masterhost && server.repl_state == REPL_STATE_TRANSFER)
-            replicationSendNewlineToMaster();
-        loadingProgress(r->processed_bytes);
-        processEventsWhileBlocked();
-        processModuleLoadingProgressEvent(0);
+        loadingProcessEvents(r->processed_bytes);
+    }
+}
+
+/* Serve the clients from time to time while loading an RDB. When the
+ * dataset received from the master is loaded with the old one backed up
+ * (see repl-diskless-load-pipeline), the old dataset is swapped back in
+ * server.db meanwhile, so that read only commands can be served. */
+void loadingProcessEvents(off_t pos) {
+    dbBackup *stale = server.loading_stale_backup;
+
+    /* The DB can take some non trivial amount of time to load. Update
+     * our cached time since it is used to create and update the last
+     * interaction time with clients and for other important things. */
+    updateCachedTime(0);
+    if (server.masterhost && server.repl_state == REPL_STATE_TRANSFER)
+        replicationSendNewlineToMaster();
+    loadingProgress(pos);
+    if (stale) {
+        swapDbBackup(stale);
+        server.loading_serving_stale = 1;
+    }
+    processEventsWhileBlocked();
+    if (stale) {
+        server.loading_serving_stale = 0;
+        swapDbBackup(stale);
+    }
+    processModuleLoadingProgressEvent(0);
+}
+
+/* Add a key loaded from an RDB to the dataset, unless it is already expired
+ * and we are allowed to expire it. */
+static void rdbLoadAddKey(redisDb *db, sds key, robj *val,
+                          long long expiretime, long long lru_idle,
+                          long long lfu_freq, long long lru_clock,
+                          long long now, int rdbflags)
+{
+    /* Check if the key already expired. This function is used when loading
+     * an RDB file from disk, either at startup, or when an RDB was
+     * received from the master. In the latter case, the master is
+     * responsible for key expiry. If we would expire keys here, the
+     * snapshot taken by the master may not be reflected on the slave.
+     * Similarly if the RDB is the preamble of an AOF file, we want to
+     * load all the keys as they are, since the log of operations later
+     * assume to work in an exact keyspace state. */
+    if (iAmMaster() &&
+        !(rdbflags&RDBFLAGS_AOF_PREAMBLE) &&
+        expiretime != -1 && expiretime < now)
+    {
+        sdsfree(key);
+        decrRefCount(val);
+    } else {
+        robj keyobj;
+        initStaticStringObject(keyobj,key);
+
+        /* Add the new object in the hash table */
+        int added = dbAddRDBLoad(db,key,val);
+        if (!added) {
+            if (rdbflags & RDBFLAGS_ALLOW_DUP) {
+                /* This flag is useful for DEBUG RELOAD special modes.
+                 * When it's set we allow new keys to replace the current
+                 * keys with the same name. */
+                dbSyncDelete(db,&keyobj);
+                dbAddRDBLoad(db,key,val);
+            } else {
+                serverLog(LL_WARNING,
+                    "RDB has duplicated key '%s' in DB %d",key,db->id);
+                serverPanic("Duplicated key found in RDB file");
+            }
+        }
+
+        /* Set the expire time if needed */
+        if (expiretime != -1) {
+            setExpire(NULL,db,&keyobj,expiretime);
+        }
+
+        /* Set usage information (for eviction). */
+        objectSetLRUOrLFU(val,lfu_freq,lru_idle,lru_clock,1000);
+
+        /* call key space notification on key loaded for modules only */
+        moduleNotifyKeyspaceEvent(NOTIFY_LOADED, "loaded", &keyobj, db->id);
+
+        /* With compact keyspace entries the key was copied into the
+         * dict entry, so we still own the loaded SDS string. */
+        if (dbKeysAreEmbedded(db)) sdsfree(key);
     }
 }
 
@@ -2135,6 +3159,7 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
     long long lru_idle = -1, lfu_freq = -1, expiretime = -1, now = mstime();
     long long lru_clock = LRU_CLOCK();
 
+    rdbParallelLoadStart(rdbflags,now,lru_clock);
     while(1) {
         sds key;
         robj *val;
@@ -2171,6 +3196,8 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_EOF) {
             /* EOF: End of file, exit the main loop. */
+            if (rdbLoader.threads && rdbParallelLoadFlush() == C_ERR)
+                goto eoferr;
             break;
         } else if (type == RDB_OPCODE_SELECTDB) {
             /* SELECTDB: Select the specified database. */
@@ -2259,6 +3286,8 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
             /* Load module data that is not related to the Redis key space.
              * Such data can be potentially be stored both before and after the
              * RDB keys-values section. */
+            if (rdbLoader.threads && rdbParallelLoadFlush() == C_ERR)
+                goto eoferr;
             uint64_t moduleid = rdbLoadLen(rdb,NULL);
             int when_opcode = rdbLoadLen(rdb,NULL);
             int when = rdbLoadLen(rdb,NULL);
@@ -2311,56 +3340,24 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
         /* Read key */
         if ((key = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL)
             goto eoferr;
-        /* Read value */
-        if ((val = rdbLoadObject(type,rdb,key)) == NULL) {
-            sdsfree(key);
-            goto eoferr;
-        }
-
-        /* Check if the key already expired. This function is used when loading
-         * an RDB file from disk, either at startup, or when an RDB was
-         * received from the master. In the latter case, the master is
-         * responsible for key expiry. If we would expire keys here, the
-         * snapshot taken by the master may not be reflected on the slave.
-         * Similarly if the RDB is the preamble of an AOF file, we want to
-         * load all the keys as they are, since the log of operations later
-         * assume to work in an exact keyspace state. */
-        if (iAmMaster() &&
-            !(rdbflags&RDBFLAGS_AOF_PREAMBLE) &&
-            expiretime != -1 && expiretime < now)
-        {
-            sdsfree(key);
-            decrRefCount(val);
+        if (rdbLoader.threads && rdbParallelLoadType(type)) {
+            /* The value is decoded by the loading threads. */
+            if (rdbParallelLoadKey(rdb,type,db,key,expiretime,lru_idle,
+                                   lfu_freq) == C_ERR) goto eoferr;
         } else {
-            robj keyobj;
-            initStaticStringObject(keyobj,key);
-
-            /* Add the new object in the hash table */
-            int added = dbAddRDBLoad(db,key,val);
-            if (!added) {
-                if (rdbflags & RDBFLAGS_ALLOW_DUP) {
-                    /* This flag is useful for DEBUG RELOAD special modes.
-                     * When it's set we allow new keys to replace the current
-                     * keys with the same name. */
-                    dbSyncDelete(db,&keyobj);
-                    dbAddRDBLoad(db,key,val);
-                } else {
-                    serverLog(LL_WARNING,
-                        "RDB has duplicated key '%s' in DB %d",key,db->id);
-                    serverPanic("Duplicated key found in RDB file");
-                }
+            /* Add the keys loaded so far before this one, so that they are
+             * added to the dataset in order. */
+            if (rdbLoader.threads && rdbParallelLoadFlush() == C_ERR) {
+                sdsfree(key);
+                goto eoferr;
             }
-
-            /* Set the expire time if needed */
-            if (expiretime != -1) {
-                setExpire(NULL,db,&keyobj,expiretime);
+            /* Read value */
+            if ((val = rdbLoadObject(type,rdb,key)) == NULL) {
+                sdsfree(key);
+                goto eoferr;
             }
-
-            /* Set usage information (for eviction). */
-            objectSetLRUOrLFU(val,lfu_freq,lru_idle,lru_clock,1000);
-
-            /* call key space notification on key loaded for modules only */
-            moduleNotifyKeyspaceEvent(NOTIFY_LOADED, "loaded", &keyobj, db->id);
+            rdbLoadAddKey(db,key,val,expiretime,lru_idle,lfu_freq,lru_clock,
+                          now,rdbflags);
         }
 
         /* Loading the database more slowly is useful in order to test
@@ -2373,6 +3370,8 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
         lfu_freq = -1;
         lru_idle = -1;
     }
+    rdbParallelLoadStop();
+
     /* Verify the checksum if RDB version is >= 5 */
     if (rdbver >= 5) {
         uint64_t cksum, expected = rdb->cksum;
@@ -2398,6 +3397,7 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
      * the RDB file from a socket during initial SYNC (diskless replica mode),
      * we'll report the error to the caller, so that we can retry. */
 eoferr:
+    rdbParallelLoadStop();
     serverLog(LL_WARNING,
         "Short read or OOM loading DB. Unrecoverable error, aborting now.");
     rdbReportReadError("Unexpected EOF reading RDB file");
@@ -2416,10 +3416,16 @@ int rdbLoad(char *filename, rdbSaveInfo *rsi, int rdbflags) {
     rio rdb;
     int retval;
 
+    struct redis_stat sb;
+    int mapped = 0;
+
     if ((fp = fopen(filename,"r")) == NULL) return C_ERR;
     startLoadingFile(fp, filename,rdbflags);
-    rioInitWithFile(&rdb,fp);
+    if (server.rdb_load_mmap && redis_fstat(fileno(fp),&sb) != -1)
+        mapped = rioInitWithMmap(&rdb,fileno(fp),sb.st_size);
+    if (!mapped) rioInitWithFile(&rdb,fp);
     retval = rdbLoadRio(&rdb,rdbflags,rsi);
+    if (mapped) rioFreeMmap(&rdb);
     fclose(fp);
     stopLoading(retval==C_OK);
     return retval;
@@ -2589,6 +3595,7 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
             serverLog(LL_NOTICE,"Background RDB transfer started by pid %d",
                 childpid);
             server.rdb_save_time_start = time(NULL);
+            memset(&server.stat_rdb_save,0,sizeof(server.stat_rdb_save));
             server.rdb_child_pid = childpid;
             server.rdb_child_type = RDB_CHILD_TYPE_SOCKET;
             updateDictResizePolicy();
@@ -2603,7 +3610,7 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
 }
 
 void saveCommand(client *c) {
-    if (server.rdb_child_pid != -1) {
+    if (server.rdb_child_pid != -1 || server.snapshot_in_progress) {
         addReplyError(c,"Background save already in progress");
         return;
     }
@@ -2634,7 +3641,7 @@ void bgsaveCommand(client *c) {
     rdbSaveInfo rsi, *rsiptr;
     rsiptr = rdbPopulateSaveInfo(&rsi);
 
-    if (server.rdb_child_pid != -1) {
+    if (server.rdb_child_pid != -1 || server.snapshot_in_progress) {
         addReplyError(c,"Background save already in progress");
     } else if (hasActiveChildProcess()) {
         if (schedule) {
@@ -2646,6 +3653,11 @@ void bgsaveCommand(client *c) {
             "Use BGSAVE SCHEDULE in order to schedule a BGSAVE whenever "
             "possible.");
         }
+    } else if (server.rdb_save_forkless) {
+        if (snapshotStart(server.rdb_filename,rsiptr) == C_OK)
+            addReplyStatus(c,"Background saving started");
+        else
+            addReply(c,shared.err);
     } else if (rdbSaveBackground(server.rdb_filename,rsiptr) == C_OK) {
         addReplyStatus(c,"Background saving started");
     } else {
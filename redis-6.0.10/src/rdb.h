@@ -37,8 +37,14 @@
 #include "server.h"
 
 /* The current RDB version. When the format changes in a way that is no longer
- * backward compatible this number gets incremented. */
-#define RDB_VERSION 9
+ * backward compatible this number gets incremented.
+ *
+ * 10: strings may be compressed with LZ4 (RDB_ENC_LZ4).
+ * 11: sets may be saved as listpacks (RDB_TYPE_SET_LISTPACK).
+ * 12: hashes and sorted sets may be saved as listpacks
+ *     (RDB_TYPE_HASH_LISTPACK, RDB_TYPE_ZSET_LISTPACK).
+ * 13: hash fields may have a TTL (RDB_TYPE_HASH_TTL). */
+#define RDB_VERSION 13
 
 /* Defines related to the dump file format. To store 32 bits lengths for short
  * keys requires a lot of space, so we check the most significant 2 bits of
@@ -68,6 +74,12 @@
 #define RDB_ENC_INT16 1       /* 16 bit signed integer */
 #define RDB_ENC_INT32 2       /* 32 bit signed integer */
 #define RDB_ENC_LZF 3         /* string compressed with FASTLZ */
+#define RDB_ENC_LZ4 4         /* string compressed with LZ4 */
+
+/* Codecs used to compress the strings, see the rdb-compression-codec
+ * configuration. */
+#define RDB_CODEC_LZF 0
+#define RDB_CODEC_LZ4 1
 
 /* Map object types to RDB object types. Macros starting with OBJ_ are for
  * memory storage and may change. Instead RDB types must be fixed because
@@ -91,10 +103,18 @@
 #define RDB_TYPE_HASH_ZIPLIST  13
 #define RDB_TYPE_LIST_QUICKLIST 14
 #define RDB_TYPE_STREAM_LISTPACKS 15
+#define RDB_TYPE_HASH_LISTPACK 16
+#define RDB_TYPE_ZSET_LISTPACK 17
+#define RDB_TYPE_SET_LISTPACK  20 /* Same numbers used by later Redis versions
+                                     for the three listpack types. */
+#define RDB_TYPE_HASH_TTL      64 /* Hash table with fields having a TTL. Far
+                                     from the numbers used by later Redis
+                                     versions, that encode it differently. */
 /* NOTE: WHEN ADDING NEW RDB TYPE, UPDATE rdbIsObjectType() BELOW */
 
 /* Test if a type is an object type. */
-#define rdbIsObjectType(t) ((t >= 0 && t <= 7) || (t >= 9 && t <= 15))
+#define rdbIsObjectType(t) ((t >= 0 && t <= 7) || (t >= 9 && t <= 17) || \
+                            t == 20 || t == 64)
 
 /* Special RDB opcodes (saved/loaded with rdbSaveType/rdbLoadType). */
 #define RDB_OPCODE_MODULE_AUX 247   /* Module auxiliary data. */
@@ -153,6 +173,8 @@ robj *rdbLoadCheckModuleValue(rio *rdb, char *modulename);
 robj *rdbLoadStringObject(rio *rdb);
 ssize_t rdbSaveStringObject(rio *rdb, robj *obj);
 ssize_t rdbSaveRawString(rio *rdb, unsigned char *s, size_t len);
+ssize_t rdbSaveLongLongAsStringObject(rio *rdb, long long value);
+int rdbTryIntegerEncoding(char *s, size_t len, unsigned char *enc);
 void *rdbGenericLoadStringObject(rio *rdb, int flags, size_t *lenptr);
 int rdbSaveBinaryDoubleValue(rio *rdb, double val);
 int rdbLoadBinaryDoubleValue(rio *rdb, double *val);
@@ -160,6 +182,8 @@ int rdbSaveBinaryFloatValue(rio *rdb, float val);
 int rdbLoadBinaryFloatValue(rio *rdb, float *val);
 int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi);
 int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi);
+int rdbSaveRioHeader(rio *rdb, int rdbflags, rdbSaveInfo *rsi);
+int rdbSaveRioTrailer(rio *rdb, rdbSaveInfo *rsi);
 rdbSaveInfo *rdbPopulateSaveInfo(rdbSaveInfo *rsi);
 
 #endif
@@ -97,31 +97,73 @@ int readArgc(FILE *fp, long *target) {
     return readLong(fp,'*',target);
 }
 
-off_t process(FILE *fp) {
+/* Check the MULTI/EXEC nesting given the name of the next command. */
+int checkMulti(const char *name, int *multi) {
+    if (strcasecmp(name, "multi") == 0) {
+        if ((*multi)++) {
+            ERROR("Unexpected MULTI");
+            return 0;
+        }
+    } else if (strcasecmp(name, "exec") == 0) {
+        if (--(*multi)) {
+            ERROR("Unexpected EXEC");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Check a block of the binary AOF format, see aof.c. */
+int processBinaryBlock(FILE *fp, off_t size, int *multi) {
+    sds payload;
+    rio r;
+    int ret, argc, j, ok = 1;
+    robj **argv;
+
+    epos = ftello(fp);
+    fgetc(fp); /* Skip the block type. */
+    if ((ret = aofReadBinaryBlock(fp,size,&payload)) != 1) {
+        if (ret == 0) {
+            ERROR("Truncated binary block");
+        } else {
+            ERROR("Binary block checksum mismatch or bad length");
+        }
+        return 0;
+    }
+    rioInitWithBuffer(&r,payload);
+    while(ok && (size_t)r.io.buffer.pos < sdslen(payload)) {
+        if (aofParseBinaryRecord(&r,&argc,&argv) == C_ERR) {
+            ERROR("Invalid record in binary block");
+            ok = 0;
+            break;
+        }
+        ok = checkMulti(argv[0]->ptr,multi);
+        for (j = 0; j < argc; j++) decrRefCount(argv[j]);
+        zfree(argv);
+    }
+    sdsfree(payload);
+    return ok;
+}
+
+off_t process(FILE *fp, off_t size) {
     long argc;
     off_t pos = 0;
-    int i, multi = 0;
+    int i, c, multi = 0;
     char *str;
 
     while(1) {
         if (!multi) pos = ftello(fp);
+        if ((c = fgetc(fp)) == EOF) break;
+        ungetc(c,fp);
+        if (c == AOF_BINARY_BLOCK) {
+            if (!processBinaryBlock(fp,size,&multi)) break;
+            continue;
+        }
         if (!readArgc(fp, &argc)) break;
 
         for (i = 0; i < argc; i++) {
             if (!readString(fp,&str)) break;
-            if (i == 0) {
-                if (strcasecmp(str, "multi") == 0) {
-                    if (multi++) {
-                        ERROR("Unexpected MULTI");
-                        break;
-                    }
-                } else if (strcasecmp(str, "exec") == 0) {
-                    if (--multi) {
-                        ERROR("Unexpected EXEC");
-                        break;
-                    }
-                }
-            }
+            if (i == 0 && !checkMulti(str,&multi)) break;
             zfree(str);
         }
 
@@ -199,7 +241,7 @@ int redis_check_aof_main(int argc, char **argv) {
         }
     }
 
-    off_t pos = process(fp);
+    off_t pos = process(fp,size);
     off_t diff = size-pos;
     printf("AOF analyzed: size=%lld, ok_up_to=%lld, diff=%lld\n",
         (long long) size, (long long) pos, (long long) diff);
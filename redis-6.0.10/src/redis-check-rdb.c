@@ -43,6 +43,8 @@ struct {
     unsigned long keys;             /* Number of keys processed. */
     unsigned long expires;          /* Number of keys with an expire. */
     unsigned long already_expired;  /* Number of keys already expired. */
+    unsigned long lzf_strings;      /* Number of LZF compressed strings. */
+    unsigned long lz4_strings;      /* Number of LZ4 compressed strings. */
     int doing;                      /* The state while reading the RDB. */
     int error_set;                  /* True if error is populated. */
     char error[1024];
@@ -87,7 +89,12 @@ char *rdb_type_string[] = {
     "zset-ziplist",
     "hash-ziplist",
     "quicklist",
-    "stream"
+    "stream",
+    "hash-listpack",
+    "zset-listpack",
+    "","",
+    "set-listpack",
+    [RDB_TYPE_HASH_TTL] = "hash-ttl"
 };
 
 /* Show a few stats collected into 'rdbstate' */
@@ -95,6 +102,16 @@ void rdbShowGenericInfo(void) {
     printf("[info] %lu keys read\n", rdbstate.keys);
     printf("[info] %lu expires\n", rdbstate.expires);
     printf("[info] %lu already expired\n", rdbstate.already_expired);
+    printf("[info] %lu LZF and %lu LZ4 compressed strings\n",
+        rdbstate.lzf_strings, rdbstate.lz4_strings);
+}
+
+/* Called by the loading functions for every compressed string. */
+void rdbCheckCompressedString(int enc) {
+    if (enc == RDB_ENC_LZ4)
+        rdbstate.lz4_strings++;
+    else
+        rdbstate.lzf_strings++;
 }
 
 /* Called on RDB errors. Provides details about the RDB and the offset
@@ -120,7 +137,8 @@ void rdbCheckError(const char *fmt, ...) {
         printf("[additional info] Reading type %d (%s)\n",
             rdbstate.key_type,
             ((unsigned)rdbstate.key_type <
-             sizeof(rdb_type_string)/sizeof(char*)) ?
+             sizeof(rdb_type_string)/sizeof(char*) &&
+             rdb_type_string[rdbstate.key_type]) ?
                 rdb_type_string[rdbstate.key_type] : "unknown");
     rdbShowGenericInfo();
 }
@@ -1456,6 +1456,15 @@ void disklessLoadDiscardBackup(dbBackup *buckup, int flag) {
     discardDbBackup(buckup, flag, replicationEmptyDbCallback);
 }
 
+/* Helper function for readSyncBulkPayload() to release the rio used to
+ * load the payload from the socket. */
+static void disklessLoadFreeRio(rio *rdb, int pipeline) {
+    if (pipeline)
+        rioFreeReader(rdb,NULL);
+    else
+        rioFreeConn(rdb,NULL);
+}
+
 /* Asynchronously read the SYNC payload we receive from a master */
 #define REPL_MAX_WRITTEN_BEFORE_FSYNC (1024*1024*8) /* 8 MB */
 void readSyncBulkPayload(connection *conn) {
@@ -1661,22 +1670,43 @@ void readSyncBulkPayload(connection *conn) {
     rdbSaveInfo rsi = RDB_SAVE_INFO_INIT;
     if (use_diskless_load) {
         rio rdb;
-        rioInitWithConn(&rdb,conn,server.repl_transfer_size);
+        /* With repl-diskless-load-pipeline the socket is read by a thread
+         * while the payload is parsed, and the old dataset, if backed up,
+         * is served to read only commands meanwhile. A TLS connection
+         * can't be read by another thread. */
+        int pipeline = server.repl_diskless_load_pipeline &&
+                       connGetType(conn) == CONN_TYPE_SOCKET;
+
+        if (pipeline) {
+            /* The socket stays in non blocking mode, it is polled by the
+             * reader thread. */
+            rioInitWithReader(&rdb,conn->fd,server.repl_transfer_size,
+                              server.repl_timeout*1000,loadingProcessEvents);
+            if (diskless_load_backup && server.repl_serve_stale_data &&
+                !server.cluster_enabled)
+            {
+                server.loading_stale_backup = diskless_load_backup;
+            }
+        } else {
+            rioInitWithConn(&rdb,conn,server.repl_transfer_size);
 
-        /* Put the socket in blocking mode to simplify RDB transfer.
-         * We'll restore it when the RDB is received. */
-        connBlock(conn);
-        connRecvTimeout(conn, server.repl_timeout*1000);
+            /* Put the socket in blocking mode to simplify RDB transfer.
+             * We'll restore it when the RDB is received. */
+            connBlock(conn);
+            connRecvTimeout(conn, server.repl_timeout*1000);
+        }
         startLoading(server.repl_transfer_size, RDBFLAGS_REPLICATION);
 
-        if (rdbLoadRio(&rdb,RDBFLAGS_REPLICATION,&rsi) != C_OK) {
+        int loaded = rdbLoadRio(&rdb,RDBFLAGS_REPLICATION,&rsi);
+        server.loading_stale_backup = NULL;
+        if (loaded != C_OK) {
             /* RDB loading failed. */
             stopLoading(0);
             serverLog(LL_WARNING,
                 "Failed trying to load the MASTER synchronization DB "
                 "from socket");
             cancelReplicationHandshake();
-            rioFreeConn(&rdb, NULL);
+            disklessLoadFreeRio(&rdb,pipeline);
 
             /* Remove the half-loaded data in case we started with
              * an empty replica. */
@@ -1709,14 +1739,14 @@ void readSyncBulkPayload(connection *conn) {
             {
                 serverLog(LL_WARNING,"Replication stream EOF marker is broken");
                 cancelReplicationHandshake();
-                rioFreeConn(&rdb, NULL);
+                disklessLoadFreeRio(&rdb,pipeline);
                 return;
             }
         }
 
         /* Cleanup and restore the socket to the original state to continue
          * with the normal replication. */
-        rioFreeConn(&rdb, NULL);
+        disklessLoadFreeRio(&rdb,pipeline);
         connNonBlock(conn);
         connRecvTimeout(conn,0);
     } else {
@@ -49,6 +49,9 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
 #include "rio.h"
 #include "util.h"
 #include "crc64.h"
@@ -95,6 +98,7 @@ static const rio rioBufferIO = {
     0,              /* flags */
     0,              /* bytes read or written */
     0,              /* read/write chunk size */
+    0, 0,           /* write and fsync time */
     { { NULL, 0 } } /* union for io-specific vars */
 };
 
@@ -110,14 +114,27 @@ void rioInitWithBuffer(rio *r, sds s) {
 static size_t rioFileWrite(rio *r, const void *buf, size_t len) {
     size_t retval;
 
-    retval = fwrite(buf,len,1,r->io.file.fp);
+    /* With stdio buffers that are a multiple of the page size, only the
+     * writes crossing a page boundary can reach the kernel: we time just
+     * those, instead of reading the clock for every small write. */
+    if ((r->processed_bytes & 4095) + len >= 4096) {
+        long long start = ustime();
+        retval = fwrite(buf,len,1,r->io.file.fp);
+        r->write_usecs += ustime()-start;
+    } else {
+        retval = fwrite(buf,len,1,r->io.file.fp);
+    }
     r->io.file.buffered += len;
 
     if (r->io.file.autosync &&
         r->io.file.buffered >= r->io.file.autosync)
     {
+        long long start = ustime();
         fflush(r->io.file.fp);
+        r->write_usecs += ustime()-start;
+        start = ustime();
         redis_fsync(fileno(r->io.file.fp));
+        r->fsync_usecs += ustime()-start;
         r->io.file.buffered = 0;
     }
     return retval;
@@ -149,6 +166,7 @@ static const rio rioFileIO = {
     0,              /* flags */
     0,              /* bytes read or written */
     0,              /* read/write chunk size */
+    0, 0,           /* write and fsync time */
     { { NULL, 0 } } /* union for io-specific vars */
 };
 
@@ -244,6 +262,7 @@ static const rio rioConnIO = {
     0,              /* flags */
     0,              /* bytes read or written */
     0,              /* read/write chunk size */
+    0, 0,           /* write and fsync time */
     { { NULL, 0 } } /* union for io-specific vars */
 };
 
@@ -313,6 +332,7 @@ static size_t rioFdWrite(rio *r, const void *buf, size_t len) {
     }
 
     size_t nwritten = 0;
+    long long start = ustime();
     while(nwritten != len) {
         retval = write(r->io.fd.fd,p+nwritten,len-nwritten);
         if (retval <= 0) {
@@ -325,6 +345,7 @@ static size_t rioFdWrite(rio *r, const void *buf, size_t len) {
         }
         nwritten += retval;
     }
+    r->write_usecs += ustime()-start;
 
     r->io.fd.pos += len;
     sdsclear(r->io.fd.buf);
@@ -362,6 +383,7 @@ static const rio rioFdIO = {
     0,              /* flags */
     0,              /* bytes read or written */
     0,              /* read/write chunk size */
+    0, 0,           /* write and fsync time */
     { { NULL, 0 } } /* union for io-specific vars */
 };
 
@@ -377,6 +399,337 @@ void rioFreeFd(rio *r) {
     sdsfree(r->io.fd.buf);
 }
 
+/* ------------------- Memory mapped file implementation -------------------
+ * We use this RIO implementation to load an RDB file from disk: reading from
+ * the mapping copies the data straight from the page cache to the loaded
+ * objects, without the intermediate stdio buffer. Every half window the
+ * kernel is asked to read ahead the next RIO_MMAP_WINDOW bytes, while the
+ * pages already consumed are released, so that the mapping doesn't inflate
+ * the RSS of the process.
+ *
+ * Accessing the pages of the mapping past the end of the file raises
+ * SIGBUS, so the size of the file is checked again every half window, and
+ * the reads stop at its end if it was truncated. A file truncated while
+ * the current window is read can still crash the process: this is why
+ * rdb-load-mmap is disabled by default. */
+
+#define RIO_MMAP_WINDOW (1024*1024*32)
+
+static size_t rioMmapWrite(rio *r, const void *buf, size_t len) {
+    UNUSED(r);
+    UNUSED(buf);
+    UNUSED(len);
+    return 0; /* Error, this target does not support writing. */
+}
+
+/* Release the pages already read, and read ahead the next window. */
+static void rioMmapAdvise(rio *r) {
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t upto = r->io.mmap.pos - r->io.mmap.pos % pagesize;
+    size_t ahead;
+    struct redis_stat sb;
+
+    if (redis_fstat(r->io.mmap.fd,&sb) != -1 &&
+        (size_t)sb.st_size < r->io.mmap.limit)
+    {
+        r->io.mmap.limit = sb.st_size;
+    }
+    if (upto > r->io.mmap.advised) {
+        madvise(r->io.mmap.base+r->io.mmap.advised,upto-r->io.mmap.advised,
+                MADV_DONTNEED);
+        r->io.mmap.advised = upto;
+    }
+    if (upto >= r->io.mmap.limit) return;
+    ahead = r->io.mmap.limit - upto;
+    if (ahead > RIO_MMAP_WINDOW) ahead = RIO_MMAP_WINDOW;
+    madvise(r->io.mmap.base+upto,ahead,MADV_WILLNEED);
+}
+
+/* Returns 1 or 0 for success/failure. */
+static size_t rioMmapRead(rio *r, void *buf, size_t len) {
+    if (r->io.mmap.pos > r->io.mmap.limit ||
+        r->io.mmap.limit-r->io.mmap.pos < len) return 0;
+    memcpy(buf,r->io.mmap.base+r->io.mmap.pos,len);
+    r->io.mmap.pos += len;
+    if (r->io.mmap.pos-r->io.mmap.advised >= RIO_MMAP_WINDOW/2)
+        rioMmapAdvise(r);
+    return 1;
+}
+
+/* Returns read position in the file. */
+static off_t rioMmapTell(rio *r) {
+    return r->io.mmap.pos;
+}
+
+static int rioMmapFlush(rio *r) {
+    UNUSED(r);
+    return 1; /* Nothing to do. */
+}
+
+static const rio rioMmapIO = {
+    rioMmapRead,
+    rioMmapWrite,
+    rioMmapTell,
+    rioMmapFlush,
+    NULL,           /* update_checksum */
+    0,              /* current checksum */
+    0,              /* flags */
+    0,              /* bytes read or written */
+    0,              /* read/write chunk size */
+    0, 0,           /* write and fsync time */
+    { { NULL, 0 } } /* union for io-specific vars */
+};
+
+/* Map the first 'size' bytes of the file 'fd' for reading. Returns 0 if the
+ * file can't be mapped, so that the caller can fall back to stdio, 1
+ * otherwise. */
+int rioInitWithMmap(rio *r, int fd, size_t size) {
+    void *base;
+
+    if (size == 0) return 0;
+    base = mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+    if (base == MAP_FAILED) return 0;
+    madvise(base,size,MADV_SEQUENTIAL);
+    *r = rioMmapIO;
+    r->io.mmap.fd = fd;
+    r->io.mmap.base = base;
+    r->io.mmap.size = r->io.mmap.limit = size;
+    r->io.mmap.pos = 0;
+    r->io.mmap.advised = 0;
+    rioMmapAdvise(r);
+    return 1;
+}
+
+/* release the rio stream. */
+void rioFreeMmap(rio *r) {
+    munmap(r->io.mmap.base,r->io.mmap.size);
+}
+
+/* ------------------- Socket reader thread implementation -------------------
+ * We use this RIO implementation to load the RDB from the master socket
+ * while it is transferred: a thread reads the socket into a ring buffer,
+ * so that receiving the payload overlaps with parsing it, instead of
+ * alternating with it. Only plain sockets are supported, since a TLS
+ * connection can't be read and written by different threads.
+ *
+ * The thread reads up to 'read_limit' bytes if not zero, otherwise until it
+ * is stopped by rioFreeReader(). The socket must be non blocking: the thread
+ * polls it with a short timeout to notice when it is stopped. */
+
+#define RIO_READER_RING_SIZE (1024*1024*8)
+#define RIO_READER_PUBLISH_BYTES (1024*64)
+
+typedef struct rioReader {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        /* Data or room available, or thread done. */
+    int fd;
+    char *ring;
+    size_t read_limit;          /* Bytes to read from the socket, or 0. */
+    long long timeout;          /* Milliseconds without data before failing. */
+    void (*idle)(off_t pos);    /* Called every 100ms waiting for data. */
+    size_t head;                /* Bytes written to the ring so far. */
+    size_t tail;                /* Bytes consumed, as seen by the thread. */
+    int done;                   /* The thread exited. */
+    int stop;                   /* The thread must exit. */
+    /* Only accessed by the consumer. */
+    size_t consumed;            /* Bytes consumed so far. */
+    size_t avail_head;          /* Last value of 'head' seen. */
+} rioReader;
+
+static void *rioReaderMain(void *arg) {
+    rioReader *rd = arg;
+    long long idle = 0;
+
+    redis_set_thread_title("rio_reader");
+    pthread_mutex_lock(&rd->mutex);
+    while(1) {
+        size_t off, toread;
+        struct pollfd pfd;
+        ssize_t nread;
+        int err = 0;
+
+        while(!rd->stop && rd->head-rd->tail == RIO_READER_RING_SIZE)
+            pthread_cond_wait(&rd->cond,&rd->mutex);
+        if (rd->stop ||
+            (rd->read_limit && rd->head == rd->read_limit)) break;
+        off = rd->head % RIO_READER_RING_SIZE;
+        toread = RIO_READER_RING_SIZE-(rd->head-rd->tail);
+        if (toread > RIO_READER_RING_SIZE-off)
+            toread = RIO_READER_RING_SIZE-off;
+        if (rd->read_limit && toread > rd->read_limit-rd->head)
+            toread = rd->read_limit-rd->head;
+        pthread_mutex_unlock(&rd->mutex);
+
+        /* The consumer never accesses the free part of the ring. */
+        pfd.fd = rd->fd;
+        pfd.events = POLLIN;
+        nread = 0;
+        if (poll(&pfd,1,100) == 1) {
+            nread = read(rd->fd,rd->ring+off,toread);
+            if (nread == 0 || (nread == -1 && errno != EAGAIN &&
+                               errno != EINTR)) err = 1;
+        } else {
+            idle += 100;
+            if (rd->timeout && idle >= rd->timeout) err = 1;
+        }
+
+        pthread_mutex_lock(&rd->mutex);
+        if (err) break;
+        if (nread > 0) {
+            idle = 0;
+            rd->head += nread;
+            pthread_cond_broadcast(&rd->cond);
+        }
+    }
+    rd->done = 1;
+    pthread_cond_broadcast(&rd->cond);
+    pthread_mutex_unlock(&rd->mutex);
+    return NULL;
+}
+
+static size_t rioReaderWrite(rio *r, const void *buf, size_t len) {
+    UNUSED(r);
+    UNUSED(buf);
+    UNUSED(len);
+    return 0; /* Error, this target does not support writing. */
+}
+
+/* Returns 1 or 0 for success/failure. */
+static size_t rioReaderRead(rio *r, void *buf, size_t len) {
+    rioReader *rd = r->io.reader.reader;
+
+    while(len) {
+        size_t off, chunk;
+
+        if (rd->avail_head == rd->consumed) {
+            /* Wait for more data, publishing what was consumed so far. */
+            pthread_mutex_lock(&rd->mutex);
+            rd->tail = rd->consumed;
+            pthread_cond_broadcast(&rd->cond);
+            while(rd->head == rd->consumed && !rd->done) {
+                struct timespec ts;
+
+                if (!rd->idle) {
+                    pthread_cond_wait(&rd->cond,&rd->mutex);
+                    continue;
+                }
+                clock_gettime(CLOCK_REALTIME,&ts);
+                ts.tv_nsec += 100*1000000;
+                if (ts.tv_nsec >= 1000000000) {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000;
+                }
+                if (pthread_cond_timedwait(&rd->cond,&rd->mutex,&ts) ==
+                    ETIMEDOUT)
+                {
+                    pthread_mutex_unlock(&rd->mutex);
+                    rd->idle(rd->consumed);
+                    pthread_mutex_lock(&rd->mutex);
+                }
+            }
+            rd->avail_head = rd->head;
+            pthread_mutex_unlock(&rd->mutex);
+            if (rd->avail_head == rd->consumed) return 0;
+        }
+        off = rd->consumed % RIO_READER_RING_SIZE;
+        chunk = rd->avail_head-rd->consumed;
+        if (chunk > RIO_READER_RING_SIZE-off) chunk = RIO_READER_RING_SIZE-off;
+        if (chunk > len) chunk = len;
+        memcpy(buf,rd->ring+off,chunk);
+        buf = (char*)buf+chunk;
+        len -= chunk;
+        rd->consumed += chunk;
+
+        /* Give room back to the thread from time to time. */
+        if (rd->consumed-rd->tail >= RIO_READER_PUBLISH_BYTES) {
+            pthread_mutex_lock(&rd->mutex);
+            rd->tail = rd->consumed;
+            rd->avail_head = rd->head;
+            pthread_cond_broadcast(&rd->cond);
+            pthread_mutex_unlock(&rd->mutex);
+        }
+    }
+    return 1;
+}
+
+/* Returns the number of bytes consumed. */
+static off_t rioReaderTell(rio *r) {
+    return r->io.reader.reader->consumed;
+}
+
+static int rioReaderFlush(rio *r) {
+    UNUSED(r);
+    return 1; /* Nothing to do. */
+}
+
+static const rio rioReaderIO = {
+    rioReaderRead,
+    rioReaderWrite,
+    rioReaderTell,
+    rioReaderFlush,
+    NULL,           /* update_checksum */
+    0,              /* current checksum */
+    0,              /* flags */
+    0,              /* bytes read or written */
+    0,              /* read/write chunk size */
+    0, 0,           /* write and fsync time */
+    { { NULL, 0 } } /* union for io-specific vars */
+};
+
+/* Start a thread reading the socket 'fd', failing after 'timeout'
+ * milliseconds without data, if not zero. If 'idle' is not NULL it is
+ * called with the number of bytes consumed when reading waits for the
+ * thread for too long, so that the caller can do something else. */
+void rioInitWithReader(rio *r, int fd, size_t read_limit, long long timeout,
+                       void (*idle)(off_t pos))
+{
+    rioReader *rd = zcalloc(sizeof(*rd));
+
+    rd->fd = fd;
+    rd->ring = zmalloc(RIO_READER_RING_SIZE);
+    rd->read_limit = read_limit;
+    rd->timeout = timeout;
+    rd->idle = idle;
+    pthread_mutex_init(&rd->mutex,NULL);
+    pthread_cond_init(&rd->cond,NULL);
+    if (pthread_create(&rd->thread,NULL,rioReaderMain,rd) != 0) {
+        serverLog(LL_WARNING,"Fatal: Can't initialize the socket reader thread.");
+        exit(1);
+    }
+    *r = rioReaderIO;
+    r->io.reader.reader = rd;
+}
+
+/* Stop the thread and release the rio stream. The data read from the socket
+ * but not consumed is stored at 'remaining' if not NULL. */
+void rioFreeReader(rio *r, sds *remaining) {
+    rioReader *rd = r->io.reader.reader;
+
+    pthread_mutex_lock(&rd->mutex);
+    rd->stop = 1;
+    pthread_cond_broadcast(&rd->cond);
+    pthread_mutex_unlock(&rd->mutex);
+    pthread_join(rd->thread,NULL);
+
+    if (remaining) {
+        *remaining = sdsempty();
+        while(rd->consumed != rd->head) {
+            size_t off = rd->consumed % RIO_READER_RING_SIZE;
+            size_t chunk = rd->head-rd->consumed;
+
+            if (chunk > RIO_READER_RING_SIZE-off)
+                chunk = RIO_READER_RING_SIZE-off;
+            *remaining = sdscatlen(*remaining,rd->ring+off,chunk);
+            rd->consumed += chunk;
+        }
+    }
+    pthread_mutex_destroy(&rd->mutex);
+    pthread_cond_destroy(&rd->cond);
+    zfree(rd->ring);
+    zfree(rd);
+}
+
 /* ---------------------------- Generic functions ---------------------------- */
 
 /* This function can be installed both in memory and file streams when checksum
@@ -64,6 +64,10 @@ struct _rio {
     /* maximum single read or write chunk size */
     size_t max_processing_chunk;
 
+    /* Microseconds spent blocked writing to the target and in fsync(), for
+     * the targets performing actual I/O. */
+    long long write_usecs, fsync_usecs;
+
     /* Backend-specific vars. */
     union {
         /* In-memory buffer target. */
@@ -91,6 +95,19 @@ struct _rio {
             off_t pos;
             sds buf;
         } fd;
+        /* Socket read by a thread (used to load the RDB from the master). */
+        struct {
+            struct rioReader *reader;
+        } reader;
+        /* Memory mapped file (used to load the RDB). */
+        struct {
+            int fd;         /* Mapped file. */
+            char *base;     /* Start of the mapping. */
+            size_t size;    /* Size of the mapping. */
+            size_t limit;   /* Size of the file, if it was truncated. */
+            size_t pos;     /* Read position. */
+            size_t advised; /* Pages before this offset were released. */
+        } mmap;
     } io;
 };
 
@@ -160,9 +177,14 @@ void rioInitWithFile(rio *r, FILE *fp);
 void rioInitWithBuffer(rio *r, sds s);
 void rioInitWithConn(rio *r, connection *conn, size_t read_limit);
 void rioInitWithFd(rio *r, int fd);
+int rioInitWithMmap(rio *r, int fd, size_t size);
+void rioInitWithReader(rio *r, int fd, size_t read_limit, long long timeout,
+                       void (*idle)(off_t pos));
 
 void rioFreeFd(rio *r);
 void rioFreeConn(rio *r, sds* out_remainingBufferedData);
+void rioFreeMmap(rio *r);
+void rioFreeReader(rio *r, sds *remaining);
 
 size_t rioWriteBulkCount(rio *r, char prefix, long count);
 size_t rioWriteBulkString(rio *r, const char *buf, size_t len);
@@ -167,6 +167,63 @@ sds sdsdup(const sds s) {
     return sdsnewlen(s, sdslen(s));
 }
 
+/* Return the number of bytes needed by sdsembed() in order to store a copy
+ * of the sds string 's'. */
+size_t sdsembedlen(const sds s) {
+    size_t len = sdslen(s);
+    char type = sdsReqType(len);
+
+    if (type == SDS_TYPE_5 && len == 0) type = SDS_TYPE_8;
+    return sdsHdrSize(type)+len+1;
+}
+
+/* Create a copy of the sds string 's' inside the buffer 'buf', that must be
+ * at least sdsembedlen(s) bytes, and return it. This is useful in order to
+ * store a string inside some other allocation: the returned string has no
+ * free space, and must never be freed or modified in a way that can
+ * reallocate it, since it is not allocated by itself. */
+sds sdsembed(void *buf, const sds s) {
+    size_t len = sdslen(s);
+    char type = sdsReqType(len);
+
+    if (type == SDS_TYPE_5 && len == 0) type = SDS_TYPE_8;
+    sds e = (char*)buf+sdsHdrSize(type);
+    unsigned char *fp = ((unsigned char*)e)-1;
+    switch(type) {
+        case SDS_TYPE_5: {
+            *fp = type | (len << SDS_TYPE_BITS);
+            break;
+        }
+        case SDS_TYPE_8: {
+            SDS_HDR_VAR(8,e);
+            sh->len = sh->alloc = len;
+            *fp = type;
+            break;
+        }
+        case SDS_TYPE_16: {
+            SDS_HDR_VAR(16,e);
+            sh->len = sh->alloc = len;
+            *fp = type;
+            break;
+        }
+        case SDS_TYPE_32: {
+            SDS_HDR_VAR(32,e);
+            sh->len = sh->alloc = len;
+            *fp = type;
+            break;
+        }
+        case SDS_TYPE_64: {
+            SDS_HDR_VAR(64,e);
+            sh->len = sh->alloc = len;
+            *fp = type;
+            break;
+        }
+    }
+    memcpy(e,s,len);
+    e[len] = '\0';
+    return e;
+}
+
 /* Free an sds string. No operation is performed if 's' is NULL. */
 // 通过指针偏移定位到sdshdr结构体头部处，然后释放内存
 void sdsfree(sds s) {
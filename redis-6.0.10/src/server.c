@@ -33,6 +33,7 @@
 #include "bio.h"
 #include "latency.h"
 #include "atomicvar.h"
+#include "lz4.h"
 
 #include <time.h>
 #include <signal.h>
@@ -561,6 +562,42 @@ struct redisCommand redisCommandTable[] = {
      "read-only random @hash",
      0,NULL,1,1,1,0,0,0},
 
+    {"hexpire",hexpireCommand,-6,
+     "write fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hpexpire",hpexpireCommand,-6,
+     "write fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hexpireat",hexpireatCommand,-6,
+     "write fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hpexpireat",hpexpireatCommand,-6,
+     "write fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"httl",httlCommand,-5,
+     "read-only fast random @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hpttl",hpttlCommand,-5,
+     "read-only fast random @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hexpiretime",hexpiretimeCommand,-5,
+     "read-only fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hpexpiretime",hpexpiretimeCommand,-5,
+     "read-only fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hpersist",hpersistCommand,-5,
+     "write fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
     {"incrby",incrbyCommand,3,
      "write use-memory fast @string",
      0,NULL,1,1,1,0,0,0},
@@ -1196,6 +1233,14 @@ void dictSdsDestructor(void *privdata, void *val)
     sdsfree(val);
 }
 
+size_t dictSdsEmbedLen(const void *key) {
+    return sdsembedlen((sds)key);
+}
+
+void *dictSdsEmbed(void *buf, const void *key) {
+    return sdsembed(buf,(sds)key);
+}
+
 int dictObjKeyCompare(void *privdata, const void *key1,
         const void *key2)
 {
@@ -1343,14 +1388,18 @@ dictType commandTableDictType = {
     NULL                        /* val destructor */
 };
 
-/* Hash type hash table (note that small hashes are represented with ziplists) */
+/* Hash type hash table (note that small hashes are represented with listpacks).
+ * Every entry reserves room for the expire time of the field, see t_hash.c:
+ * with jemalloc the entry is served from the same 32 bytes size class. */
 dictType hashDictType = {
     dictSdsHash,                /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
     dictSdsDestructor,          /* key destructor */
-    dictSdsDestructor           /* val destructor */
+    dictSdsDestructor,          /* val destructor */
+    0,                          /* store hash */
+    sizeof(long long)           /* entry metadata: field expire time */
 };
 
 /* Keylist hash table type has unencoded redis objects as keys and
@@ -1467,7 +1516,8 @@ int incrementallyRehash(int dbid) {
  * for dict.c to resize the hash tables accordingly to the fact we have an
  * active fork child running. */
 void updateDictResizePolicy(void) {
-    if (!hasActiveChildProcess())
+    /* Fork-less snapshots need the tables to never shrink, see snapshot.c. */
+    if (!hasActiveChildProcess() && !server.snapshot_in_progress)
         dictEnableResize();
     else
         dictDisableResize();
@@ -1971,6 +2021,9 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     /* Handle background operations on Redis databases. */
     databasesCron();
 
+    /* Keep good eviction candidates ready when near the memory limit. */
+    evictionPoolRefresh();
+
     /* Start a scheduled AOF rewrite if this was requested by the user while
      * a BGSAVE was in progress. */
     if (!hasActiveChildProcess() &&
@@ -1979,9 +2032,13 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         rewriteAppendOnlyFileBackground();
     }
 
+    /* Close the files of the fork-less snapshots no longer in progress. */
+    snapshotCloseFiles();
+
     /* Check if a background saving or AOF rewrite in progress terminated. */
     if (hasActiveChildProcess() || ldbPendingChildren())
     {
+        receiveChildInfo();
         checkChildrenDone();
     } else {
         /* If there is not a background saving/rewrite in progress check if
@@ -1993,7 +2050,8 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
              * the given amount of seconds, and if the latest bgsave was
              * successful or if, in case of an error, at least
              * CONFIG_BGSAVE_RETRY_DELAY seconds already elapsed. */
-            if (server.dirty >= sp->changes &&
+            if (!server.snapshot_in_progress &&
+                server.dirty >= sp->changes &&
                 server.unixtime-server.lastsave > sp->seconds &&
                 (server.unixtime-server.lastbgsave_try >
                  CONFIG_BGSAVE_RETRY_DELAY ||
@@ -2003,7 +2061,10 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
                     sp->changes, (int)sp->seconds);
                 rdbSaveInfo rsi, *rsiptr;
                 rsiptr = rdbPopulateSaveInfo(&rsi);
-                rdbSaveBackground(server.rdb_filename,rsiptr);
+                if (server.rdb_save_forkless)
+                    snapshotStart(server.rdb_filename,rsiptr);
+                else
+                    rdbSaveBackground(server.rdb_filename,rsiptr);
                 break;
             }
         }
@@ -2078,13 +2139,20 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
      * make sure when refactoring this file to keep this order. This is useful
      * because we want to give priority to RDB savings for replication. */
     if (!hasActiveChildProcess() &&
+        !server.snapshot_in_progress &&
         server.rdb_bgsave_scheduled &&
         (server.unixtime-server.lastbgsave_try > CONFIG_BGSAVE_RETRY_DELAY ||
          server.lastbgsave_status == C_OK))
     {
         rdbSaveInfo rsi, *rsiptr;
+        int retval;
+
         rsiptr = rdbPopulateSaveInfo(&rsi);
-        if (rdbSaveBackground(server.rdb_filename,rsiptr) == C_OK)
+        if (server.rdb_save_forkless)
+            retval = snapshotStart(server.rdb_filename,rsiptr);
+        else
+            retval = rdbSaveBackground(server.rdb_filename,rsiptr);
+        if (retval == C_OK)
             server.rdb_bgsave_scheduled = 0;
     }
 
@@ -2197,6 +2265,9 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     /* Write the AOF buffer on disk */
     flushAppendOnlyFile(0);
 
+    /* Hold the replies of the clients whose writes are not fsynced yet. */
+    if (server.aof_writer_thread) aofHoldPendingReplies();
+
     /* Handle writes with pending output buffers. */
     handleClientsWithPendingWritesUsingThreads();
 
@@ -2208,9 +2279,13 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
      * visit processCommand() at all). */
     handleClientsBlockedOnKeys();
 
+    /* Hand the objects deleted in this iteration to the lazyfree thread. */
+    lazyfreeFlushBatch();
+
     /* Before we are going to sleep, let the threads access the dataset by
      * releasing the GIL. Redis main thread will not touch anything at this
-     * time. */
+     * time. The expire scan thread is also allowed to read the keyspace. */
+    activeExpireScanResume();
     if (moduleCount()) moduleReleaseGIL();
 
     /* Do NOT add anything below moduleReleaseGIL !!! */
@@ -2222,10 +2297,12 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
 void afterSleep(struct aeEventLoop *eventLoop) {
     UNUSED(eventLoop);
 
-    /* Do NOT add anything above moduleAcquireGIL !!! */
+    /* Do NOT add anything above moduleAcquireGIL !!! (but stopping the
+     * expire scan thread, that may be waiting for the GIL itself) */
 
     /* Aquire the modules GIL so that their threads won't touch anything. */
     if (!ProcessingEventsWhileBlocked) {
+        activeExpireScanPause();
         if (moduleCount()) moduleAcquireGIL();
     }
 }
@@ -2383,6 +2460,8 @@ void initServerConfig(void) {
     server.aof_lastbgrewrite_status = C_OK;
     server.aof_delayed_fsync = 0;
     server.aof_fd = -1;
+    server.aof_manifest = NULL;
+    server.aof_rewrite_incrs = 0;
     server.aof_selected_db = -1; /* Make sure the first time will not match */
     server.aof_flush_postponed_start = 0;
     server.pidfile = NULL;
@@ -2397,6 +2476,8 @@ void initServerConfig(void) {
     server.migrate_cached_sockets = dictCreate(&migrateCacheDictType,NULL);
     server.next_client_id = 1; /* Client IDs, start from 1 .*/
     server.loading_process_events_interval_bytes = (1024*1024*2);
+    server.loading_stale_backup = NULL;
+    server.loading_serving_stale = 0;
 
     server.lruclock = getLRUClock();
     resetServerSaveParams();
@@ -2448,6 +2529,7 @@ void initServerConfig(void) {
     server.orig_commands = dictCreate(&commandTableDictType,NULL);
     populateCommandTable();
     server.delCommand = lookupCommandByCString("del");
+    server.hdelCommand = lookupCommandByCString("hdel");
     server.multiCommand = lookupCommandByCString("multi");
     server.lpushCommand = lookupCommandByCString("lpush");
     server.lpopCommand = lookupCommandByCString("lpop");
@@ -2789,10 +2871,15 @@ void resetServerStats(void) {
     server.stat_numcommands = 0;
     server.stat_numconnections = 0;
     server.stat_expiredkeys = 0;
+    server.stat_expired_fields = 0;
     server.stat_expired_stale_perc = 0;
     server.stat_expired_time_cap_reached_count = 0;
     server.stat_expire_cycle_time_used = 0;
+    server.stat_expire_cycle_scanned_keys = 0;
+    server.stat_expire_scan_stale_perc = 0;
+    server.stat_expire_cycle_expired_keys = 0;
     server.stat_evictedkeys = 0;
+    server.stat_eviction_stale_candidates = 0;
     server.stat_keyspace_misses = 0;
     server.stat_keyspace_hits = 0;
     server.stat_active_defrag_hits = 0;
@@ -2809,6 +2896,8 @@ void resetServerStats(void) {
     server.stat_io_reads_processed = 0;
     server.stat_total_reads_processed = 0;
     server.stat_io_writes_processed = 0;
+    server.stat_io_keys_prefetched = 0;
+    server.stat_pipelined_keys_prefetched = 0;
     server.stat_total_writes_processed = 0;
     for (j = 0; j < STATS_METRIC_COUNT; j++) {
         server.inst_metric[j].idx = 0;
@@ -2862,6 +2951,7 @@ void initServer(void) {
     server.slaves = listCreate();
     server.monitors = listCreate();
     server.clients_pending_write = listCreate();
+    server.clients_waiting_aof = listCreate();
     server.clients_pending_read = listCreate();
     server.clients_timeout_table = raxNew();
     server.slaveseldb = -1; /* Force to emit the first SELECT command. */
@@ -2917,11 +3007,28 @@ void initServer(void) {
         exit(1);
     }
 
-    /* Create the Redis databases, and initialize other internal state. */
+    /* Create the Redis databases, and initialize other internal state.
+     * The dict types of the keyspace are configured first, since every
+     * dictionary of the keyspace created from now on (including the ones
+     * created by FLUSHALL ASYNC and by diskless loading) must use the
+     * same entries layout. */
+    dbDictType.storeHash = server.keyspace_dict_store_hash;
+    keyptrDictType.storeHash = server.keyspace_dict_store_hash;
+    if (server.keyspace_compact_entries) {
+        /* Every key is embedded in its main dict entry, together with a
+         * copy of its expire time, see dbEntryExpire(). */
+        dbDictType.keyDestructor = NULL;
+        dbDictType.entryMetadataBytes = sizeof(long long);
+        dbDictType.keyEmbedLen = dictSdsEmbedLen;
+        dbDictType.keyEmbed = dictSdsEmbed;
+    }
     for (j = 0; j < server.dbnum; j++) {
         server.db[j].dict = dictCreate(&dbDictType,NULL);
         server.db[j].expires = dictCreate(&keyptrDictType,NULL);
         server.db[j].expires_cursor = 0;
+        server.db[j].expires_index = server.active_expire_index ?
+                                     raxNew() : NULL;
+        server.db[j].volatile_hashes = dictCreate(&setDictType,NULL);
         server.db[j].blocking_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].ready_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
         server.db[j].watched_keys = dictCreate(&keylistDictType,NULL);
@@ -2931,6 +3038,7 @@ void initServer(void) {
         listSetFreeMethod(server.db[j].defrag_later,(void (*)(void*))sdsfree);
     }
     evictionPoolAlloc(); /* Initialize the LRU keys pool. */
+    evictionResetState();
     server.pubsub_channels = dictCreate(&keylistDictType,NULL);
     server.pubsub_patterns = listCreate();
     server.pubsub_patterns_dict = dictCreate(&keylistDictType,NULL);
@@ -2938,6 +3046,8 @@ void initServer(void) {
     listSetMatchMethod(server.pubsub_patterns,listMatchPubsubPattern);
     server.cronloops = 0;
     server.rdb_child_pid = -1;
+    server.snapshot_in_progress = 0;
+    server.stat_rdb_forkless_copied_keys = 0;
     server.aof_child_pid = -1;
     server.module_child_pid = -1;
     server.rdb_child_type = RDB_CHILD_TYPE_NONE;
@@ -2962,6 +3072,7 @@ void initServer(void) {
     server.stat_starttime = time(NULL);
     server.stat_peak_memory = 0;
     server.stat_rdb_cow_bytes = 0;
+    memset(&server.stat_rdb_save,0,sizeof(server.stat_rdb_save));
     server.stat_aof_cow_bytes = 0;
     server.stat_module_cow_bytes = 0;
     for (int j = 0; j < CLIENT_TYPE_COUNT; j++)
@@ -3021,7 +3132,9 @@ void initServer(void) {
     aeSetAfterSleepProc(server.el,afterSleep);
 
     /* Open the AOF file if needed. */
-    if (server.aof_state == AOF_ON) {
+    if (server.aof_multi_part) {
+        aofMultiPartInit();
+    } else if (server.aof_state == AOF_ON) {
         server.aof_fd = open(server.aof_filename,
                                O_WRONLY|O_APPEND|O_CREAT,0644);
         if (server.aof_fd == -1) {
@@ -3055,7 +3168,9 @@ void initServer(void) {
  * see: https://sourceware.org/bugzilla/show_bug.cgi?id=19329 */
 void InitServerLast() {
     bioInit();
+    if (server.aof_writer_thread) aofWriterInit();
     initThreadedIO();
+    initActiveExpireScanThread();
     set_jemalloc_bg_thread(server.jemalloc_bg_thread);
     server.initial_memory_usage = zmalloc_used_memory();
 }
@@ -3571,7 +3686,14 @@ int processCommand(client *c) {
 
     /* Now lookup the command and check ASAP about trivial error conditions
      * such as wrong arity, bad command name and so forth. */
-    c->cmd = c->lastcmd = lookupCommand(c->argv[0]->ptr);
+    c->cmd = c->lastcmd = c->parsed_cmd;
+    if (c->cmd == NULL || c->cmds_version != server.commands_version ||
+        strcasecmp(c->cmd->name,c->argv[0]->ptr))
+    {
+        /* Not already looked up while parsing the request, or the table
+         * changed since then, or a command filter rewrote the request. */
+        c->cmd = c->lastcmd = lookupCommand(c->argv[0]->ptr);
+    }
     if (!c->cmd) {
         sds args = sdsempty();
         int i;
@@ -3760,8 +3882,12 @@ int processCommand(client *c) {
     }
 
     /* Loading DB? Return an error if the command has not the
-     * CMD_LOADING flag. */
-    if (server.loading && is_denyloading_command) {
+     * CMD_LOADING flag. While the old dataset is served during the load of
+     * the one received from the master, read only commands are allowed. */
+    if (server.loading && is_denyloading_command &&
+        !(server.loading_serving_stale && !is_write_command &&
+          (c->cmd->flags & CMD_READONLY)))
+    {
         rejectCommand(c, shared.loadingerr);
         return C_OK;
     }
@@ -3857,6 +3983,9 @@ int prepareForShutdown(int flags) {
         killRDBChild();
     }
 
+    /* The same for a fork-less snapshot. */
+    snapshotAbort();
+
     /* Kill module child if there is one. */
     if (server.module_child_pid != -1) {
         serverLog(LL_WARNING,"There is a module fork child. Killing it!");
@@ -4313,7 +4442,8 @@ sds genRedisInfoString(const char *section) {
             "mem_aof_buffer:%zu\r\n"
             "mem_allocator:%s\r\n"
             "active_defrag_running:%d\r\n"
-            "lazyfree_pending_objects:%zu\r\n",
+            "lazyfree_pending_objects:%zu\r\n"
+            "keyspace_entries:%s\r\n",
             zmalloc_used,
             hmem,
             server.cron_malloc_stats.process_rss,
@@ -4356,7 +4486,8 @@ sds genRedisInfoString(const char *section) {
             mh->aof_buffer,
             ZMALLOC_LIB,
             server.active_defrag_running,
-            lazyfreeGetPendingObjectsCount()
+            lazyfreeGetPendingObjectsCount(),
+            server.keyspace_compact_entries ? "compact" : "default"
         );
         freeMemoryOverheadData(mh);
     }
@@ -4374,6 +4505,7 @@ sds genRedisInfoString(const char *section) {
             "rdb_last_bgsave_time_sec:%jd\r\n"
             "rdb_current_bgsave_time_sec:%jd\r\n"
             "rdb_last_cow_size:%zu\r\n"
+            "rdb_forkless_copied_keys:%lld\r\n"
             "aof_enabled:%d\r\n"
             "aof_rewrite_in_progress:%d\r\n"
             "aof_rewrite_scheduled:%d\r\n"
@@ -4386,13 +4518,15 @@ sds genRedisInfoString(const char *section) {
             "module_fork_last_cow_size:%zu\r\n",
             server.loading,
             server.dirty,
-            server.rdb_child_pid != -1,
+            server.rdb_child_pid != -1 || server.snapshot_in_progress,
             (intmax_t)server.lastsave,
             (server.lastbgsave_status == C_OK) ? "ok" : "err",
             (intmax_t)server.rdb_save_time_last,
-            (intmax_t)((server.rdb_child_pid == -1) ?
+            (intmax_t)((server.rdb_child_pid == -1 &&
+                        !server.snapshot_in_progress) ?
                 -1 : time(NULL)-server.rdb_save_time_start),
             server.stat_rdb_cow_bytes,
+            server.stat_rdb_forkless_copied_keys,
             server.aof_state != AOF_OFF,
             server.aof_child_pid != -1,
             server.aof_rewrite_scheduled,
@@ -4405,6 +4539,30 @@ sds genRedisInfoString(const char *section) {
             server.module_child_pid != -1,
             server.stat_module_cow_bytes);
 
+        /* Stats of the current or last RDB save. */
+        rdbSaveStats *rs = &server.stat_rdb_save;
+        unsigned long long saved = 0;
+        for (int j = 0; j < OBJ_TYPE_MAX; j++) saved += rs->keys[j];
+        info = sdscatprintf(info,
+            "rdb_save_keys_saved:%llu\r\n"
+            "rdb_save_keys_total:%llu\r\n"
+            "rdb_save_saved_perc:%.2f\r\n"
+            "rdb_save_bytes:%llu\r\n"
+            "rdb_save_compress_in_bytes:%llu\r\n"
+            "rdb_save_compress_out_bytes:%llu\r\n"
+            "rdb_save_compress_usec:%llu\r\n"
+            "rdb_save_write_usec:%llu\r\n"
+            "rdb_save_fsync_usec:%llu\r\n",
+            saved,
+            rs->keys_total,
+            rs->keys_total ? (double)saved/rs->keys_total*100 : 0,
+            rs->bytes,
+            rs->compress_in,
+            rs->compress_out,
+            rs->compress_usecs,
+            rs->write_usecs,
+            rs->fsync_usecs);
+
         if (server.aof_enabled) {
             info = sdscatprintf(info,
                 "aof_current_size:%lld\r\n"
@@ -4472,10 +4630,18 @@ sds genRedisInfoString(const char *section) {
             "sync_partial_ok:%lld\r\n"
             "sync_partial_err:%lld\r\n"
             "expired_keys:%lld\r\n"
+            "expired_fields:%lld\r\n"
             "expired_stale_perc:%.2f\r\n"
             "expired_time_cap_reached_count:%lld\r\n"
             "expire_cycle_cpu_milliseconds:%lld\r\n"
+            "expire_cycle_scanned_keys:%lld\r\n"
+            "expire_cycle_expired_keys:%lld\r\n"
+            "expire_scan_stale_perc:%.2f\r\n"
             "evicted_keys:%lld\r\n"
+            "eviction_precision:%.4f\r\n"
+            "eviction_samples:%d\r\n"
+            "eviction_batch:%d\r\n"
+            "eviction_stale_candidates:%lld\r\n"
             "keyspace_hits:%lld\r\n"
             "keyspace_misses:%lld\r\n"
             "pubsub_channels:%ld\r\n"
@@ -4494,7 +4660,9 @@ sds genRedisInfoString(const char *section) {
             "total_reads_processed:%lld\r\n"
             "total_writes_processed:%lld\r\n"
             "io_threaded_reads_processed:%lld\r\n"
-            "io_threaded_writes_processed:%lld\r\n",
+            "io_threaded_writes_processed:%lld\r\n"
+            "io_threaded_keys_prefetched:%lld\r\n"
+            "pipelined_keys_prefetched:%lld\r\n",
             server.stat_numconnections,
             server.stat_numcommands,
             getInstantaneousMetric(STATS_METRIC_COMMAND),
@@ -4507,10 +4675,18 @@ sds genRedisInfoString(const char *section) {
             server.stat_sync_partial_ok,
             server.stat_sync_partial_err,
             server.stat_expiredkeys,
+            server.stat_expired_fields,
             server.stat_expired_stale_perc*100,
             server.stat_expired_time_cap_reached_count,
             server.stat_expire_cycle_time_used/1000,
+            server.stat_expire_cycle_scanned_keys,
+            server.stat_expire_cycle_expired_keys,
+            server.stat_expire_scan_stale_perc*100,
             server.stat_evictedkeys,
+            server.stat_eviction_precision,
+            server.eviction_samples,
+            server.eviction_batch,
+            server.stat_eviction_stale_candidates,
             server.stat_keyspace_hits,
             server.stat_keyspace_misses,
             dictSize(server.pubsub_channels),
@@ -4529,7 +4705,9 @@ sds genRedisInfoString(const char *section) {
             server.stat_total_reads_processed,
             server.stat_total_writes_processed,
             server.stat_io_reads_processed,
-            server.stat_io_writes_processed);
+            server.stat_io_writes_processed,
+            server.stat_io_keys_prefetched,
+            server.stat_pipelined_keys_prefetched);
     }
 
     /* Replication */
@@ -5312,6 +5490,8 @@ int main(int argc, char **argv) {
             return endianconvTest(argc, argv);
         } else if (!strcasecmp(argv[2], "crc64")) {
             return crc64Test(argc, argv);
+        } else if (!strcasecmp(argv[2], "lz4")) {
+            return lz4Test(argc, argv);
         } else if (!strcasecmp(argv[2], "zmalloc")) {
             return zmalloc_test(argc, argv);
         }
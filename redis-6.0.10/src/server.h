@@ -72,6 +72,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #include "quicklist.h"  /* Lists are encoded as linked lists of
                            N-elements flat arrays */
 #include "rax.h"     /* Radix tree */
+#include "zbtree.h"  /* B+tree of the btree encoded sorted sets */
 #include "connection.h" /* Connection abstraction */
 
 #define REDISMODULE_CORE 1
@@ -139,6 +140,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #define PROTO_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
 #define PROTO_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define PROTO_MBULK_BIG_ARG     (1024*32)
+#define CLIENT_LOOKAHEAD_CMDS   16 /* Requests of querybuf looked up ahead. */
 #define LONG_STR_SIZE      21          /* Bytes needed for long -> str + '\0' */
 #define REDIS_AUTOSYNC_BYTES (1024*1024*32) /* fdatasync every 32MB */
 
@@ -266,6 +268,8 @@ extern int configOOMScoreAdjValuesDefaults[CONFIG_OOM_COUNT];
 #define CLIENT_PROTOCOL_ERROR (1ULL<<39) /* Protocol error chatting with it. */
 #define CLIENT_CLOSE_AFTER_COMMAND (1ULL<<40) /* Close after executing commands
                                                * and writing entire reply. */
+#define CLIENT_AOF_WAIT (1ULL<<41) /* Replies held until the writes of the
+                                      client are fsynced to the AOF. */
 
 /* Client block type (btype field in client structure)
  * if CLIENT_BLOCKED flag is set. */
@@ -364,6 +368,13 @@ extern int configOOMScoreAdjValuesDefaults[CONFIG_OOM_COUNT];
 #define AOF_FSYNC_ALWAYS 1
 #define AOF_FSYNC_EVERYSEC 2
 
+/* AOF command log formats. See the "AOF binary format" section in aof.c. */
+#define AOF_FORMAT_RESP 0
+#define AOF_FORMAT_BINARY 1
+#define AOF_BINARY_BLOCK 0xF5   /* Starts a binary block. Can't be '*'. */
+#define AOF_BINARY_SELECT 0     /* Binary record: select the DB. */
+#define AOF_BINARY_COMMAND 1    /* Binary record: command vector. */
+
 /* Replication diskless load defines */
 #define REPL_DISKLESS_LOAD_DISABLED 0
 #define REPL_DISKLESS_LOAD_WHEN_DB_EMPTY 1
@@ -489,6 +500,7 @@ extern int configOOMScoreAdjValuesDefaults[CONFIG_OOM_COUNT];
  * encoding version. */
 #define OBJ_MODULE 5    /* Module object. */
 #define OBJ_STREAM 6    /* Stream object. */
+#define OBJ_TYPE_MAX 7  /* Number of object types. */
 
 /* Extract encver / signature from a module type ID. */
 #define REDISMODULE_TYPE_ENCVER_BITS 10
@@ -617,6 +629,8 @@ typedef struct RedisModuleDigest {
 #define OBJ_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
 #define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
 #define OBJ_ENCODING_STREAM 10 /* Encoded as a radix tree of listpacks */
+#define OBJ_ENCODING_BTREE 11  /* Encoded as B+tree */
+#define OBJ_ENCODING_LISTPACK 12 /* Encoded as a listpack */
 
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */
@@ -679,6 +693,8 @@ typedef struct redisDb {
     int id;                     /* Database ID */
     long long avg_ttl;          /* Average TTL, just for stats */
     unsigned long expires_cursor; /* Cursor of the active expire cycle. */
+    rax *expires_index;         /* Keys with a timeout by expire time, or NULL. */
+    dict *volatile_hashes;      /* Keys of hashes with fields having a TTL. */
     list *defrag_later;         /* List of key names to attempt to defrag one by one, gradually. */
 } redisDb;
 
@@ -819,6 +835,13 @@ typedef struct client {
     robj **argv;            /* Arguments of current command. */
     size_t argv_len_sum;    /* Sum of lengths of objects in argv list. */
     struct redisCommand *cmd, *lastcmd;  /* Last command executed. */
+    struct redisCommand *parsed_cmd; /* Command of argv if already looked up,
+                                        see processCommand(). */
+    struct redisCommand *next_cmds[CLIENT_LOOKAHEAD_CMDS]; /* Commands of the
+                                        next requests in querybuf. */
+    int next_cmds_pos, next_cmds_num;
+    unsigned long long cmds_version; /* server.commands_version when the
+                                        commands above were looked up. */
     user *user;             /* User associated with this connection. If the
                                user is set to NULL the connection can do
                                anything (admin). */
@@ -855,6 +878,7 @@ typedef struct client {
     int btype;              /* Type of blocking op if CLIENT_BLOCKED. */
     blockingState bpop;     /* blocking state */
     long long woff;         /* Last write global replication offset. */
+    long long aof_woff;     /* AOF offset of the last write of the client. */
     list *watched_keys;     /* Keys WATCHED for MULTI/EXEC CAS */
     dict *pubsub_channels;  /* channels a client is interested in (SUBSCRIBE) */
     list *pubsub_patterns;  /* patterns a client is interested in (SUBSCRIBE) */
@@ -944,11 +968,21 @@ typedef struct zskiplist {  //定义了真正的skiplist结构
     int level;  //level表示skiplist的总层数，即所有节点层数的最大值
 } zskiplist;
 
+/* A sorted set is encoded either as a skiplist or as a B+tree, so only one
+ * of 'zsl' and 'zbt' is used. With the skiplist the values of the dict are
+ * pointers to the scores of the nodes, with the B+tree, where the entries
+ * move across the leaves, the values are the scores themselves. */
 typedef struct zset {
     dict *dict;
     zskiplist *zsl;
+    zbtree *zbt;
 } zset;
 
+/* Return the score of the dict entry 'de' of the skiplist or btree encoded
+ * sorted set 'zobj'. */
+#define zsetDictGetScore(zobj,de) ((zobj)->encoding == OBJ_ENCODING_BTREE ? \
+    dictGetDoubleVal(de) : *(double*)dictGetVal(de))
+
 typedef struct clientBufferLimitsConfig {
     unsigned long long hard_limit_bytes;
     unsigned long long soft_limit_bytes;
@@ -981,6 +1015,19 @@ typedef struct redisOpArray {
     int numops;
 } redisOpArray;
 
+/* The files of a multi part AOF, as listed in its manifest: see aof.c. */
+typedef struct aofFile {
+    sds name;
+    long long seq;              /* Sequence number of the file. */
+} aofFile;
+
+typedef struct aofManifest {
+    aofFile *base;              /* Base file, NULL if there is none. */
+    list *incrs;                /* Increment files, oldest first. */
+    long long base_seq;         /* Latest base sequence number used. */
+    long long incr_seq;         /* Latest increment sequence number used. */
+} aofManifest;
+
 /* This structure is returned by the getMemoryOverheadData() function in
  * order to return memory overhead information. */
 struct redisMemOverhead {
@@ -1080,6 +1127,23 @@ struct clusterState;
 #define CHILD_TYPE_LDB 3
 #define CHILD_TYPE_MODULE 4
 
+/* Statistics of the serialization of an RDB. The child saving the RDB sends
+ * them to the parent with the child info pipe, every second while saving
+ * and when done, so that the progress of a BGSAVE can be followed. */
+typedef struct rdbSaveStats {
+    unsigned long long keys_total;          /* Keys of the dataset. */
+    unsigned long long keys[OBJ_TYPE_MAX];  /* Keys saved, by type. */
+    unsigned long long usecs[OBJ_TYPE_MAX]; /* Time to serialize them. */
+    unsigned long long compress_strings;    /* Strings we tried to compress. */
+    unsigned long long compress_in;         /* Their bytes. */
+    unsigned long long compress_out;        /* Bytes saved for them. */
+    unsigned long long compress_usecs;      /* Time spent compressing. */
+    unsigned long long bytes;               /* Bytes of RDB written. */
+    unsigned long long write_usecs;         /* Time blocked in write(). */
+    unsigned long long fsync_usecs;         /* Time blocked in fsync(). */
+    unsigned long long elapsed_usecs;       /* Time since the save started. */
+} rdbSaveStats;
+
 struct redisServer {
     /* General */
     pid_t pid;                  /* Main process pid. */
@@ -1096,6 +1160,8 @@ struct redisServer {
     redisDb *db;
     dict *commands;             /* Command table */
     dict *orig_commands;        /* Command table before command renaming. */
+    unsigned long long commands_version; /* Incremented when commands are
+                                            removed from the table. */
     aeEventLoop *el;
     _Atomic unsigned int lruclock; /* Clock for LRU eviction */
     volatile sig_atomic_t shutdown_asap; /* SHUTDOWN needed ASAP */
@@ -1136,6 +1202,7 @@ struct redisServer {
     list *clients;              /* List of active clients */
     list *clients_to_close;     /* Clients to close asynchronously */
     list *clients_pending_write; /* There is to write or install handler. */
+    list *clients_waiting_aof;  /* Replies held until the AOF is fsynced. */
     list *clients_pending_read;  /* Client has pending read socket buffers. */
     list *slaves, *monitors;    /* List of slaves and MONITORs */
     client *current_client;     /* Current client executing the command. */
@@ -1161,21 +1228,29 @@ struct redisServer {
     off_t loading_loaded_bytes;
     time_t loading_start_time;
     off_t loading_process_events_interval_bytes;
+    dbBackup *loading_stale_backup; /* Old dataset served while loading. */
+    int loading_serving_stale;      /* The old dataset is in server.db. */
     /* Fast pointers to often looked up command */
     struct redisCommand *delCommand, *multiCommand, *lpushCommand,
                         *lpopCommand, *rpopCommand, *zpopminCommand,
                         *zpopmaxCommand, *sremCommand, *execCommand,
                         *expireCommand, *pexpireCommand, *xclaimCommand,
-                        *xgroupCommand, *rpoplpushCommand;
+                        *xgroupCommand, *rpoplpushCommand, *hdelCommand;
     /* Fields used only for stats */
     time_t stat_starttime;          /* Server start time */
     long long stat_numcommands;     /* Number of processed commands */
     long long stat_numconnections;  /* Number of connections received */
     long long stat_expiredkeys;     /* Number of expired keys */
+    long long stat_expired_fields;  /* Number of expired hash fields */
     double stat_expired_stale_perc; /* Percentage of keys probably expired */
     long long stat_expired_time_cap_reached_count; /* Early expire cylce stops.*/
     long long stat_expire_cycle_time_used; /* Cumulative microseconds used. */
+    long long stat_expire_cycle_scanned_keys; /* Keys checked by active expire. */
+    long long stat_expire_cycle_expired_keys; /* Keys expired by active expire. */
+    double stat_expire_scan_stale_perc; /* Expired keys in the last scan pass. */
     long long stat_evictedkeys;     /* Number of evicted keys (maxmemory) */
+    double stat_eviction_precision; /* Estimated precision of the eviction. */
+    long long stat_eviction_stale_candidates; /* Pool keys accessed/deleted. */
     long long stat_keyspace_hits;   /* Number of successful lookups of keys */
     long long stat_keyspace_misses; /* Number of failed lookups of keys */
     long long stat_active_defrag_hits;      /* number of allocations moved */
@@ -1198,12 +1273,17 @@ struct redisServer {
     _Atomic long long stat_net_input_bytes; /* Bytes read from network. */
     _Atomic long long stat_net_output_bytes; /* Bytes written to network. */
     size_t stat_rdb_cow_bytes;      /* Copy on write bytes during RDB saving. */
+    long long stat_rdb_forkless_copied_keys; /* Keys saved ahead of the scan
+                                                by the fork-less snapshot. */
+    rdbSaveStats stat_rdb_save;     /* Stats of the current or last RDB save. */
     size_t stat_aof_cow_bytes;      /* Copy on write bytes during AOF rewrite. */
     size_t stat_module_cow_bytes;   /* Copy on write bytes during module fork. */
     uint64_t stat_clients_type_memory[CLIENT_TYPE_COUNT];/* Mem usage by type */
     long long stat_unexpected_error_replies; /* Number of unexpected (aof-loading, replica to master, etc.) error replies */
     long long stat_io_reads_processed; /* Number of read events processed by IO / Main threads */
     long long stat_io_writes_processed; /* Number of write events processed by IO / Main threads */
+    long long stat_io_keys_prefetched; /* Keys of commands parsed by IO threads we prefetched */
+    long long stat_pipelined_keys_prefetched; /* Keys of pipelined commands we prefetched */
     _Atomic long long stat_total_reads_processed; /* Total number of read events processed */
     _Atomic long long stat_total_writes_processed; /* Total number of write events processed */
     /* The following two are used to track instantaneous metrics, like
@@ -1220,6 +1300,8 @@ struct redisServer {
     int tcpkeepalive;               /* Set SO_KEEPALIVE if non-zero. */
     int active_expire_enabled;      /* Can be disabled for testing purposes. */
     int active_expire_effort;       /* From 1 (default) to 10, active effort. */
+    int active_expire_index;        /* Index the keys by expire time. */
+    int active_expire_scan_thread;  /* Find the expired keys in a thread. */
     int active_defrag_enabled;
     int jemalloc_bg_thread;         /* Enable jemalloc background thread */
     size_t active_defrag_ignore_bytes; /* minimum amount of fragmentation waste to start active defrag */
@@ -1230,6 +1312,8 @@ struct redisServer {
     unsigned long active_defrag_max_scan_fields; /* maximum number of fields of set/hash/zset/list to process from within the main dict scan */
     _Atomic size_t client_max_querybuf_len; /* Limit for client query buffer length */
     int dbnum;                      /* Total number of configured DBs */
+    int keyspace_dict_store_hash;   /* Cache key hashes in keyspace dict entries. */
+    int keyspace_compact_entries;   /* Embed keys and expires in dict entries. */
     int supervised;                 /* 1 if supervised, 0 otherwise. */
     int supervised_mode;            /* See SUPERVISED_* */
     int daemonize;                  /* True if running as a daemon */
@@ -1264,6 +1348,12 @@ struct redisServer {
     int aof_last_write_errno;       /* Valid if aof_last_write_status is ERR */
     int aof_load_truncated;         /* Don't stop on unexpected AOF EOF. */
     int aof_use_rdb_preamble;       /* Use RDB preamble on AOF rewrites. */
+    int aof_multi_part;             /* AOF made of base and increment files. */
+    int aof_writer_thread;          /* Write the AOF from a dedicated thread. */
+    int aof_format;                 /* AOF_FORMAT_* of the appended commands. */
+    aofManifest *aof_manifest;      /* Files of the multi part AOF. */
+    unsigned long aof_rewrite_incrs; /* Increment files replaced by the base
+                                        being written by the rewrite child. */
     /* AOF pipes used to communicate between parent and child during rewrite. */
     int aof_pipe_write_data_to_child;
     int aof_pipe_read_data_from_parent;
@@ -1278,10 +1368,14 @@ struct redisServer {
     long long dirty;                /* Changes to DB from the last save */
     long long dirty_before_bgsave;  /* Used to restore dirty on failed BGSAVE */
     pid_t rdb_child_pid;            /* PID of RDB saving child */
+    int rdb_save_forkless;          /* Save the RDB without forking. */
+    int snapshot_in_progress;       /* Fork-less RDB save in progress. */
     struct saveparam *saveparams;   /* Save points array for RDB */
     int saveparamslen;              /* Number of saving points */
     char *rdb_filename;             /* Name of RDB file */
     int rdb_compression;            /* Use compression in RDB? */
+    int rdb_compression_codec;      /* RDB_CODEC_* used to compress strings. */
+    int rdb_compression_level;      /* Compression level of the LZ4 codec. */
     int rdb_checksum;               /* Use RDB checksum? */
     int rdb_del_sync_files;         /* Remove RDB files used only for SYNC if
                                        the instance does not use persistence. */
@@ -1304,11 +1398,18 @@ struct redisServer {
                                      * writing the RDB. (for testings) */
     int key_load_delay;             /* Delay in microseconds between keys while
                                      * loading aof or rdb. (for testings) */
+    int rdb_load_threads;           /* Threads decoding the values while
+                                     * loading an RDB. */
+    int rdb_load_mmap;              /* Load the RDB file memory mapping it. */
+    int rdb_save_threads;           /* Threads serializing the keys while
+                                     * saving an RDB in a child. */
     /* Pipe and data structures for child -> parent info sharing. */
     int child_info_pipe[2];         /* Pipe used to write the child_info_data. */
     struct {
         int process_type;           /* AOF or RDB child? */
+        int progress;               /* Sent while the child is working. */
         size_t cow_size;            /* Copy on write size. */
+        rdbSaveStats rdb_stats;     /* Stats of the RDB saved by the child. */
         unsigned long long magic;   /* Magic value to make sure data is valid. */
     } child_info_data;
     /* Propagation of commands in AOF / replication */
@@ -1342,6 +1443,8 @@ struct redisServer {
     int repl_diskless_sync;         /* Master send RDB to slaves sockets directly. */
     int repl_diskless_load;         /* Slave parse RDB directly from the socket.
                                      * see REPL_DISKLESS_LOAD_* enum */
+    int repl_diskless_load_pipeline; /* Read the socket from a thread and
+                                      * serve the old dataset meanwhile. */
     int repl_diskless_sync_delay;   /* Delay to start a diskless repl BGSAVE. */
     /* Replication (slave) */
     char *masteruser;               /* AUTH with this user and masterauth with master */
@@ -1386,6 +1489,8 @@ struct redisServer {
     unsigned long long maxmemory;   /* Max number of memory bytes to use */
     int maxmemory_policy;           /* Policy for key eviction */
     int maxmemory_samples;          /* Precision of random sampling */
+    int eviction_samples;           /* Adaptive keys sampled per DB. */
+    int eviction_batch;             /* Adaptive keys evicted per sampling. */
     int lfu_log_factor;             /* LFU logarithmic counter factor. */
     int lfu_decay_time;             /* LFU counter decay factor. */
     long long proto_max_bulk_len;   /* Protocol bulk length maximum size. */
@@ -1407,11 +1512,14 @@ struct redisServer {
     int sort_bypattern;
     int sort_store;
     /* Zip structure config, see redis.conf for more information  */
-    size_t hash_max_ziplist_entries;
-    size_t hash_max_ziplist_value;
+    size_t hash_max_listpack_entries;
+    size_t hash_max_listpack_value;
     size_t set_max_intset_entries;
-    size_t zset_max_ziplist_entries;
-    size_t zset_max_ziplist_value;
+    size_t set_max_listpack_entries;
+    size_t set_max_listpack_value;
+    size_t zset_max_listpack_entries;
+    size_t zset_max_listpack_value;
+    size_t zset_max_skiplist_entries;
     size_t hll_sparse_max_bytes;
     size_t stream_node_max_bytes;
     long long stream_node_max_entries;
@@ -1477,6 +1585,7 @@ struct redisServer {
     int lazyfree_lazy_expire;
     int lazyfree_lazy_server_del;
     int lazyfree_lazy_user_del;
+    int lazyfree_threads;           /* Threads releasing objects lazily. */
     /* Latency monitor */
     long long latency_monitor_threshold;
     dict *latency_events;
@@ -1585,6 +1694,8 @@ typedef struct {
     int encoding;
     int ii; /* intset iterator */
     dictIterator *di;
+    unsigned char *lpi; /* listpack iterator */
+    sds lpele;          /* Current listpack element, see setTypeNext(). */
 } setTypeIterator;
 
 /* Structure to hold hash iteration abstraction. Note that iteration over
@@ -1750,6 +1861,7 @@ int handleClientsWithPendingWritesUsingThreads(void);
 int handleClientsWithPendingReadsUsingThreads(void);
 int stopThreadedIOIfNeeded(void);
 int clientHasPendingReplies(client *c);
+void clientInstallWriteHandler(client *c);
 void unlinkClient(client *c);
 int writeToClient(client *c, int handler_installed);
 void linkClient(client *c);
@@ -1837,9 +1949,11 @@ robj *createQuicklistObject(void);
 robj *createZiplistObject(void);
 robj *createSetObject(void);
 robj *createIntsetObject(void);
+robj *createSetListpackObject(void);
 robj *createHashObject(void);
 robj *createZsetObject(void);
-robj *createZsetZiplistObject(void);
+robj *createZsetListpackObject(void);
+robj *createZsetBtreeObject(void);
 robj *createStreamObject(void);
 robj *createModuleObject(moduleType *mt, void *value);
 int getLongFromObjectOrReply(client *c, robj *o, long *target, const char *msg);
@@ -1900,6 +2014,7 @@ void rdbPipeWriteHandlerConnRemoved(struct connection *conn);
 void startLoadingFile(FILE* fp, char* filename, int rdbflags);
 void startLoading(size_t size, int rdbflags);
 void loadingProgress(off_t pos);
+void loadingProcessEvents(off_t pos);
 void stopLoading(int success);
 void startSaving(int rdbflags);
 void stopSaving(int success);
@@ -1915,12 +2030,26 @@ int writeCommandsDeniedByDiskError(void);
 void killRDBChild(void);
 int bg_unlink(const char *filename);
 
+/* Fork-less RDB snapshots */
+int snapshotStart(char *filename, rdbSaveInfo *rsi);
+void snapshotAbort(void);
+void snapshotCloseFiles(void);
+void snapshotBeforeWrite(redisDb *db, sds key);
+
 /* AOF persistence */
 void flushAppendOnlyFile(int force);
 void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc);
 void aofRemoveTempFile(pid_t childpid);
+void aof_background_fsync(int fd);
 int rewriteAppendOnlyFileBackground(void);
 int loadAppendOnlyFile(char *filename);
+void aofMultiPartInit(void);
+void aofWriterInit(void);
+int aofReadBinaryBlock(FILE *fp, off_t size, sds *payload);
+int aofParseBinaryRecord(rio *payload, int *argcp, robj ***argvp);
+int aofClientMustWait(client *c);
+void aofHoldClientReplies(client *c);
+void aofHoldPendingReplies(void);
 void stopAppendOnly(void);
 int startAppendOnly(void);
 void backgroundRewriteDoneHandler(int exitcode, int bysignal);
@@ -1934,6 +2063,7 @@ void restartAOFAfterSYNC();
 void openChildInfoPipe(void);
 void closeChildInfoPipe(void);
 void sendChildInfo(int process_type);
+void sendChildProgressInfo(int process_type);
 void receiveChildInfo(void);
 
 /* Fork helpers */
@@ -2003,6 +2133,7 @@ typedef struct {
 
 zskiplist *zslCreate(void);
 void zslFree(zskiplist *zsl);
+void zslFreeNode(zskiplistNode *node);
 zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele);
 unsigned char *zzlInsert(unsigned char *zl, sds ele, double score);
 int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node);
@@ -2015,14 +2146,15 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range);
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range);
 unsigned long zsetLength(const robj *zobj);
 void zsetConvert(robj *zobj, int encoding);
-void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen);
+void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen);
+void zsetBtreeInsert(zset *zs, double score, sds ele);
 int zsetScore(robj *zobj, sds member, double *score);
 unsigned long zslGetRank(zskiplist *zsl, double score, sds o);
 int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore);
 long zsetRank(robj *zobj, sds ele, int reverse);
 int zsetDel(robj *zobj, sds ele);
 void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey, robj *countarg);
-sds ziplistGetObject(unsigned char *sptr);
+sds lpGetObject(unsigned char *sptr);
 int zslValueGteMin(double value, zrangespec *spec);
 int zslValueLteMax(double value, zrangespec *spec);
 void zslFreeLexRange(zlexrangespec *spec);
@@ -2031,6 +2163,10 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range);
 unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range);
 zskiplistNode *zslFirstInLexRange(zskiplist *zsl, zlexrangespec *range);
 zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range);
+int zbtFirstInRange(zbtree *zbt, zrangespec *range, zbtCursor *c, unsigned long *rank);
+int zbtLastInRange(zbtree *zbt, zrangespec *range, zbtCursor *c, unsigned long *rank);
+int zbtFirstInLexRange(zbtree *zbt, zlexrangespec *range, zbtCursor *c, unsigned long *rank);
+int zbtLastInLexRange(zbtree *zbt, zlexrangespec *range, zbtCursor *c, unsigned long *rank);
 int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec);
 int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec);
 int zslLexValueGteMin(sds value, zlexrangespec *spec);
@@ -2104,6 +2240,7 @@ void setTypeConvert(robj *subject, int enc);
 /* Hash data type */
 #define HASH_SET_TAKE_FIELD (1<<0)
 #define HASH_SET_TAKE_VALUE (1<<1)
+#define HASH_SET_KEEP_TTL (1<<2)
 #define HASH_SET_COPY 0
 
 void hashTypeConvert(robj *o, int enc);
@@ -2114,7 +2251,7 @@ unsigned long hashTypeLength(const robj *o);
 hashTypeIterator *hashTypeInitIterator(robj *subject);
 void hashTypeReleaseIterator(hashTypeIterator *hi);
 int hashTypeNext(hashTypeIterator *hi);
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what,
                                 unsigned char **vstr,
                                 unsigned int *vlen,
                                 long long *vll);
@@ -2124,6 +2261,20 @@ sds hashTypeCurrentObjectNewSds(hashTypeIterator *hi, int what);
 robj *hashTypeLookupWriteOrCreate(client *c, robj *key);
 robj *hashTypeGetValueObject(robj *o, sds field);
 int hashTypeSet(robj *o, sds field, sds value, int flags);
+/* True if the object is a hash with fields having a TTL, see t_hash.c. */
+#define hashTypeHasVolatileFields(o) ((o)->type == OBJ_HASH && \
+    (o)->encoding == OBJ_ENCODING_HT && ((dict*)(o)->ptr)->privdata != NULL)
+/* Expire time of the field of the entry 'de' of a hash table encoded hash,
+ * or zero if the field has no TTL. */
+#define hashEntryExpire(d,de) (*(long long*)dictEntryMetadata((d),(de)))
+long long hashTypeGetFieldExpire(robj *o, sds field);
+long long hashTypeMinFieldExpire(robj *o);
+int hashTypeSetFieldExpire(robj *o, sds field, long long when);
+long hashTypeExpireFields(redisDb *db, robj *key, robj *o, long max,
+                          int *keyremoved);
+int hashTypeExpireIfNeeded(redisDb *db, robj *key, robj *o);
+int hashTypeFieldIsHidden(dict *d, dictEntry *de);
+unsigned long hashTypeVisibleLength(const robj *o);
 
 /* Pub / Sub */
 int pubsubUnsubscribeAllChannels(client *c, int notify);
@@ -2150,7 +2301,16 @@ void initConfigValues();
 /* db.c -- Keyspace access API */
 int removeExpire(redisDb *db, robj *key);
 void propagateExpire(redisDb *db, robj *key, int lazy);
+void propagateExpires(redisDb *db, robj **keys, int numkeys, int lazy);
+int dbDeleteExpire(redisDb *db, sds key);
+#define EXPIRES_INDEX_PREFIX_LEN 8 /* Expire time prefix in the index keys. */
+void expiresIndexUpdate(rax *index, unsigned char *key, size_t keylen,
+                        long long when, int add);
+long long expiresIndexKeyTime(unsigned char *indexed);
+void dbTrackVolatileHash(redisDb *db, sds key);
 int expireIfNeeded(redisDb *db, robj *key);
+int keyIsExpired(redisDb *db, robj *key);
+int expireTimeIsReached(mstime_t when);
 long long getExpire(redisDb *db, robj *key);
 void setExpire(client *c, redisDb *db, robj *key, long long when);
 int checkAlreadyExpired(long long when);
@@ -2161,6 +2321,7 @@ robj *lookupKeyReadOrReply(client *c, robj *key, robj *reply);
 robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply);
 robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags);
 robj *lookupKeyWriteWithFlags(redisDb *db, robj *key, int flags);
+void dbPrefetchKeys(redisDb *db, robj **keys, int numkeys, int step);
 robj *objectCommandLookup(client *c, robj *key);
 robj *objectCommandLookupOrReply(client *c, robj *key, robj *reply);
 int objectSetLRUOrLFU(robj *val, long long lfu_freq, long long lru_idle,
@@ -2168,8 +2329,12 @@ int objectSetLRUOrLFU(robj *val, long long lfu_freq, long long lru_idle,
 #define LOOKUP_NONE 0
 #define LOOKUP_NOTOUCH (1<<0)
 #define LOOKUP_NONOTIFY (1<<1)
+#define DB_PREFETCH_BATCH 16 /* Max keys prefetched by dbPrefetchKeys(). */
 void dbAdd(redisDb *db, robj *key, robj *val);
 int dbAddRDBLoad(redisDb *db, sds key, robj *val);
+/* True if the keys are embedded in the main dict entries of the DB, that is,
+ * if keyspace-compact-entries is enabled. */
+#define dbKeysAreEmbedded(db) ((db)->dict->type->keyEmbed != NULL)
 void dbOverwrite(redisDb *db, robj *key, robj *val);
 void genericSetKey(client *c, redisDb *db, robj *key, robj *val, int keepttl, int signal);
 void setKey(client *c, redisDb *db, robj *key, robj *val);
@@ -2188,6 +2353,7 @@ long long dbTotalServerKeyCount();
 dbBackup *backupDb(void);
 void restoreDbBackup(dbBackup *buckup);
 void discardDbBackup(dbBackup *buckup, int flags, void(callback)(void*));
+void swapDbBackup(dbBackup *backup);
 
 
 int selectDb(client *c, int id);
@@ -2206,6 +2372,7 @@ void emptyDbAsync(redisDb *db);
 void slotToKeyFlush(int async);
 size_t lazyfreeGetPendingObjectsCount(void);
 void freeObjAsync(robj *obj);
+void lazyfreeFlushBatch(void);
 void freeSlotsToKeysMapAsync(rax *rt);
 void freeSlotsToKeysMap(rax *rt, int async);
 
@@ -2272,6 +2439,9 @@ int clientsCronHandleTimeout(client *c, mstime_t now_ms);
 
 /* expire.c -- Handling of expired keys */
 void activeExpireCycle(int type);
+void initActiveExpireScanThread(void);
+void activeExpireScanResume(void);
+void activeExpireScanPause(void);
 void expireSlaveKeys(void);
 void rememberSlaveKeyWithExpire(redisDb *db, robj *key);
 void flushSlaveKeysWithExpireList(void);
@@ -2279,6 +2449,8 @@ size_t getSlaveKeyWithExpireCount(void);
 
 /* evict.c -- maxmemory handling and LRU eviction. */
 void evictionPoolAlloc(void);
+void evictionResetState(void);
+void evictionPoolRefresh(void);
 #define LFU_INIT_VAL 5
 unsigned long LFUGetTimeInMinutes(void);
 uint8_t LFULogIncr(uint8_t value);
@@ -2419,6 +2591,15 @@ void hgetCommand(client *c);
 void hmsetCommand(client *c);
 void hmgetCommand(client *c);
 void hdelCommand(client *c);
+void hexpireCommand(client *c);
+void hpexpireCommand(client *c);
+void hexpireatCommand(client *c);
+void hpexpireatCommand(client *c);
+void httlCommand(client *c);
+void hpttlCommand(client *c);
+void hexpiretimeCommand(client *c);
+void hpexpiretimeCommand(client *c);
+void hpersistCommand(client *c);
 void hlenCommand(client *c);
 void hstrlenCommand(client *c);
 void zremrangebyrankCommand(client *c);
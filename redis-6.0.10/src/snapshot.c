@@ -0,0 +1,359 @@
+/* Fork-less RDB snapshots.
+ *
+ * When rdb-save-forkless is enabled, BGSAVE and the save points don't fork
+ * a child that saves the dataset as it was at fork time thanks to the copy
+ * on write of the kernel. Instead the main thread itself produces the RDB
+ * incrementally, a few keys at a time, while it keeps serving clients, and
+ * the point-in-time semantics are obtained with a copy-before-write of the
+ * keys at the application level:
+ *
+ * 1. The keys of every DB are visited with dictScan(), a little at every
+ *    iteration of a time event, and saved in the RDB as they are visited.
+ *    While the snapshot is in progress the hash tables are never shrunk
+ *    (see updateDictResizePolicy()), and a shrink already in progress when
+ *    the snapshot started is completed before the DB is scanned, so that
+ *    dictScan() never returns the same key twice, and whether a key was
+ *    already visited can be told from the scan cursor and the hash of the
+ *    key (see dictScanCursorPassed()).
+ *
+ * 2. Before a key is written (looked up for writing, added, overwritten,
+ *    deleted, or its TTL is changed), snapshotBeforeWrite() checks if it was
+ *    already visited. If not, the key is saved in the RDB right away, if it
+ *    exists, and remembered in a set of keys the scan must skip, so that it
+ *    is saved exactly once, as it was when the snapshot started. Keys
+ *    created after the snapshot started are added to the same set, so that
+ *    they are not saved at all.
+ *
+ * Keys saved ahead of the scan may belong to a DB different from the one
+ * being scanned, so the RDB may contain more SELECTDB opcodes than usual,
+ * but its format is the same produced by rdbSaveRio().
+ *
+ * The RDB is written to a temp file by the main thread like the AOF is,
+ * with the fsync performed in the background by the bio threads. Once
+ * done, the temp file is renamed like a BGSAVE child does. The temp file
+ * is closed by serverCron() once no fsync of it is pending anymore, see
+ * snapshotCloseFiles().
+ *
+ * Commands changing the DBs wholesale (FLUSHALL, FLUSHDB, SWAPDB, and the
+ * replacement of the dataset by a replica) abort the snapshot, like a
+ * FLUSHALL kills the BGSAVE child: the save will be attempted again by the
+ * save points, as after a BGSAVE child killed on purpose. */
+
+#include "server.h"
+#include "bio.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/* Microseconds of work performed by every step of the snapshot. */
+#define SNAPSHOT_STEP_US 1000
+/* Bytes of RDB accumulated in memory before writing them to the file. */
+#define SNAPSHOT_WRITE_BYTES (1024*64)
+
+#define SNAPSHOT_STATE_SCAN 0   /* Saving the keys. */
+#define SNAPSHOT_STATE_SYNC 1   /* Waiting for the file to be fsync'ed. */
+
+static struct {
+    int state;
+    int fd;                     /* Temp file the RDB is written to. */
+    char tmpfile[256];
+    sds filename;               /* Final name of the RDB file. */
+    rdbSaveInfo rsi, *rsiptr;
+    rio rdb;                    /* The RDB is produced in an SDS buffer. */
+    off_t written;              /* Bytes written to the temp file. */
+    off_t synced;               /* Bytes written when last fsync'ed. */
+    int dbid;                   /* DB being scanned. */
+    int started;                /* Scan of 'dbid' started. */
+    unsigned long cursor;       /* Scan cursor of 'dbid'. */
+    int selected;               /* Last DB selected in the RDB, or -1. */
+    dict **skip;                /* Keys the scan must skip, for every DB. */
+    long long te;               /* Time event producing the snapshot. */
+    int error;                  /* errno of the first write error, if any. */
+} snapshot;
+
+/* Temp files of the released snapshots, to close once no background fsync
+ * is pending, since the bio thread may be still using the descriptor. */
+static list *snapshot_fds = NULL;
+
+/* Write the RDB accumulated in memory to the temp file. On error the errno
+ * is stored in snapshot.error, and the output is discarded from now on. */
+static void snapshotWrite(void) {
+    sds buf = snapshot.rdb.io.buffer.ptr;
+    size_t len = sdslen(buf), nwritten = 0;
+
+    while (nwritten < len && !snapshot.error) {
+        ssize_t n = write(snapshot.fd,buf+nwritten,len-nwritten);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            snapshot.error = errno;
+        } else {
+            nwritten += n;
+        }
+    }
+    snapshot.written += nwritten;
+    sdsclear(buf);
+    snapshot.rdb.io.buffer.pos = 0;
+
+    if (server.rdb_save_incremental_fsync &&
+        snapshot.written - snapshot.synced >= REDIS_AUTOSYNC_BYTES)
+    {
+        aof_background_fsync(snapshot.fd);
+        snapshot.synced = snapshot.written;
+    }
+}
+
+/* Make sure the next keys saved in the RDB are loaded in the specified DB. */
+static void snapshotSelectDb(int dbid) {
+    if (snapshot.selected == dbid) return;
+    rdbSaveType(&snapshot.rdb,RDB_OPCODE_SELECTDB);
+    rdbSaveLen(&snapshot.rdb,dbid);
+    snapshot.selected = dbid;
+}
+
+/* Save a key in the RDB. */
+static void snapshotSaveKey(redisDb *db, sds keystr, robj *val) {
+    robj key;
+
+    initStaticStringObject(key,keystr);
+    snapshotSelectDb(db->id);
+    rdbSaveKeyValuePair(&snapshot.rdb,&key,val,getExpire(db,&key));
+}
+
+/* Return true if the scan already visited the specified key. */
+static int snapshotKeyVisited(redisDb *db, sds key) {
+    if (db->id != snapshot.dbid) return db->id < snapshot.dbid;
+    if (!snapshot.started) return 0;
+    return dictScanCursorPassed(db->dict,snapshot.cursor,key);
+}
+
+static void snapshotScanCallback(void *privdata, const dictEntry *de) {
+    redisDb *db = privdata;
+    dict *skip = snapshot.skip[db->id];
+    sds keystr = dictGetKey(de);
+
+    /* Keys in the skip set were already saved, or did not exist when the
+     * snapshot started. The scan will not return them again. */
+    if (skip && dictDelete(skip,keystr) == DICT_OK) return;
+    snapshotSaveKey(db,keystr,dictGetVal(de));
+}
+
+/* Called before the specified key is written while a snapshot is in
+ * progress: if the key was not yet visited by the scan, it is saved now
+ * as it is, and it is skipped by the scan later. */
+void snapshotBeforeWrite(redisDb *db, sds key) {
+    dict *skip;
+    dictEntry *de;
+
+    if (snapshot.state != SNAPSHOT_STATE_SCAN) return;
+    if (snapshotKeyVisited(db,key)) return;
+
+    skip = snapshot.skip[db->id];
+    if (skip == NULL) skip = snapshot.skip[db->id] = dictCreate(&setDictType,NULL);
+    if (dictFind(skip,key) != NULL) return;
+    dictAdd(skip,sdsdup(key),NULL);
+
+    if ((de = dictFind(db->dict,key)) != NULL) {
+        snapshotSaveKey(db,dictGetKey(de),dictGetVal(de));
+        server.stat_rdb_forkless_copied_keys++;
+        if (sdslen(snapshot.rdb.io.buffer.ptr) >= SNAPSHOT_WRITE_BYTES)
+            snapshotWrite();
+    }
+}
+
+/* Scan the DBs saving the keys for at most 'us' microseconds. Returns 1 once
+ * all the DBs were scanned, otherwise 0. */
+static int snapshotScan(long long us) {
+    long long start = ustime();
+    int iterations = 0;
+
+    while (snapshot.dbid < server.dbnum) {
+        redisDb *db = server.db+snapshot.dbid;
+
+        if (!snapshot.started) {
+            if (dictSize(db->dict) == 0) {
+                snapshot.dbid++;
+                continue;
+            }
+            /* dictScan() may return the same key twice while the table is
+             * shrinking: complete the rehashing first, a bit at a time. */
+            if (dictIsRehashing(db->dict) &&
+                db->dict->ht[1].size < db->dict->ht[0].size)
+            {
+                dictRehashMilliseconds(db->dict,1);
+                if (ustime()-start > us) return 0;
+                continue;
+            }
+            snapshotSelectDb(db->id);
+            rdbSaveType(&snapshot.rdb,RDB_OPCODE_RESIZEDB);
+            rdbSaveLen(&snapshot.rdb,dictSize(db->dict));
+            rdbSaveLen(&snapshot.rdb,dictSize(db->expires));
+            snapshot.started = 1;
+            snapshot.cursor = 0;
+        }
+
+        snapshot.cursor = dictScan(db->dict,snapshot.cursor,
+                                   snapshotScanCallback,NULL,db);
+        if (snapshot.cursor == 0) {
+            snapshot.dbid++;
+            snapshot.started = 0;
+        }
+        if (sdslen(snapshot.rdb.io.buffer.ptr) >= SNAPSHOT_WRITE_BYTES)
+            snapshotWrite();
+        if ((++iterations & 15) == 0 && ustime()-start > us) return 0;
+    }
+    return 1;
+}
+
+/* Release the state of the snapshot, and remove the temp file unless it
+ * was already renamed. */
+static void snapshotRelease(int unlink_tmpfile) {
+    if (unlink_tmpfile) bg_unlink(snapshot.tmpfile);
+    if (snapshot.fd != -1) {
+        if (snapshot_fds == NULL) snapshot_fds = listCreate();
+        listAddNodeTail(snapshot_fds,(void*)(long)snapshot.fd);
+        snapshotCloseFiles();
+    }
+    snapshot.fd = -1;
+    sdsfree(snapshot.rdb.io.buffer.ptr);
+    sdsfree(snapshot.filename);
+    for (int j = 0; j < server.dbnum; j++)
+        if (snapshot.skip[j]) dictRelease(snapshot.skip[j]);
+    zfree(snapshot.skip);
+    if (snapshot.te != -1) aeDeleteTimeEvent(server.el,snapshot.te);
+    snapshot.te = -1;
+
+    server.snapshot_in_progress = 0;
+    server.rdb_save_time_last = time(NULL)-server.rdb_save_time_start;
+    server.rdb_save_time_start = -1;
+    updateDictResizePolicy();
+}
+
+/* Close the temp files of the released snapshots, unless the bio thread may
+ * be still fsync'ing them. Called by serverCron(). */
+void snapshotCloseFiles(void) {
+    listNode *ln;
+
+    if (snapshot_fds == NULL || listLength(snapshot_fds) == 0) return;
+    if (bioPendingJobsOfType(BIO_AOF_FSYNC)) return;
+    while ((ln = listFirst(snapshot_fds)) != NULL) {
+        close((long)listNodeValue(ln));
+        listDelNode(snapshot_fds,ln);
+    }
+}
+
+/* Finalize the snapshot once the temp file is fsync'ed: like a BGSAVE child
+ * we rename it, but the old file is unlinked in the background. Returns
+ * C_ERR on error. */
+static int snapshotRename(void) {
+    /* Don't let rename() unlink the old file, that may be slow: we close
+     * it in the background, like the AOF after a rewrite. */
+    int oldfd = open(snapshot.filename,O_RDONLY|O_NONBLOCK);
+
+    if (rename(snapshot.tmpfile,snapshot.filename) == -1) {
+        serverLog(LL_WARNING,
+            "Error moving temp DB file %s on the final destination %s: %s",
+            snapshot.tmpfile, snapshot.filename, strerror(errno));
+        if (oldfd != -1) close(oldfd);
+        return C_ERR;
+    }
+    if (oldfd != -1) bioCreateBackgroundJob(BIO_CLOSE_FILE,(void*)(long)oldfd,NULL,NULL);
+    return C_OK;
+}
+
+/* Perform a step of the snapshot, called by its time event. */
+static int snapshotCron(struct aeEventLoop *eventLoop, long long id,
+                        void *clientData)
+{
+    UNUSED(eventLoop);
+    UNUSED(id);
+    UNUSED(clientData);
+    int success;
+
+    if (snapshot.state == SNAPSHOT_STATE_SCAN) {
+        if (!snapshotScan(SNAPSHOT_STEP_US)) return 1;
+        rdbSaveRioTrailer(&snapshot.rdb,snapshot.rsiptr);
+        snapshotWrite();
+        if (!snapshot.error) {
+            aof_background_fsync(snapshot.fd);
+            snapshot.state = SNAPSHOT_STATE_SYNC;
+            return 1;
+        }
+    } else if (bioPendingJobsOfType(BIO_AOF_FSYNC)) {
+        return 1; /* Still waiting for the fsync. */
+    }
+
+    if (snapshot.error) {
+        serverLog(LL_WARNING,"Write error saving DB on disk: %s",
+            strerror(snapshot.error));
+        success = 0;
+    } else {
+        success = snapshotRename() == C_OK;
+    }
+    snapshot.te = -1; /* Deleted by returning AE_NOMORE. */
+    snapshotRelease(!success);
+
+    if (success) {
+        serverLog(LL_NOTICE,"Background saving terminated with success");
+        server.dirty = server.dirty - server.dirty_before_bgsave;
+        server.lastsave = time(NULL);
+        server.lastbgsave_status = C_OK;
+    } else {
+        server.lastbgsave_status = C_ERR;
+    }
+    stopSaving(success);
+    return AE_NOMORE;
+}
+
+/* Start a fork-less snapshot of the dataset to the specified file. Returns
+ * C_ERR if a snapshot is already in progress or on error. */
+int snapshotStart(char *filename, rdbSaveInfo *rsi) {
+    if (server.snapshot_in_progress) return C_ERR;
+
+    server.dirty_before_bgsave = server.dirty;
+    server.lastbgsave_try = time(NULL);
+
+    snprintf(snapshot.tmpfile,sizeof(snapshot.tmpfile),"temp-forkless-%d.rdb",
+        (int) getpid());
+    snapshot.fd = open(snapshot.tmpfile,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if (snapshot.fd == -1) {
+        server.lastbgsave_status = C_ERR;
+        serverLog(LL_WARNING,
+            "Failed opening the RDB file %s for saving: %s",
+            snapshot.tmpfile, strerror(errno));
+        return C_ERR;
+    }
+
+    snapshot.state = SNAPSHOT_STATE_SCAN;
+    snapshot.filename = sdsnew(filename);
+    if (rsi) snapshot.rsi = *rsi;
+    snapshot.rsiptr = rsi ? &snapshot.rsi : NULL;
+    rioInitWithBuffer(&snapshot.rdb,sdsempty());
+    snapshot.written = snapshot.synced = 0;
+    snapshot.dbid = 0;
+    snapshot.started = 0;
+    snapshot.cursor = 0;
+    snapshot.selected = -1;
+    snapshot.skip = zcalloc(sizeof(dict*)*server.dbnum);
+    snapshot.error = 0;
+    snapshot.te = aeCreateTimeEvent(server.el,1,snapshotCron,NULL,NULL);
+    if (snapshot.te == AE_ERR) serverPanic("Can't create the snapshot timer.");
+
+    startSaving(RDBFLAGS_NONE);
+    rdbSaveRioHeader(&snapshot.rdb,RDBFLAGS_NONE,snapshot.rsiptr);
+    serverLog(LL_NOTICE,"Background saving started without forking");
+    server.snapshot_in_progress = 1;
+    server.rdb_save_time_start = time(NULL);
+    server.stat_rdb_forkless_copied_keys = 0;
+    updateDictResizePolicy();
+    return C_OK;
+}
+
+/* Abort the snapshot in progress, if any, removing the temp file. Like
+ * for a BGSAVE child killed on purpose, the status of the last BGSAVE is
+ * not changed. */
+void snapshotAbort(void) {
+    if (!server.snapshot_in_progress) return;
+    serverLog(LL_WARNING,"Background saving without forking aborted");
+    snapshotRelease(1);
+    stopSaving(0);
+}
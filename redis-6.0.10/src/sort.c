@@ -395,6 +395,28 @@ void sortCommand(client *c) {
             j++;
         }
         setTypeReleaseIterator(si);
+    } else if (sortval->type == OBJ_ZSET && dontsort &&
+               sortval->encoding == OBJ_ENCODING_BTREE)
+    {
+        /* Same as below for the btree encoding. */
+        zset *zs = sortval->ptr;
+        zbtCursor cur;
+        int valid, rangelen = vectorlen;
+
+        valid = zbtSeekRank(zs->zbt,
+            desc ? zs->zbt->length-start : (unsigned long)start+1,&cur);
+        while(rangelen--) {
+            serverAssertWithInfo(c,sortval,valid);
+            sds sdsele = zbtCursorEntry(&cur)->ele;
+            vector[j].obj = createStringObject(sdsele,sdslen(sdsele));
+            vector[j].u.score = 0;
+            vector[j].u.cmpobj = NULL;
+            j++;
+            valid = desc ? zbtPrev(&cur) : zbtNext(&cur);
+        }
+        /* Fix start/end: output code is not aware of this optimization. */
+        end -= start;
+        start = 0;
     } else if (sortval->type == OBJ_ZSET && dontsort) {
         /* Special handling for a sorted set, if 'dontsort' is true.
          * This makes sure we return elements in the sorted set original
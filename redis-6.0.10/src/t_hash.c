@@ -34,17 +34,20 @@
  * Hash type API
  *----------------------------------------------------------------------------*/
 
+static dictEntry *hashTypeFindField(dict *d, sds field);
+static void hashTypeUpdateFieldExpire(dict *d, dictEntry *de, long long when);
+
 /* Check the length of a number of objects to see if we need to convert a
- * ziplist to a real hash. Note that we only check string encoded objects
+ * listpack to a real hash. Note that we only check string encoded objects
  * as their string length can be queried in constant time. */
 void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
     int i;
 
-    if (o->encoding != OBJ_ENCODING_ZIPLIST) return;
+    if (o->encoding != OBJ_ENCODING_LISTPACK) return;
 
     for (i = start; i <= end; i++) {
         if (sdsEncodedObject(argv[i]) &&
-            sdslen(argv[i]->ptr) > server.hash_max_ziplist_value)
+            sdslen(argv[i]->ptr) > server.hash_max_listpack_value)
         {
             hashTypeConvert(o, OBJ_ENCODING_HT);
             break;
@@ -52,32 +55,30 @@ void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
     }
 }
 
-/* Get the value from a ziplist encoded hash, identified by field.
+/* Get the value from a listpack encoded hash, identified by field.
  * Returns -1 when the field cannot be found. */
-int hashTypeGetFromZiplist(robj *o, sds field,
+int hashTypeGetFromListpack(robj *o, sds field,
                            unsigned char **vstr,
                            unsigned int *vlen,
                            long long *vll)
 {
     unsigned char *zl, *fptr = NULL, *vptr = NULL;
-    int ret;
 
-    serverAssert(o->encoding == OBJ_ENCODING_ZIPLIST);
+    serverAssert(o->encoding == OBJ_ENCODING_LISTPACK);
 
     zl = o->ptr;
-    fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+    fptr = lpFirst(zl);
     if (fptr != NULL) {
-        fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+        fptr = lpFind(zl, fptr, (unsigned char*)field, sdslen(field), 1);
         if (fptr != NULL) {
             /* Grab pointer to the value (fptr points to the field) */
-            vptr = ziplistNext(zl, fptr);
+            vptr = lpNext(zl, fptr);
             serverAssert(vptr != NULL);
         }
     }
 
     if (vptr != NULL) {
-        ret = ziplistGet(vptr, vstr, vlen, vll);
-        serverAssert(ret);
+        *vstr = lpGetValue(vptr, vlen, vll);
         return 0;
     }
 
@@ -92,7 +93,7 @@ sds hashTypeGetFromHashTable(robj *o, sds field) {
 
     serverAssert(o->encoding == OBJ_ENCODING_HT);
 
-    de = dictFind(o->ptr, field);
+    de = hashTypeFindField(o->ptr, field);
     if (de == NULL) return NULL;
     return dictGetVal(de);
 }
@@ -107,9 +108,9 @@ sds hashTypeGetFromHashTable(robj *o, sds field) {
  * can always check the function return by checking the return value
  * for C_OK and checking if vll (or vstr) is NULL. */
 int hashTypeGetValue(robj *o, sds field, unsigned char **vstr, unsigned int *vlen, long long *vll) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         *vstr = NULL;
-        if (hashTypeGetFromZiplist(o, field, vstr, vlen, vll) == 0)
+        if (hashTypeGetFromListpack(o, field, vstr, vlen, vll) == 0)
             return C_OK;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         sds value;
@@ -143,12 +144,12 @@ robj *hashTypeGetValueObject(robj *o, sds field) {
  * exist. */
 size_t hashTypeGetValueLength(robj *o, sds field) {
     size_t len = 0;
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        if (hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0)
+        if (hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll) == 0)
             len = vstr ? vlen : sdigits10(vll);
     } else if (o->encoding == OBJ_ENCODING_HT) {
         sds aux;
@@ -164,12 +165,12 @@ size_t hashTypeGetValueLength(robj *o, sds field) {
 /* Test if the specified field exists in the given hash. Returns 1 if the field
  * exists, and 0 when it doesn't. */
 int hashTypeExists(robj *o, sds field) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        if (hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0) return 1;
+        if (hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll) == 0) return 1;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         if (hashTypeGetFromHashTable(o, field) != NULL) return 1;
     } else {
@@ -195,50 +196,51 @@ int hashTypeExists(robj *o, sds field) {
  * HASH_SET_COPY corresponds to no flags passed, and means the default
  * semantics of copying the values if needed.
  *
+ * The expire time of an updated field is removed, unless HASH_SET_KEEP_TTL
+ * is passed, like SET and INCR do with the TTL of keys.
  */
 #define HASH_SET_TAKE_FIELD (1<<0)
 #define HASH_SET_TAKE_VALUE (1<<1)
+#define HASH_SET_KEEP_TTL (1<<2)
 #define HASH_SET_COPY 0
 int hashTypeSet(robj *o, sds field, sds value, int flags) {
     int update = 0;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl, *fptr, *vptr;
 
         zl = o->ptr;
-        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        fptr = lpFirst(zl);
         if (fptr != NULL) {
-            fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+            fptr = lpFind(zl, fptr, (unsigned char*)field, sdslen(field), 1);
             if (fptr != NULL) {
                 /* Grab pointer to the value (fptr points to the field) */
-                vptr = ziplistNext(zl, fptr);
+                vptr = lpNext(zl, fptr);
                 serverAssert(vptr != NULL);
                 update = 1;
 
-                /* Delete value */
-                zl = ziplistDelete(zl, &vptr);
-
-                /* Insert new value */
-                zl = ziplistInsert(zl, vptr, (unsigned char*)value,
-                        sdslen(value));
+                /* Replace value */
+                zl = lpInsert(zl, (unsigned char*)value, sdslen(value),
+                        vptr, LP_REPLACE, NULL);
             }
         }
 
         if (!update) {
-            /* Push new field/value pair onto the tail of the ziplist */
-            zl = ziplistPush(zl, (unsigned char*)field, sdslen(field),
-                    ZIPLIST_TAIL);
-            zl = ziplistPush(zl, (unsigned char*)value, sdslen(value),
-                    ZIPLIST_TAIL);
+            /* Push new field/value pair onto the tail of the listpack */
+            zl = lpAppend(zl, (unsigned char*)field, sdslen(field));
+            zl = lpAppend(zl, (unsigned char*)value, sdslen(value));
         }
         o->ptr = zl;
 
-        /* Check if the ziplist needs to be converted to a hash table */
-        if (hashTypeLength(o) > server.hash_max_ziplist_entries)
+        /* Check if the listpack needs to be converted to a hash table */
+        if (hashTypeLength(o) > server.hash_max_listpack_entries)
             hashTypeConvert(o, OBJ_ENCODING_HT);
     } else if (o->encoding == OBJ_ENCODING_HT) {
-        dictEntry *de = dictFind(o->ptr,field);
+        dict *d = o->ptr;
+        dictEntry *de = dictFind(d,field);
         if (de) {
+            if (d->privdata && !(flags & HASH_SET_KEEP_TTL))
+                hashTypeUpdateFieldExpire(d,de,0);
             sdsfree(dictGetVal(de));
             if (flags & HASH_SET_TAKE_VALUE) {
                 dictGetVal(de) = value;
@@ -279,22 +281,27 @@ int hashTypeSet(robj *o, sds field, sds value, int flags) {
 int hashTypeDelete(robj *o, sds field) {
     int deleted = 0;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl, *fptr;
 
         zl = o->ptr;
-        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        fptr = lpFirst(zl);
         if (fptr != NULL) {
-            fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+            fptr = lpFind(zl, fptr, (unsigned char*)field, sdslen(field), 1);
             if (fptr != NULL) {
-                zl = ziplistDelete(zl,&fptr); /* Delete the key. */
-                zl = ziplistDelete(zl,&fptr); /* Delete the value. */
+                /* Delete both the key and the value. */
+                zl = lpDeleteRangeWithEntry(zl,fptr,2);
                 o->ptr = zl;
                 deleted = 1;
             }
         }
     } else if (o->encoding == OBJ_ENCODING_HT) {
-        if (dictDelete((dict*)o->ptr, field) == C_OK) {
+        dict *d = o->ptr;
+        dictEntry *de = dictUnlink(d,field);
+
+        if (de) {
+            if (d->privdata) hashTypeUpdateFieldExpire(d,de,0);
+            dictFreeUnlinkedEntry(d,de);
             deleted = 1;
 
             /* Always check if the dictionary needs a resize after a delete. */
@@ -311,8 +318,8 @@ int hashTypeDelete(robj *o, sds field) {
 unsigned long hashTypeLength(const robj *o) {
     unsigned long length = ULONG_MAX;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        length = ziplistLen(o->ptr) / 2;
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        length = lpLength(o->ptr) / 2;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         length = dictSize((const dict*)o->ptr);
     } else {
@@ -326,7 +333,7 @@ hashTypeIterator *hashTypeInitIterator(robj *subject) {
     hi->subject = subject;
     hi->encoding = subject->encoding;
 
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         hi->fptr = NULL;
         hi->vptr = NULL;
     } else if (hi->encoding == OBJ_ENCODING_HT) {
@@ -346,7 +353,7 @@ void hashTypeReleaseIterator(hashTypeIterator *hi) {
 /* Move to the next entry in the hash. Return C_OK when the next entry
  * could be found and C_ERR when the iterator reaches the end. */
 int hashTypeNext(hashTypeIterator *hi) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl;
         unsigned char *fptr, *vptr;
 
@@ -357,16 +364,16 @@ int hashTypeNext(hashTypeIterator *hi) {
         if (fptr == NULL) {
             /* Initialize cursor */
             serverAssert(vptr == NULL);
-            fptr = ziplistIndex(zl, 0);
+            fptr = lpFirst(zl);
         } else {
             /* Advance cursor */
             serverAssert(vptr != NULL);
-            fptr = ziplistNext(zl, vptr);
+            fptr = lpNext(zl, vptr);
         }
         if (fptr == NULL) return C_ERR;
 
         /* Grab pointer to the value (fptr points to the field) */
-        vptr = ziplistNext(zl, fptr);
+        vptr = lpNext(zl, fptr);
         serverAssert(vptr != NULL);
 
         /* fptr, vptr now point to the first or next pair */
@@ -381,22 +388,18 @@ int hashTypeNext(hashTypeIterator *hi) {
 }
 
 /* Get the field or value at iterator cursor, for an iterator on a hash value
- * encoded as a ziplist. Prototype is similar to `hashTypeGetFromZiplist`. */
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
+ * encoded as a listpack. Prototype is similar to `hashTypeGetFromListpack`. */
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what,
                                 unsigned char **vstr,
                                 unsigned int *vlen,
                                 long long *vll)
 {
-    int ret;
-
-    serverAssert(hi->encoding == OBJ_ENCODING_ZIPLIST);
+    serverAssert(hi->encoding == OBJ_ENCODING_LISTPACK);
 
     if (what & OBJ_HASH_KEY) {
-        ret = ziplistGet(hi->fptr, vstr, vlen, vll);
-        serverAssert(ret);
+        *vstr = lpGetValue(hi->fptr, vlen, vll);
     } else {
-        ret = ziplistGet(hi->vptr, vstr, vlen, vll);
-        serverAssert(ret);
+        *vstr = lpGetValue(hi->vptr, vlen, vll);
     }
 }
 
@@ -424,9 +427,9 @@ sds hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what) {
  * can always check the function return by checking the return value
  * type checking if vstr == NULL. */
 void hashTypeCurrentObject(hashTypeIterator *hi, int what, unsigned char **vstr, unsigned int *vlen, long long *vll) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         *vstr = NULL;
-        hashTypeCurrentFromZiplist(hi, what, vstr, vlen, vll);
+        hashTypeCurrentFromListpack(hi, what, vstr, vlen, vll);
     } else if (hi->encoding == OBJ_ENCODING_HT) {
         sds ele = hashTypeCurrentFromHashTable(hi, what);
         *vstr = (unsigned char*) ele;
@@ -462,10 +465,10 @@ robj *hashTypeLookupWriteOrCreate(client *c, robj *key) {
     return o;
 }
 
-void hashTypeConvertZiplist(robj *o, int enc) {
-    serverAssert(o->encoding == OBJ_ENCODING_ZIPLIST);
+void hashTypeConvertListpack(robj *o, int enc) {
+    serverAssert(o->encoding == OBJ_ENCODING_LISTPACK);
 
-    if (enc == OBJ_ENCODING_ZIPLIST) {
+    if (enc == OBJ_ENCODING_LISTPACK) {
         /* Nothing to do... */
 
     } else if (enc == OBJ_ENCODING_HT) {
@@ -483,13 +486,13 @@ void hashTypeConvertZiplist(robj *o, int enc) {
             value = hashTypeCurrentObjectNewSds(hi,OBJ_HASH_VALUE);
             ret = dictAdd(dict, key, value);
             if (ret != DICT_OK) {
-                serverLogHexDump(LL_WARNING,"ziplist with dup elements dump",
-                    o->ptr,ziplistBlobLen(o->ptr));
-                serverPanic("Ziplist corruption detected");
+                serverLogHexDump(LL_WARNING,"listpack with dup elements dump",
+                    o->ptr,lpBytes(o->ptr));
+                serverPanic("Listpack corruption detected");
             }
         }
         hashTypeReleaseIterator(hi);
-        zfree(o->ptr);
+        lpFree(o->ptr);
         o->encoding = OBJ_ENCODING_HT;
         o->ptr = dict;
     } else {
@@ -498,8 +501,8 @@ void hashTypeConvertZiplist(robj *o, int enc) {
 }
 
 void hashTypeConvert(robj *o, int enc) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        hashTypeConvertZiplist(o, enc);
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        hashTypeConvertListpack(o, enc);
     } else if (o->encoding == OBJ_ENCODING_HT) {
         serverPanic("Not implemented");
     } else {
@@ -507,6 +510,212 @@ void hashTypeConvert(robj *o, int enc) {
     }
 }
 
+/*-----------------------------------------------------------------------------
+ * Hash fields expires
+ *
+ * Fields with a TTL ("volatile fields") are only supported by the hash table
+ * encoding, so a listpack is converted when the first TTL is set. The expire
+ * time of a field, as unix time in milliseconds, is stored in the metadata
+ * of its dict entry (see hashDictType), and is zero if the field has no TTL.
+ * While a hash has volatile fields they are also indexed by expire time in
+ * a radix tree referenced by the private data of the dict, with the layout
+ * of the keys expires index (see expiresIndexUpdate()), so that the due
+ * fields are found in expire time order without scanning the hash.
+ *
+ * Like keys, the expired fields are deleted by masters when the hash is
+ * looked up (see hashTypeExpireIfNeeded()), or by the active expire cycle,
+ * that samples the hashes of db->volatile_hashes, and HDELs are propagated
+ * to the replicas and the AOF.
+ *----------------------------------------------------------------------------*/
+
+/* Set the expire time of the field of the entry 'de' of the hash table 'd',
+ * or remove it if 'when' is zero, keeping the index in sync. The index is
+ * released as soon as no field has a TTL. */
+static void hashTypeUpdateFieldExpire(dict *d, dictEntry *de, long long when) {
+    sds field = dictGetKey(de);
+    long long old = hashEntryExpire(d,de);
+    rax *index = d->privdata;
+
+    if (old == when) return;
+    if (old)
+        expiresIndexUpdate(index,(unsigned char*)field,sdslen(field),old,0);
+    if (when) {
+        if (index == NULL) index = d->privdata = raxNew();
+        expiresIndexUpdate(index,(unsigned char*)field,sdslen(field),when,1);
+    } else if (raxSize(index) == 0) {
+        raxFree(index);
+        d->privdata = NULL;
+    }
+    hashEntryExpire(d,de) = when;
+}
+
+/* Replicas don't delete the expired fields, they wait for the HDELs of the
+ * master, but as it happens for keys (see lookupKeyReadWithFlags()) the read
+ * only commands of normal clients see such fields as already deleted.
+ * Returns true if the expired fields of the hash table 'd' must be hidden
+ * to the current client. */
+static int hashTypeHidesExpiredFields(dict *d) {
+    return d->privdata && server.masterhost &&
+           server.current_client &&
+           server.current_client != server.master &&
+           server.current_client->cmd &&
+           server.current_client->cmd->flags & CMD_READONLY;
+}
+
+/* Return true if the field of the entry 'de' of the hash table 'd' expired
+ * and must be hidden to the current client. */
+int hashTypeFieldIsHidden(dict *d, dictEntry *de) {
+    return hashTypeHidesExpiredFields(d) && hashEntryExpire(d,de) &&
+           expireTimeIsReached(hashEntryExpire(d,de));
+}
+
+/* Like hashTypeLength(), but without the fields hidden to the current
+ * client. The due fields are the first ones of the index. */
+unsigned long hashTypeVisibleLength(const robj *o) {
+    unsigned long len = hashTypeLength(o);
+    raxIterator ri;
+
+    if (o->encoding != OBJ_ENCODING_HT || !hashTypeHidesExpiredFields(o->ptr))
+        return len;
+    raxStart(&ri,((dict*)o->ptr)->privdata);
+    raxSeek(&ri,"^",NULL,0);
+    while (raxNext(&ri) && expireTimeIsReached(expiresIndexKeyTime(ri.key)))
+        len--;
+    raxStop(&ri);
+    return len;
+}
+
+/* Lookup the entry of a field in a hash table encoded hash, as seen by the
+ * current client. */
+static dictEntry *hashTypeFindField(dict *d, sds field) {
+    dictEntry *de = dictFind(d,field);
+
+    if (de && hashTypeFieldIsHidden(d,de)) return NULL;
+    return de;
+}
+
+/* Return the expire time of a field of the hash, -1 if the field has no
+ * expire, or -2 if the field does not exist. */
+long long hashTypeGetFieldExpire(robj *o, sds field) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK)
+        return hashTypeExists(o,field) ? -1 : -2;
+    serverAssert(o->encoding == OBJ_ENCODING_HT);
+
+    dictEntry *de = hashTypeFindField(o->ptr,field);
+    if (de == NULL) return -2;
+    return hashEntryExpire((dict*)o->ptr,de) ? hashEntryExpire((dict*)o->ptr,de) : -1;
+}
+
+/* Set the expire time of a field of the hash, as unix time in milliseconds,
+ * or remove it if 'when' is zero. A listpack is converted to a hash table
+ * before setting the first expire. Returns 0 if the field does not exist,
+ * otherwise 1. When the hash belongs to a DB, it's up to the caller to
+ * track it with dbTrackVolatileHash(). */
+int hashTypeSetFieldExpire(robj *o, sds field, long long when) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        if (!hashTypeExists(o,field)) return 0;
+        if (when == 0) return 1;
+        hashTypeConvert(o,OBJ_ENCODING_HT);
+    }
+    serverAssert(o->encoding == OBJ_ENCODING_HT);
+
+    dictEntry *de = dictFind(o->ptr,field);
+    if (de == NULL) return 0;
+    hashTypeUpdateFieldExpire(o->ptr,de,when);
+    return 1;
+}
+
+/* Return the earliest expire time of the fields of a hash with volatile
+ * fields. */
+long long hashTypeMinFieldExpire(robj *o) {
+    raxIterator ri;
+    long long when;
+
+    serverAssert(hashTypeHasVolatileFields(o));
+    raxStart(&ri,((dict*)o->ptr)->privdata);
+    raxSeek(&ri,"^",NULL,0);
+    serverAssert(raxNext(&ri));
+    when = expiresIndexKeyTime(ri.key);
+    raxStop(&ri);
+    return when;
+}
+
+/* Number of fields deleted by every HDEL propagated for expired fields. */
+#define HASH_EXPIRE_BATCH 128
+
+/* Delete up to 'max' fields of the hash 'o' stored at 'key' that reached
+ * their TTL, in expire time order, propagating them as HDELs to the
+ * replicas and the AOF. If no field is left the key is deleted as well,
+ * and *keyremoved is set to 1. Returns the number of expired fields.
+ * This is only called by masters. */
+long hashTypeExpireFields(redisDb *db, robj *key, robj *o, long max,
+                          int *keyremoved)
+{
+    robj *argv[HASH_EXPIRE_BATCH+2];
+    long expired = 0;
+    raxIterator ri;
+
+    *keyremoved = 0;
+    while (expired < max && hashTypeHasVolatileFields(o)) {
+        int numfields = 0;
+
+        /* Collect the due fields first, since the index can't be modified
+         * while we iterate it. */
+        raxStart(&ri,((dict*)o->ptr)->privdata);
+        raxSeek(&ri,"^",NULL,0);
+        while (numfields < HASH_EXPIRE_BATCH && expired+numfields < max &&
+               raxNext(&ri))
+        {
+            if (!expireTimeIsReached(expiresIndexKeyTime(ri.key))) break;
+            argv[2+numfields++] = createStringObject(
+                (char*)ri.key+EXPIRES_INDEX_PREFIX_LEN,
+                ri.key_len-EXPIRES_INDEX_PREFIX_LEN);
+        }
+        raxStop(&ri);
+        if (numfields == 0) break;
+
+        if (expired == 0 && server.snapshot_in_progress)
+            snapshotBeforeWrite(db,key->ptr);
+        for (int j = 0; j < numfields; j++)
+            serverAssert(hashTypeDelete(o,argv[2+j]->ptr));
+        expired += numfields;
+
+        argv[0] = createStringObject("HDEL",4);
+        argv[1] = key;
+        incrRefCount(key);
+        if (server.aof_state != AOF_OFF)
+            feedAppendOnlyFile(server.hdelCommand,db->id,argv,numfields+2);
+        replicationFeedSlaves(server.slaves,db->id,argv,numfields+2);
+        for (int j = 0; j < numfields+2; j++) decrRefCount(argv[j]);
+    }
+    if (expired == 0) return 0;
+
+    server.stat_expired_fields += expired;
+    notifyKeyspaceEvent(NOTIFY_HASH,"hexpired",key,db->id);
+    if (hashTypeLength(o) == 0) {
+        dbDelete(db,key);
+        notifyKeyspaceEvent(NOTIFY_GENERIC,"del",key,db->id);
+        *keyremoved = 1;
+    }
+    signalModifiedKey(NULL,db,key);
+    return expired;
+}
+
+/* Called when a hash with volatile fields is looked up: like it happens
+ * for keys in expireIfNeeded(), masters delete the fields that reached
+ * their TTL. Returns 1 if no field was left, so the key itself was deleted,
+ * otherwise 0. */
+int hashTypeExpireIfNeeded(redisDb *db, robj *key, robj *o) {
+    int keyremoved;
+
+    /* Nothing expires while loading, and the fields are checked against
+     * the time the Lua script or the command started, see
+     * expireTimeIsReached(). */
+    if (server.loading || server.masterhost != NULL) return 0;
+    hashTypeExpireFields(db,key,o,LONG_MAX,&keyremoved);
+    return keyremoved;
+}
+
 /*-----------------------------------------------------------------------------
  * Hash type commands
  *----------------------------------------------------------------------------*/
@@ -584,7 +793,7 @@ void hincrbyCommand(client *c) {
     }
     value += incr;
     new = sdsfromlonglong(value);
-    hashTypeSet(o,c->argv[2]->ptr,new,HASH_SET_TAKE_VALUE);
+    hashTypeSet(o,c->argv[2]->ptr,new,HASH_SET_TAKE_VALUE|HASH_SET_KEEP_TTL);
     addReplyLongLong(c,value);
     signalModifiedKey(c,c->db,c->argv[1]);
     notifyKeyspaceEvent(NOTIFY_HASH,"hincrby",c->argv[1],c->db->id);
@@ -623,7 +832,7 @@ void hincrbyfloatCommand(client *c) {
     char buf[MAX_LONG_DOUBLE_CHARS];
     int len = ld2string(buf,sizeof(buf),value,LD_STR_HUMAN);
     new = sdsnewlen(buf,len);
-    hashTypeSet(o,c->argv[2]->ptr,new,HASH_SET_TAKE_VALUE);
+    hashTypeSet(o,c->argv[2]->ptr,new,HASH_SET_TAKE_VALUE|HASH_SET_KEEP_TTL);
     addReplyBulkCBuffer(c,buf,len);
     signalModifiedKey(c,c->db,c->argv[1]);
     notifyKeyspaceEvent(NOTIFY_HASH,"hincrbyfloat",c->argv[1],c->db->id);
@@ -639,6 +848,24 @@ void hincrbyfloatCommand(client *c) {
     decrRefCount(aux);
     rewriteClientCommandArgument(c,3,newobj);
     decrRefCount(newobj);
+
+    /* The HSET would remove the TTL of the field, so propagate it again. */
+    long long when = hashTypeGetFieldExpire(o,c->argv[2]->ptr);
+    if (when >= 0) {
+        robj *argv[6];
+        argv[0] = createStringObject("HPEXPIREAT",10);
+        argv[1] = c->argv[1];
+        argv[2] = createStringObjectFromLongLong(when);
+        argv[3] = createStringObject("FIELDS",6);
+        argv[4] = createStringObjectFromLongLong(1);
+        argv[5] = c->argv[2];
+        alsoPropagate(lookupCommandByCString("hpexpireat"),c->db->id,argv,6,
+                      PROPAGATE_AOF|PROPAGATE_REPL);
+        decrRefCount(argv[0]);
+        decrRefCount(argv[2]);
+        decrRefCount(argv[3]);
+        decrRefCount(argv[4]);
+    }
 }
 
 static void addHashFieldToReply(client *c, robj *o, sds field) {
@@ -649,12 +876,12 @@ static void addHashFieldToReply(client *c, robj *o, sds field) {
         return;
     }
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        ret = hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll);
+        ret = hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll);
         if (ret < 0) {
             addReplyNull(c);
         } else {
@@ -737,7 +964,7 @@ void hlenCommand(client *c) {
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,OBJ_HASH)) return;
 
-    addReplyLongLong(c,hashTypeLength(o));
+    addReplyLongLong(c,hashTypeVisibleLength(o));
 }
 
 void hstrlenCommand(client *c) {
@@ -749,12 +976,12 @@ void hstrlenCommand(client *c) {
 }
 
 static void addHashIteratorCursorToReply(client *c, hashTypeIterator *hi, int what) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
         if (vstr)
             addReplyBulkCBuffer(c, vstr, vlen);
         else
@@ -779,7 +1006,7 @@ void genericHgetallCommand(client *c, int flags) {
 
     /* We return a map if the user requested keys and values, like in the
      * HGETALL case. Otherwise to use a flat array makes more sense. */
-    length = hashTypeLength(o);
+    length = hashTypeVisibleLength(o);
     if (flags & OBJ_HASH_KEY && flags & OBJ_HASH_VALUE) {
         addReplyMapLen(c, length);
     } else {
@@ -788,6 +1015,8 @@ void genericHgetallCommand(client *c, int flags) {
 
     hi = hashTypeInitIterator(o);
     while (hashTypeNext(hi) != C_ERR) {
+        if (hi->encoding == OBJ_ENCODING_HT &&
+            hashTypeFieldIsHidden(o->ptr,hi->de)) continue;
         if (flags & OBJ_HASH_KEY) {
             addHashIteratorCursorToReply(c, hi, OBJ_HASH_KEY);
             count++;
@@ -834,3 +1063,247 @@ void hscanCommand(client *c) {
         checkType(c,o,OBJ_HASH)) return;
     scanGenericCommand(c,o,cursor);
 }
+
+/* Parse the "FIELDS numfields field [field ...]" arguments that end the
+ * field expires commands, starting at argv[pos]. On success returns C_OK,
+ * and the number of fields by reference, otherwise replies with an error
+ * and returns C_ERR. */
+static int getHashFieldsArgsOrReply(client *c, int pos, long *numfields) {
+    long long num;
+
+    if (pos >= c->argc || strcasecmp(c->argv[pos]->ptr,"fields") != 0) {
+        addReplyError(c,"Mandatory argument FIELDS is missing or not at "
+                        "the right position");
+        return C_ERR;
+    }
+    if (pos+1 >= c->argc ||
+        getLongLongFromObjectOrReply(c,c->argv[pos+1],&num,NULL) != C_OK)
+    {
+        if (pos+1 >= c->argc) addReply(c,shared.syntaxerr);
+        return C_ERR;
+    }
+    if (num <= 0 || num != c->argc-pos-2) {
+        addReplyError(c,"The numfields parameter must match the number of "
+                        "arguments");
+        return C_ERR;
+    }
+    *numfields = num;
+    return C_OK;
+}
+
+#define HFE_NX (1<<0) /* Set only if the field has no expire. */
+#define HFE_XX (1<<1) /* Set only if the field has an expire. */
+#define HFE_GT (1<<2) /* Set only if greater than the current expire. */
+#define HFE_LT (1<<3) /* Set only if less than the current expire. */
+
+/* This is the generic command implementation for HEXPIRE, HPEXPIRE,
+ * HEXPIREAT and HPEXPIREAT, the arguments are the same used by
+ * expireGenericCommand():
+ *
+ * HEXPIRE key seconds [NX|XX|GT|LT] FIELDS numfields field [field ...]
+ *
+ * For every field the reply contains -2 if the field does not exist, 0 if
+ * the condition is not met, 1 if the expire was set, or 2 if the field was
+ * deleted, since the time is already in the past.
+ *
+ * The command is propagated as HPEXPIREAT, or as an HDEL of the deleted
+ * fields, so that replicas and the AOF don't depend on the current time. */
+void hexpireGenericCommand(client *c, long long basetime, int unit) {
+    robj *key = c->argv[1], *o;
+    long long when, current;
+    long numfields, j;
+    int flags = 0, pos = 3, keyremoved = 0, updated = 0, deleted = 0;
+
+    if (getLongLongFromObjectOrReply(c,c->argv[2],&when,NULL) != C_OK)
+        return;
+    if (when < 0 || (unit == UNIT_SECONDS && when > LLONG_MAX/1000) ||
+        (unit == UNIT_SECONDS ? when*1000 : when) > LLONG_MAX-basetime)
+    {
+        addReplyErrorFormat(c,"invalid expire time in '%s' command",
+                            c->cmd->name);
+        return;
+    }
+    if (unit == UNIT_SECONDS) when *= 1000;
+    when += basetime;
+
+    if (pos < c->argc && strcasecmp(c->argv[pos]->ptr,"fields") != 0) {
+        char *opt = c->argv[pos]->ptr;
+        if (!strcasecmp(opt,"nx")) flags = HFE_NX;
+        else if (!strcasecmp(opt,"xx")) flags = HFE_XX;
+        else if (!strcasecmp(opt,"gt")) flags = HFE_GT;
+        else if (!strcasecmp(opt,"lt")) flags = HFE_LT;
+        else {
+            addReplyErrorFormat(c,"Unsupported argument: %s",opt);
+            return;
+        }
+        pos++;
+    }
+    if (getHashFieldsArgsOrReply(c,pos,&numfields) == C_ERR) return;
+
+    if ((o = lookupKeyWrite(c->db,key)) != NULL && checkType(c,o,OBJ_HASH))
+        return;
+
+    int past = checkAlreadyExpired(when);
+    robj **hdelargv = past ? zmalloc(sizeof(robj*)*(numfields+2)) : NULL;
+
+    addReplyArrayLen(c,numfields);
+    for (j = 0; j < numfields; j++) {
+        robj *field = c->argv[pos+2+j];
+
+        current = o ? hashTypeGetFieldExpire(o,field->ptr) : -2;
+        if (current == -2) {
+            addReplyLongLong(c,-2);
+        } else if ((flags & HFE_NX && current != -1) ||
+                   (flags & HFE_XX && current == -1) ||
+                   (flags & HFE_GT && (current == -1 || when <= current)) ||
+                   (flags & HFE_LT && current != -1 && when >= current))
+        {
+            addReplyLongLong(c,0);
+        } else if (past) {
+            hashTypeDelete(o,field->ptr);
+            hdelargv[2+deleted++] = field;
+            incrRefCount(field);
+            addReplyLongLong(c,2);
+            if (hashTypeLength(o) == 0) {
+                dbDelete(c->db,key);
+                keyremoved = 1;
+                o = NULL;
+            }
+        } else {
+            hashTypeSetFieldExpire(o,field->ptr,when);
+            updated++;
+            addReplyLongLong(c,1);
+        }
+    }
+
+    if (updated) {
+        dbTrackVolatileHash(c->db,key->ptr);
+        notifyKeyspaceEvent(NOTIFY_HASH,"hexpire",key,c->db->id);
+
+        /* Propagate as HPEXPIREAT with the absolute time in milliseconds. */
+        robj *aux = createStringObject("HPEXPIREAT",10);
+        rewriteClientCommandArgument(c,0,aux);
+        decrRefCount(aux);
+        aux = createStringObjectFromLongLong(when);
+        rewriteClientCommandArgument(c,2,aux);
+        decrRefCount(aux);
+    }
+    if (deleted) {
+        notifyKeyspaceEvent(NOTIFY_HASH,"hdel",key,c->db->id);
+        if (keyremoved)
+            notifyKeyspaceEvent(NOTIFY_GENERIC,"del",key,c->db->id);
+
+        /* Propagate as an HDEL of the deleted fields. */
+        hdelargv[0] = createStringObject("HDEL",4);
+        hdelargv[1] = key;
+        incrRefCount(key);
+        replaceClientCommandVector(c,deleted+2,hdelargv);
+    } else if (hdelargv) {
+        zfree(hdelargv);
+    }
+    if (updated || deleted) {
+        signalModifiedKey(c,c->db,key);
+        server.dirty += updated+deleted;
+    }
+}
+
+/* HEXPIRE key seconds [NX|XX|GT|LT] FIELDS numfields field [field ...] */
+void hexpireCommand(client *c) {
+    hexpireGenericCommand(c,mstime(),UNIT_SECONDS);
+}
+
+/* HPEXPIRE key milliseconds [NX|XX|GT|LT] FIELDS numfields field ... */
+void hpexpireCommand(client *c) {
+    hexpireGenericCommand(c,mstime(),UNIT_MILLISECONDS);
+}
+
+/* HEXPIREAT key unix-time-seconds [NX|XX|GT|LT] FIELDS numfields field ... */
+void hexpireatCommand(client *c) {
+    hexpireGenericCommand(c,0,UNIT_SECONDS);
+}
+
+/* HPEXPIREAT key unix-time-ms [NX|XX|GT|LT] FIELDS numfields field ... */
+void hpexpireatCommand(client *c) {
+    hexpireGenericCommand(c,0,UNIT_MILLISECONDS);
+}
+
+/* Implements HTTL, HPTTL, HEXPIRETIME and HPEXPIRETIME, that reply for every
+ * field with -2 if the field does not exist, -1 if it has no expire,
+ * otherwise its time to live, or its expire time if 'absolute' is true, in
+ * seconds or milliseconds. */
+void httlGenericCommand(client *c, int output_ms, int absolute) {
+    robj *o;
+    long numfields, j;
+
+    if (getHashFieldsArgsOrReply(c,2,&numfields) == C_ERR) return;
+    if ((o = lookupKeyReadWithFlags(c->db,c->argv[1],LOOKUP_NOTOUCH)) != NULL &&
+        checkType(c,o,OBJ_HASH)) return;
+
+    addReplyArrayLen(c,numfields);
+    for (j = 0; j < numfields; j++) {
+        long long when = o ? hashTypeGetFieldExpire(o,c->argv[4+j]->ptr) : -2;
+
+        if (when < 0) {
+            addReplyLongLong(c,when);
+        } else if (absolute) {
+            addReplyLongLong(c,output_ms ? when : when/1000);
+        } else {
+            long long ttl = when-mstime();
+            if (ttl < 0) ttl = 0;
+            addReplyLongLong(c,output_ms ? ttl : ((ttl+500)/1000));
+        }
+    }
+}
+
+/* HTTL key FIELDS numfields field [field ...] */
+void httlCommand(client *c) {
+    httlGenericCommand(c,0,0);
+}
+
+/* HPTTL key FIELDS numfields field [field ...] */
+void hpttlCommand(client *c) {
+    httlGenericCommand(c,1,0);
+}
+
+/* HEXPIRETIME key FIELDS numfields field [field ...] */
+void hexpiretimeCommand(client *c) {
+    httlGenericCommand(c,0,1);
+}
+
+/* HPEXPIRETIME key FIELDS numfields field [field ...] */
+void hpexpiretimeCommand(client *c) {
+    httlGenericCommand(c,1,1);
+}
+
+/* HPERSIST key FIELDS numfields field [field ...]
+ *
+ * For every field replies with -2 if the field does not exist, -1 if it
+ * has no expire, or 1 if the expire was removed. */
+void hpersistCommand(client *c) {
+    robj *o;
+    long numfields, j;
+    int persisted = 0;
+
+    if (getHashFieldsArgsOrReply(c,2,&numfields) == C_ERR) return;
+    if ((o = lookupKeyWrite(c->db,c->argv[1])) != NULL &&
+        checkType(c,o,OBJ_HASH)) return;
+
+    addReplyArrayLen(c,numfields);
+    for (j = 0; j < numfields; j++) {
+        sds field = c->argv[4+j]->ptr;
+        long long when = o ? hashTypeGetFieldExpire(o,field) : -2;
+
+        if (when < 0) {
+            addReplyLongLong(c,when);
+        } else {
+            hashTypeSetFieldExpire(o,field,0);
+            persisted++;
+            addReplyLongLong(c,1);
+        }
+    }
+    if (persisted) {
+        signalModifiedKey(c,c->db,c->argv[1]);
+        notifyKeyspaceEvent(NOTIFY_HASH,"hpersist",c->argv[1],c->db->id);
+        server.dirty += persisted;
+    }
+}
@@ -37,14 +37,24 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
                               robj *dstkey, int op);
 
 /* Factory method to return a set that *can* hold "value". When the object has
- * an integer-encodable value, an intset will be returned. Otherwise a regular
- * hash table. */
+ * an integer-encodable value, an intset will be returned. Otherwise a listpack
+ * if the value is small enough, or a regular hash table. */
 robj *setTypeCreate(sds value) {
     if (isSdsRepresentableAsLongLong(value,NULL) == C_OK)
         return createIntsetObject();
+    if (server.set_max_listpack_entries &&
+        sdslen(value) <= server.set_max_listpack_value)
+        return createSetListpackObject();
     return createSetObject();
 }
 
+/* Return true if a set of "len" elements, one of them "value", can be
+ * listpack encoded. */
+static int setFitsListpack(size_t len, sds value) {
+    return len <= server.set_max_listpack_entries &&
+           sdslen(value) <= server.set_max_listpack_value;
+}
+
 /* Add the specified value into a set.
  *
  * If the value was already member of the set, nothing is done and 0 is
@@ -70,6 +80,13 @@ int setTypeAdd(robj *subject, sds value) {
                     setTypeConvert(subject,OBJ_ENCODING_HT);
                 return 1;
             }
+        } else if (setFitsListpack(intsetLen(subject->ptr)+1,value)) {
+            /* Failed to get integer from object, convert to a listpack
+             * that can hold strings. */
+            setTypeConvert(subject,OBJ_ENCODING_LISTPACK);
+            subject->ptr = lpAppend(subject->ptr,(unsigned char*)value,
+                                    sdslen(value));
+            return 1;
         } else {
             /* Failed to get integer from object, convert to regular set. */
             setTypeConvert(subject,OBJ_ENCODING_HT);
@@ -79,6 +96,23 @@ int setTypeAdd(robj *subject, sds value) {
             serverAssert(dictAdd(subject->ptr,sdsdup(value),NULL) == DICT_OK);
             return 1;
         }
+    } else if (subject->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = subject->ptr;
+        unsigned char *p = lpFind(lp,lpFirst(lp),(unsigned char*)value,
+                                  sdslen(value),0);
+        if (p == NULL) {
+            if (setFitsListpack(lpLength(lp)+1,value)) {
+                subject->ptr = lpAppend(lp,(unsigned char*)value,
+                                        sdslen(value));
+            } else {
+                /* Convert to regular set when the listpack contains
+                 * too many or too big entries. */
+                setTypeConvert(subject,OBJ_ENCODING_HT);
+                serverAssert(dictAdd(subject->ptr,sdsdup(value),NULL) ==
+                             DICT_OK);
+            }
+            return 1;
+        }
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -98,6 +132,14 @@ int setTypeRemove(robj *setobj, sds value) {
             setobj->ptr = intsetRemove(setobj->ptr,llval,&success);
             if (success) return 1;
         }
+    } else if (setobj->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = setobj->ptr;
+        unsigned char *p = lpFind(lp,lpFirst(lp),(unsigned char*)value,
+                                  sdslen(value),0);
+        if (p) {
+            setobj->ptr = lpDelete(setobj->ptr,p,NULL);
+            return 1;
+        }
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -112,6 +154,10 @@ int setTypeIsMember(robj *subject, sds value) {
         if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
             return intsetFind((intset*)subject->ptr,llval);
         }
+    } else if (subject->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = subject->ptr;
+        return lpFind(lp,lpFirst(lp),(unsigned char*)value,sdslen(value),0)
+               != NULL;
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -126,6 +172,9 @@ setTypeIterator *setTypeInitIterator(robj *subject) {
         si->di = dictGetIterator(subject->ptr);
     } else if (si->encoding == OBJ_ENCODING_INTSET) {
         si->ii = 0;
+    } else if (si->encoding == OBJ_ENCODING_LISTPACK) {
+        si->lpi = lpFirst(subject->ptr);
+        si->lpele = NULL;
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -135,6 +184,8 @@ setTypeIterator *setTypeInitIterator(robj *subject) {
 void setTypeReleaseIterator(setTypeIterator *si) {
     if (si->encoding == OBJ_ENCODING_HT)
         dictReleaseIterator(si->di);
+    else if (si->encoding == OBJ_ENCODING_LISTPACK)
+        sdsfree(si->lpele);
     zfree(si);
 }
 
@@ -144,7 +195,9 @@ void setTypeReleaseIterator(setTypeIterator *si) {
  * Since set elements can be internally be stored as SDS strings or
  * simple arrays of integers, setTypeNext returns the encoding of the
  * set object you are iterating, and will populate the appropriate pointer
- * (sdsele) or (llele) accordingly.
+ * (sdsele) or (llele) accordingly. Only intsets populate (llele): the
+ * elements of a listpack are copied in an SDS string owned by the iterator,
+ * that is valid until the next call.
  *
  * Note that both the sdsele and llele pointers should be passed and cannot
  * be NULL since the function will try to defensively populate the non
@@ -161,6 +214,17 @@ int setTypeNext(setTypeIterator *si, sds *sdsele, int64_t *llele) {
         if (!intsetGet(si->subject->ptr,si->ii++,llele))
             return -1;
         *sdsele = NULL; /* Not needed. Defensive. */
+    } else if (si->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char buf[LP_INTBUF_SIZE], *str;
+        int64_t len;
+
+        if (si->lpi == NULL) return -1;
+        str = lpGet(si->lpi,&len,buf);
+        si->lpele = si->lpele ? sdscpylen(si->lpele,(char*)str,len) :
+                                sdsnewlen(str,len);
+        si->lpi = lpNext(si->subject->ptr,si->lpi);
+        *sdsele = si->lpele;
+        *llele = -123456789; /* Not needed. Defensive. */
     } else {
         serverPanic("Wrong set encoding in setTypeNext");
     }
@@ -185,6 +249,7 @@ sds setTypeNextObject(setTypeIterator *si) {
         case OBJ_ENCODING_INTSET:
             return sdsfromlonglong(intele);
         case OBJ_ENCODING_HT:
+        case OBJ_ENCODING_LISTPACK:
             return sdsdup(sdsele);
         default:
             serverPanic("Unsupported encoding");
@@ -204,7 +269,12 @@ sds setTypeNextObject(setTypeIterator *si) {
  *
  * Note that both the sdsele and llele pointers should be passed and cannot
  * be NULL since the function will try to defensively populate the non
- * used field with values which are easy to trap if misused. */
+ * used field with values which are easy to trap if misused.
+ *
+ * The elements of listpack encoded sets are returned as SDS strings in a
+ * buffer that is valid until the next call. */
+static sds setTypeRandomListpackElement = NULL;
+
 int setTypeRandomElement(robj *setobj, sds *sdsele, int64_t *llele) {
     if (setobj->encoding == OBJ_ENCODING_HT) {
         dictEntry *de = dictGetFairRandomKey(setobj->ptr);
@@ -213,6 +283,18 @@ int setTypeRandomElement(robj *setobj, sds *sdsele, int64_t *llele) {
     } else if (setobj->encoding == OBJ_ENCODING_INTSET) {
         *llele = intsetRandom(setobj->ptr);
         *sdsele = NULL; /* Not needed. Defensive. */
+    } else if (setobj->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = setobj->ptr, buf[LP_INTBUF_SIZE], *str;
+        int64_t len;
+
+        str = lpGet(lpSeek(lp,rand()%lpLength(lp)),&len,buf);
+        if (setTypeRandomListpackElement)
+            setTypeRandomListpackElement =
+                sdscpylen(setTypeRandomListpackElement,(char*)str,len);
+        else
+            setTypeRandomListpackElement = sdsnewlen(str,len);
+        *sdsele = setTypeRandomListpackElement;
+        *llele = -123456789; /* Not needed. Defensive. */
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -224,6 +306,8 @@ unsigned long setTypeSize(const robj *subject) {
         return dictSize((const dict*)subject->ptr);
     } else if (subject->encoding == OBJ_ENCODING_INTSET) {
         return intsetLen((const intset*)subject->ptr);
+    } else if (subject->encoding == OBJ_ENCODING_LISTPACK) {
+        return lpLength(subject->ptr);
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -231,31 +315,49 @@ unsigned long setTypeSize(const robj *subject) {
 
 /* Convert the set to specified encoding. The resulting dict (when converting
  * to a hash table) is presized to hold the number of elements in the original
- * set. */
+ * set. Intsets can be converted to listpacks or hash tables, listpacks to
+ * hash tables. */
 void setTypeConvert(robj *setobj, int enc) {
     setTypeIterator *si;
     serverAssertWithInfo(NULL,setobj,setobj->type == OBJ_SET &&
-                             setobj->encoding == OBJ_ENCODING_INTSET);
+                             (setobj->encoding == OBJ_ENCODING_INTSET ||
+                              setobj->encoding == OBJ_ENCODING_LISTPACK));
 
     if (enc == OBJ_ENCODING_HT) {
-        int64_t intele;
         dict *d = dictCreate(&setDictType,NULL);
         sds element;
 
         /* Presize the dict to avoid rehashing */
-        dictExpand(d,intsetLen(setobj->ptr));
+        dictExpand(d,setTypeSize(setobj));
 
-        /* To add the elements we extract integers and create redis objects */
+        /* To add the elements we extract them as new SDS strings. */
         si = setTypeInitIterator(setobj);
-        while (setTypeNext(si,&element,&intele) != -1) {
-            element = sdsfromlonglong(intele);
+        while ((element = setTypeNextObject(si)) != NULL)
             serverAssert(dictAdd(d,element,NULL) == DICT_OK);
-        }
         setTypeReleaseIterator(si);
 
+        if (setobj->encoding == OBJ_ENCODING_INTSET)
+            zfree(setobj->ptr);
+        else
+            lpFree(setobj->ptr);
         setobj->encoding = OBJ_ENCODING_HT;
-        zfree(setobj->ptr);
         setobj->ptr = d;
+    } else if (enc == OBJ_ENCODING_LISTPACK &&
+               setobj->encoding == OBJ_ENCODING_INTSET)
+    {
+        unsigned char *lp = lpNew();
+        char buf[LONG_STR_SIZE];
+        int64_t intele;
+        int len;
+
+        for (uint32_t j = 0; intsetGet(setobj->ptr,j,&intele); j++) {
+            len = ll2string(buf,sizeof(buf),intele);
+            lp = lpAppend(lp,(unsigned char*)buf,len);
+        }
+
+        setobj->encoding = OBJ_ENCODING_LISTPACK;
+        zfree(setobj->ptr);
+        setobj->ptr = lp;
     } else {
         serverPanic("Unsupported set conversion");
     }
@@ -789,6 +891,51 @@ int qsortCompareSetsByRevCardinality(const void *s1, const void *s2) {
     return 0;
 }
 
+/* Return 1 if all the sets are intset encoded. NULL sets, that are non
+ * existing keys, are ignored. */
+static int setsAreIntsets(robj **sets, unsigned long setnum) {
+    for (unsigned long j = 0; j < setnum; j++) {
+        if (sets[j] && sets[j]->encoding != OBJ_ENCODING_INTSET) return 0;
+    }
+    return 1;
+}
+
+/* Reply with the result "is" of an operation between intsets, or store it
+ * at "dstkey" when not NULL. The intset is owned by this function. */
+static void setOpIntsetResult(client *c, intset *is, robj *dstkey,
+                              char *event)
+{
+    robj *dstset;
+    int64_t intobj;
+
+    if (!dstkey) {
+        addReplySetLen(c,intsetLen(is));
+        for (uint32_t j = 0; intsetGet(is,j,&intobj); j++)
+            addReplyBulkLongLong(c,intobj);
+        zfree(is);
+        return;
+    }
+
+    dstset = createObject(OBJ_SET,is);
+    dstset->encoding = OBJ_ENCODING_INTSET;
+    if (intsetLen(is) > server.set_max_intset_entries)
+        setTypeConvert(dstset,OBJ_ENCODING_HT);
+
+    int deleted = dbDelete(c->db,dstkey);
+    if (setTypeSize(dstset) > 0) {
+        dbAdd(c->db,dstkey,dstset);
+        addReplyLongLong(c,setTypeSize(dstset));
+        notifyKeyspaceEvent(NOTIFY_SET,event,dstkey,c->db->id);
+    } else {
+        decrRefCount(dstset);
+        addReply(c,shared.czero);
+        if (deleted)
+            notifyKeyspaceEvent(NOTIFY_GENERIC,"del",dstkey,c->db->id);
+    }
+    signalModifiedKey(c,c->db,dstkey);
+    server.dirty++;
+}
+
 void sinterGenericCommand(client *c, robj **setkeys,
                           unsigned long setnum, robj *dstkey) {
     robj **sets = zmalloc(sizeof(robj*)*setnum);
@@ -801,6 +948,8 @@ void sinterGenericCommand(client *c, robj **setkeys,
     int encoding;
 
     for (j = 0; j < setnum; j++) {
+        if (j % DB_PREFETCH_BATCH == 0)
+            dbPrefetchKeys(c->db,setkeys+j,setnum-j,1);
         robj *setobj = dstkey ?
             lookupKeyWrite(c->db,setkeys[j]) :
             lookupKeyRead(c->db,setkeys[j]);
@@ -827,6 +976,20 @@ void sinterGenericCommand(client *c, robj **setkeys,
      * algorithm's performance */
     qsort(sets,setnum,sizeof(robj*),qsortCompareSetsByCardinality);
 
+    /* Intsets are intersected merging their sorted arrays, starting from
+     * the smallest ones. */
+    if (setsAreIntsets(sets,setnum)) {
+        intset *is = intsetIntersect(sets[0]->ptr,sets[setnum > 1]->ptr);
+        for (j = 2; j < setnum && intsetLen(is); j++) {
+            intset *next = intsetIntersect(is,sets[j]->ptr);
+            zfree(is);
+            is = next;
+        }
+        setOpIntsetResult(c,is,dstkey,"sinterstore");
+        zfree(sets);
+        return;
+    }
+
     /* The first thing we should output is the total number of elements...
      * since this is a multi-bulk write, but at this stage we don't know
      * the intersection set size, so we use a trick, append an empty object
@@ -856,7 +1019,7 @@ void sinterGenericCommand(client *c, robj **setkeys,
                 /* in order to compare an integer with an object we
                  * have to use the generic function, creating an object
                  * for this */
-                } else if (sets[j]->encoding == OBJ_ENCODING_HT) {
+                } else if (sets[j]->encoding != OBJ_ENCODING_INTSET) {
                     elesds = sdsfromlonglong(intobj);
                     if (!setTypeIsMember(sets[j],elesds)) {
                         sdsfree(elesds);
@@ -864,7 +1027,7 @@ void sinterGenericCommand(client *c, robj **setkeys,
                     }
                     sdsfree(elesds);
                 }
-            } else if (encoding == OBJ_ENCODING_HT) {
+            } else {
                 if (!setTypeIsMember(sets[j],elesds)) {
                     break;
                 }
@@ -874,10 +1037,10 @@ void sinterGenericCommand(client *c, robj **setkeys,
         /* Only take action when all sets contain the member */
         if (j == setnum) {
             if (!dstkey) {
-                if (encoding == OBJ_ENCODING_HT)
-                    addReplyBulkCBuffer(c,elesds,sdslen(elesds));
-                else
+                if (encoding == OBJ_ENCODING_INTSET)
                     addReplyBulkLongLong(c,intobj);
+                else
+                    addReplyBulkCBuffer(c,elesds,sdslen(elesds));
                 cardinality++;
             } else {
                 if (encoding == OBJ_ENCODING_INTSET) {
@@ -938,6 +1101,8 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
     int diff_algo = 1;
 
     for (j = 0; j < setnum; j++) {
+        if (j % DB_PREFETCH_BATCH == 0)
+            dbPrefetchKeys(c->db,setkeys+j,setnum-j,1);
         robj *setobj = dstkey ?
             lookupKeyWrite(c->db,setkeys[j]) :
             lookupKeyRead(c->db,setkeys[j]);
@@ -952,6 +1117,25 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
         sets[j] = setobj;
     }
 
+    /* Intsets are merged in order, one set at a time. */
+    if (setsAreIntsets(sets,setnum)) {
+        intset *is = intsetNew(), *next;
+        for (j = 0; j < setnum; j++) {
+            if (op == SET_OP_DIFF && j > 0 && intsetLen(is) == 0) break;
+            if (!sets[j]) continue; /* non existing keys are like empty sets */
+            if (op == SET_OP_DIFF && j > 0)
+                next = intsetDifference(is,sets[j]->ptr);
+            else
+                next = intsetUnion(is,sets[j]->ptr);
+            zfree(is);
+            is = next;
+        }
+        setOpIntsetResult(c,is,dstkey,
+            op == SET_OP_UNION ? "sunionstore" : "sdiffstore");
+        zfree(sets);
+        return;
+    }
+
     /* Select what DIFF algorithm to use.
      *
      * Algorithm 1 is O(N*M) where N is the size of the element first set
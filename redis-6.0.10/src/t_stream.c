@@ -1516,7 +1516,10 @@ void xreadCommand(client *c) {
     size_t arraylen = 0;
     void *arraylen_ptr = NULL;
     for (int i = 0; i < streams_count; i++) {
-        robj *o = lookupKeyRead(c->db,c->argv[streams_arg+i]);
+        /* XREADGROUP modifies the consumer group, so it looks up the key
+         * for writing. */
+        robj *o = groups ? lookupKeyWrite(c->db,c->argv[streams_arg+i]) :
+                           lookupKeyRead(c->db,c->argv[streams_arg+i]);
         if (o == NULL) continue;
         stream *s = o->ptr;
         streamID *gt = ids+i; /* ID must be greater than this. */
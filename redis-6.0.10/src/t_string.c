@@ -294,6 +294,8 @@ void mgetCommand(client *c) {
 
     addReplyArrayLen(c,c->argc-1);
     for (j = 1; j < c->argc; j++) {
+        if ((j-1) % DB_PREFETCH_BATCH == 0)
+            dbPrefetchKeys(c->db,c->argv+j,c->argc-j,1);
         robj *o = lookupKeyRead(c->db,c->argv[j]);
         if (o == NULL) {
             addReplyNull(c);
@@ -319,6 +321,8 @@ void msetGenericCommand(client *c, int nx) {
      * set anything if at least one key already exists. */
     if (nx) {
         for (j = 1; j < c->argc; j += 2) {
+            if ((j-1)/2 % DB_PREFETCH_BATCH == 0)
+                dbPrefetchKeys(c->db,c->argv+j,(c->argc-j)/2,2);
             if (lookupKeyWrite(c->db,c->argv[j]) != NULL) {
                 addReply(c, shared.czero);
                 return;
@@ -327,6 +331,8 @@ void msetGenericCommand(client *c, int nx) {
     }
 
     for (j = 1; j < c->argc; j += 2) {
+        if ((j-1)/2 % DB_PREFETCH_BATCH == 0)
+            dbPrefetchKeys(c->db,c->argv+j,(c->argc-j)/2,2);
         c->argv[j+1] = tryObjectEncoding(c->argv[j+1]);
         setKey(c,c->db,c->argv[j],c->argv[j+1]);
         notifyKeyspaceEvent(NOTIFY_STRING,"set",c->argv[j],c->db->id);
@@ -0,0 +1,578 @@
+/* B+tree of (score, element) pairs, ordered by score and then by element,
+ * used by the sorted sets with the btree encoding.
+ *
+ * Compared to the skiplist, the entries are packed in arrays of up to
+ * ZBT_LEAF_MAX entries per leaf: the score of the entries is compared
+ * without dereferencing any pointer, the element being compared only when
+ * the scores are the same, and iterating a range of entries mostly reads
+ * consecutive memory. There is no allocation per entry, and an entry takes
+ * 16 bytes instead of a skiplist node of at least 48 bytes.
+ *
+ * Every inner node stores, for every child, the number of entries in the
+ * subtree of the child, so that the rank of an entry, or the entry with a
+ * given rank, are found in O(log N) descending the tree.
+ *
+ * The inner nodes store for every child but the first a lower bound of
+ * the entries of the child: when the first entry of a child is deleted the
+ * bound is not updated, so the bounds are copies of the elements, owned by
+ * the inner nodes. Only one entry every ZBT_LEAF_MAX/2 entries at least has
+ * a copy, so that's a small overhead.
+ *
+ * The elements of the entries are owned by the tree, and are freed when
+ * deleted, unless the caller asks for them. */
+
+#include <string.h>
+#include "zbtree.h"
+#include "zmalloc.h"
+#include "redisassert.h"
+
+#define ZBT_LEAF_MIN (ZBT_LEAF_MAX/4)   /* Less entries and we merge. */
+#define ZBT_INNER_MIN (ZBT_INNER_MAX/4) /* Less children and we merge. */
+
+/* Compare the entry 'e' with the specified score and element. */
+static inline int zbtCompare(zbtEntry *e, double score, sds ele) {
+    if (e->score < score) return -1;
+    if (e->score > score) return 1;
+    return sdscmp(e->ele,ele);
+}
+
+static zbtLeaf *zbtCreateLeaf(zbtree *t) {
+    zbtLeaf *l = zmalloc(sizeof(*l));
+    l->node.leaf = 1;
+    l->node.count = 0;
+    l->prev = l->next = NULL;
+    t->leaves++;
+    return l;
+}
+
+static zbtInner *zbtCreateInner(zbtree *t) {
+    zbtInner *in = zmalloc(sizeof(*in));
+    in->node.leaf = 0;
+    in->node.count = 0;
+    in->keys[0].score = 0;
+    in->keys[0].ele = NULL;
+    t->inners++;
+    return in;
+}
+
+zbtree *zbtCreate(void) {
+    zbtree *t = zmalloc(sizeof(*t));
+    t->length = 0;
+    t->leaves = t->inners = 0;
+    t->head = t->tail = zbtCreateLeaf(t);
+    t->root = (zbtNode*)t->head;
+    t->height = 1;
+    return t;
+}
+
+static void zbtFreeNode(zbtNode *n) {
+    int j;
+
+    if (n->leaf) {
+        zbtLeaf *l = (zbtLeaf*)n;
+        for (j = 0; j < n->count; j++) sdsfree(l->entries[j].ele);
+    } else {
+        zbtInner *in = (zbtInner*)n;
+        for (j = 0; j < n->count; j++) {
+            if (j) sdsfree(in->keys[j].ele);
+            zbtFreeNode(in->children[j]);
+        }
+    }
+    zfree(n);
+}
+
+/* Free the tree and its elements. */
+void zbtFree(zbtree *t) {
+    zbtFreeNode(t->root);
+    zfree(t);
+}
+
+/* Return the memory used by the nodes of the tree, without the elements. */
+size_t zbtAllocSize(zbtree *t) {
+    return sizeof(*t)+t->leaves*sizeof(zbtLeaf)+t->inners*sizeof(zbtInner);
+}
+
+/* Return the position of the first entry of the leaf not smaller than the
+ * specified score and element. */
+static int zbtLeafLowerBound(zbtLeaf *l, double score, sds ele) {
+    int lo = 0, hi = l->node.count;
+
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (zbtCompare(l->entries+mid,score,ele) < 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Return the child of the inner node that may contain the specified score
+ * and element. */
+static int zbtChildIndex(zbtInner *in, double score, sds ele) {
+    int lo = 1, hi = in->node.count;
+
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (zbtCompare(in->keys+mid,score,ele) <= 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo-1;
+}
+
+/* Insert 'child' at position 'pos' of the inner node, that has room. */
+static void zbtInnerInsertAt(zbtInner *in, int pos, zbtEntry key,
+                             zbtNode *child, unsigned long size)
+{
+    int move = in->node.count-pos;
+
+    memmove(in->keys+pos+1,in->keys+pos,sizeof(zbtEntry)*move);
+    memmove(in->sizes+pos+1,in->sizes+pos,sizeof(unsigned long)*move);
+    memmove(in->children+pos+1,in->children+pos,sizeof(zbtNode*)*move);
+    in->keys[pos] = key;
+    in->sizes[pos] = size;
+    in->children[pos] = child;
+    in->node.count++;
+}
+
+/* Remove the child at position 'pos' of the inner node. The key of the
+ * child is not freed. */
+static void zbtInnerRemoveAt(zbtInner *in, int pos) {
+    int move = in->node.count-pos-1;
+
+    memmove(in->keys+pos,in->keys+pos+1,sizeof(zbtEntry)*move);
+    memmove(in->sizes+pos,in->sizes+pos+1,sizeof(unsigned long)*move);
+    memmove(in->children+pos,in->children+pos+1,sizeof(zbtNode*)*move);
+    in->node.count--;
+    in->keys[0].score = 0;
+    in->keys[0].ele = NULL;
+}
+
+static unsigned long zbtInnerSize(zbtInner *in) {
+    unsigned long size = 0;
+    for (int j = 0; j < in->node.count; j++) size += in->sizes[j];
+    return size;
+}
+
+/* After the node 'left' at the specified level of 'path' was split, add
+ * the new node 'right' to its parent, with 'key' as lower bound. This may
+ * split the parent in turn, up to the root. The sizes along the path
+ * already account for the inserted entry. */
+static void zbtAddChild(zbtree *t, zbtInner **path, int *idx, int level,
+                        zbtNode *left, zbtNode *right, zbtEntry key,
+                        unsigned long rightsize)
+{
+    while (level > 0) {
+        zbtInner *p = path[--level], *q;
+        int i = idx[level], half = ZBT_INNER_MAX/2;
+
+        p->sizes[i] -= rightsize;
+        if (p->node.count < ZBT_INNER_MAX) {
+            zbtInnerInsertAt(p,i+1,key,right,rightsize);
+            return;
+        }
+
+        /* Split the parent in two halves, and add the child to the half
+         * it belongs to. The lower bound of the first child of the new
+         * node goes up to the grandparent. */
+        q = zbtCreateInner(t);
+        q->node.count = ZBT_INNER_MAX-half;
+        memcpy(q->keys,p->keys+half,sizeof(zbtEntry)*q->node.count);
+        memcpy(q->sizes,p->sizes+half,sizeof(unsigned long)*q->node.count);
+        memcpy(q->children,p->children+half,sizeof(zbtNode*)*q->node.count);
+        p->node.count = half;
+        zbtEntry upkey = q->keys[0];
+        q->keys[0].score = 0;
+        q->keys[0].ele = NULL;
+        if (i+1 <= half)
+            zbtInnerInsertAt(p,i+1,key,right,rightsize);
+        else
+            zbtInnerInsertAt(q,i+1-half,key,right,rightsize);
+
+        left = (zbtNode*)p;
+        right = (zbtNode*)q;
+        key = upkey;
+        rightsize = zbtInnerSize(q);
+    }
+
+    /* The root was split: the tree grows by one level. */
+    zbtInner *root = zbtCreateInner(t);
+    root->node.count = 2;
+    root->children[0] = left;
+    root->children[1] = right;
+    root->sizes[0] = t->length-rightsize;
+    root->sizes[1] = rightsize;
+    root->keys[1] = key;
+    t->root = (zbtNode*)root;
+    t->height++;
+}
+
+/* Insert an entry. The element must not be already in the tree, and it is
+ * owned by the tree from now on. */
+void zbtInsert(zbtree *t, double score, sds ele) {
+    zbtInner *path[ZBT_MAX_HEIGHT];
+    int idx[ZBT_MAX_HEIGHT], level = 0, pos;
+    zbtNode *n = t->root;
+    zbtLeaf *l, *r;
+
+    while (!n->leaf) {
+        zbtInner *in = (zbtInner*)n;
+        int i = zbtChildIndex(in,score,ele);
+        in->sizes[i]++;
+        path[level] = in;
+        idx[level++] = i;
+        n = in->children[i];
+    }
+    l = (zbtLeaf*)n;
+    pos = zbtLeafLowerBound(l,score,ele);
+    t->length++;
+
+    /* Split the leaf if full, and insert in the half the entry belongs
+     * to. When appending to the last leaf or prepending to the first one,
+     * as it happens inserting the entries in order, all the current entries
+     * stay in the same leaf, and the new entry starts a leaf alone. */
+    r = NULL;
+    if (l->node.count == ZBT_LEAF_MAX) {
+        int half = ZBT_LEAF_MAX/2;
+
+        if (l->next == NULL && pos == ZBT_LEAF_MAX) half = ZBT_LEAF_MAX;
+        else if (l->prev == NULL && pos == 0) half = 0;
+
+        r = zbtCreateLeaf(t);
+        r->node.count = ZBT_LEAF_MAX-half;
+        memcpy(r->entries,l->entries+half,sizeof(zbtEntry)*r->node.count);
+        l->node.count = half;
+        r->prev = l;
+        r->next = l->next;
+        if (l->next) l->next->prev = r; else t->tail = r;
+        l->next = r;
+        if (pos > half || (pos == half && half == ZBT_LEAF_MAX)) {
+            l = r;
+            pos -= half;
+        }
+    }
+    memmove(l->entries+pos+1,l->entries+pos,
+            sizeof(zbtEntry)*(l->node.count-pos));
+    l->entries[pos].score = score;
+    l->entries[pos].ele = ele;
+    l->node.count++;
+
+    if (r) {
+        zbtEntry key = {r->entries[0].score, sdsdup(r->entries[0].ele)};
+        zbtAddChild(t,path,idx,level,(zbtNode*)r->prev,(zbtNode*)r,key,
+                    r->node.count);
+    }
+}
+
+/* Merge the child at position 'pos'+1 of the inner node into the child
+ * at position 'pos'. */
+static void zbtMerge(zbtree *t, zbtInner *p, int pos) {
+    zbtNode *ln = p->children[pos], *rn = p->children[pos+1];
+
+    if (ln->leaf) {
+        zbtLeaf *l = (zbtLeaf*)ln, *r = (zbtLeaf*)rn;
+        memcpy(l->entries+ln->count,r->entries,sizeof(zbtEntry)*rn->count);
+        l->next = r->next;
+        if (r->next) r->next->prev = l; else t->tail = l;
+        sdsfree(p->keys[pos+1].ele);
+        t->leaves--;
+    } else {
+        zbtInner *l = (zbtInner*)ln, *r = (zbtInner*)rn;
+        /* The lower bound of the right node becomes the one of its first
+         * child, now a child of the left node. */
+        l->keys[ln->count] = p->keys[pos+1];
+        memcpy(l->keys+ln->count+1,r->keys+1,sizeof(zbtEntry)*(rn->count-1));
+        memcpy(l->sizes+ln->count,r->sizes,sizeof(unsigned long)*rn->count);
+        memcpy(l->children+ln->count,r->children,sizeof(zbtNode*)*rn->count);
+        t->inners--;
+    }
+    ln->count += rn->count;
+    p->sizes[pos] += p->sizes[pos+1];
+    zbtInnerRemoveAt(p,pos+1);
+    zfree(rn);
+}
+
+/* Move entries or children between the children at position 'pos' and
+ * 'pos'+1 of the inner node, so that they have about the same number. */
+static void zbtRedistribute(zbtInner *p, int pos) {
+    zbtNode *ln = p->children[pos], *rn = p->children[pos+1];
+    int move = (ln->count-rn->count)/2;
+
+    if (move == 0) return;
+    if (ln->leaf) {
+        zbtLeaf *l = (zbtLeaf*)ln, *r = (zbtLeaf*)rn;
+        if (move > 0) {
+            memmove(r->entries+move,r->entries,sizeof(zbtEntry)*rn->count);
+            memcpy(r->entries,l->entries+ln->count-move,
+                   sizeof(zbtEntry)*move);
+        } else {
+            move = -move;
+            memcpy(l->entries+ln->count,r->entries,sizeof(zbtEntry)*move);
+            memmove(r->entries,r->entries+move,
+                    sizeof(zbtEntry)*(rn->count-move));
+            move = -move;
+        }
+        ln->count -= move;
+        rn->count += move;
+        p->sizes[pos] -= move;
+        p->sizes[pos+1] += move;
+        sdsfree(p->keys[pos+1].ele);
+        p->keys[pos+1].score = r->entries[0].score;
+        p->keys[pos+1].ele = sdsdup(r->entries[0].ele);
+        return;
+    }
+
+    /* Inner nodes: move one child at a time through the parent. */
+    zbtInner *l = (zbtInner*)ln, *r = (zbtInner*)rn;
+    zbtEntry nokey = {0, NULL};
+    for (; move > 0; move--) {
+        int last = ln->count-1;
+        unsigned long size = l->sizes[last];
+        /* The lower bound of the right node now belongs to its former
+         * first child, and the one of the moved child goes up. */
+        r->keys[0] = p->keys[pos+1];
+        zbtInnerInsertAt(r,0,nokey,l->children[last],size);
+        p->keys[pos+1] = l->keys[last];
+        ln->count--;
+        p->sizes[pos] -= size;
+        p->sizes[pos+1] += size;
+    }
+    for (; move < 0; move++) {
+        unsigned long size = r->sizes[0];
+        zbtInnerInsertAt(l,ln->count,p->keys[pos+1],r->children[0],size);
+        p->keys[pos+1] = r->keys[1];
+        zbtInnerRemoveAt(r,0);
+        p->sizes[pos] += size;
+        p->sizes[pos+1] -= size;
+    }
+}
+
+/* Called after an entry was deleted from the node 'n' at the specified
+ * level of 'path': if the node has too few entries or children, it is
+ * merged with a sibling, or takes some from it, and so forth up to the
+ * root. */
+static void zbtRebalance(zbtree *t, zbtInner **path, int *idx, int level,
+                         zbtNode *n)
+{
+    while (level > 0) {
+        int min = n->leaf ? ZBT_LEAF_MIN : ZBT_INNER_MIN;
+        int max = n->leaf ? ZBT_LEAF_MAX : ZBT_INNER_MAX;
+        zbtInner *p = path[--level];
+        int pos = idx[level];
+
+        if (n->count >= min) return;
+        if (pos == p->node.count-1) pos--;
+        if (p->children[pos]->count+p->children[pos+1]->count <= max) {
+            zbtMerge(t,p,pos);
+            n = (zbtNode*)p;
+        } else {
+            zbtRedistribute(p,pos);
+            return;
+        }
+    }
+
+    /* The root is left with a single child: the tree shrinks by one
+     * level. */
+    if (!n->leaf && n->count == 1) {
+        t->root = ((zbtInner*)n)->children[0];
+        t->height--;
+        t->inners--;
+        zfree(n);
+    }
+}
+
+/* Delete the entry with the specified score and element. Returns 1 if the
+ * entry was found and deleted, otherwise 0. If 'deleted' is not NULL the
+ * element of the entry is returned there instead of being freed. */
+int zbtDelete(zbtree *t, double score, sds ele, sds *deleted) {
+    zbtInner *path[ZBT_MAX_HEIGHT];
+    int idx[ZBT_MAX_HEIGHT], level = 0, pos, j;
+    zbtNode *n = t->root;
+    zbtLeaf *l;
+
+    while (!n->leaf) {
+        zbtInner *in = (zbtInner*)n;
+        int i = zbtChildIndex(in,score,ele);
+        path[level] = in;
+        idx[level++] = i;
+        n = in->children[i];
+    }
+    l = (zbtLeaf*)n;
+    pos = zbtLeafLowerBound(l,score,ele);
+    if (pos == n->count || zbtCompare(l->entries+pos,score,ele) != 0)
+        return 0;
+
+    if (deleted)
+        *deleted = l->entries[pos].ele;
+    else
+        sdsfree(l->entries[pos].ele);
+    memmove(l->entries+pos,l->entries+pos+1,
+            sizeof(zbtEntry)*(n->count-pos-1));
+    n->count--;
+    t->length--;
+    for (j = 0; j < level; j++) path[j]->sizes[idx[j]]--;
+    zbtRebalance(t,path,idx,level,n);
+    return 1;
+}
+
+/* Update the score of an entry, that must exist. */
+void zbtUpdateScore(zbtree *t, double curscore, sds ele, double newscore) {
+    zbtNode *n = t->root;
+    zbtLeaf *l;
+    int pos;
+
+    while (!n->leaf) {
+        zbtInner *in = (zbtInner*)n;
+        n = in->children[zbtChildIndex(in,curscore,ele)];
+    }
+    l = (zbtLeaf*)n;
+    pos = zbtLeafLowerBound(l,curscore,ele);
+    assert(pos < n->count && zbtCompare(l->entries+pos,curscore,ele) == 0);
+
+    /* If the entry stays between the same entries of the leaf, just update
+     * the score. The first and last entries of a leaf are always moved, so
+     * that the lower bounds of the leaves stay correct. */
+    if (pos > 0 && pos < n->count-1 &&
+        zbtCompare(l->entries+pos-1,newscore,ele) < 0 &&
+        zbtCompare(l->entries+pos+1,newscore,ele) > 0)
+    {
+        l->entries[pos].score = newscore;
+        return;
+    }
+
+    sds e;
+    zbtDelete(t,curscore,ele,&e);
+    zbtInsert(t,newscore,e);
+}
+
+/* Return the rank, starting from 1, of the entry with the specified score
+ * and element, or 0 if there is no such entry. */
+unsigned long zbtGetRank(zbtree *t, double score, sds ele) {
+    unsigned long rank = 0;
+    zbtNode *n = t->root;
+    int pos, j;
+
+    while (!n->leaf) {
+        zbtInner *in = (zbtInner*)n;
+        int i = zbtChildIndex(in,score,ele);
+        for (j = 0; j < i; j++) rank += in->sizes[j];
+        n = in->children[i];
+    }
+    pos = zbtLeafLowerBound((zbtLeaf*)n,score,ele);
+    if (pos == n->count ||
+        zbtCompare(((zbtLeaf*)n)->entries+pos,score,ele) != 0) return 0;
+    return rank+pos+1;
+}
+
+/* Set the cursor to the entry with the specified score and element.
+ * Returns 0 if there is no such entry. */
+int zbtFind(zbtree *t, double score, sds ele, zbtCursor *c) {
+    zbtNode *n = t->root;
+
+    while (!n->leaf) {
+        zbtInner *in = (zbtInner*)n;
+        n = in->children[zbtChildIndex(in,score,ele)];
+    }
+    c->leaf = (zbtLeaf*)n;
+    c->pos = zbtLeafLowerBound(c->leaf,score,ele);
+    return c->pos < n->count && zbtCompare(zbtCursorEntry(c),score,ele) == 0;
+}
+
+/* Set the cursor to the entry with the specified rank, starting from 1.
+ * Returns 0 if the rank is out of range. */
+int zbtSeekRank(zbtree *t, unsigned long rank, zbtCursor *c) {
+    zbtNode *n = t->root;
+
+    if (rank == 0 || rank > t->length) return 0;
+    rank--;
+    while (!n->leaf) {
+        zbtInner *in = (zbtInner*)n;
+        int i = 0;
+        while (rank >= in->sizes[i]) rank -= in->sizes[i++];
+        n = in->children[i];
+    }
+    c->leaf = (zbtLeaf*)n;
+    c->pos = rank;
+    return 1;
+}
+
+/* Set the cursor to the first entry for which before() returns false.
+ * before() must return true for all the entries up to some point of the
+ * order, and false for all the following ones. Returns 0 if there is no
+ * such entry, otherwise 1, and if 'rank' is not NULL, the rank of the
+ * entry is stored there. */
+int zbtSeek(zbtree *t, int (*before)(zbtEntry *e, void *privdata),
+            void *privdata, zbtCursor *c, unsigned long *rank)
+{
+    unsigned long r = 0;
+    zbtNode *n = t->root;
+    int lo, hi, j;
+
+    while (!n->leaf) {
+        zbtInner *in = (zbtInner*)n;
+        /* Descend into the last child with a lower bound before the
+         * target: the following child only has entries after it. */
+        lo = 1;
+        hi = n->count;
+        while (lo < hi) {
+            int mid = (lo+hi)/2;
+            if (before(in->keys+mid,privdata)) lo = mid+1; else hi = mid;
+        }
+        for (j = 0; j < lo-1; j++) r += in->sizes[j];
+        n = in->children[lo-1];
+    }
+
+    lo = 0;
+    hi = n->count;
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (before(((zbtLeaf*)n)->entries+mid,privdata)) lo = mid+1;
+        else hi = mid;
+    }
+    if (rank) *rank = r+lo+1;
+    c->leaf = (zbtLeaf*)n;
+    c->pos = lo;
+    /* All the entries of the leaf are before the target: the one we look
+     * for, if any, is the first of the next leaf. */
+    if (lo == n->count) {
+        c->leaf = c->leaf->next;
+        c->pos = 0;
+    }
+    return c->leaf != NULL;
+}
+
+int zbtFirst(zbtree *t, zbtCursor *c) {
+    c->leaf = t->head;
+    c->pos = 0;
+    return t->length != 0;
+}
+
+int zbtLast(zbtree *t, zbtCursor *c) {
+    c->leaf = t->tail;
+    c->pos = t->tail->node.count-1;
+    return t->length != 0;
+}
+
+/* Move the cursor to the next entry. Returns 0 if there are no more
+ * entries. */
+int zbtNext(zbtCursor *c) {
+    if (++c->pos < c->leaf->node.count) return 1;
+    c->leaf = c->leaf->next;
+    c->pos = 0;
+    return c->leaf != NULL;
+}
+
+/* Move the cursor to the previous entry. Returns 0 if there are no more
+ * entries. */
+int zbtPrev(zbtCursor *c) {
+    if (c->pos > 0) {
+        c->pos--;
+        return 1;
+    }
+    c->leaf = c->leaf->prev;
+    if (c->leaf == NULL) return 0;
+    c->pos = c->leaf->node.count-1;
+    return 1;
+}
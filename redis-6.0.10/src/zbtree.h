@@ -0,0 +1,71 @@
+/* B+tree of (score, element) pairs, used by the sorted sets with the btree
+ * encoding. See zbtree.c for more information. */
+
+#ifndef __ZBTREE_H
+#define __ZBTREE_H
+
+#include "sds.h"
+
+#define ZBT_LEAF_MAX 64     /* Entries of a leaf. */
+#define ZBT_INNER_MAX 64    /* Children of an inner node. */
+#define ZBT_MAX_HEIGHT 16   /* More than enough for 2^64 entries. */
+
+typedef struct zbtEntry {
+    double score;
+    sds ele;
+} zbtEntry;
+
+/* Header of both the leaves and the inner nodes. */
+typedef struct zbtNode {
+    int leaf;               /* Leaf or inner node? */
+    int count;              /* Entries of a leaf, or children of a node. */
+} zbtNode;
+
+typedef struct zbtLeaf {
+    zbtNode node;
+    struct zbtLeaf *prev, *next;
+    zbtEntry entries[ZBT_LEAF_MAX];
+} zbtLeaf;
+
+typedef struct zbtInner {
+    zbtNode node;
+    unsigned long sizes[ZBT_INNER_MAX]; /* Entries under every child. */
+    zbtEntry keys[ZBT_INNER_MAX];       /* keys[i] is a lower bound for the
+                                           entries of child i. keys[0] is
+                                           not used. */
+    zbtNode *children[ZBT_INNER_MAX];
+} zbtInner;
+
+typedef struct zbtree {
+    zbtNode *root;
+    zbtLeaf *head, *tail;
+    unsigned long length;
+    unsigned long leaves, inners;
+    int height;             /* Levels of the tree, 1 if the root is a leaf. */
+} zbtree;
+
+/* Position of an entry, valid until the tree is modified. */
+typedef struct zbtCursor {
+    zbtLeaf *leaf;
+    int pos;
+} zbtCursor;
+
+#define zbtCursorEntry(c) (&(c)->leaf->entries[(c)->pos])
+
+zbtree *zbtCreate(void);
+void zbtFree(zbtree *t);
+size_t zbtAllocSize(zbtree *t);
+void zbtInsert(zbtree *t, double score, sds ele);
+int zbtDelete(zbtree *t, double score, sds ele, sds *deleted);
+void zbtUpdateScore(zbtree *t, double curscore, sds ele, double newscore);
+unsigned long zbtGetRank(zbtree *t, double score, sds ele);
+int zbtFind(zbtree *t, double score, sds ele, zbtCursor *c);
+int zbtSeekRank(zbtree *t, unsigned long rank, zbtCursor *c);
+int zbtSeek(zbtree *t, int (*before)(zbtEntry *e, void *privdata),
+            void *privdata, zbtCursor *c, unsigned long *rank);
+int zbtFirst(zbtree *t, zbtCursor *c);
+int zbtLast(zbtree *t, zbtCursor *c);
+int zbtNext(zbtCursor *c);
+int zbtPrev(zbtCursor *c);
+
+#endif
@@ -373,6 +373,20 @@ void set_jemalloc_bg_thread(int enable) {
     je_mallctl("background_thread", NULL, 0, &val, 1);
 }
 
+void set_jemalloc_thread_arena(void) {
+    /* create a new arena and make the calling thread allocate from it, so
+     * that it does not contend for the arenas of the other threads */
+    unsigned arena;
+    size_t sz = sizeof(arena);
+    if (!je_mallctl("arenas.create", &arena, &sz, NULL, 0))
+        je_mallctl("thread.arena", NULL, NULL, &arena, sizeof(arena));
+}
+
+void flush_jemalloc_thread_tcache(void) {
+    /* return the memory cached by the calling thread to the arenas */
+    je_mallctl("thread.tcache.flush", NULL, NULL, NULL, 0);
+}
+
 int jemalloc_purge() {
     /* return all unused (reserved) pages to the OS */
     char tmp[32];
@@ -399,6 +413,12 @@ void set_jemalloc_bg_thread(int enable) {
     ((void)(enable));
 }
 
+void set_jemalloc_thread_arena(void) {
+}
+
+void flush_jemalloc_thread_tcache(void) {
+}
+
 int jemalloc_purge() {
     return 0;
 }
@@ -14,6 +14,16 @@ proc create_aof {code} {
     close $fp
 }
 
+proc aof_manifest_files {dir} {
+    set fp [open [file join $dir appendonly.aof.manifest] r]
+    set files {}
+    while {[gets $fp line] >= 0} {
+        lappend files [lindex $line 1]
+    }
+    close $fp
+    return $files
+}
+
 proc start_server_aof {overrides code} {
     upvar defaults defaults srv srv server_path server_path
     set config [concat $defaults $overrides]
@@ -235,6 +245,21 @@ tags {"aof"} {
         }
     }
 
+    ## Test that the hash fields don't expire while the AOF is loaded
+    create_aof {
+        append_to_aof [formatCommand hset myhash f1 1 f2 2]
+        append_to_aof [formatCommand hpexpireat myhash 1000 FIELDS 1 f1]
+        append_to_aof [formatCommand hincrby myhash f1 1]
+    }
+
+    start_server_aof [list dir $server_path aof-load-truncated no] {
+        test "AOF+HPEXPIREAT: Field expires after the AOF is loaded" {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            assert_equal {f2 2} [$client hgetall myhash]
+        }
+    }
+
     start_server {overrides {appendonly {yes} appendfilename {appendonly.aof}}} {
         test {Redis should not try to convert DEL into EXPIREAT for EXPIRE -1} {
             r set x 10
@@ -272,4 +297,257 @@ tags {"aof"} {
             }
         }
     }
+
+    ## Multi part AOF: a legacy AOF is used as base
+    create_aof {
+        append_to_aof [formatCommand set foo hello]
+        append_to_aof [formatCommand rpush list a b c]
+    }
+
+    start_server_aof [list dir $server_path aof-multi-part yes] {
+        set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+        wait_done_loading $client
+
+        test "Multi part AOF: the single file AOF is used as base" {
+            assert_equal hello [$client get foo]
+            assert_equal 3 [$client llen list]
+            assert_equal {appendonly.aof appendonly.aof.1.incr.aof} \
+                [aof_manifest_files $server_path]
+        }
+
+        test "Multi part AOF: BGREWRITEAOF replaces the old files" {
+            $client incr counter
+            $client bgrewriteaof
+            wait_for_condition 50 100 {
+                [status $client aof_rewrite_in_progress] == 0
+            } else {
+                fail "AOF rewrite not finished"
+            }
+            $client incr counter
+            assert_equal {appendonly.aof.1.base.rdb appendonly.aof.2.incr.aof} \
+                [aof_manifest_files $server_path]
+            assert_equal 0 [file exists $server_path/appendonly.aof]
+            assert_equal 0 [file exists $server_path/appendonly.aof.1.incr.aof]
+        }
+    }
+
+    start_server_aof [list dir $server_path aof-multi-part yes] {
+        test "Multi part AOF: the dataset is loaded from the base and increments" {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            assert_equal hello [$client get foo]
+            assert_equal 3 [$client llen list]
+            assert_equal 2 [$client get counter]
+        }
+    }
+
+    start_server {overrides {appendonly {yes} appendfilename {appendonly.aof} aof-multi-part {yes}}} {
+        set dir [lindex [r config get dir] 1]
+
+        test {Multi part AOF: writes performed during a rewrite are not lost} {
+            r debug populate 1000
+            r config set rdb-key-save-delay 200
+            r bgrewriteaof
+            for {set j 0} {$j < 100} {incr j} {
+                r incr counter
+                r rpush list $j
+            }
+            assert_equal 1 [s aof_rewrite_in_progress]
+            waitForBgrewriteaof r
+            r config set rdb-key-save-delay 0
+            assert_equal {appendonly.aof.1.base.rdb appendonly.aof.2.incr.aof} \
+                [aof_manifest_files $dir]
+
+            set digest [r debug digest]
+            r debug loadaof
+            assert_equal $digest [r debug digest]
+            assert_equal 100 [r get counter]
+        }
+
+        test {Multi part AOF: the dataset survives a restart} {
+            set digest [r debug digest]
+            restart_server 0 true
+            assert_equal $digest [r debug digest]
+        }
+
+        test {Multi part AOF: a truncated last increment can be loaded} {
+            r incr counter
+            set fp [open $dir/appendonly.aof.2.incr.aof a]
+            puts -nonewline $fp [string range [formatCommand incr counter] 0 end-1]
+            close $fp
+            restart_server 0 true
+            assert_equal 101 [r get counter]
+        }
+    }
+
+    start_server {overrides {appendfilename {appendonly.aof} aof-multi-part {yes}}} {
+        set dir [lindex [r config get dir] 1]
+
+        test {Multi part AOF: AOF can be enabled at runtime} {
+            r debug populate 1000
+            r config set rdb-key-save-delay 200
+            r config set appendonly yes
+            for {set j 0} {$j < 100} {incr j} {
+                r incr counter
+            }
+            waitForBgrewriteaof r
+            r config set rdb-key-save-delay 0
+            assert_equal {appendonly.aof.1.base.rdb appendonly.aof.1.incr.aof} \
+                [aof_manifest_files $dir]
+
+            set digest [r debug digest]
+            r debug loadaof
+            assert_equal $digest [r debug digest]
+        }
+    }
+
+    start_server {overrides {appendonly {yes} appendfilename {appendonly.aof} appendfsync always aof-writer-thread {yes}}} {
+        test {AOF writer thread: replies are held until the write is fsynced} {
+            set rd [redis_deferring_client]
+            r debug aof-flush-sleep 500000
+            set start [clock milliseconds]
+            $rd incr counter
+            after 100
+            # The other clients are served in the meantime.
+            assert_equal PONG [r ping]
+            assert_lessthan [expr {[clock milliseconds]-$start}] 400
+            assert_equal 1 [$rd read]
+            assert {[clock milliseconds]-$start >= 500}
+            r debug aof-flush-sleep 0
+            $rd close
+        }
+
+        foreach fsync {always everysec} {
+            test "AOF writer thread: the AOF matches the dataset (appendfsync $fsync)" {
+                r config set appendfsync $fsync
+                r del counter list
+                set clients {}
+                for {set j 0} {$j < 5} {incr j} {
+                    lappend clients [redis_deferring_client]
+                }
+                for {set i 0} {$i < 200} {incr i} {
+                    foreach rd $clients {
+                        $rd incr counter
+                        $rd rpush list $i
+                    }
+                }
+                foreach rd $clients {
+                    for {set i 0} {$i < 400} {incr i} {
+                        $rd read
+                    }
+                    $rd close
+                }
+                assert_equal 1000 [r get counter]
+
+                set digest [r debug digest]
+                r debug loadaof
+                assert_equal $digest [r debug digest]
+            }
+        }
+
+        test {AOF writer thread: the file is replaced while the thread writes} {
+            r config set appendfsync everysec
+            r debug aof-flush-sleep 10000
+            set rd [redis_deferring_client]
+            for {set i 0} {$i < 100} {incr i} {
+                $rd rpush list $i
+            }
+            r bgrewriteaof
+            for {set i 0} {$i < 100} {incr i} {
+                $rd incr counter
+            }
+            waitForBgrewriteaof r
+            r config set appendonly no
+            r config set appendonly yes
+            for {set i 0} {$i < 100} {incr i} {
+                $rd rpush list $i
+            }
+            for {set i 0} {$i < 300} {incr i} {
+                $rd read
+            }
+            $rd close
+            waitForBgrewriteaof r
+            r debug aof-flush-sleep 0
+
+            set digest [r debug digest]
+            r debug loadaof
+            assert_equal $digest [r debug digest]
+        }
+    }
+
+    start_server {overrides {appendonly {yes} appendfilename {appendonly.aof} aof-format {binary}}} {
+        set aof [file join [lindex [r config get dir] 1] appendonly.aof]
+
+        test {Binary AOF: the dataset is loaded from binary blocks} {
+            r set foo bar ex 1000
+            r select 10
+            r multi
+            r incr counter
+            r rpush list a 12345 -1 [string repeat x 100]
+            r select 9
+            r sadd set 1 2 3
+            r exec
+            createComplexDataset r 1000 useexpire
+            set digest [r debug digest]
+
+            set fp [open $aof r]
+            fconfigure $fp -translation binary
+            set magic [read $fp 1]
+            close $fp
+            assert_equal 0xf5 [format 0x%x [scan $magic %c]]
+
+            r debug loadaof
+            assert_equal $digest [r debug digest]
+            assert_match {*AOF is valid*} [exec src/redis-check-aof $aof]
+        }
+
+        test {Binary AOF: binary blocks and RESP commands can be mixed} {
+            r config set aof-format resp
+            r incr mixed
+            r config set aof-format binary
+            r incr mixed
+            r debug loadaof
+            assert_equal 2 [r get mixed]
+            assert_match {*AOF is valid*} [exec src/redis-check-aof $aof]
+        }
+
+        test {Binary AOF: redis-check-aof fixes a truncated block} {
+            r set last [string repeat y 1000]
+            set size [file size $aof]
+            set fp [open $aof a]
+            fconfigure $fp -translation binary
+            puts -nonewline $fp [binary format cca3 0xf5 5 abc]
+            close $fp
+            catch {exec src/redis-check-aof $aof} result
+            assert_match {*Truncated binary block*not valid*} $result
+            exec echo y | src/redis-check-aof --fix $aof
+            assert_equal $size [file size $aof]
+
+            restart_server 0 true
+            assert_equal [string repeat y 1000] [r get last]
+            assert_equal 2 [r get mixed]
+        }
+
+        test {Binary AOF: redis-check-aof detects a corrupted block} {
+            file copy -force $aof $aof_path
+            set fp [open $aof_path r+]
+            fconfigure $fp -translation binary
+            seek $fp -10 end
+            puts -nonewline $fp x
+            close $fp
+            catch {exec src/redis-check-aof $aof_path} result
+            assert_match {*checksum mismatch*not valid*} $result
+        }
+    }
+
+    start_server_aof [list dir $server_path aof-load-truncated yes] {
+        test {Binary AOF: the server refuses to load a corrupted block} {
+            wait_for_condition 50 100 {
+                [string match {*Bad file format*} \
+                    [exec tail -1 < [dict get $srv stdout]]]
+            } else {
+                fail "The corrupted binary block was loaded"
+            }
+        }
+    }
 }
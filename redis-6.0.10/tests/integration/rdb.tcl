@@ -3,8 +3,9 @@ set server_path [tmpdir "server.rdb-encoding-test"]
 # Copy RDB with different encodings in server path
 exec cp tests/assets/encodings.rdb $server_path
 
-start_server [list overrides [list "dir" $server_path "dbfilename" "encodings.rdb"]] {
-  test "RDB encoding loading test" {
+foreach threads {1 4} {
+start_server [list overrides [list "dir" $server_path "dbfilename" "encodings.rdb" "rdb-load-threads" $threads]] {
+  test "RDB encoding loading test (rdb-load-threads $threads)" {
     r select 0
     csvdump r
   } {"0","compressible","string","aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
@@ -20,6 +21,15 @@ start_server [list overrides [list "dir" $server_path "dbfilename" "encodings.rd
 "0","string","string","Hello World"
 "0","zset","zset","a","1","b","2","c","3","aa","10","bb","20","cc","30","aaa","100","bbb","200","ccc","300","aaaa","1000","cccc","123456789","bbbb","5000000000",
 "0","zset_zipped","zset","a","1","b","2","c","3",
+}
+
+  test "RDB ziplist hashes and sorted sets are loaded as listpacks (rdb-load-threads $threads)" {
+    r select 0
+    assert_encoding listpack hash_zipped
+    assert_encoding listpack zset_zipped
+    assert_equal {a 1 b 2 c 3} [r zrange zset_zipped 0 -1 withscores]
+    assert_equal {1 2 3} [r hmget hash_zipped a b c]
+  }
 }
 }
 
@@ -39,6 +49,91 @@ start_server [list overrides [list "dir" $server_path] keep_persistence true] {
     } {0000000000000000000000000000000000000000}
 }
 
+start_server [list overrides [list "dir" $server_path "rdb-load-threads" 4]] {
+    test {Check consistency of different data types after a parallel reload} {
+        createComplexDataset r 10000 useexpire
+        for {set j 0} {$j < 100} {incr j} {
+            r set big:$j [string repeat x 20000]
+            r xadd stream:[expr {$j%10}] * foo $j
+        }
+        r debug populate 10000
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+        r config set rdb-load-threads 1
+        r debug reload
+        assert_equal $digest [r debug digest]
+        r flushall
+    }
+
+    test {Check consistency of different data types after a parallel save} {
+        # Don't let the save points start a BGSAVE before ours.
+        r config set save ""
+        createComplexDataset r 10000 useexpire
+        for {set j 0} {$j < 100} {incr j} {
+            r set big:$j [string repeat x 20000]
+            r xadd stream:[expr {$j%10}] * foo $j
+        }
+        r debug populate 50000
+        r select 10
+        r debug populate 20000 other 100
+        r select 9
+        set digest [r debug digest]
+        r config set rdb-save-threads 4
+        r bgsave
+        waitForBgsave r
+        r debug reload nosave
+        assert_equal $digest [r debug digest]
+        r config set rdb-save-threads 1
+        r flushall
+    }
+}
+
+start_server {} {
+    test {Check consistency of different data types with LZ4 compression} {
+        createComplexDataset r 10000 useexpire
+        for {set j 0} {$j < 100} {incr j} {
+            r set big:$j [string repeat "lz4 $j " 2000]
+        }
+        set digest [r debug digest]
+        foreach level {1 9} {
+            r config set rdb-compression-codec lz4
+            r config set rdb-compression-level $level
+            r debug reload
+            assert_equal $digest [r debug digest]
+        }
+        set rdb [file join [lindex [r config get dir] 1] dump.rdb]
+        set res [exec src/redis-check-rdb $rdb]
+        assert_match {*RDB looks OK*} $res
+        assert_match {*0 LZF and * LZ4 compressed strings*} $res
+        assert ![string match {*0 LZF and 0 LZ4*} $res]
+
+        # LZF compressed strings are still loaded.
+        r config set rdb-compression-codec lzf
+        r save
+        r config set rdb-compression-codec lz4
+        r debug reload nosave
+        assert_equal $digest [r debug digest]
+    }
+}
+
+start_server {overrides {rdbcompression no}} {
+    test {RDB loading with and without memory mapping the file} {
+        createComplexDataset r 10000
+        # More than the readahead window of the memory mapped file.
+        r debug populate 20000 big 2000
+        set digest [r debug digest]
+        foreach mmap {yes no} {
+            foreach threads {1 4} {
+                r config set rdb-load-mmap $mmap
+                r config set rdb-load-threads $threads
+                r debug reload
+                assert_equal $digest [r debug digest]
+            }
+        }
+    }
+}
+
 start_server [list overrides [list "dir" $server_path] keep_persistence true] {
     test {Test RDB stream encoding} {
         for {set j 0} {$j < 1000} {incr j} {
@@ -148,6 +243,133 @@ start_server {} {
     }
 }
 
+start_server {overrides {rdb-save-forkless yes}} {
+    test {Fork-less BGSAVE saves the dataset as it was when it started} {
+        r debug populate 1000
+        r select 10
+        r debug populate 1000 other
+        r select 9
+        createComplexDataset r 1000
+        for {set j 0} {$j < 100} {incr j} {
+            r expire key:$j 10000
+        }
+        set digest [r debug digest]
+
+        r config set rdb-key-save-delay 1000
+        r bgsave
+        assert_equal [s rdb_bgsave_in_progress] 1
+
+        # Modify the dataset in any possible way while it is saved.
+        for {set j 0} {$j < 998} {incr j 3} {
+            r set key:$j changed
+            r del key:[expr {$j+1}]
+            r expire key:[expr {$j+2}] 5000
+            r rpush newlist:$j a b c
+            r rename key:[expr {$j+2}] renamed:$j
+        }
+        r select 10
+        for {set j 0} {$j < 1000} {incr j 2} {
+            r del other:$j
+        }
+        r move other:1 9
+        r select 9
+        r persist key:0
+        r sadd newset a b c
+
+        r config set rdb-key-save-delay 0
+        wait_for_condition 50 100 {
+            [s rdb_bgsave_in_progress] == 0
+        } else {
+            fail "bgsave not done"
+        }
+        assert_equal [s rdb_last_bgsave_status] ok
+        assert_lessthan 0 [s rdb_forkless_copied_keys]
+        r debug reload nosave
+        assert_equal [r debug digest] $digest
+    }
+
+    test {Fork-less BGSAVE saves the consumer groups before XREADGROUP} {
+        r flushall
+        r debug populate 1000
+        for {set j 0} {$j < 10} {incr j} {
+            r xadd mystream * item $j
+        }
+        r xgroup create mystream mygroup 0
+
+        r config set rdb-key-save-delay 1000
+        r bgsave
+        assert_equal [s rdb_bgsave_in_progress] 1
+        r xreadgroup group mygroup alice streams mystream >
+        r config set rdb-key-save-delay 0
+        wait_for_condition 50 100 {
+            [s rdb_bgsave_in_progress] == 0
+        } else {
+            fail "bgsave not done"
+        }
+        assert_equal 10 [lindex [r xpending mystream mygroup] 0]
+        r debug reload nosave
+        assert_equal 0 [lindex [r xpending mystream mygroup] 0]
+    }
+
+    test {FLUSHALL aborts a fork-less BGSAVE} {
+        r config set rdb-key-save-delay 1000
+        r bgsave
+        assert_equal [s rdb_bgsave_in_progress] 1
+        r flushall
+        assert_equal [s rdb_bgsave_in_progress] 0
+        assert_equal [s rdb_last_bgsave_status] ok
+        r config set rdb-key-save-delay 0
+        r set x xx
+        r bgsave
+        wait_for_condition 50 100 {
+            [s rdb_bgsave_in_progress] == 0
+        } else {
+            fail "bgsave not done"
+        }
+        r debug reload nosave
+        assert_equal [r get x] xx
+    }
+}
+
+start_server {} {
+    test {RDB save progress and stats are reported while saving} {
+        r debug populate 5000 key 100
+        r rpush list a b c
+        # 5000 keys with 0.5ms sleep per key should take 2.5 seconds
+        r config set rdb-key-save-delay 500
+        r bgsave
+        wait_for_condition 50 100 {
+            [s rdb_save_keys_saved] > 0
+        } else {
+            fail "No progress reported while saving"
+        }
+        assert_equal [s rdb_bgsave_in_progress] 1
+        assert_equal [s rdb_save_keys_total] 5001
+        assert_lessthan [s rdb_save_saved_perc] 100
+        assert_match {*in progress: yes*} [r debug savestats]
+
+        r config set rdb-key-save-delay 0
+        waitForBgsave r
+        assert_equal [s rdb_save_keys_saved] 5001
+        assert_equal [s rdb_save_saved_perc] 100.00
+        assert_lessthan [s rdb_save_compress_out_bytes] [s rdb_save_compress_in_bytes]
+        set stats [r debug savestats]
+        assert_match {*keys: 5001 of 5001*} $stats
+        assert_match {*string: 5000 keys*list: 1 keys*} $stats
+    }
+
+    test {RDB save stats account the keys saved by the save threads} {
+        r debug populate 50000 key 100
+        r config set rdb-save-threads 4
+        r bgsave
+        waitForBgsave r
+        assert_equal [s rdb_save_keys_total] 50001
+        assert_equal [s rdb_save_keys_saved] 50001
+        assert_match {*string: 50000 keys*} [r debug savestats]
+        r config set rdb-save-threads 1
+    }
+}
+
 test {client freed during loading} {
     start_server [list overrides [list key-load-delay 10 rdbcompression no]] {
         # create a big rdb that will take long to load. it is important
@@ -142,5 +142,22 @@ start_server {tags {"repl"}} {
                 fail "SPOP replication inconsistency"
             }
         }
+
+        test {Replica hides the expired hash fields not yet deleted by the master} {
+            $master debug set-active-expire 0
+            $master del myhash
+            $master hset myhash f1 v1 f2 v2 f3 v3
+            $master hpexpire myhash 200 FIELDS 2 f1 f2
+            $master wait 1 5000
+            after 300
+            assert_equal {f3 v3} [$slave hgetall myhash]
+            assert_equal {f3} [$slave hkeys myhash]
+            assert_equal {v3} [$slave hvals myhash]
+            assert_equal 1 [$slave hlen myhash]
+            assert_equal {0 {f3 v3}} [$slave hscan myhash 0]
+            assert_equal {} [$slave hget myhash f1]
+            assert_equal 0 [$slave hexists myhash f2]
+            $master debug set-active-expire 1
+        }
     }
 }
@@ -393,6 +393,100 @@ test {slave fails full sync and diskless load swapdb recovers it} {
     }
 }
 
+foreach mdl {no yes} {
+    test "diskless load pipeline serves the old dataset while loading (diskless master: $mdl)" {
+        start_server {tags {"repl"}} {
+            set replica [srv 0 client]
+            start_server {} {
+                set master [srv 0 client]
+                set master_host [srv 0 host]
+                set master_port [srv 0 port]
+
+                $replica set old 1
+                createComplexDataset $master 1000
+                $master debug populate 200 master 100000
+                $master config set rdbcompression no
+                $master config set repl-diskless-sync $mdl
+                $master config set repl-diskless-sync-delay 0
+
+                # 10ms per key, with 200 large keys loading takes 2 seconds
+                $replica config set key-load-delay 10000
+                $replica config set rdb-load-threads 4
+                $replica config set repl-diskless-load swapdb
+                $replica config set repl-diskless-load-pipeline yes
+                $replica replicaof $master_host $master_port
+
+                wait_for_condition 50 100 {
+                    [s -1 loading] eq 1
+                } else {
+                    fail "Replica didn't get into loading mode"
+                }
+
+                # Reads are served from the old dataset, writes are refused.
+                assert_equal 1 [$replica get old]
+                assert_equal 1 [$replica dbsize]
+                catch {$replica incr old} err
+                assert_match {*READONLY*} $err
+
+                wait_for_condition 100 100 {
+                    [s -1 loading] eq 0 &&
+                    [s -1 master_link_status] eq {up}
+                } else {
+                    fail "Replica didn't finish loading"
+                }
+                assert_equal {} [$replica get old]
+                $replica config set key-load-delay 0
+                assert_equal [$master debug digest] [$replica debug digest]
+            }
+        }
+    }
+}
+
+test {diskless load pipeline hides the expired keys of the old dataset} {
+    start_server {tags {"repl"}} {
+        set replica [srv 0 client]
+        start_server {} {
+            set master [srv 0 client]
+            set master_host [srv 0 host]
+            set master_port [srv 0 port]
+
+            # Keep the expired keys in the old dataset of the replica.
+            $replica debug set-active-expire 0
+            $replica set live 1
+            $replica set volatile 1 px 100
+            $replica hset myhash f1 v1 f2 v2
+            $replica hpexpire myhash 100 FIELDS 1 f1
+            after 200
+
+            $master debug populate 200 master 100000
+            $master config set rdbcompression no
+            $replica config set key-load-delay 10000
+            $replica config set repl-diskless-load swapdb
+            $replica config set repl-diskless-load-pipeline yes
+            $replica replicaof $master_host $master_port
+
+            wait_for_condition 50 100 {
+                [s -1 loading] eq 1
+            } else {
+                fail "Replica didn't get into loading mode"
+            }
+
+            assert_equal {1 {}} [$replica mget live volatile]
+            assert_equal 0 [$replica exists volatile]
+            assert_equal {} [$replica hget myhash f1]
+            assert_equal {f2 v2} [$replica hgetall myhash]
+
+            wait_for_condition 100 100 {
+                [s -1 loading] eq 0
+            } else {
+                fail "Replica didn't finish loading"
+            }
+            $replica config set key-load-delay 0
+            assert_equal 0 [$replica exists live]
+        }
+    }
+}
+
 test {diskless loading short read} {
     start_server {tags {"repl"}} {
         set replica [srv 0 client]
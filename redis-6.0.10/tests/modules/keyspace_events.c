@@ -55,6 +55,19 @@ static int KeySpace_Notification(RedisModuleCtx *ctx, int type, const char *even
     return REDISMODULE_OK;
 }
 
+/* When a key expires, delete the key with the same name and the ":dep"
+ * suffix as well, if any. */
+static int KeySpace_NotificationExpired(RedisModuleCtx *ctx, int type, const char *event, RedisModuleString *key){
+    REDISMODULE_NOT_USED(type);
+    REDISMODULE_NOT_USED(event);
+
+    RedisModuleString *dep = RedisModule_CreateStringPrintf(ctx, "%s:dep", RedisModule_StringPtrLen(key, NULL));
+    RedisModuleCallReply *rep = RedisModule_Call(ctx, "DEL", "s", dep);
+    if (rep) RedisModule_FreeCallReply(rep);
+    RedisModule_FreeString(ctx, dep);
+    return REDISMODULE_OK;
+}
+
 static int cmdIsKeyLoaded(RedisModuleCtx *ctx, RedisModuleString **argv, int argc){
     if(argc != 2){
         return RedisModule_WrongArity(ctx);
@@ -98,6 +111,10 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
         return REDISMODULE_ERR;
     }
 
+    if(RedisModule_SubscribeToKeyspaceEvents(ctx, REDISMODULE_NOTIFY_EXPIRED, KeySpace_NotificationExpired) != REDISMODULE_OK){
+        return REDISMODULE_ERR;
+    }
+
     if (RedisModule_CreateCommand(ctx,"keyspace.is_key_loaded", cmdIsKeyLoaded,"",0,0,0) == REDISMODULE_ERR){
         return REDISMODULE_ERR;
     }
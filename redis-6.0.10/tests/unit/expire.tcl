@@ -247,3 +247,163 @@ start_server {tags {"expire"}} {
         assert {$ttl <= 98 && $ttl > 90}
     }
 }
+
+start_server {tags {"expire"}} {
+    test {Active expire reclaims keys in big DBs} {
+        r flushall
+        r debug populate 20000 key
+        r eval {for i=0,14999 do redis.call('pexpire','key:'..i,1) end} 0
+        wait_for_condition 50 100 {
+            [r dbsize] == 5000
+        } else {
+            fail "Keys were not actively expired"
+        }
+        # Some key may be already expired when PEXPIRE is called.
+        assert {[s expire_cycle_expired_keys] > 10000}
+        assert {[s expire_cycle_scanned_keys] >= [s expire_cycle_expired_keys]}
+        assert_equal {value:15000 value:19999} [r mget key:15000 key:19999]
+    }
+
+    test {Active expire propagates the expired keys to the AOF} {
+        r flushall
+        r debug populate 20000 key
+        r config set appendonly yes
+        waitForBgrewriteaof r
+        r eval {for i=0,14999 do redis.call('pexpire','key:'..i,1) end} 0
+        wait_for_condition 50 100 {
+            [r dbsize] == 5000
+        } else {
+            fail "Keys were not actively expired"
+        }
+        r debug loadaof
+        r config set appendonly no
+        list [r dbsize] [r exists key:0] [r exists key:14999] [r get key:15000]
+    } {5000 0 0 value:15000}
+}
+
+start_server {tags {"expire"} overrides {active-expire-scan-thread yes}} {
+    test {Expire scan thread finds the expired keys in big DBs} {
+        r flushall
+        r debug populate 20000 key
+        r eval {for i=0,14999 do redis.call('pexpire','key:'..i,1) end} 0
+        wait_for_condition 50 100 {
+            [r dbsize] == 5000
+        } else {
+            fail "Keys were not actively expired"
+        }
+        assert {[s expire_cycle_expired_keys] > 10000}
+        assert {[s expire_cycle_scanned_keys] >= [s expire_cycle_expired_keys]}
+        assert_equal {value:15000 value:19999} [r mget key:15000 key:19999]
+    }
+
+    test {Expire scan thread reports the ratio of expired keys} {
+        r flushall
+        # Spread the scan passes one second apart.
+        r config set hz 1
+        r debug populate 1000 key
+        r eval {for i=0,999 do redis.call('pexpire','key:'..i,100000) end} 0
+        r eval {for i=0,499 do redis.call('pexpire','key:'..i,100) end} 0
+        wait_for_condition 100 20 {
+            [s expire_scan_stale_perc] > 0
+        } else {
+            fail "No expired keys found by the scan thread"
+        }
+        assert {[s expire_scan_stale_perc] <= 50}
+        wait_for_condition 50 100 {
+            [r dbsize] == 500
+        } else {
+            fail "Keys were not actively expired"
+        }
+        r config set hz 10
+        assert_equal {{} value:500} [r mget key:499 key:500]
+    }
+
+    test {Expire scan thread propagates the expired keys with a single DEL} {
+        r flushall
+        set repl [attach_to_replication_stream]
+        r debug set-active-expire 0
+        r set a 1 px 1
+        r set b 2 px 1
+        r set c 3 px 1
+        r set d 4
+        after 10
+        r debug set-active-expire 1
+        wait_for_condition 50 100 {
+            [r dbsize] == 1
+        } else {
+            fail "Keys were not actively expired"
+        }
+        assert_replication_stream $repl {
+            {select *}
+            {set a 1 px 1}
+            {set b 2 px 1}
+            {set c 3 px 1}
+            {set d 4}
+        }
+        set del [read_from_replication_stream $repl]
+        close_replication_stream $repl
+        list [lindex $del 0] [lsort [lrange $del 1 end]]
+    } {del {a b c}}
+}
+
+start_server {tags {"expire"} overrides {active-expire-index yes}} {
+    test {Active expire with the expires index reclaims due keys only} {
+        r flushall
+        r debug populate 10000 key
+        r eval {for i=0,9999 do redis.call('pexpire','key:'..i,100000) end} 0
+        r eval {for i=0,2999 do redis.call('pexpire','key:'..i,200) end} 0
+        r persist key:4000
+        r set key:5000 value:5000
+        wait_for_condition 50 100 {
+            [r dbsize] == 7000
+        } else {
+            fail "Keys were not actively expired"
+        }
+        assert_equal {{} value:3000} [r mget key:0 key:3000]
+        assert_equal -1 [r pttl key:4000]
+        assert_equal -1 [r pttl key:5000]
+        assert {[r pttl key:9999] > 0}
+    }
+
+    test {Expires index is updated by key deletions, RENAME and SWAPDB} {
+        r flushall
+        r set foo bar px 100
+        r rename foo foo2
+        r set baz bar px 100
+        r del baz
+        r set old bar px 100
+        r set old new
+        r select 10
+        r set other bar px 100
+        r swapdb 9 10
+        wait_for_condition 50 100 {
+            [r dbsize] == 1
+        } else {
+            fail "Keys were not actively expired"
+        }
+        r select 9
+        wait_for_condition 50 100 {
+            [r dbsize] == 0
+        } else {
+            fail "Keys were not actively expired"
+        }
+        r select 10
+        set res [r get old]
+        r flushdb
+        r select 9
+        set res
+    } {new}
+
+    test {Expires index survives DEBUG RELOAD and FLUSHALL ASYNC} {
+        r flushall async
+        r set foo bar px 500
+        r set bar foo px 100000
+        r debug reload
+        wait_for_condition 50 100 {
+            [r dbsize] == 1
+        } else {
+            fail "Keys were not actively expired"
+        }
+        r exists bar
+    } {1}
+}
@@ -65,6 +65,13 @@ start_server {tags {"introspection"}} {
             rdbchecksum
             daemonize
             io-threads-do-reads
+            keyspace-dict-store-hash
+            keyspace-compact-entries
+            lazyfree-threads
+            active-expire-index
+            active-expire-scan-thread
+            aof-multi-part
+            aof-writer-thread
             tcp-backlog
             always-show-logo
             syslog-enabled
@@ -273,3 +273,138 @@ start_server {tags {"keyspace"}} {
         r keys *
     } {dlskeriewrioeuwqoirueioqwrueoqwrueqw}
 }
+
+start_server {tags {"keyspace"} overrides {keyspace-dict-store-hash yes}} {
+    test {Keyspace with cached key hashes survives rehashing} {
+        r flushall
+        r debug populate 10000 key
+        for {set j 0} {$j < 1000} {incr j} {
+            r pexpire key:$j 100000
+        }
+        # Wait for the incremental rehashing of both the dictionaries.
+        wait_for_condition 50 100 {
+            ![string match {*table 1*} [r debug htstats 9]]
+        } else {
+            fail "Rehashing of the keyspace not completed"
+        }
+        assert_equal 10000 [r dbsize]
+        assert_equal {value:0 value:5000 value:9999} [r mget key:0 key:5000 key:9999]
+        assert_equal 1 [r exists key:999]
+        assert {[r pttl key:999] > 0}
+        assert_equal -1 [r pttl key:1000]
+        assert_equal 2 [r del key:0 key:5000 nokey]
+        assert_equal 9998 [r dbsize]
+    }
+
+    test {Keyspace with cached key hashes survives DEBUG RELOAD} {
+        r debug reload
+        assert_equal 9998 [r dbsize]
+        assert_equal {{} value:1 value:9999} [r mget key:0 key:1 key:9999]
+        assert {[r pttl key:1] > 0}
+        r flushall
+        r dbsize
+    } {0}
+}
+
+start_server {tags {"keyspace"} overrides {keyspace-compact-entries yes}} {
+    test {Compact keyspace entries basic operations} {
+        r flushall
+        r set foo bar
+        r set "" empty
+        r set [string repeat x 300] long
+        assert_equal {bar empty long} [r mget foo "" [string repeat x 300]]
+        assert_match {*keyspace_entry:compact*} [r debug object foo]
+        assert_equal compact [s keyspace_entries]
+        assert {[r memory usage foo] > 0}
+        r rename foo foo2
+        assert_equal bar [r get foo2]
+        assert_equal 1 [r move foo2 10]
+        r select 10
+        assert_equal bar [r get foo2]
+        r select 9
+        r del "" [string repeat x 300]
+        r dbsize
+    } {0}
+
+    test {Compact keyspace entries track expires} {
+        r flushall
+        r debug populate 1000 key
+        r pexpire key:1 100000
+        r pexpire key:2 1
+        r set key:3 value:3 px 100000
+        r set key:3 changed keepttl
+        after 10
+        assert_equal {value:1 {} changed} [r mget key:1 key:2 key:3]
+        assert {[r pttl key:1] > 0}
+        assert {[r pttl key:3] > 0}
+        r persist key:1
+        assert_equal -1 [r pttl key:1]
+        r set key:3 other
+        assert_equal -1 [r pttl key:3]
+        r pexpire key:4 1
+        after 10
+        assert_equal 0 [r exists key:4]
+        r dbsize
+    } {998}
+
+    test {Compact keyspace entries survive DEBUG RELOAD} {
+        r expire key:5 100
+        r debug reload
+        assert_equal 998 [r dbsize]
+        assert_equal {value:1 value:5 other} [r mget key:1 key:5 key:3]
+        assert {[r ttl key:5] > 0}
+        assert_equal -1 [r ttl key:1]
+        r flushall
+        r dbsize
+    } {0}
+}
+
+foreach compact {no yes} {
+start_server [list tags {"keyspace"} overrides [list keyspace-compact-entries $compact]] {
+    # The multi-key commands resolve their keys in batches of 16 and reuse
+    # the entries found, so use more keys than that, with missing, expired
+    # and duplicated keys in the same batch.
+    test "Multi-key commands over batches of keys (compact entries: $compact)" {
+        r flushall
+        r debug set-active-expire 0
+        set keys {}
+        set args {}
+        for {set j 0} {$j < 40} {incr j} {
+            lappend keys key:$j
+            lappend args key:$j val:$j
+        }
+        r mset {*}$args
+        r pexpire key:3 1
+        r pexpire key:20 1
+        after 10
+
+        set mget [r mget key:0 key:3 missing key:0 {*}[lrange $keys 4 39]]
+        assert_equal {val:0 {} {} val:0} [lrange $mget 0 3]
+        assert_equal val:39 [lindex $mget end]
+        assert_equal {} [lindex $mget 20]
+        assert_equal 39 [r exists {*}$keys missing key:0]
+
+        r mset key:0 a missing b key:0 c key:3 d
+        assert_equal {c b d} [r mget key:0 missing key:3]
+        assert_equal 0 [r msetnx new:1 x new:2 y key:5 z]
+        assert_equal 1 [r msetnx new:1 x new:2 y new:1 z]
+        assert_equal {z y} [r mget new:1 new:2]
+
+        assert_equal 4 [r del key:0 key:0 missing key:1 key:20 key:2]
+        assert_equal 3 [r unlink key:4 key:4 key:5 key:6 key:5]
+        assert_equal 0 [r exists key:0 key:1 key:2 key:4 key:5 key:6]
+
+        set sets {}
+        for {set j 0} {$j < 20} {incr j} {
+            r sadd set:$j a b $j
+            lappend sets set:$j
+        }
+        assert_equal {a b} [lsort [r sinter {*}$sets set:0]]
+        assert_equal 22 [r sunionstore dst {*}$sets set:0 nosuchset]
+        assert_equal {} [r sdiff set:0 {*}$sets]
+        assert_equal 22 [r zunionstore zdst 21 {*}$sets nosuchset]
+        assert_equal 20 [r zscore zdst a]
+        r debug set-active-expire 1
+    } {OK}
+}
+}
@@ -36,4 +36,90 @@ start_server {tags {"lazyfree"}} {
             fail "Memory is not reclaimed by FLUSHDB ASYNC"
         }
     }
+
+    test "UNLINK of many keys reclaims memory in background" {
+        set orig_mem [s used_memory]
+        set keys {}
+        for {set j 0} {$j < 200} {incr j} {
+            r sadd set:$j {*}[lrange $args 0 999]
+            lappend keys set:$j
+        }
+        set peak_mem [s used_memory]
+        assert {$peak_mem > $orig_mem+1000000}
+        assert {[r unlink {*}$keys] == 200}
+        wait_for_condition 50 100 {
+            [s lazyfree_pending_objects] == 0 &&
+            [s used_memory] < $peak_mem &&
+            [s used_memory] < $orig_mem*2
+        } else {
+            fail "Memory is not reclaimed by UNLINK"
+        }
+    }
+
+    test "Lazy expire of many keys reclaims memory in background" {
+        r config set lazyfree-lazy-expire yes
+        set orig_mem [s used_memory]
+        for {set j 0} {$j < 200} {incr j} {
+            r sadd set:$j {*}[lrange $args 0 999]
+            r pexpire set:$j 10
+        }
+        set peak_mem [s used_memory]
+        wait_for_condition 50 100 {
+            [r dbsize] == 0 &&
+            [s lazyfree_pending_objects] == 0 &&
+            [s used_memory] < $peak_mem &&
+            [s used_memory] < $orig_mem*2
+        } else {
+            fail "Memory is not reclaimed by lazy expire"
+        }
+        r config set lazyfree-lazy-expire no
+    }
+}
+
+start_server {tags {"lazyfree"} overrides {lazyfree-threads 4}} {
+    test "UNLINK of large objects with multiple lazyfree threads" {
+        set orig_mem [s used_memory]
+        set args {}
+        for {set i 0} {$i < 100000} {incr i} {
+            lappend args $i
+        }
+        r sadd myset {*}$args
+        foreach i $args {lappend zargs $i $i; lappend hargs $i $i}
+        r zadd myzset {*}$zargs
+        r hset myhash {*}$hargs
+        set peak_mem [s used_memory]
+        assert {$peak_mem > $orig_mem+1000000}
+        assert {[r unlink myset myzset myhash] == 3}
+        wait_for_condition 50 100 {
+            [s lazyfree_pending_objects] == 0 &&
+            [s used_memory] < $peak_mem &&
+            [s used_memory] < $orig_mem*2
+        } else {
+            fail "Memory is not reclaimed by UNLINK"
+        }
+        assert_equal [r debug digest] [string repeat 0 40]
+    }
+
+    test "FLUSHALL ASYNC of a large dataset with multiple lazyfree threads" {
+        set orig_mem [s used_memory]
+        r debug populate 200000
+        r select 10
+        r debug populate 100000 key: 10
+        for {set j 0} {$j < 1000} {incr j} {
+            r expire key:$j 1000
+        }
+        set peak_mem [s used_memory]
+        r flushall async
+        assert_equal [r dbsize] 0
+        wait_for_condition 50 100 {
+            [s lazyfree_pending_objects] == 0 &&
+            [s used_memory] < $peak_mem &&
+            [s used_memory] < $orig_mem*2
+        } else {
+            fail "Memory is not reclaimed by FLUSHALL ASYNC"
+        }
+        r select 9
+        r set foo bar
+        assert_equal [r get foo] bar
+    }
 }
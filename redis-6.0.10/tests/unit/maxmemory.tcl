@@ -303,3 +303,59 @@ start_server {tags {"maxmemory"}} {
         if {$::verbose} { puts "evicted: $evicted" }
     }
 }
+
+start_server {tags {"maxmemory"}} {
+    test {Batched eviction still evicts the least recently used keys} {
+        r config set maxmemory 0
+        r config set maxmemory-policy allkeys-lru
+        r flushall
+        set base [s used_memory]
+        r debug populate 20000 old 100
+        after 2100
+        r debug populate 20000 new 100
+        set used [s used_memory]
+
+        # Evict about a quarter of the keys.
+        r config set maxmemory [expr {$used-($used-$base)/4}]
+        set evicted [s evicted_keys]
+        assert_range $evicted 5000 20000
+        set new_evicted 0
+        for {set j 0} {$j < 20000} {incr j} {
+            if {![r exists new:$j]} {incr new_evicted}
+        }
+        if {$::verbose} { puts "evicted: $evicted new keys evicted: $new_evicted" }
+        assert {$new_evicted < $evicted/10}
+
+        # Check the eviction quality metrics.
+        assert {[s eviction_precision] >= 0 && [s eviction_precision] <= 1}
+        assert {[s eviction_samples] >= [lindex [r config get maxmemory-samples] 1]}
+        assert_range [s eviction_batch] 1 8
+        r config set maxmemory 0
+    }
+}
+
+start_server {tags {"maxmemory"}} {
+    test {Changing the eviction config resets the adaptive eviction state} {
+        r config set maxmemory 0
+        r config set maxmemory-policy allkeys-lru
+        r flushall
+        set base [s used_memory]
+        r debug populate 20000 key 100
+        set used [s used_memory]
+        r config set maxmemory [expr {$used-($used-$base)/10}]
+        assert {[s evicted_keys] > 0}
+
+        # The pool and the adaptive samples were computed under the old
+        # policy: they must start again from scratch.
+        r config set maxmemory-policy allkeys-lfu
+        assert_equal [s eviction_samples] [lindex [r config get maxmemory-samples] 1]
+        assert_equal [s eviction_batch] 1
+        assert_equal [s eviction_precision] 1.0000
+
+        r config set maxmemory-policy allkeys-lru
+        r config set maxmemory-samples 10
+        assert_equal [s eviction_samples] 10
+        assert_equal [s eviction_batch] 1
+        r config set maxmemory 0
+    }
+}
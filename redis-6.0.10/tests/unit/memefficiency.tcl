@@ -456,4 +456,88 @@ start_server {tags {"defrag"}} {
         }
     }
 }
+
+start_server {tags {"defrag"} overrides {keyspace-compact-entries yes}} {
+    if {[string match {*jemalloc*} [s mem_allocator]]} {
+        test "Active defrag compact keyspace entries" {
+            r config set save "" ;# prevent bgsave from interfereing with save below
+            r config set hz 100
+            r config set activedefrag no
+            r config set active-defrag-threshold-lower 5
+            r config set active-defrag-cycle-min 65
+            r config set active-defrag-cycle-max 75
+            r config set active-defrag-ignore-bytes 1mb
+            r config set maxmemory 0
+
+            # The entries hold the key names, so use long names to make the
+            # entries the bulk of the memory, and set expires so that the
+            # expires dict shares the keys with the main dict.
+            set prefix [string repeat k 100]
+            set rd [redis_deferring_client]
+            set keys 300000
+            for {set j 0} {$j < $keys} {incr j} {
+                $rd set $prefix$j 1 px [expr {1000000+$j}]
+            }
+            for {set j 0} {$j < $keys} {incr j} {
+                $rd read ; # Discard replies
+            }
+
+            # create some fragmentation
+            for {set j 0} {$j < $keys} {incr j 2} {
+                $rd del $prefix$j
+            }
+            for {set j 0} {$j < $keys} {incr j 2} {
+                $rd read ; # Discard replies
+            }
+            $rd close
+
+            after 120 ;# serverCron only updates the info once in 100ms
+            set frag [s allocator_frag_ratio]
+            if {$::verbose} {
+                puts "frag $frag"
+            }
+            assert {$frag >= 1.4}
+
+            set digest [r debug digest]
+            catch {r config set activedefrag yes} e
+            if {![string match {DISABLED*} $e]} {
+                # wait for the active defrag to start working (decision once a second)
+                wait_for_condition 50 100 {
+                    [s active_defrag_running] ne 0
+                } else {
+                    fail "defrag not started."
+                }
+
+                # wait for the active defrag to stop working
+                wait_for_condition 150 100 {
+                    [s active_defrag_running] eq 0
+                } else {
+                    after 120 ;# serverCron only updates the info once in 100ms
+                    puts [r info memory]
+                    puts [r memory malloc-stats]
+                    fail "defrag didn't stop."
+                }
+
+                # test the the fragmentation is lower
+                after 120 ;# serverCron only updates the info once in 100ms
+                set frag [s allocator_frag_ratio]
+                if {$::verbose} {
+                    puts "frag $frag"
+                }
+                assert {$frag < 1.1}
+            }
+            # verify the data isn't corrupted or changed, and that the keys
+            # moved together with the entries are still found by the main
+            # dict and the expires dict.
+            set newdigest [r debug digest]
+            assert {$digest eq $newdigest}
+            assert_equal [expr {$keys/2}] [r dbsize]
+            assert_equal 1 [r get ${prefix}1]
+            assert {[r pttl ${prefix}1] > 0}
+            assert_equal 1 [r persist ${prefix}3]
+            assert_equal 1 [r del ${prefix}5]
+            r save ;# saving an rdb iterates over all the data / pointers
+        } {OK}
+    }
+}
 } ;# run_solo
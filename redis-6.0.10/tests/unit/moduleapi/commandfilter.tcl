@@ -81,4 +81,15 @@ start_server {tags {"modules"}} {
         assert_equal {} [r lrange log-key 0 -1]
     }
 
+    test {Pipelined module commands are not called once the module is unloaded} {
+        set rd [redis_deferring_client]
+        $rd write [formatCommand module unload commandfilter]
+        $rd write [formatCommand commandfilter.ping]
+        $rd flush
+        assert_equal OK [$rd read]
+        catch {$rd read} err
+        $rd close
+        set err
+    } {*unknown command*}
+
 } 
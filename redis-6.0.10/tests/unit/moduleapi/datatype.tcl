@@ -42,3 +42,39 @@ start_server {tags {"modules"}} {
         set e
     } {*ERR*}
 }
+
+start_server {tags {"modules"}} {
+    r module load $testmodule
+
+    test {DataType: RDB saved with threads is the same file} {
+        r config set save ""
+        r debug populate 20000
+        for {set j 0} {$j < 200} {incr j} {
+            r datatype.set dtkey:$j $j value:$j
+        }
+        set dumpfile [file join [lindex [r config get dir] 1] dump.rdb]
+
+        # Compare the keys saved by a single thread and by many threads: the
+        # module values are serialized by the main thread of the child, but
+        # they must still be written in the same order. The aux fields (with
+        # the creation time) and the checksum are left out, so the keys are
+        # taken from the SELECTDB/RESIZEDB opcodes to the EOF opcode.
+        set saved {}
+        foreach threads {1 4} {
+            r config set rdb-save-threads $threads
+            r bgsave
+            waitForBgsave r
+            set fd [open $dumpfile rb]
+            set rdb [read $fd]
+            close $fd
+            set start [string first "\xfe\x09\xfb" $rdb]
+            assert {$start > 0}
+            lappend saved [string range $rdb $start end-8]
+        }
+        r config set rdb-save-threads 1
+
+        assert {[lindex $saved 0] eq [lindex $saved 1]}
+        r debug reload
+        assert_equal {7 value:7} [r datatype.get dtkey:7]
+    }
+}
@@ -19,4 +19,25 @@ tags "modules" {
             assert_equal {1 s} [r keyspace.is_key_loaded s]
         }
 	}
+
+    start_server [list overrides [list loadmodule "$testmodule" active-expire-index yes]] {
+        test {Expires index handles keys deleted by expired key space events} {
+            r debug set-active-expire 0
+            set now [clock milliseconds]
+            r set x 1
+            r set x:dep 1
+            r set y 1
+            r pexpireat x [expr {$now+100}]
+            r pexpireat x:dep [expr {$now+101}]
+            r pexpireat y [expr {$now+102}]
+            after 200
+            r debug set-active-expire 1
+            wait_for_condition 50 100 {
+                [r dbsize] == 0
+            } else {
+                fail "Keys were not actively expired"
+            }
+            r ping
+        } {PONG}
+    }
 }
\ No newline at end of file
@@ -270,3 +270,91 @@ start_server {tags {"other"}} {
         assert_match "*table size: 16384*" [r debug HTSTATS 9]
     }
 }
+
+start_server {tags {"other"}} {
+    test {Pipelined commands are looked up ahead and prefetched} {
+        r select 9
+        r flushdb
+        for {set j 0} {$j < 20} {incr j} {
+            r set key:$j val:$j
+        }
+
+        # Send the whole pipeline with a single write, so that the server
+        # finds all the requests in the query buffer at once.
+        set rd [redis_deferring_client]
+        $rd select 9
+        $rd read
+        set buf {}
+        for {set j 0} {$j < 20} {incr j} {
+            append buf [formatCommand get key:$j]
+        }
+        append buf [formatCommand incr counter]
+        append buf [formatCommand nosuchcommand key:0]
+        append buf "PING\r\n"
+        append buf [formatCommand GeT key:19]
+        append buf [formatCommand del key:0]
+        append buf [formatCommand get key:0]
+        $rd write $buf
+        $rd flush
+        for {set j 0} {$j < 20} {incr j} {
+            assert_equal val:$j [$rd read]
+        }
+        assert_equal 1 [$rd read]
+        catch {$rd read} err
+        assert_match {*unknown command*} $err
+        assert_equal PONG [$rd read]
+        assert_equal val:19 [$rd read]
+        assert_equal 1 [$rd read]
+        assert_equal {} [$rd read]
+        $rd close
+        assert {[s pipelined_keys_prefetched] > 0}
+    }
+}
+
+start_server {tags {"other"} overrides {rename-command {set myset}}} {
+    test {Pipelined renamed commands are looked up by their new name} {
+        set rd [redis_deferring_client]
+        $rd write [formatCommand myset foo bar]
+        $rd write [formatCommand set foo baz]
+        $rd write [formatCommand get foo]
+        $rd flush
+        assert_equal OK [$rd read]
+        catch {$rd read} err
+        assert_match {*unknown command*} $err
+        assert_equal bar [$rd read]
+        $rd close
+    }
+}
+
+start_server {tags {"other"} overrides {io-threads 2 io-threads-do-reads yes}} {
+    test {Pipelined commands parsed by I/O threads are prefetched and served} {
+        r select 9
+        for {set j 0} {$j < 100} {incr j} {
+            r set key:$j val:$j
+        }
+
+        set clients {}
+        for {set j 0} {$j < 16} {incr j} {
+            lappend clients [redis_deferring_client]
+        }
+
+        # Threaded I/O is only active with enough clients pending replies,
+        # so keep many clients pipelining until the I/O threads parsed some
+        # of their commands.
+        for {set round 0} {$round < 100} {incr round} {
+            foreach rd $clients {
+                for {set j 0} {$j < 10} {incr j} {
+                    $rd get key:[expr {($round+$j)%100}]
+                }
+            }
+            foreach rd $clients {
+                for {set j 0} {$j < 10} {incr j} {
+                    assert_equal val:[expr {($round+$j)%100}] [$rd read]
+                }
+            }
+            if {[s io_threaded_keys_prefetched] > 0} break
+        }
+        foreach rd $clients {$rd close}
+        assert {[s io_threaded_keys_prefetched] > 0}
+    }
+}
@@ -14,8 +14,8 @@ start_server {tags {"hash"}} {
         list [r hlen smallhash]
     } {8}
 
-    test {Is the small hash encoded with a ziplist?} {
-        assert_encoding ziplist smallhash
+    test {Is the small hash encoded with a listpack?} {
+        assert_encoding listpack smallhash
     }
 
     test {HSET/HLEN - Big hash creation} {
@@ -252,7 +252,7 @@ start_server {tags {"hash"}} {
         lappend rv [r hexists bighash nokey]
     } {1 0 1 0}
 
-    test {Is a ziplist encoded Hash promoted on big payload?} {
+    test {Is a listpack encoded Hash promoted on big payload?} {
         r hset smallhash foo [string repeat a 1024]
         r debug object smallhash
     } {*hashtable*}
@@ -445,7 +445,7 @@ start_server {tags {"hash"}} {
         }
     }
 
-    test {Hash ziplist regression test for large keys} {
+    test {Hash listpack regression test for large keys} {
         r hset hash kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk a
         r hset hash kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk b
         r hget hash kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk
@@ -512,8 +512,8 @@ start_server {tags {"hash"}} {
         }
     }
 
-    test {Stress test the hash ziplist -> hashtable encoding conversion} {
-        r config set hash-max-ziplist-entries 32
+    test {Stress test the hash listpack -> hashtable encoding conversion} {
+        r config set hash-max-listpack-entries 32
         for {set j 0} {$j < 100} {incr j} {
             r del myhash
             for {set i 0} {$i < 64} {incr i} {
@@ -540,4 +540,151 @@ start_server {tags {"hash"}} {
             assert {[r hincrbyfloat myhash float -0.1] eq {1.9}}
         }
     }
+
+    test {HEXPIRE/HTTL/HPERSIST - basic replies} {
+        r del myhash
+        r hset myhash f1 v1 f2 v2 f3 v3
+        assert_equal {listpack} [r object encoding myhash]
+        assert_equal {1 1 -2} [r hexpire myhash 100 FIELDS 3 f1 f2 nofield]
+        assert_equal {hashtable} [r object encoding myhash]
+        set ttl [r httl myhash FIELDS 3 f1 f3 nofield]
+        assert_range [lindex $ttl 0] 90 100
+        assert_equal {-1 -2} [lrange $ttl 1 2]
+        assert_range [lindex [r hpttl myhash FIELDS 1 f1] 0] 90000 100000
+        assert_equal {1 -1 -2} [r hpersist myhash FIELDS 3 f1 f3 nofield]
+        assert_equal {-1 -1} [r httl myhash FIELDS 2 f1 f3]
+        assert_equal {-2} [r httl nokey FIELDS 1 f1]
+        assert_equal {-2} [r hexpire nokey 100 FIELDS 1 f1]
+        assert_equal 3 [r hlen myhash]
+    }
+
+    test {HEXPIRE - NX, XX, GT and LT conditions} {
+        r del myhash
+        r hset myhash f1 v1 f2 v2
+        assert_equal {1 0} [r hexpire myhash 100 NX FIELDS 2 f1 f1]
+        assert_equal {0 1} [r hexpire myhash 200 XX FIELDS 2 f2 f1]
+        assert_equal {0 0} [r hexpire myhash 150 GT FIELDS 2 f1 f2]
+        assert_equal {1 1} [r hexpire myhash 150 LT FIELDS 2 f1 f2]
+        assert_equal {150 150} [r httl myhash FIELDS 2 f1 f2]
+    }
+
+    test {HEXPIREAT/HPEXPIRETIME - absolute times} {
+        r del myhash
+        r hset myhash f1 v1 f2 v2
+        set at [expr {[clock seconds]+1000}]
+        assert_equal {1} [r hexpireat myhash $at FIELDS 1 f1]
+        assert_equal {1} [r hpexpireat myhash [expr {$at*1000+123}] FIELDS 1 f2]
+        assert_equal [list $at $at] [r hexpiretime myhash FIELDS 2 f1 f2]
+        assert_equal [list [expr {$at*1000}] [expr {$at*1000+123}]] \
+            [r hpexpiretime myhash FIELDS 2 f1 f2]
+    }
+
+    test {HEXPIRE - a time in the past deletes the fields and the key} {
+        r del myhash
+        r hset myhash f1 v1 f2 v2
+        assert_equal {2 -2} [r hexpireat myhash 1 FIELDS 2 f1 nofield]
+        assert_equal {v2} [r hget myhash f2]
+        assert_equal {2} [r hpexpire myhash 0 FIELDS 1 f2]
+        assert_equal 0 [r exists myhash]
+    }
+
+    test {HEXPIRE - wrong arguments} {
+        r del myhash
+        r hset myhash f1 v1
+        assert_error {*FIELDS is missing*} {r hexpire myhash 100 NX f1 1 f1}
+        assert_error {*numfields*} {r hexpire myhash 100 FIELDS 2 f1}
+        assert_error {*numfields*} {r httl myhash FIELDS 0 f1}
+        assert_error {*Unsupported argument*} {r hexpire myhash 100 YY FIELDS 1 f1}
+        assert_error {*invalid expire time*} {r hexpire myhash -1 FIELDS 1 f1}
+        r set mystring foo
+        assert_error {WRONGTYPE*} {r hexpire mystring 100 FIELDS 1 f1}
+        r del mystring
+    }
+
+    test {Hash fields expire lazily when the hash is accessed} {
+        r debug set-active-expire 0
+        r del myhash
+        r hset myhash f1 v1 f2 v2 f3 v3
+        r hpexpire myhash 10 FIELDS 2 f1 f2
+        after 50
+        assert_equal {f3 v3} [r hgetall myhash]
+        assert_equal 1 [r hlen myhash]
+        r hpexpire myhash 10 FIELDS 1 f3
+        after 50
+        assert_equal 0 [r exists myhash]
+        r debug set-active-expire 1
+    } {OK}
+
+    test {Hash fields are reclaimed by the active expire cycle} {
+        r del myhash myhash2
+        set expired [s expired_fields]
+        for {set j 0} {$j < 500} {incr j} {
+            r hset myhash f$j v$j
+            r hset myhash2 f$j v$j
+        }
+        r hpexpire myhash 10 FIELDS 3 f1 f2 f3
+        r hpexpire myhash2 10 FIELDS 500 {*}[lrange [r hkeys myhash2] 0 end]
+        wait_for_condition 50 100 {
+            [s expired_fields] == $expired+503
+        } else {
+            fail "Hash fields were not expired by the active expire cycle"
+        }
+        assert_equal 0 [r exists myhash2]
+        assert_equal 497 [r hlen myhash]
+        assert_equal 0 [r hexists myhash f1]
+    }
+
+    test {HSET discards the TTL of a field, HINCRBY keeps it} {
+        r del myhash
+        r hset myhash f1 v1 f2 10 f3 1.5
+        r hexpire myhash 100 FIELDS 3 f1 f2 f3
+        r hset myhash f1 v2
+        r hincrby myhash f2 1
+        r hincrbyfloat myhash f3 1
+        assert_equal -1 [r httl myhash FIELDS 1 f1]
+        assert_equal {100 100} [r httl myhash FIELDS 2 f2 f3]
+    }
+
+    test {Hash field expires are propagated as HPEXPIREAT and HDEL} {
+        r del myhash
+        r hset myhash f1 v1 f2 2
+        set repl [attach_to_replication_stream]
+        r hpexpireat myhash 9999999999000 FIELDS 1 f1
+        r hexpire myhash 100 FIELDS 1 f2
+        r hincrbyfloat myhash f2 1
+        r hexpireat myhash 1 FIELDS 1 f1
+        r debug set-active-expire 0
+        r hpexpire myhash 1 FIELDS 1 f2
+        after 10
+        r hlen myhash
+        r debug set-active-expire 1
+        assert_replication_stream $repl {
+            {select *}
+            {hpexpireat myhash 9999999999000 FIELDS 1 f1}
+            {hpexpireat myhash * FIELDS 1 f2}
+            {hset myhash f2 3}
+            {hpexpireat myhash * FIELDS 1 f2}
+            {hdel myhash f1}
+            {hpexpireat myhash * FIELDS 1 f2}
+            {hdel myhash f2}
+        }
+        close_replication_stream $repl
+    }
+
+    test {Hash field expires after a reload (snapshot + AOF rewrite)} {
+        r del myhash
+        r hset myhash f1 v1 f2 v2 f3 v3
+        r hexpire myhash 1000 FIELDS 2 f1 f2
+        r hpexpireat myhash 9999999999000 FIELDS 1 f3
+        set digest [r debug digest-value myhash]
+        r debug reload
+        assert_equal $digest [r debug digest-value myhash]
+        assert_range [lindex [r httl myhash FIELDS 1 f1] 0] 900 1000
+        r bgrewriteaof
+        waitForBgrewriteaof r
+        r debug loadaof
+        assert_equal $digest [r debug digest-value myhash]
+        assert_equal {9999999999000} [r hpexpiretime myhash FIELDS 1 f3]
+        assert_range [lindex [r httl myhash FIELDS 1 f2] 0] 900 1000
+    }
 }
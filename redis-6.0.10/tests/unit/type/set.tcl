@@ -9,16 +9,29 @@ start_server {
         foreach entry $entries { r sadd $key $entry }
     }
 
-    test {SADD, SCARD, SISMEMBER, SMEMBERS basics - regular set} {
-        create_set myset {foo}
-        assert_encoding hashtable myset
-        assert_equal 1 [r sadd myset bar]
-        assert_equal 0 [r sadd myset bar]
-        assert_equal 2 [r scard myset]
-        assert_equal 1 [r sismember myset foo]
-        assert_equal 1 [r sismember myset bar]
-        assert_equal 0 [r sismember myset bla]
-        assert_equal {bar foo} [lsort [r smembers myset]]
+    # Small sets of strings are listpack encoded: disable the listpack
+    # encoding while creating a set when the hashtable one is wanted.
+    proc create_set_with_encoding {key entries encoding} {
+        if {$encoding eq {hashtable}} {
+            r config set set-max-listpack-entries 0
+        }
+        create_set $key $entries
+        r config set set-max-listpack-entries 128
+        assert_encoding $encoding $key
+    }
+
+    foreach type {listpack hashtable} {
+        test "SADD, SCARD, SISMEMBER, SMEMBERS basics - $type" {
+            create_set_with_encoding myset {foo} $type
+            assert_equal 1 [r sadd myset bar]
+            assert_equal 0 [r sadd myset bar]
+            assert_equal 2 [r scard myset]
+            assert_equal 1 [r sismember myset foo]
+            assert_equal 1 [r sismember myset bar]
+            assert_equal 0 [r sismember myset bla]
+            assert_equal {bar foo} [lsort [r smembers myset]]
+            assert_encoding $type myset
+        }
     }
 
     test {SADD, SCARD, SISMEMBER, SMEMBERS basics - intset} {
@@ -38,19 +51,48 @@ start_server {
         assert_error WRONGTYPE* {r sadd mylist bar}
     }
 
-    test "SADD a non-integer against an intset" {
+    test "SADD a non-integer against a small intset" {
         create_set myset {1 2 3}
         assert_encoding intset myset
         assert_equal 1 [r sadd myset a]
+        assert_encoding listpack myset
+        assert_equal {1 2 3 a} [lsort [r smembers myset]]
+        assert_equal 1 [r sismember myset 2]
+        assert_equal 0 [r sismember myset 4]
+    }
+
+    test "SADD a non-integer against a large intset" {
+        r del myset
+        for {set i 0} {$i < 200} {incr i} { r sadd myset $i }
+        assert_encoding intset myset
+        assert_equal 1 [r sadd myset a]
         assert_encoding hashtable myset
     }
 
     test "SADD an integer larger than 64 bits" {
         create_set myset {213244124402402314402033402}
-        assert_encoding hashtable myset
+        assert_encoding listpack myset
         assert_equal 1 [r sismember myset 213244124402402314402033402]
     }
 
+    test "SADD converts a listpack with too many elements to a hashtable" {
+        r del myset
+        for {set i 0} {$i < 128} {incr i} { r sadd myset "e$i" }
+        assert_encoding listpack myset
+        assert_equal 0 [r sadd myset e1]
+        assert_equal 1 [r sadd myset e128]
+        assert_encoding hashtable myset
+        assert_equal 129 [r scard myset]
+    }
+
+    test "SADD converts a listpack with a too big element to a hashtable" {
+        create_set myset {a b c}
+        assert_encoding listpack myset
+        assert_equal 1 [r sadd myset [string repeat x 65]]
+        assert_encoding hashtable myset
+        assert_equal 4 [r scard myset]
+    }
+
     test "SADD overflows the maximum allowed integers in an intset" {
         r del myset
         for {set i 0} {$i < 512} {incr i} { r sadd myset $i }
@@ -67,26 +109,46 @@ start_server {
     }
 
     test "Set encoding after DEBUG RELOAD" {
-        r del myintset myhashset mylargeintset
+        r del myintset myhashset mylargeintset mylistpackset
         for {set i 0} {$i <  100} {incr i} { r sadd myintset $i }
         for {set i 0} {$i < 1280} {incr i} { r sadd mylargeintset $i }
         for {set i 0} {$i <  256} {incr i} { r sadd myhashset [format "i%03d" $i] }
+        for {set i 0} {$i <  100} {incr i} { r sadd mylistpackset [format "i%03d" $i] }
+        r sadd mylistpackset 1 -1 12345678901
         assert_encoding intset myintset
         assert_encoding hashtable mylargeintset
         assert_encoding hashtable myhashset
+        assert_encoding listpack mylistpackset
+        set digest [r debug digest-value mylistpackset]
 
         r debug reload
         assert_encoding intset myintset
         assert_encoding hashtable mylargeintset
         assert_encoding hashtable myhashset
+        assert_encoding listpack mylistpackset
+        assert_equal $digest [r debug digest-value mylistpackset]
     }
 
-    test {SREM basics - regular set} {
-        create_set myset {foo bar ciao}
-        assert_encoding hashtable myset
-        assert_equal 0 [r srem myset qux]
-        assert_equal 1 [r srem myset foo]
-        assert_equal {bar ciao} [lsort [r smembers myset]]
+    test "Set encoding after DEBUG RELOAD with a lower listpack limit" {
+        r del mylistpackset
+        for {set i 0} {$i < 100} {incr i} { r sadd mylistpackset [format "i%03d" $i] }
+        assert_encoding listpack mylistpackset
+        r config set set-max-listpack-entries 50
+        r debug reload
+        assert_encoding hashtable mylistpackset
+        assert_equal 100 [r scard mylistpackset]
+        r config set set-max-listpack-entries 128
+    }
+
+    foreach type {listpack hashtable} {
+        test "SREM basics - $type" {
+            create_set_with_encoding myset {foo bar ciao} $type
+            assert_equal 0 [r srem myset qux]
+            assert_equal 1 [r srem myset foo]
+            assert_equal {bar ciao} [lsort [r smembers myset]]
+            assert_equal 1 [r srem myset 1 bar]
+            assert_equal {ciao} [r smembers myset]
+        }
     }
 
     test {SREM basics - intset} {
@@ -111,7 +173,14 @@ start_server {
         r srem myset 1 2 3 4 5 6 7 8
     } {3}
 
-    foreach {type} {hashtable intset} {
+    foreach {type} {hashtable listpack intset} {
+        # Big enough for all the sets created below to be listpacks, or
+        # no listpacks at all.
+        if {$type eq {hashtable}} {
+            r config set set-max-listpack-entries 0
+        } elseif {$type eq {listpack}} {
+            r config set set-max-listpack-entries 512
+        }
         for {set i 1} {$i <= 5} {incr i} {
             r del [format "set%d" $i]
         }
@@ -132,7 +201,7 @@ start_server {
         # while the tests are running -- an extra element is added to every
         # set that determines its encoding.
         set large 200
-        if {$type eq "hashtable"} {
+        if {$type ne "intset"} {
             set large foo
         }
 
@@ -205,6 +274,16 @@ start_server {
             }
             assert_equal {1 2 3 4} [lsort [r smembers setres]]
         }
+
+        test "ZUNIONSTORE and ZINTERSTORE with sets - $type" {
+            r zunionstore zsetres 2 set1 set2
+            assert_equal [lsort [r sunion set1 set2]] [lsort [r zrange zsetres 0 -1]]
+            r zinterstore zsetres 2 set1 set2 weights 1 2
+            assert_equal [list 195 196 197 198 199 $large] [lsort [r zrange zsetres 0 -1]]
+            assert_equal 3 [r zscore zsetres 195]
+        }
+
+        r config set set-max-listpack-entries 128
     }
 
     test "SDIFF with first set empty" {
@@ -246,6 +325,67 @@ start_server {
         }
     }
 
+    test "SINTER, SUNION, SDIFF fuzzing - intset" {
+        set original_max [lindex [r config get set-max-intset-entries] 1]
+        r config set set-max-intset-entries 5000
+        for {set j 0} {$j < 50} {incr j} {
+            set args {}
+            set num_sets [expr {[randomInt 4]+1}]
+            for {set i 0} {$i < $num_sets} {incr i} {
+                r del set_$i
+                lappend args set_$i
+                set range [lindex {100 40000 100000 5000000000} [randomInt 4]]
+                set num_elements [randomInt 3000]
+                set elements {}
+                for {set k 0} {$k < $num_elements} {incr k} {
+                    lappend elements [expr {[randomInt $range]-$range/4}]
+                }
+                if {$num_elements} {r sadd set_$i {*}$elements}
+                set intset_content($i) [lsort -integer -uniq $elements]
+            }
+
+            # Compute the expected results with a Tcl array per set.
+            unset -nocomplain inter union diff
+            array set inter {}
+            array set diff {}
+            array set union {}
+            foreach ele $intset_content(0) {
+                set inter($ele) 1
+                set diff($ele) 1
+            }
+            for {set i 0} {$i < $num_sets} {incr i} {
+                unset -nocomplain in
+                array set in {}
+                foreach ele $intset_content($i) {
+                    set in($ele) 1
+                    set union($ele) 1
+                    if {$i > 0} {unset -nocomplain diff($ele)}
+                }
+                foreach ele [array names inter] {
+                    if {![info exists in($ele)]} {unset inter($ele)}
+                }
+            }
+
+            assert_equal [lsort -integer [array names inter]] \
+                         [lsort -integer [r sinter {*}$args]]
+            assert_equal [lsort -integer [array names union]] \
+                         [lsort -integer [r sunion {*}$args]]
+            assert_equal [lsort -integer [array names diff]] \
+                         [lsort -integer [r sdiff {*}$args]]
+            assert_equal [array size inter] [r sinterstore setres {*}$args]
+            assert_equal [lsort -integer [array names inter]] \
+                         [lsort -integer [r smembers setres]]
+            assert_equal [array size union] [r sunionstore setres {*}$args]
+            if {[array size union] > 5000} {
+                assert_encoding hashtable setres
+            }
+            assert_equal [lsort -integer [array names union]] \
+                         [lsort -integer [r smembers setres]]
+        }
+        unset -nocomplain intset_content inter union diff in
+        r config set set-max-intset-entries $original_max
+    }
+
     test "SINTER against non-set should throw error" {
         r set key1 x
         assert_error "WRONGTYPE*" {r sinter key1 noset}
@@ -269,7 +409,7 @@ start_server {
         r sadd set2 1 2 3 a
         r srem set2 a
         assert_encoding intset set1
-        assert_encoding hashtable set2
+        assert_encoding listpack set2
         lsort [r sinter set1 set2]
     } {1 2 3}
 
@@ -285,23 +425,21 @@ start_server {
         assert_equal 0 [r exists setres]
     }
 
-    foreach {type contents} {hashtable {a b c} intset {1 2 3}} {
+    foreach {type contents} {hashtable {a b c} listpack {a b c} intset {1 2 3}} {
         test "SPOP basics - $type" {
-            create_set myset $contents
-            assert_encoding $type myset
+            create_set_with_encoding myset $contents $type
             assert_equal $contents [lsort [list [r spop myset] [r spop myset] [r spop myset]]]
             assert_equal 0 [r scard myset]
         }
 
         test "SPOP with <count>=1 - $type" {
-            create_set myset $contents
-            assert_encoding $type myset
+            create_set_with_encoding myset $contents $type
             assert_equal $contents [lsort [list [r spop myset 1] [r spop myset 1] [r spop myset 1]]]
             assert_equal 0 [r scard myset]
         }
 
         test "SRANDMEMBER - $type" {
-            create_set myset $contents
+            create_set_with_encoding myset $contents $type
             unset -nocomplain myset
             array set myset {}
             for {set i 0} {$i < 100} {incr i} {
@@ -312,12 +450,12 @@ start_server {
     }
 
     foreach {type contents} {
-        hashtable {a b c d e f g h i j k l m n o p q r s t u v w x y z} 
+        hashtable {a b c d e f g h i j k l m n o p q r s t u v w x y z}
+        listpack {a b c d e f g h i j k l m n o p q r s t u v w x y z}
         intset {1 10 11 12 13 14 15 16 17 18 19 2 20 21 22 23 24 25 26 3 4 5 6 7 8 9}
     } {
-        test "SPOP with <count>" {
-            create_set myset $contents
-            assert_encoding $type myset
+        test "SPOP with <count> - $type" {
+            create_set_with_encoding myset $contents $type
             assert_equal $contents [lsort [concat [r spop myset 11] [r spop myset 9] [r spop myset 0] [r spop myset 4] [r spop myset 1] [r spop myset 0] [r spop myset 1] [r spop myset 0]]]
             assert_equal 0 [r scard myset]
         }
@@ -387,6 +525,15 @@ start_server {
             KIMBERLY DEBORAH JESSICA SHIRLEY CYNTHIA ANGELA MELISSA
             BRENDA AMY ANNA REBECCA VIRGINIA KATHLEEN
         }
+        listpack {
+            1 5 10 50 125 50000 33959417 4775547 65434162
+            12098459 427716 483706 2726473884 72615637475
+            MARY PATRICIA LINDA BARBARA ELIZABETH JENNIFER MARIA
+            SUSAN MARGARET DOROTHY LISA NANCY KAREN BETTY HELEN
+            SANDRA DONNA CAROL RUTH SHARON MICHELLE LAURA SARAH
+            KIMBERLY DEBORAH JESSICA SHIRLEY CYNTHIA ANGELA MELISSA
+            BRENDA AMY ANNA REBECCA VIRGINIA KATHLEEN
+        }
         intset {
             0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19
             20 21 22 23 24 25 26 27 28 29
@@ -395,7 +542,7 @@ start_server {
         }
     } {
         test "SRANDMEMBER with <count> - $type" {
-            create_set myset $contents
+            create_set_with_encoding myset $contents $type
             unset -nocomplain myset
             array set myset {}
             foreach ele [r smembers myset] {
@@ -489,7 +636,7 @@ start_server {
         r del myset3 myset4
         create_set myset1 {1 a b}
         create_set myset2 {2 3 4}
-        assert_encoding hashtable myset1
+        assert_encoding listpack myset1
         assert_encoding intset myset2
     }
 
@@ -499,7 +646,7 @@ start_server {
         assert_equal 1 [r smove myset1 myset2 a]
         assert_equal {1 b} [lsort [r smembers myset1]]
         assert_equal {2 3 4 a} [lsort [r smembers myset2]]
-        assert_encoding hashtable myset2
+        assert_encoding listpack myset2
 
         # move an integer element should not convert the encoding
         setup_move
@@ -535,7 +682,7 @@ start_server {
         assert_equal 1 [r smove myset1 myset3 a]
         assert_equal {1 b} [lsort [r smembers myset1]]
         assert_equal {a} [lsort [r smembers myset3]]
-        assert_encoding hashtable myset3
+        assert_encoding listpack myset3
     }
 
     test "SMOVE from intset to non existing destination set" {
@@ -7,12 +7,17 @@ start_server {tags {"zset"}} {
     }
 
     proc basics {encoding} {
-        if {$encoding == "ziplist"} {
-            r config set zset-max-ziplist-entries 128
-            r config set zset-max-ziplist-value 64
+        if {$encoding == "listpack"} {
+            r config set zset-max-listpack-entries 128
+            r config set zset-max-listpack-value 64
         } elseif {$encoding == "skiplist"} {
-            r config set zset-max-ziplist-entries 0
-            r config set zset-max-ziplist-value 0
+            r config set zset-max-listpack-entries 0
+            r config set zset-max-listpack-value 0
+            r config set zset-max-skiplist-entries 1024
+        } elseif {$encoding == "btree"} {
+            r config set zset-max-listpack-entries 0
+            r config set zset-max-listpack-value 0
+            r config set zset-max-skiplist-entries 0
         } else {
             puts "Unknown sorted set encoding"
             exit
@@ -735,8 +740,10 @@ start_server {tags {"zset"}} {
         }
     }
 
-    basics ziplist
+    basics listpack
     basics skiplist
+    basics btree
+    r config set zset-max-skiplist-entries 1024
 
     test {ZINTERSTORE regression with two sets, intset+hashtable} {
         r del seta setb setc
@@ -751,7 +758,7 @@ start_server {tags {"zset"}} {
         r zrange out 0 -1 withscores
     } {neginf 0}
 
-    test {ZINTERSTORE #516 regression, mixed sets and ziplist zsets} {
+    test {ZINTERSTORE #516 regression, mixed sets and listpack zsets} {
         r sadd one 100 101 102 103
         r sadd two 100 200 201 202
         r zadd three 1 500 1 501 1 502 1 503 1 100
@@ -786,14 +793,20 @@ start_server {tags {"zset"}} {
     }
 
     proc stressers {encoding} {
-        if {$encoding == "ziplist"} {
+        if {$encoding == "listpack"} {
             # Little extra to allow proper fuzzing in the sorting stresser
-            r config set zset-max-ziplist-entries 256
-            r config set zset-max-ziplist-value 64
+            r config set zset-max-listpack-entries 256
+            r config set zset-max-listpack-value 64
             set elements 128
         } elseif {$encoding == "skiplist"} {
-            r config set zset-max-ziplist-entries 0
-            r config set zset-max-ziplist-value 0
+            r config set zset-max-listpack-entries 0
+            r config set zset-max-listpack-value 0
+            r config set zset-max-skiplist-entries 1024
+            if {$::accurate} {set elements 1000} else {set elements 100}
+        } elseif {$encoding == "btree"} {
+            r config set zset-max-listpack-entries 0
+            r config set zset-max-listpack-value 0
+            r config set zset-max-skiplist-entries 0
             if {$::accurate} {set elements 1000} else {set elements 100}
         } else {
             puts "Unknown sorted set encoding"
@@ -1198,13 +1211,15 @@ start_server {tags {"zset"}} {
     }
 
     tags {"slow"} {
-        stressers ziplist
+        stressers listpack
         stressers skiplist
+        stressers btree
+        r config set zset-max-skiplist-entries 1024
     }
 
     test {ZSET skiplist order consistency when elements are moved} {
-        set original_max [lindex [r config get zset-max-ziplist-entries] 1]
-        r config set zset-max-ziplist-entries 0
+        set original_max [lindex [r config get zset-max-listpack-entries] 1]
+        r config set zset-max-listpack-entries 0
         for {set times 0} {$times < 10} {incr times} {
             r del zset
             for {set j 0} {$j < 1000} {incr j} {
@@ -1225,6 +1240,122 @@ start_server {tags {"zset"}} {
                 set prev_score $score
             }
         }
-        r config set zset-max-ziplist-entries $original_max
+        r config set zset-max-listpack-entries $original_max
+    }
+
+    test {ZSET skiplist is converted to btree when it grows} {
+        r config set zset-max-listpack-entries 128
+        r config set zset-max-listpack-value 64
+        r config set zset-max-skiplist-entries 200
+        r del zset zset2
+        for {set j 0} {$j < 200} {incr j} {
+            r zadd zset $j ele-$j
+        }
+        assert_encoding skiplist zset
+        r zadd zset 200 ele-200
+        assert_encoding btree zset
+        assert_equal 201 [r zcard zset]
+        assert_equal {ele-0 0 ele-200 200} \
+            [concat [r zrange zset 0 0 withscores] [r zrange zset -1 -1 withscores]]
+
+        # Large sorted sets are loaded as a btree.
+        r debug reload
+        assert_encoding btree zset
+        assert_equal 201 [r zcard zset]
+
+        # The btree is converted to a listpack when small enough.
+        r zremrangebyrank zset 0 99
+        r zunionstore zset2 1 zset
+        assert_encoding listpack zset2
+        assert_equal [r zrange zset 0 -1 withscores] [r zrange zset2 0 -1 withscores]
+        r config set zset-max-skiplist-entries 1024
+    }
+
+    proc zset_compare_encodings {keys cmd} {
+        set results {}
+        foreach key $keys {
+            lappend results [r {*}[lreplace $cmd 1 1 $key]]
+        }
+        assert_equal [lindex $results 0] [lindex $results 1]
+    }
+
+    test {ZSET btree and skiplist encodings give the same results} {
+        r config set zset-max-listpack-entries 0
+        r config set zset-max-skiplist-entries 0
+        r del zbt zsl
+        r zadd zbt 0 init
+        r config set zset-max-skiplist-entries 1000000
+        r zadd zsl 0 init
+        assert_encoding btree zbt
+        assert_encoding skiplist zsl
+
+        for {set j 0} {$j < 10000} {incr j} {
+            set ele [randomInt 3000]
+            switch [randomInt 5] {
+                0 - 1 {set cmd [list zadd KEY [randomInt 100] $ele]}
+                2 {set cmd [list zincrby KEY [randomInt 10] $ele]}
+                3 {set cmd [list zrem KEY $ele]}
+                4 {
+                    if {[randomInt 50] == 0} {
+                        set min [randomInt 100]
+                        set cmd [list zremrangebyscore KEY $min ($min]
+                    } elseif {[randomInt 50] == 0} {
+                        set start [randomInt 1000]
+                        set cmd [list zremrangebyrank KEY $start [expr {$start+[randomInt 10]}]]
+                    } else {
+                        set cmd [list zscore KEY $ele]
+                    }
+                }
+            }
+            zset_compare_encodings {zbt zsl} $cmd
+        }
+        assert_encoding btree zbt
+        zset_compare_encodings {zbt zsl} {zrange KEY 0 -1 withscores}
+
+        for {set j 0} {$j < 300} {incr j} {
+            set min [randomInt 100]
+            set max [expr {$min+[randomInt 20]}]
+            set offset [randomInt 100]
+            set count [randomInt 50]
+            set ele [randomInt 3000]
+            set start [randomInt 2000]
+            set end [expr {$start+[randomInt 100]}]
+            zset_compare_encodings {zbt zsl} [list zrangebyscore KEY $min $max withscores]
+            zset_compare_encodings {zbt zsl} [list zrangebyscore KEY ($min ($max limit $offset $count]
+            zset_compare_encodings {zbt zsl} [list zrevrangebyscore KEY $max $min limit $offset $count]
+            zset_compare_encodings {zbt zsl} [list zcount KEY $min ($max]
+            zset_compare_encodings {zbt zsl} [list zrank KEY $ele]
+            zset_compare_encodings {zbt zsl} [list zrevrank KEY $ele]
+            zset_compare_encodings {zbt zsl} [list zrange KEY $start $end withscores]
+            zset_compare_encodings {zbt zsl} [list zrevrange KEY $start $end]
+        }
+
+        # Lexicographical ranges, with all the elements with the same score.
+        r del zbt zsl
+        r config set zset-max-skiplist-entries 0
+        r zadd zbt 0 init
+        r config set zset-max-skiplist-entries 1000000
+        r zadd zsl 0 init
+        for {set j 0} {$j < 3000} {incr j} {
+            set ele [randstring 0 10 alpha]
+            zset_compare_encodings {zbt zsl} [list zadd KEY 0 $ele]
+        }
+        for {set j 0} {$j < 300} {incr j} {
+            set min \[[randstring 0 3 alpha]
+            set max ([randstring 0 3 alpha]
+            set offset [randomInt 100]
+            set count [randomInt 50]
+            zset_compare_encodings {zbt zsl} [list zrangebylex KEY $min $max]
+            zset_compare_encodings {zbt zsl} [list zrangebylex KEY - $max limit $offset $count]
+            zset_compare_encodings {zbt zsl} [list zrevrangebylex KEY $max $min limit $offset $count]
+            zset_compare_encodings {zbt zsl} [list zlexcount KEY $min +]
+            if {[randomInt 20] == 0} {
+                zset_compare_encodings {zbt zsl} [list zremrangebylex KEY $min $max]
+            }
+        }
+        zset_compare_encodings {zbt zsl} {zrange KEY 0 -1}
+        assert_equal [r debug digest-value zbt] [r debug digest-value zsl]
+        r config set zset-max-listpack-entries 128
+        r config set zset-max-skiplist-entries 1024
     }
 }